@@ -0,0 +1,26 @@
+"""Builds the `katy` CPython extension over the C library in src/."""
+import numpy
+from setuptools import Extension, setup
+
+SOURCES = [
+    "src/python/katymodule.c",
+    "src/katy.c",
+    "src/heap.c",
+    "src/pool.c",
+    "src/distance.c",
+]
+
+setup(
+    name="katy",
+    version="0.1.0",
+    description="kd-trees over NumPy arrays",
+    ext_modules=[
+        Extension(
+            "katy",
+            sources=SOURCES,
+            include_dirs=[numpy.get_include()],
+            extra_compile_args=["-std=c99", "-O2"],
+            libraries=["m", "pthread"],
+        )
+    ],
+)
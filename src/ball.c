@@ -0,0 +1,655 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "ball.h"
+#include "heap.h"
+#include "pool.h"
+#include "distance.h"
+#include "query.h"
+
+// Number of queries a batch worker claims at a time.
+#define BATCH_CHUNK_SIZE 64
+
+// Candidate sets of at most this many neighbors live on the stack.
+#define STACK_HEAP_CAPACITY 64
+
+// Radii are grown by this relative margin, so that rounding differences
+// between the build's sums and the distance kernels never prune a point
+// lying right on a ball's surface.
+#define RADIUS_MARGIN 1e-12
+
+/* Which of a node's radii bounds a metric's. */
+enum BallNorm {
+  BALL_MANHATTAN,
+  BALL_EUCLIDEAN,
+  BALL_CHEBYSHEV,
+  BALL_NUM_NORMS
+};
+
+/* State of a ball tree build. */
+struct BallBuild {
+  struct BallTree *tree;
+  int leaf_size;
+  int capacity;       // Nodes the arena has room for
+  double *minimums;   // Scratch extents of the current node's points
+  double *maximums;
+  bool failed;
+};
+
+/* An n nearest neighbor query of a ball tree in progress. */
+struct BallQuery {
+  struct BallTree *tree;
+  double *test_point;
+  struct BoundedHeap *heap;
+  struct Metric *metric;
+  enum BallNorm norm;
+};
+
+/* Shared state of a batch nearest neighbor query of a ball tree. */
+struct BallBatchQuery {
+  struct BallTree *tree;
+  double *test_points;
+  int n;
+  struct Metric metric;
+  int *indices;
+  double *distances;
+  struct WorkQueue queue;
+};
+
+/* Gathers range query hits of a ball tree into a growing array of results. */
+struct BallRangeQuery {
+  struct BallTree *tree;
+  double *test_point;
+  double *radii;
+  struct Metric *metric;  // NULL to skip distances
+  struct KdResult *results;
+  int size;
+  int capacity;
+  bool failed;
+};
+
+/*
+  Make the node over tree->indices[start, end) and its subtree, in pre-order.
+  Returns the arena index of the node, or -1 on failure.
+*/
+int recursive_build_ball(struct BallBuild *build, int start, int end);
+
+/* Append a node to the arena of a ball tree build. Returns -1 on failure. */
+int allocate_ball_node(struct BallBuild *build);
+
+/*
+  Set the center and radii of `node_index` from its points, and their extents
+  to build->minimums and build->maximums.
+*/
+void fit_ball(struct BallBuild *build, int node_index);
+
+/*
+  Reorder `indices` so that the point at `nth` is the one a sort along `axis`
+  would put there, with no greater point before it and no lesser one after.
+*/
+void select_along_axis(struct BallTree *tree, int *indices, int num_indices,
+                       int axis, int nth);
+
+/* The point of data row `row`. */
+double *ball_tree_row(struct BallTree *tree, int row);
+
+/* The node radius bounding the radius of balls under `metric`. */
+enum BallNorm ball_norm(struct Metric *metric);
+
+/*
+  Lower bound on the reduced distance from the query's test point to any
+  point of `node`.
+*/
+double ball_distance(struct BallQuery *query, struct BallNode *node);
+
+/*
+  Descend into the children of `node` nearest ball first, skipping those
+  whose `lower_bound` shows they cannot hold a closer point than the
+  query's n-th.
+*/
+void recursive_ball_search(struct BallQuery *query, struct BallNode *node,
+                           double lower_bound);
+
+/* Run an n nearest neighbor query from the root of the tree. */
+void ball_nearest_neighbor_search(struct BallQuery *query);
+
+/*
+  Worker of ball_tree_query_n_nearest_neighbors_batch(), answering chunks of
+  queries from the shared BallBatchQuery in `context`.
+*/
+void ball_batch_worker(void *context, int worker_id);
+
+/*
+  Gather the points of `node` that lie within the query's box of radii.
+  Returns `0` on failure to grow the results.
+*/
+int recursive_ball_range(struct BallRangeQuery *query, struct BallNode *node);
+
+/* Fill a query result for the point at `position` of the tree. */
+void fill_ball_result(struct BallTree *tree, int position, double distance,
+                      struct KdResult *result);
+
+
+struct BallTree *build_ball_tree(double *points, int num_points, int k,
+                                 int leaf_size, bool copy_data) {
+  if (num_points == 0) {
+    return NULL;
+  }
+  struct BallTree *tree = calloc(1, sizeof(struct BallTree));
+  if (tree == NULL) {
+    return NULL;
+  }
+  tree->k = k;
+  tree->size = num_points;
+  tree->kernels = best_distance_kernels(k);
+  tree->data = points;
+  if (copy_data) {
+    size_t data_bytes = sizeof(double) * num_points * k;
+    tree->data = malloc(data_bytes);
+    if (tree->data == NULL) {
+      free(tree);
+      return NULL;
+    }
+    memcpy(tree->data, points, data_bytes);
+    tree->copied = true;
+    tree->memory_bytes += data_bytes;
+  }
+
+  tree->indices = malloc(sizeof(int) * num_points);
+  struct BallBuild build;
+  build.tree = tree;
+  build.leaf_size = leaf_size;
+  build.capacity = 0;
+  build.minimums = malloc(sizeof(double) * k);
+  build.maximums = malloc(sizeof(double) * k);
+  build.failed = tree->indices == NULL || build.minimums == NULL
+                 || build.maximums == NULL;
+  if (!build.failed) {
+    for (int i = 0; i < num_points; i++) tree->indices[i] = i;
+    recursive_build_ball(&build, 0, num_points);
+  }
+  free(build.minimums);
+  free(build.maximums);
+  if (build.failed) {
+    free_ball_tree(tree);
+    return NULL;
+  }
+
+  // Give back what the arena overallocated.
+  struct BallNode *nodes = realloc(tree->nodes,
+                                   sizeof(struct BallNode) * tree->num_nodes);
+  if (nodes != NULL) {
+    tree->nodes = nodes;
+  }
+  double *centers = realloc(tree->centers,
+                            sizeof(double) * k * tree->num_nodes);
+  if (centers != NULL) {
+    tree->centers = centers;
+  }
+  double *node_radii = realloc(tree->node_radii, sizeof(double)
+                                                 * BALL_NUM_NORMS
+                                                 * tree->num_nodes);
+  if (node_radii != NULL) {
+    tree->node_radii = node_radii;
+  }
+  tree->root = tree->nodes;
+  tree->memory_bytes += sizeof(int) * num_points
+                        + (sizeof(struct BallNode)
+                           + sizeof(double) * (k + BALL_NUM_NORMS))
+                          * tree->num_nodes;
+  return tree;
+}
+
+void free_ball_tree(struct BallTree *tree) {
+  if (tree->copied) {
+    free(tree->data);
+  }
+  free(tree->nodes);
+  free(tree->indices);
+  free(tree->centers);
+  free(tree->node_radii);
+  free(tree);
+}
+
+/*
+  The arena moves as it grows, so nodes are only held by index. Splits are
+  at the median, as sklearn's ball tree makes them, so the tree stays
+  balanced whatever the shape of the balls.
+*/
+int recursive_build_ball(struct BallBuild *build, int start, int end) {
+  struct BallTree *tree = build->tree;
+  int node_index = allocate_ball_node(build);
+  if (node_index == -1) {
+    return -1;
+  }
+  struct BallNode *node = tree->nodes + node_index;
+  int num_indices = end - start;
+  node->start = start;
+  node->end = end;
+  node->is_leaf = true;
+  node->low = -1;
+  node->high = -1;
+  fit_ball(build, node_index);
+  if (num_indices <= build->leaf_size || num_indices < 2) {
+    return node_index;
+  }
+
+  int split_axis = 0;
+  for (int j = 1; j < tree->k; j++) {
+    if (build->maximums[j] - build->minimums[j]
+        > build->maximums[split_axis] - build->minimums[split_axis]) {
+      split_axis = j;
+    }
+  }
+  int median = num_indices / 2;
+  select_along_axis(tree, tree->indices + start, num_indices, split_axis,
+                    median);
+  int low = recursive_build_ball(build, start, start + median);
+  int high = low == -1 ? -1 : recursive_build_ball(build, start + median,
+                                                   end);
+  if (high == -1) {
+    return -1;
+  }
+  tree->nodes[node_index].is_leaf = false;
+  tree->nodes[node_index].low = low;
+  tree->nodes[node_index].high = high;
+  return node_index;
+}
+
+int allocate_ball_node(struct BallBuild *build) {
+  struct BallTree *tree = build->tree;
+  if (build->failed) {
+    return -1;
+  }
+  if (tree->num_nodes == build->capacity) {
+    int capacity = build->capacity == 0 ? 64 : build->capacity * 2;
+    struct BallNode *nodes = realloc(tree->nodes,
+                                     sizeof(struct BallNode) * capacity);
+    if (nodes != NULL) {
+      tree->nodes = nodes;
+    }
+    double *centers = realloc(tree->centers,
+                              sizeof(double) * tree->k * capacity);
+    if (centers != NULL) {
+      tree->centers = centers;
+    }
+    double *node_radii = realloc(tree->node_radii, sizeof(double)
+                                                   * BALL_NUM_NORMS
+                                                   * capacity);
+    if (node_radii != NULL) {
+      tree->node_radii = node_radii;
+    }
+    if (nodes == NULL || centers == NULL || node_radii == NULL) {
+      build->failed = true;
+      return -1;
+    }
+    build->capacity = capacity;
+  }
+  return tree->num_nodes++;
+}
+
+void fit_ball(struct BallBuild *build, int node_index) {
+  struct BallTree *tree = build->tree;
+  struct BallNode *node = tree->nodes + node_index;
+  int k = tree->k;
+  double *center = tree->centers + ((size_t) node_index * k);
+  double *radii = tree->node_radii + ((size_t) node_index * BALL_NUM_NORMS);
+  for (int j = 0; j < k; j++) {
+    center[j] = 0;
+    build->minimums[j] = INFINITY;
+    build->maximums[j] = -INFINITY;
+  }
+  for (int i = node->start; i < node->end; i++) {
+    double *point = ball_tree_row(tree, tree->indices[i]);
+    for (int j = 0; j < k; j++) {
+      center[j] += point[j];
+      build->minimums[j] = fmin(build->minimums[j], point[j]);
+      build->maximums[j] = fmax(build->maximums[j], point[j]);
+    }
+  }
+  for (int j = 0; j < k; j++) {
+    center[j] /= node->end - node->start;
+  }
+
+  double manhattan = 0;
+  double squared_euclidean = 0;
+  double chebyshev = 0;
+  for (int i = node->start; i < node->end; i++) {
+    double *point = ball_tree_row(tree, tree->indices[i]);
+    double sum = 0;
+    double squares = 0;
+    double largest = 0;
+    for (int j = 0; j < k; j++) {
+      double offset = fabs(point[j] - center[j]);
+      sum += offset;
+      squares += offset * offset;
+      largest = fmax(largest, offset);
+    }
+    manhattan = fmax(manhattan, sum);
+    squared_euclidean = fmax(squared_euclidean, squares);
+    chebyshev = fmax(chebyshev, largest);
+  }
+  radii[BALL_MANHATTAN] = manhattan * (1 + RADIUS_MARGIN);
+  radii[BALL_EUCLIDEAN] = sqrt(squared_euclidean) * (1 + RADIUS_MARGIN);
+  radii[BALL_CHEBYSHEV] = chebyshev * (1 + RADIUS_MARGIN);
+}
+
+/*
+  Quickselect with three way partitions, so runs of equal coordinates end up
+  in the middle partition instead of degrading the selection.
+*/
+void select_along_axis(struct BallTree *tree, int *indices, int num_indices,
+                       int axis, int nth) {
+  int k = tree->k;
+  int left = 0;
+  int right = num_indices;
+  while (right - left > 1) {
+    double pivot = tree->data[((size_t) indices[left + (right - left) / 2]
+                               * k) + axis];
+    // [left, less) < pivot, [less, i) == pivot, (greater, right) > pivot
+    int less = left;
+    int i = left;
+    int greater = right - 1;
+    while (i <= greater) {
+      double value = tree->data[((size_t) indices[i] * k) + axis];
+      int index = indices[i];
+      if (value < pivot) {
+        indices[i++] = indices[less];
+        indices[less++] = index;
+      } else if (value > pivot) {
+        indices[i] = indices[greater];
+        indices[greater--] = index;
+      } else {
+        i++;
+      }
+    }
+    if (nth < less) {
+      right = less;
+    } else if (nth > greater) {
+      left = greater + 1;
+    } else {
+      return;
+    }
+  }
+}
+
+double *ball_tree_row(struct BallTree *tree, int row) {
+  return tree->data + ((size_t) row * tree->k);
+}
+
+/*
+  Minkowski norms shrink as the order grows, so the Manhattan radius bounds
+  every order below 2 and the Euclidean radius every order above.
+*/
+enum BallNorm ball_norm(struct Metric *metric) {
+  switch (metric->type) {
+    case METRIC_MANHATTAN:
+      return BALL_MANHATTAN;
+    case METRIC_CHEBYSHEV:
+      return BALL_CHEBYSHEV;
+    case METRIC_MINKOWSKI:
+      return metric->p < 2 ? BALL_MANHATTAN : BALL_EUCLIDEAN;
+    default:
+      return BALL_EUCLIDEAN;
+  }
+}
+
+/*
+  By the triangle inequality no point of a ball is closer than the distance
+  to its center less its radius. Squared Euclidean distances are not a
+  metric, so they are bounded as Euclidean ones and squared back.
+*/
+double ball_distance(struct BallQuery *query, struct BallNode *node) {
+  struct BallTree *tree = query->tree;
+  size_t node_index = node - tree->nodes;
+  double *center = tree->centers + (node_index * tree->k);
+  double radius = tree->node_radii[(node_index * BALL_NUM_NORMS)
+                                   + query->norm];
+  double reduced = metric_distance(query->metric, center, query->test_point,
+                                   tree->k);
+  double distance = query->metric->type == METRIC_SQUARED_EUCLIDEAN
+                    ? sqrt(reduced) : true_distance(query->metric, reduced);
+  if (distance <= radius) {
+    return 0;
+  }
+  return axis_distance(query->metric, distance - radius);
+}
+
+void recursive_ball_search(struct BallQuery *query, struct BallNode *node,
+                           double lower_bound) {
+  struct BallTree *tree = query->tree;
+  struct BoundedHeap *heap = query->heap;
+  if (heap->size == heap->capacity && lower_bound > heap->entries[0].value) {
+    return;
+  }
+
+  if (node->is_leaf) {
+    for (int i = node->start; i < node->end; i++) {
+      double distance = metric_distance(
+          query->metric, ball_tree_row(tree, tree->indices[i]),
+          query->test_point, tree->k);
+      if (heap->size < heap->capacity) {
+        bounded_heap_push(heap, i, distance);
+      } else if (distance < heap->entries[0].value) {
+        bounded_heap_replace_top(heap, i, distance);
+      }
+    }
+    return;
+  }
+
+  struct BallNode *near = tree->nodes + node->low;
+  struct BallNode *far = tree->nodes + node->high;
+  double near_bound = ball_distance(query, near);
+  double far_bound = ball_distance(query, far);
+  if (far_bound < near_bound) {
+    struct BallNode *swap = near;
+    near = far;
+    far = swap;
+    double swap_bound = near_bound;
+    near_bound = far_bound;
+    far_bound = swap_bound;
+  }
+  recursive_ball_search(query, near, near_bound);
+  recursive_ball_search(query, far, far_bound);
+}
+
+void ball_nearest_neighbor_search(struct BallQuery *query) {
+  query->norm = ball_norm(query->metric);
+  recursive_ball_search(query, query->tree->root,
+                        ball_distance(query, query->tree->root));
+}
+
+int ball_tree_query_n_nearest_neighbors(struct BallTree *tree,
+                                        double *test_point, int n,
+                                        char *distance_metric,
+                                        struct KdResult **results) {
+  struct Metric metric;
+  if (tree->size == 0 || n <= 0
+      || !resolve_query_metric(tree->kernels, distance_metric, NULL,
+                               &metric)) {
+    return 0;
+  }
+
+  // Small candidate sets live on the stack.
+  struct HeapEntry stack_entries[STACK_HEAP_CAPACITY];
+  struct HeapEntry *entries = stack_entries;
+  if (n > STACK_HEAP_CAPACITY) {
+    entries = malloc(sizeof(struct HeapEntry) * n);
+    if (entries == NULL) {
+      return 0;
+    }
+  }
+  struct BoundedHeap heap;
+  init_bounded_heap(&heap, entries, n);
+  struct BallQuery query = {tree, test_point, &heap, &metric, BALL_EUCLIDEAN};
+  ball_nearest_neighbor_search(&query);
+
+  struct HeapEntry entry;
+  int num_results = heap.size;
+  *results = malloc(sizeof(struct KdResult) * num_results);
+  for (int i = 0; i < num_results && *results != NULL; i++) {
+    bounded_heap_pop(&heap, &entry);
+    fill_ball_result(tree, entry.index, true_distance(&metric, entry.value),
+                     *results + i);
+  }
+  if (entries != stack_entries) {
+    free(entries);
+  }
+  return *results == NULL ? 0 : num_results;
+}
+
+int ball_tree_query_n_nearest_neighbors_batch(struct BallTree *tree,
+                                              double *test_points,
+                                              int num_queries, int n,
+                                              char *distance_metric,
+                                              int num_threads, int *indices,
+                                              double *distances) {
+  if (n <= 0 || num_queries <= 0) {
+    return 1;
+  }
+
+  struct BallBatchQuery batch;
+  if (!resolve_query_metric(tree->kernels, distance_metric, NULL,
+                            &batch.metric)) {
+    return 0;
+  }
+  batch.tree = tree;
+  batch.test_points = test_points;
+  batch.n = n;
+  batch.indices = indices;
+  batch.distances = distances;
+  if (!init_work_queue(&batch.queue, num_queries, BATCH_CHUNK_SIZE)) {
+    return 0;
+  }
+  // Workers report failures through the queue, whose lock orders them.
+  bool failed = !run_workers(num_threads, ball_batch_worker, &batch)
+                || batch.queue.failed;
+  destroy_work_queue(&batch.queue);
+  return !failed;
+}
+
+void ball_batch_worker(void *context, int worker_id) {
+  struct BallBatchQuery *batch = context;
+  struct BallTree *tree = batch->tree;
+  int n = batch->n;
+
+  // One heap per worker, reset between queries, so queries do not allocate.
+  struct HeapEntry *entries = malloc(sizeof(struct HeapEntry) * n);
+  if (entries == NULL) {
+    work_queue_fail(&batch->queue);
+    return;
+  }
+  struct BoundedHeap heap;
+  struct BallQuery query = {tree, NULL, &heap, &batch->metric,
+                            BALL_EUCLIDEAN};
+
+  int start, end;
+  while (work_queue_next(&batch->queue, &start, &end)) {
+    for (int q = start; q < end; q++) {
+      int *row_indices = batch->indices + ((size_t) q * n);
+      double *row_distances = batch->distances + ((size_t) q * n);
+      init_bounded_heap(&heap, entries, n);
+      if (tree->size > 0) {
+        query.test_point = batch->test_points + ((size_t) q * tree->k);
+        ball_nearest_neighbor_search(&query);
+      }
+
+      fill_batch_row(&heap, tree->indices, &batch->metric, n, row_indices,
+                     row_distances);
+    }
+  }
+  free(entries);
+}
+
+int ball_tree_query_range(struct BallTree *tree, double *test_point,
+                          double *radii, char *distance_metric,
+                          struct KdResult **results) {
+  *results = NULL;
+  if (tree->size == 0) {
+    return 0;
+  }
+  struct Metric metric;
+  struct BallRangeQuery query = {tree, test_point, radii, NULL, NULL, 0, 0,
+                                 false};
+  if (distance_metric != NULL) {
+    if (!resolve_query_metric(tree->kernels, distance_metric, NULL,
+                              &metric)) {
+      return 0;
+    }
+    query.metric = &metric;
+  }
+  if (!recursive_ball_range(&query, tree->root)) {
+    free(query.results);
+    return 0;
+  }
+
+  // Furthest first, as n nearest neighbor results are.
+  qsort(query.results, query.size, sizeof(struct KdResult),
+        compare_results_descending);
+  *results = query.results;
+  return query.size;
+}
+
+/*
+  Every point of a ball lies within its Chebyshev radius of the center along
+  each axis, so a ball whose center is further than that from the box along
+  any axis holds no point of it.
+*/
+int recursive_ball_range(struct BallRangeQuery *query, struct BallNode *node) {
+  struct BallTree *tree = query->tree;
+  int k = tree->k;
+  size_t node_index = node - tree->nodes;
+  double *center = tree->centers + (node_index * k);
+  double radius = tree->node_radii[(node_index * BALL_NUM_NORMS)
+                                   + BALL_CHEBYSHEV];
+  for (int j = 0; j < k; j++) {
+    if (fabs(center[j] - query->test_point[j]) > query->radii[j] + radius) {
+      return 1;
+    }
+  }
+
+  if (!node->is_leaf) {
+    return recursive_ball_range(query, tree->nodes + node->low)
+           && recursive_ball_range(query, tree->nodes + node->high);
+  }
+
+  for (int i = node->start; i < node->end; i++) {
+    double *point = ball_tree_row(tree, tree->indices[i]);
+    bool inside = true;
+    for (int j = 0; j < k && inside; j++) {
+      inside = fabs(point[j] - query->test_point[j]) <= query->radii[j];
+    }
+    if (!inside) {
+      continue;
+    }
+    if (query->size == query->capacity) {
+      int capacity = query->capacity == 0 ? 64 : query->capacity * 2;
+      struct KdResult *results = realloc(query->results,
+                                         sizeof(struct KdResult) * capacity);
+      if (results == NULL) {
+        return 0;
+      }
+      query->results = results;
+      query->capacity = capacity;
+    }
+    double distance = NAN;
+    if (query->metric != NULL) {
+      distance = true_distance(query->metric,
+                               metric_distance(query->metric, point,
+                                               query->test_point, k));
+    }
+    fill_ball_result(tree, i, distance, query->results + query->size);
+    query->size++;
+  }
+  return 1;
+}
+
+void fill_ball_result(struct BallTree *tree, int position, double distance,
+                      struct KdResult *result) {
+  result->point = ball_tree_row(tree, tree->indices[position]);
+  result->float_point = NULL;
+  result->index = tree->indices[position];
+  result->distance = distance;
+}
@@ -0,0 +1,82 @@
+/*
+  A ball tree over k-dimensional points composed of doubles, for the high
+  dimensional data where the bounding boxes of a kd-tree stop pruning. Each
+  node holds the centroid of its points and the radius of the ball around it
+  that contains them, and queries skip a node when the ball is out of reach
+  by the triangle inequality. Nodes split at the median of the axis of
+  greatest spread, like the nodes of a kd-tree, but the balls follow the
+  points rather than the axes, so clustered data of low intrinsic dimension
+  keeps pruning in hundreds of dimensions.
+
+  Radii are kept under the Manhattan, Euclidean and Chebyshev norms, so every
+  metric katy.h supports can be used at query time. Minkowski metrics of
+  other orders prune with the Manhattan radius below order 2 and with the
+  Euclidean radius above it, which bound theirs.
+
+  The build, queries and results mirror those of a KdTree.
+*/
+#ifndef _KATY_BALL_H
+#define _KATY_BALL_H
+
+#include "katy.h"
+
+struct BallNode {
+  int low;              // Arena index of the first child, -1 if leaf.
+  int high;             // Arena index of the second child, -1 if leaf.
+  int start;            // First position of this subtree in tree->indices.
+  int end;              // One past the last position in tree->indices.
+  bool is_leaf;
+};
+
+struct BallTree {
+  struct BallNode *root;  // The first node in the arena, NULL if empty.
+  struct BallNode *nodes; // Arena holding every node of the tree.
+  int *indices;           // Permutation of indices into data, grouped by node.
+  double *data;
+  double *centers;        // Centroid of each node's points, k per node.
+  double *node_radii;     // Radius of each node's ball under the Manhattan,
+                          // Euclidean and Chebyshev norms, 3 per node.
+  int size;
+  int k;
+  int num_nodes;
+  bool copied;            // Was the input data copied?
+  size_t memory_bytes;    // Bytes allocated by the build, including copied
+                          // data.
+  const struct DistanceKernels *kernels;  // Distance kernels for this CPU
+                                          // and k, picked at build time.
+};
+
+/*
+  Build a ball tree over `num_points` k-dimensional points, splitting nodes
+  of more than `leaf_size` points, as build_kd_tree() does. Returns NULL on
+  failure.
+*/
+struct BallTree *build_ball_tree(double *points, int num_points, int k,
+                                 int leaf_size, bool copy_data);
+
+/* Free a ball tree, and its copy of the data if it made one. */
+void free_ball_tree(struct BallTree *tree);
+
+/* kd_tree_query_n_nearest_neighbors() over a ball tree. */
+int ball_tree_query_n_nearest_neighbors(struct BallTree *tree,
+                                        double *test_point, int n,
+                                        char *distance_metric,
+                                        struct KdResult **results);
+
+/* kd_tree_query_n_nearest_neighbors_batch() over a ball tree. */
+int ball_tree_query_n_nearest_neighbors_batch(struct BallTree *tree,
+                                              double *test_points,
+                                              int num_queries, int n,
+                                              char *distance_metric,
+                                              int num_threads, int *indices,
+                                              double *distances);
+
+/*
+  kd_tree_query_range() over a ball tree. Balls are tested against the box of
+  `radii` with their Chebyshev radius.
+*/
+int ball_tree_query_range(struct BallTree *tree, double *test_point,
+                          double *radii, char *distance_metric,
+                          struct KdResult **results);
+
+#endif  // _KATY_BALL_H
@@ -0,0 +1,66 @@
+/*
+  All nearest neighbor benchmark. Finds the n nearest neighbors of every point
+  of a tree of uniform points with kd_tree_all_knn() and with a batch query of
+  the tree's own points, and reports the time of each for growing numbers of
+  threads.
+
+  usage: bench_all_knn [num_points] [k] [n] [max_threads]
+*/
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../katy.h"
+#include "bench_common.h"
+
+#define LEAF_SIZE 16
+
+
+int main(int argc, char **argv) {
+  int num_points = argc > 1 ? atoi(argv[1]) : 1000000;
+  int k = argc > 2 ? atoi(argv[2]) : 3;
+  int n = argc > 3 ? atoi(argv[3]) : 10;
+  int max_threads = argc > 4 ? atoi(argv[4]) : 8;
+
+  double *points = malloc(sizeof(double) * num_points * k);
+  // The batch query also finds each point itself.
+  int *indices = malloc(sizeof(int) * num_points * (n + 1));
+  double *distances = malloc(sizeof(double) * num_points * (n + 1));
+  if (points == NULL || indices == NULL || distances == NULL) {
+    fprintf(stderr, "Could not allocate %d points.\n", num_points);
+    return EXIT_FAILURE;
+  }
+  srand(1);
+  uniform_points(points, num_points, k);
+  struct KdTree *tree = build_kd_tree(points, num_points, k, LEAF_SIZE,
+                                      false);
+  if (tree == NULL) {
+    fprintf(stderr, "Build failed.\n");
+    return EXIT_FAILURE;
+  }
+  char metric[] = "squared_euclidean";
+
+  printf("num_points,k,n,num_threads,all_knn_seconds,batch_seconds\n");
+  for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    double start = now();
+    if (!kd_tree_all_knn(tree, n, metric, num_threads, indices, distances)) {
+      fprintf(stderr, "All nearest neighbor search failed.\n");
+      return EXIT_FAILURE;
+    }
+    double all_knn_seconds = now() - start;
+
+    start = now();
+    kd_tree_query_n_nearest_neighbors_batch(tree, points, num_points, n + 1,
+                                            metric, num_threads, indices,
+                                            distances);
+    double batch_seconds = now() - start;
+
+    printf("%d,%d,%d,%d,%.4f,%.4f\n", num_points, k, n, num_threads,
+           all_knn_seconds, batch_seconds);
+  }
+
+  free_kd_tree(tree);
+  free(points);
+  free(indices);
+  free(distances);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,157 @@
+/*
+  Approximate nearest neighbor benchmark. Times every n nearest neighbor
+  query one by one over uniform and clustered points, for a sweep of epsilons
+  and a sweep of leaf budgets, searching depth-first and best-first, and
+  reports the recall against exact queries
+  along with the median and 99th percentile latency, for plotting one
+  against the other.
+
+  usage: bench_approximate [num_points] [num_queries] [k ...]
+*/
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../katy.h"
+#include "bench_common.h"
+
+#define NUM_NEIGHBORS 10
+#define LEAF_SIZE 16
+
+/* qsort() comparison of doubles in increasing order. */
+int compare_doubles(const void *a, const void *b);
+
+/*
+  Fraction of the `expected` neighbor indices of each query found among its
+  `found` neighbor indices.
+*/
+double recall(int *expected, int *found, int num_queries);
+
+
+int main(int argc, char **argv) {
+  int num_points = argc > 1 ? atoi(argv[1]) : 200000;
+  int num_queries = argc > 2 ? atoi(argv[2]) : 1000;
+  int default_ks[] = {4, 8, 16, 32};
+  int *ks = default_ks;
+  int num_ks = 4;
+  if (argc > 3) {
+    num_ks = argc - 3;
+    ks = malloc(sizeof(int) * num_ks);
+    for (int i = 0; i < num_ks; i++) {
+      ks[i] = atoi(argv[3 + i]);
+    }
+  }
+
+  // Epsilon sweep without a budget, then budget sweep without epsilon.
+  double epsilons[] = {0, 0.1, 0.25, 0.5, 1, 2, 0, 0, 0, 0};
+  int budgets[] = {0, 0, 0, 0, 0, 0, 256, 64, 16, 4};
+  int num_settings = 10;
+  const char *distributions[] = {"uniform", "clustered"};
+  const char *orders[] = {"depth_first", "best_first"};
+  char metric[] = "euclidean";
+
+  size_t num_results = (size_t) num_queries * NUM_NEIGHBORS;
+  int *expected = malloc(sizeof(int) * num_results);
+  int *found = malloc(sizeof(int) * num_results);
+  double *latencies = malloc(sizeof(double) * num_queries);
+  if (expected == NULL || found == NULL || latencies == NULL) {
+    fprintf(stderr, "Could not allocate %d queries.\n", num_queries);
+    return EXIT_FAILURE;
+  }
+
+  printf("distribution,num_points,k,search,epsilon,max_leaves,recall,"
+         "mean_us,p50_us,p99_us\n");
+  for (int d = 0; d < 2; d++) {
+    for (int i = 0; i < num_ks; i++) {
+      int k = ks[i];
+      double *points = malloc(sizeof(double) * num_points * k);
+      double *queries = malloc(sizeof(double) * num_queries * k);
+      if (points == NULL || queries == NULL) {
+        fprintf(stderr, "Could not allocate %d points.\n", num_points);
+        return EXIT_FAILURE;
+      }
+      // Queries follow the distribution of the points.
+      srand(1);
+      if (d == 0) {
+        uniform_points(points, num_points, k);
+        uniform_points(queries, num_queries, k);
+      } else {
+        clustered_points(points, num_points, k);
+        clustered_points(queries, num_queries, k);
+      }
+      struct KdTree *tree = build_kd_tree(points, num_points, k, LEAF_SIZE,
+                                          false);
+      if (tree == NULL) {
+        fprintf(stderr, "Build failed.\n");
+        return EXIT_FAILURE;
+      }
+
+      for (int o = 0; o < 2; o++) {
+        for (int s = 0; s < num_settings; s++) {
+          struct KdQueryOptions options = {0};
+          options.epsilon = epsilons[s];
+          options.max_leaves = budgets[s];
+          options.search_order = (enum SearchOrder) o;
+          bool exact = o == 0 && s == 0;
+          int *indices = exact ? expected : found;
+          double total = 0;
+          for (int q = 0; q < num_queries; q++) {
+            struct KdResult *results;
+            double start = now();
+            int num_found = kd_tree_query_n_nearest_neighbors_with_options(
+                tree, queries + ((size_t) q * k), NUM_NEIGHBORS, metric,
+                &options, &results);
+            latencies[q] = (now() - start) * 1e6;
+            total += latencies[q];
+            for (int j = 0; j < NUM_NEIGHBORS; j++) {
+              indices[(q * NUM_NEIGHBORS) + j] = j < num_found
+                                                 ? results[j].index : -1;
+            }
+            free(results);
+          }
+          qsort(latencies, num_queries, sizeof(double), compare_doubles);
+
+          printf("%s,%d,%d,%s,%.2f,%d,%.4f,%.2f,%.2f,%.2f\n",
+                 distributions[d], num_points, k, orders[o], epsilons[s],
+                 budgets[s],
+                 exact ? 1.0 : recall(expected, found, num_queries),
+                 total / num_queries, latencies[num_queries / 2],
+                 latencies[(int) (num_queries * 0.99)]);
+        }
+      }
+      free_kd_tree(tree);
+      free(points);
+      free(queries);
+    }
+  }
+
+  if (ks != default_ks) {
+    free(ks);
+  }
+  free(expected);
+  free(found);
+  free(latencies);
+  return EXIT_SUCCESS;
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+double recall(int *expected, int *found, int num_queries) {
+  long hits = 0;
+  for (int i = 0; i < num_queries; i++) {
+    int *want = expected + ((size_t) i * NUM_NEIGHBORS);
+    int *got = found + ((size_t) i * NUM_NEIGHBORS);
+    for (int a = 0; a < NUM_NEIGHBORS; a++) {
+      for (int b = 0; b < NUM_NEIGHBORS; b++) {
+        if (want[a] == got[b]) {
+          hits++;
+          break;
+        }
+      }
+    }
+  }
+  return (double) hits / ((double) num_queries * NUM_NEIGHBORS);
+}
@@ -0,0 +1,168 @@
+/*
+  Ball tree benchmark. Answers the same n nearest neighbor queries with a
+  kd-tree, a ball tree and a brute force scan, over uniform points and over
+  embedding-like points lying near a random low dimensional subspace, for
+  growing dimensionality, and reports the build time and the time per query
+  of each.
+
+  usage: bench_ball [num_points] [num_queries] [n]
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "../ball.h"
+#include "bench_common.h"
+
+#define LEAF_SIZE 16
+#define NUM_DIMENSIONS 6
+#define INTRINSIC_DIMENSION 8
+#define NUM_DISTRIBUTIONS 2
+
+/*
+  Points of a random INTRINSIC_DIMENSION dimensional subspace of R^k with a
+  little noise in every dimension, as embeddings tend to be.
+*/
+void subspace_points(double *points, int num_points, int k);
+
+/* Sum of the distances of the n nearest neighbors of every query. */
+double brute_force(double *points, int num_points, double *test_points,
+                   int num_queries, int k, int n);
+
+
+int main(int argc, char **argv) {
+  int num_points = argc > 1 ? atoi(argv[1]) : 50000;
+  int num_queries = argc > 2 ? atoi(argv[2]) : 500;
+  int n = argc > 3 ? atoi(argv[3]) : 10;
+
+  int dimensions[NUM_DIMENSIONS] = {8, 16, 32, 64, 128, 256};
+  const char *distributions[NUM_DISTRIBUTIONS] = {"uniform", "subspace"};
+  int max_k = dimensions[NUM_DIMENSIONS - 1];
+  int num_rows = num_points + num_queries;
+  double *points = malloc(sizeof(double) * num_rows * max_k);
+  int *indices = malloc(sizeof(int) * num_queries * n);
+  double *distances = malloc(sizeof(double) * num_queries * n);
+  if (points == NULL || indices == NULL || distances == NULL) {
+    fprintf(stderr, "Could not allocate %d points.\n", num_rows);
+    return EXIT_FAILURE;
+  }
+
+  printf("distribution,k,num_points,n,kd_build_seconds,ball_build_seconds,"
+         "kd_us_per_query,ball_us_per_query,brute_us_per_query\n");
+  for (int d = 0; d < NUM_DISTRIBUTIONS; d++) {
+    for (int i = 0; i < NUM_DIMENSIONS; i++) {
+      int k = dimensions[i];
+      srand(1);
+      if (d == 0) {
+        uniform_points(points, num_rows, k);
+      } else {
+        subspace_points(points, num_rows, k);
+      }
+      double *test_points = points + ((size_t) num_points * k);
+
+      double start = now();
+      struct KdTree *kd = build_kd_tree(points, num_points, k, LEAF_SIZE,
+                                        false);
+      double kd_build_seconds = now() - start;
+      start = now();
+      struct BallTree *ball = build_ball_tree(points, num_points, k,
+                                              LEAF_SIZE, false);
+      double ball_build_seconds = now() - start;
+      if (kd == NULL || ball == NULL) {
+        fprintf(stderr, "Build failed.\n");
+        return EXIT_FAILURE;
+      }
+
+      start = now();
+      double kd_sum = 0;
+      kd_tree_query_n_nearest_neighbors_batch(kd, test_points, num_queries, n,
+                                              "euclidean", 1, indices,
+                                              distances);
+      for (int j = 0; j < num_queries * n; j++) kd_sum += distances[j];
+      double kd_seconds = now() - start;
+
+      start = now();
+      double ball_sum = 0;
+      ball_tree_query_n_nearest_neighbors_batch(ball, test_points,
+                                                num_queries, n, "euclidean",
+                                                1, indices, distances);
+      for (int j = 0; j < num_queries * n; j++) ball_sum += distances[j];
+      double ball_seconds = now() - start;
+
+      start = now();
+      double brute_sum = brute_force(points, num_points, test_points,
+                                     num_queries, k, n);
+      double brute_seconds = now() - start;
+
+      if (fabs(kd_sum - brute_sum) > 1e-6 * brute_sum
+          || fabs(ball_sum - brute_sum) > 1e-6 * brute_sum) {
+        fprintf(stderr, "Neighbors disagree with brute force.\n");
+        return EXIT_FAILURE;
+      }
+      printf("%s,%d,%d,%d,%.4f,%.4f,%.1f,%.1f,%.1f\n",
+             distributions[d], k, num_points, n, kd_build_seconds,
+             ball_build_seconds, kd_seconds * 1e6 / num_queries,
+             ball_seconds * 1e6 / num_queries,
+             brute_seconds * 1e6 / num_queries);
+      free_kd_tree(kd);
+      free_ball_tree(ball);
+    }
+  }
+
+  free(points);
+  free(indices);
+  free(distances);
+  return EXIT_SUCCESS;
+}
+
+void subspace_points(double *points, int num_points, int k) {
+  double basis[INTRINSIC_DIMENSION][256];
+  for (int b = 0; b < INTRINSIC_DIMENSION; b++) {
+    for (int j = 0; j < k; j++) {
+      basis[b][j] = (double) rand() / RAND_MAX - 0.5;
+    }
+  }
+  for (int i = 0; i < num_points; i++) {
+    double *point = points + ((size_t) i * k);
+    for (int j = 0; j < k; j++) {
+      point[j] = 0.01 * ((double) rand() / RAND_MAX - 0.5);
+    }
+    for (int b = 0; b < INTRINSIC_DIMENSION; b++) {
+      double weight = (double) rand() / RAND_MAX;
+      for (int j = 0; j < k; j++) {
+        point[j] += weight * basis[b][j];
+      }
+    }
+  }
+}
+
+double brute_force(double *points, int num_points, double *test_points,
+                   int num_queries, int k, int n) {
+  double *nearest = malloc(sizeof(double) * n);
+  double sum = 0;
+  for (int q = 0; q < num_queries; q++) {
+    double *test_point = test_points + ((size_t) q * k);
+    for (int j = 0; j < n; j++) nearest[j] = INFINITY;
+    for (int i = 0; i < num_points; i++) {
+      double *point = points + ((size_t) i * k);
+      double distance = 0;
+      for (int j = 0; j < k; j++) {
+        double offset = point[j] - test_point[j];
+        distance += offset * offset;
+      }
+      // Insertion into the sorted n nearest so far.
+      int j = n - 1;
+      if (distance >= nearest[j]) {
+        continue;
+      }
+      while (j > 0 && nearest[j - 1] > distance) {
+        nearest[j] = nearest[j - 1];
+        j--;
+      }
+      nearest[j] = distance;
+    }
+    for (int j = 0; j < n; j++) sum += sqrt(nearest[j]);
+  }
+  free(nearest);
+  return sum;
+}
@@ -0,0 +1,103 @@
+/*
+  Build time scaling benchmark. Builds the same tree with 1 to N threads and
+  reports the wall time of each build, its speedup over the serial build and
+  whether the tree came out identical to it.
+
+  usage: bench_build [num_points] [k] [leaf_size] [max_threads]
+*/
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../katy.h"
+#include "bench_common.h"
+
+/* Are the two trees made of identical nodes and index permutations? */
+bool same_tree(struct KdTree *a, struct KdTree *b);
+
+
+int main(int argc, char **argv) {
+  int num_points = argc > 1 ? atoi(argv[1]) : 2000000;
+  int k = argc > 2 ? atoi(argv[2]) : 3;
+  int leaf_size = argc > 3 ? atoi(argv[3]) : 16;
+  int max_threads = argc > 4 ? atoi(argv[4])
+                             : (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+
+  double *points = malloc(sizeof(double) * num_points * k);
+  if (points == NULL) {
+    fprintf(stderr, "Could not allocate %d points.\n", num_points);
+    return EXIT_FAILURE;
+  }
+  srand(1);
+  for (int i = 0; i < num_points * k; i++) {
+    points[i] = (double) rand() / RAND_MAX;
+  }
+
+  struct KdBuildOptions options = {0};
+  options.leaf_size = leaf_size;
+  options.seed = 1;
+
+  printf("num_points,k,leaf_size,threads,seconds,speedup,identical\n");
+  struct KdTree *serial = NULL;
+  double serial_seconds = 0;
+  // Powers of two, finishing with max_threads.
+  for (int threads = 1; ; threads *= 2) {
+    if (threads > max_threads) {
+      threads = max_threads;
+    }
+    options.num_threads = threads;
+    double start = now();
+    struct KdTree *tree = build_kd_tree_with_options(points, num_points, k,
+                                                     &options);
+    double seconds = now() - start;
+    if (tree == NULL) {
+      fprintf(stderr, "Build with %d threads failed.\n", threads);
+      return EXIT_FAILURE;
+    }
+
+    bool identical = true;
+    if (serial == NULL) {
+      serial = tree;
+      serial_seconds = seconds;
+    } else {
+      identical = same_tree(serial, tree);
+      free_kd_tree(tree);
+    }
+    printf("%d,%d,%d,%d,%.4f,%.2f,%s\n", num_points, k, leaf_size, threads,
+           seconds, serial_seconds / seconds, identical ? "yes" : "no");
+    if (threads == max_threads) {
+      break;
+    }
+  }
+
+  free_kd_tree(serial);
+  free(points);
+  return EXIT_SUCCESS;
+}
+
+bool same_tree(struct KdTree *a, struct KdTree *b) {
+  if (a->num_nodes != b->num_nodes || a->size != b->size) {
+    return false;
+  }
+  for (int i = 0; i < a->size; i++) {
+    if (a->indices[i] != b->indices[i]) {
+      return false;
+    }
+  }
+  for (int i = 0; i < a->num_nodes; i++) {
+    struct KdNode *x = a->nodes + i;
+    struct KdNode *y = b->nodes + i;
+    if (x->is_leaf != y->is_leaf || x->start != y->start || x->end != y->end
+        || (!x->is_leaf && (x->split_axis != y->split_axis
+                            || x->split_value != y->split_value))) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,42 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "bench_common.h"
+
+#define PI 3.14159265358979323846
+
+double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + (time.tv_nsec * 1e-9);
+}
+
+void uniform_points(double *points, int num_points, int k) {
+  for (long i = 0; i < (long) num_points * k; i++) {
+    points[i] = (double) rand() / RAND_MAX;
+  }
+}
+
+void clustered_points(double *points, int num_points, int k) {
+  // Always the same centers, whatever was drawn before.
+  unsigned int seed = (unsigned int) rand();
+  srand(12345);
+  double *centers = malloc(sizeof(double) * NUM_CLUSTERS * k);
+  uniform_points(centers, NUM_CLUSTERS, k);
+  srand(seed);
+
+  for (int i = 0; i < num_points; i++) {
+    double *center = centers + ((rand() % NUM_CLUSTERS) * k);
+    for (int j = 0; j < k; j++) {
+      // Box-Muller
+      double u = ((double) rand() + 1) / ((double) RAND_MAX + 2);
+      double v = (double) rand() / RAND_MAX;
+      double normal = sqrt(-2 * log(u)) * cos(2 * PI * v);
+      points[((size_t) i * k) + j] = center[j] + (0.01 * normal);
+    }
+  }
+  free(centers);
+}
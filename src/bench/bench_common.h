@@ -0,0 +1,22 @@
+/*
+  Timing and point generators shared by the benchmarks, so that every bench
+  draws its inputs the same way and their figures can be compared.
+*/
+#ifndef _KATY_BENCH_COMMON_H
+#define _KATY_BENCH_COMMON_H
+
+#define NUM_CLUSTERS 16
+
+/* Seconds on a monotonic clock. */
+double now(void);
+
+/* Uniform points in [0, 1)^k. */
+void uniform_points(double *points, int num_points, int k);
+
+/*
+  Points drawn around NUM_CLUSTERS centers uniform in [0, 1)^k, with a
+  gaussian spread of 0.01 along every axis.
+*/
+void clustered_points(double *points, int num_points, int k);
+
+#endif  // _KATY_BENCH_COMMON_H
@@ -0,0 +1,127 @@
+/*
+  Query context benchmark. Runs the same n nearest neighbor queries from a
+  growing number of threads, each query either allocating its own results as
+  kd_tree_query_n_nearest_neighbors_with_options() does, or drawing all of its
+  memory from a per-thread KdQueryContext, and reports the queries per second
+  of each. Large n and k push the allocating queries off their stack buffers,
+  which is where the allocator starts to contend.
+
+  usage: bench_context [num_points] [k] [n] [queries_per_thread]
+*/
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../katy.h"
+#include "../pool.h"
+#include "bench_common.h"
+
+#define LEAF_SIZE 16
+#define MAX_THREADS 8
+
+/* Queries every worker runs against a shared tree. */
+struct ContextBench {
+  struct KdTree *tree;
+  double *test_points;
+  int num_test_points;
+  int n;
+  int queries_per_thread;
+  int use_context;
+  double checksums[MAX_THREADS];
+};
+
+/* Worker running its share of the queries of a ContextBench. */
+void query_worker(void *context, int worker_id);
+
+
+int main(int argc, char **argv) {
+  int num_points = argc > 1 ? atoi(argv[1]) : 200000;
+  int k = argc > 2 ? atoi(argv[2]) : 8;
+  int n = argc > 3 ? atoi(argv[3]) : 100;
+  int queries_per_thread = argc > 4 ? atoi(argv[4]) : 5000;
+
+  int num_test_points = 4096;
+  double *points = malloc(sizeof(double) * num_points * k);
+  double *test_points = malloc(sizeof(double) * num_test_points * k);
+  if (points == NULL || test_points == NULL) {
+    fprintf(stderr, "Could not allocate %d points.\n", num_points);
+    return EXIT_FAILURE;
+  }
+  srand(1);
+  uniform_points(points, num_points, k);
+  uniform_points(test_points, num_test_points, k);
+  struct KdTree *tree = build_kd_tree(points, num_points, k, LEAF_SIZE, false);
+  if (tree == NULL) {
+    fprintf(stderr, "Build failed.\n");
+    return EXIT_FAILURE;
+  }
+
+  struct ContextBench bench = {tree, test_points, num_test_points, n,
+                               queries_per_thread, 0, {0}};
+  printf("num_points,k,n,num_threads,allocating_queries_per_second,"
+         "context_queries_per_second\n");
+  for (int num_threads = 1; num_threads <= MAX_THREADS; num_threads *= 2) {
+    double seconds[2];
+    double checksums[2] = {0, 0};
+    for (int use_context = 0; use_context < 2; use_context++) {
+      bench.use_context = use_context;
+      double start = now();
+      if (!run_workers(num_threads, query_worker, &bench)) {
+        fprintf(stderr, "Could not start %d threads.\n", num_threads);
+        return EXIT_FAILURE;
+      }
+      seconds[use_context] = now() - start;
+      for (int t = 0; t < num_threads; t++) {
+        checksums[use_context] += bench.checksums[t];
+      }
+    }
+    if (checksums[0] != checksums[1]) {
+      fprintf(stderr, "Context queries disagree with allocating queries.\n");
+      return EXIT_FAILURE;
+    }
+    double num_queries = (double) num_threads * queries_per_thread;
+    printf("%d,%d,%d,%d,%.0f,%.0f\n", num_points, k, n, num_threads,
+           num_queries / seconds[0], num_queries / seconds[1]);
+  }
+
+  free_kd_tree(tree);
+  free(points);
+  free(test_points);
+  return EXIT_SUCCESS;
+}
+
+void query_worker(void *context, int worker_id) {
+  struct ContextBench *bench = context;
+  int k = bench->tree->k;
+  struct KdQueryContext *query_context = NULL;
+  if (bench->use_context) {
+    query_context = create_kd_query_context();
+  }
+
+  double checksum = 0;
+  for (int q = 0; q < bench->queries_per_thread; q++) {
+    int row = (q + worker_id * 997) % bench->num_test_points;
+    double *test_point = bench->test_points + ((size_t) row * k);
+    struct KdResult *results;
+    int num_results;
+    if (query_context != NULL) {
+      num_results = kd_tree_query_n_nearest_neighbors_in_context(
+          bench->tree, test_point, bench->n, "squared_euclidean", NULL,
+          query_context, &results);
+    } else {
+      num_results = kd_tree_query_n_nearest_neighbors_with_options(
+          bench->tree, test_point, bench->n, "squared_euclidean", NULL,
+          &results);
+    }
+    for (int i = 0; i < num_results; i++) {
+      checksum += results[i].distance;
+    }
+    if (query_context == NULL) {
+      free(results);
+    }
+  }
+  bench->checksums[worker_id] = checksum;
+
+  if (query_context != NULL) {
+    free_kd_query_context(query_context);
+  }
+}
@@ -0,0 +1,90 @@
+/*
+  Distance kernel microbenchmark. Times every instruction set level the CPU
+  supports on each metric for k from 2 to 128 and reports the time per call
+  and the speedup over the scalar kernel.
+
+  usage: bench_distance [coordinates_per_run]
+*/
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../distance.h"
+#include "bench_common.h"
+
+#define NUM_POINTS 1024
+
+/*
+  Nanoseconds per call of `distance` between a query and each of NUM_POINTS
+  points, repeated until about `coordinates` coordinates have been visited.
+*/
+double time_kernel(double (*distance)(double *a, double *b, int k),
+                   double *points, double *query, int k, long coordinates);
+
+// Keeps the compiler from discarding distances nobody reads.
+volatile double sink;
+
+
+int main(int argc, char **argv) {
+  long coordinates = argc > 1 ? atol(argv[1]) : 100000000L;
+  int ks[] = {2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128};
+  int num_ks = sizeof(ks) / sizeof(ks[0]);
+
+  double *points = malloc(sizeof(double) * NUM_POINTS * 128);
+  double query[128];
+  if (points == NULL) {
+    return EXIT_FAILURE;
+  }
+  srand(1);
+  for (int i = 0; i < NUM_POINTS * 128; i++) {
+    points[i] = (double) rand() / RAND_MAX;
+  }
+  for (int i = 0; i < 128; i++) {
+    query[i] = (double) rand() / RAND_MAX;
+  }
+
+  const struct DistanceKernels *scalar = get_distance_kernels(SIMD_SCALAR);
+  printf("metric,k,isa,ns_per_call,speedup\n");
+  for (int metric = 0; metric < 2; metric++) {
+    for (int i = 0; i < num_ks; i++) {
+      int k = ks[i];
+      double baseline = 0;
+      for (int level = SIMD_SCALAR; level < SIMD_NUM_LEVELS; level++) {
+        const struct DistanceKernels *kernels = get_distance_kernels(level);
+        if (kernels == NULL) {
+          continue;
+        }
+        double (*distance)(double *a, double *b, int k) =
+            metric == 0 ? kernels->manhattan : kernels->squared_euclidean;
+        double ns = time_kernel(distance, points, query, k, coordinates);
+        if (kernels == scalar) {
+          baseline = ns;
+        }
+        printf("%s,%d,%s,%.2f,%.2f\n",
+               metric == 0 ? "manhattan" : "squared_euclidean", k,
+               kernels->name, ns, baseline / ns);
+      }
+    }
+  }
+
+  free(points);
+  return EXIT_SUCCESS;
+}
+
+double time_kernel(double (*distance)(double *a, double *b, int k),
+                   double *points, double *query, int k, long coordinates) {
+  long repeats = coordinates / ((long) NUM_POINTS * k);
+  if (repeats < 1) {
+    repeats = 1;
+  }
+
+  double total = 0;
+  double start = now();
+  for (long r = 0; r < repeats; r++) {
+    for (int i = 0; i < NUM_POINTS; i++) {
+      total += distance(points + (i * k), query, k);
+    }
+  }
+  double seconds = now() - start;
+  sink = total;
+  return seconds * 1e9 / ((double) repeats * NUM_POINTS);
+}
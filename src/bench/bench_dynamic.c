@@ -0,0 +1,110 @@
+/*
+  Dynamic tree benchmark. Inserts uniform points into a dynamic tree in
+  batches, deleting a share of the points after each batch, and reports the
+  time per insert and per delete, and the time per n nearest neighbor query
+  of the dynamic tree against a static tree rebuilt over the same points.
+
+  usage: bench_dynamic [num_points] [k] [batch_size] [num_queries]
+*/
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../katy.h"
+#include "../dynamic.h"
+#include "bench_common.h"
+
+#define NUM_NEIGHBORS 10
+#define LEAF_SIZE 16
+
+
+int main(int argc, char **argv) {
+  int num_points = argc > 1 ? atoi(argv[1]) : 1000000;
+  int k = argc > 2 ? atoi(argv[2]) : 8;
+  int batch_size = argc > 3 ? atoi(argv[3]) : 100000;
+  int num_queries = argc > 4 ? atoi(argv[4]) : 1000;
+
+  double *points = malloc(sizeof(double) * num_points * k);
+  double *live_points = malloc(sizeof(double) * num_points * k);
+  double *queries = malloc(sizeof(double) * num_queries * k);
+  if (points == NULL || live_points == NULL || queries == NULL) {
+    fprintf(stderr, "Could not allocate %d points.\n", num_points);
+    return EXIT_FAILURE;
+  }
+  srand(1);
+  uniform_points(points, num_points, k);
+  uniform_points(queries, num_queries, k);
+  struct KdDynamicTree *tree = create_kd_dynamic_tree(k, LEAF_SIZE, 0);
+  if (tree == NULL) {
+    fprintf(stderr, "Could not create the tree.\n");
+    return EXIT_FAILURE;
+  }
+  char metric[] = "squared_euclidean";
+
+  printf("num_points,k,live_points,us_per_insert,us_per_delete,"
+         "rebuild_seconds,dynamic_us_per_query,static_us_per_query\n");
+  for (int inserted = 0; inserted < num_points; inserted += batch_size) {
+    int end = inserted + batch_size < num_points ? inserted + batch_size
+                                                 : num_points;
+    double start = now();
+    for (int i = inserted; i < end; i++) {
+      if (kd_dynamic_tree_insert(tree, points + ((size_t) i * k)) == -1) {
+        fprintf(stderr, "Insert failed.\n");
+        return EXIT_FAILURE;
+      }
+    }
+    double insert_seconds = now() - start;
+
+    // A tenth of the batch goes again, anywhere in the tree.
+    int num_deletes = (end - inserted) / 10;
+    start = now();
+    for (int i = 0; i < num_deletes; i++) {
+      kd_dynamic_tree_delete(tree, rand() % end);
+    }
+    double delete_seconds = now() - start;
+
+    start = now();
+    for (int q = 0; q < num_queries; q++) {
+      struct KdResult *results;
+      kd_dynamic_tree_query_n_nearest_neighbors(
+          tree, queries + ((size_t) q * k), NUM_NEIGHBORS, metric, &results);
+      free(results);
+    }
+    double dynamic_seconds = now() - start;
+
+    int num_live = 0;
+    for (int i = 0; i < end; i++) {
+      if (tree->locations[i] != KD_DELETED) {
+        for (int j = 0; j < k; j++) {
+          live_points[((size_t) num_live * k) + j] = points[((size_t) i * k)
+                                                           + j];
+        }
+        num_live++;
+      }
+    }
+    start = now();
+    struct KdTree *rebuilt = build_kd_tree(live_points, num_live, k,
+                                           LEAF_SIZE, false);
+    double rebuild_seconds = now() - start;
+    start = now();
+    for (int q = 0; q < num_queries; q++) {
+      struct KdResult *results;
+      kd_tree_query_n_nearest_neighbors(rebuilt, queries + ((size_t) q * k),
+                                        NUM_NEIGHBORS, metric, &results);
+      free(results);
+    }
+    double static_seconds = now() - start;
+    free_kd_tree(rebuilt);
+
+    printf("%d,%d,%d,%.3f,%.3f,%.4f,%.2f,%.2f\n", end, k, num_live,
+           insert_seconds / (end - inserted) * 1e6,
+           num_deletes > 0 ? delete_seconds / num_deletes * 1e6 : 0,
+           rebuild_seconds, dynamic_seconds / num_queries * 1e6,
+           static_seconds / num_queries * 1e6);
+  }
+
+  free_kd_dynamic_tree(tree);
+  free(points);
+  free(live_points);
+  free(queries);
+  return EXIT_SUCCESS;
+}
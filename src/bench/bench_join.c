@@ -0,0 +1,108 @@
+/*
+  Range join benchmark. Pairs up two sets of uniform points within a box of
+  radii, once with kd_tree_join_range() and kd_tree_join_range_count(), and
+  once with one range query of the second tree per point of the first, and
+  reports the time of each for growing radii.
+
+  usage: bench_join [num_points_a] [num_points_b] [k]
+*/
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../katy.h"
+#include "bench_common.h"
+
+#define LEAF_SIZE 16
+#define NUM_RADII 3
+
+/* Range join visitor counting the pairs in a long long. */
+int count_pair(void *context, int index_a, int index_b);
+
+/* Range query visitor counting the points in a long long. */
+int count_point(void *context, int index, double *point, double distance);
+
+
+int main(int argc, char **argv) {
+  int num_points_a = argc > 1 ? atoi(argv[1]) : 200000;
+  int num_points_b = argc > 2 ? atoi(argv[2]) : 1000000;
+  int k = argc > 3 ? atoi(argv[3]) : 3;
+
+  double *points_a = malloc(sizeof(double) * num_points_a * k);
+  double *points_b = malloc(sizeof(double) * num_points_b * k);
+  double *radii = malloc(sizeof(double) * k);
+  if (points_a == NULL || points_b == NULL || radii == NULL) {
+    fprintf(stderr, "Could not allocate %d points.\n", num_points_b);
+    return EXIT_FAILURE;
+  }
+  srand(1);
+  uniform_points(points_a, num_points_a, k);
+  uniform_points(points_b, num_points_b, k);
+  struct KdTree *tree_a = build_kd_tree(points_a, num_points_a, k, LEAF_SIZE,
+                                        false);
+  struct KdTree *tree_b = build_kd_tree(points_b, num_points_b, k, LEAF_SIZE,
+                                        false);
+  if (tree_a == NULL || tree_b == NULL) {
+    fprintf(stderr, "Build failed.\n");
+    return EXIT_FAILURE;
+  }
+
+  double radius_values[NUM_RADII] = {0.005, 0.01, 0.02};
+  printf("num_points_a,num_points_b,k,radius,num_pairs,join_seconds,"
+         "join_count_seconds,per_point_seconds,per_point_count_seconds\n");
+  for (int r = 0; r < NUM_RADII; r++) {
+    for (int j = 0; j < k; j++) {
+      radii[j] = radius_values[r];
+    }
+
+    long long num_pairs = 0;
+    double start = now();
+    kd_tree_join_range(tree_a, tree_b, radii, count_pair, &num_pairs);
+    double join_seconds = now() - start;
+
+    start = now();
+    long long join_count = kd_tree_join_range_count(tree_a, tree_b, radii);
+    double join_count_seconds = now() - start;
+
+    long long per_point_pairs = 0;
+    start = now();
+    for (int i = 0; i < num_points_a; i++) {
+      kd_tree_query_range_visit(tree_b, points_a + ((size_t) i * k), radii,
+                                NULL, count_point, &per_point_pairs);
+    }
+    double per_point_seconds = now() - start;
+
+    long long per_point_count = 0;
+    start = now();
+    for (int i = 0; i < num_points_a; i++) {
+      per_point_count += kd_tree_query_range_count(
+          tree_b, points_a + ((size_t) i * k), radii);
+    }
+    double per_point_count_seconds = now() - start;
+
+    if (join_count != num_pairs || per_point_pairs != num_pairs
+        || per_point_count != num_pairs) {
+      fprintf(stderr, "Pair counts disagree.\n");
+      return EXIT_FAILURE;
+    }
+    printf("%d,%d,%d,%g,%lld,%.4f,%.4f,%.4f,%.4f\n", num_points_a,
+           num_points_b, k, radius_values[r], num_pairs, join_seconds,
+           join_count_seconds, per_point_seconds, per_point_count_seconds);
+  }
+
+  free_kd_tree(tree_a);
+  free_kd_tree(tree_b);
+  free(points_a);
+  free(points_b);
+  free(radii);
+  return EXIT_SUCCESS;
+}
+
+int count_pair(void *context, int index_a, int index_b) {
+  (*(long long *) context)++;
+  return 1;
+}
+
+int count_point(void *context, int index, double *point, double distance) {
+  (*(long long *) context)++;
+  return 1;
+}
@@ -0,0 +1,132 @@
+/*
+  Quantized leaf storage benchmark. Builds trees without quantization and with
+  16 and 8 bit codes over uniform and clustered points and reports the memory
+  each tree allocates on top of the caller's points, its time per n nearest
+  neighbor query and per range count, and the recall of its neighbors against
+  the unquantized tree's.
+
+  usage: bench_quantized [num_points] [k] [leaf_size] [num_queries]
+*/
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../katy.h"
+#include "bench_common.h"
+
+#define NUM_NEIGHBORS 10
+#define RANGE_RADIUS 0.05
+
+/*
+  Fraction of the `expected` neighbor indices of each query found among its
+  `found` neighbor indices.
+*/
+double recall(int *expected, int *found, int num_queries);
+
+
+int main(int argc, char **argv) {
+  int num_points = argc > 1 ? atoi(argv[1]) : 1000000;
+  int k = argc > 2 ? atoi(argv[2]) : 8;
+  int leaf_size = argc > 3 ? atoi(argv[3]) : 32;
+  int num_queries = argc > 4 ? atoi(argv[4]) : 10000;
+
+  size_t num_results = (size_t) num_queries * NUM_NEIGHBORS;
+  double *points = malloc(sizeof(double) * num_points * k);
+  double *queries = malloc(sizeof(double) * num_queries * k);
+  double *radii = malloc(sizeof(double) * k);
+  int *expected = malloc(sizeof(int) * num_results);
+  int *indices = malloc(sizeof(int) * num_results);
+  double *distances = malloc(sizeof(double) * num_results);
+  if (points == NULL || queries == NULL || radii == NULL || expected == NULL
+      || indices == NULL || distances == NULL) {
+    fprintf(stderr, "Could not allocate %d points.\n", num_points);
+    return EXIT_FAILURE;
+  }
+  for (int j = 0; j < k; j++) {
+    radii[j] = RANGE_RADIUS;
+  }
+
+  const char *distributions[] = {"uniform", "clustered"};
+  const char *quantizations[] = {"none", "int16", "int8"};
+  enum Quantization modes[] = {QUANTIZE_NONE, QUANTIZE_INT16, QUANTIZE_INT8};
+  char metric[] = "squared_euclidean";
+
+  printf("distribution,quantization,num_points,k,leaf_size,memory_mb,"
+         "build_seconds,us_per_query,us_per_count,recall\n");
+  for (int d = 0; d < 2; d++) {
+    // Queries follow the distribution of the points.
+    srand(1);
+    if (d == 0) {
+      uniform_points(points, num_points, k);
+      uniform_points(queries, num_queries, k);
+    } else {
+      clustered_points(points, num_points, k);
+      clustered_points(queries, num_queries, k);
+    }
+
+    for (int q = 0; q < 3; q++) {
+      struct KdBuildOptions options = {0};
+      options.leaf_size = leaf_size;
+      options.quantization = modes[q];
+      double start = now();
+      struct KdTree *tree = build_kd_tree_with_options(points, num_points, k,
+                                                       &options);
+      double build_seconds = now() - start;
+      if (tree == NULL) {
+        fprintf(stderr, "Build with %s quantization failed.\n",
+                quantizations[q]);
+        return EXIT_FAILURE;
+      }
+
+      start = now();
+      kd_tree_query_n_nearest_neighbors_batch(tree, queries, num_queries,
+                                              NUM_NEIGHBORS, metric, 1,
+                                              q == 0 ? expected : indices,
+                                              distances);
+      double query_seconds = now() - start;
+
+      start = now();
+      long count = 0;
+      for (int i = 0; i < num_queries; i++) {
+        count += kd_tree_query_range_count(tree, queries + ((size_t) i * k),
+                                           radii);
+      }
+      double count_seconds = now() - start;
+      if (count < 0) {
+        fprintf(stderr, "Range counts overflowed.\n");
+      }
+
+      printf("%s,%s,%d,%d,%d,%.1f,%.4f,%.2f,%.2f,%.4f\n", distributions[d],
+             quantizations[q], num_points, k, leaf_size,
+             tree->memory_bytes / 1e6, build_seconds,
+             query_seconds / num_queries * 1e6,
+             count_seconds / num_queries * 1e6,
+             q == 0 ? 1.0 : recall(expected, indices, num_queries));
+      free_kd_tree(tree);
+    }
+  }
+
+  free(points);
+  free(queries);
+  free(radii);
+  free(expected);
+  free(indices);
+  free(distances);
+  return EXIT_SUCCESS;
+}
+
+double recall(int *expected, int *found, int num_queries) {
+  long hits = 0;
+  for (int i = 0; i < num_queries; i++) {
+    int *want = expected + ((size_t) i * NUM_NEIGHBORS);
+    int *got = found + ((size_t) i * NUM_NEIGHBORS);
+    for (int a = 0; a < NUM_NEIGHBORS; a++) {
+      for (int b = 0; b < NUM_NEIGHBORS; b++) {
+        if (want[a] == got[b]) {
+          hits++;
+          break;
+        }
+      }
+    }
+  }
+  return (double) hits / ((double) num_queries * NUM_NEIGHBORS);
+}
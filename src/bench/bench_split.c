@@ -0,0 +1,108 @@
+/*
+  Split strategy benchmark. Builds median, midpoint and sliding-midpoint trees
+  over uniform and clustered points and reports the build time, the shape of
+  each tree, the time per n nearest neighbor query and the nodes, leaves and
+  distances each query visits.
+
+  usage: bench_split [num_points] [k] [leaf_size] [num_queries]
+*/
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../katy.h"
+#include "bench_common.h"
+
+#define NUM_NEIGHBORS 10
+
+/* Number of nodes on the longest path from `node` down to a leaf. */
+int tree_depth(struct KdTree *tree, struct KdNode *node);
+
+
+int main(int argc, char **argv) {
+  int num_points = argc > 1 ? atoi(argv[1]) : 1000000;
+  int k = argc > 2 ? atoi(argv[2]) : 8;
+  int leaf_size = argc > 3 ? atoi(argv[3]) : 16;
+  int num_queries = argc > 4 ? atoi(argv[4]) : 10000;
+
+  double *points = malloc(sizeof(double) * num_points * k);
+  double *queries = malloc(sizeof(double) * num_queries * k);
+  int *indices = malloc(sizeof(int) * num_queries * NUM_NEIGHBORS);
+  double *distances = malloc(sizeof(double) * num_queries * NUM_NEIGHBORS);
+  if (points == NULL || queries == NULL || indices == NULL
+      || distances == NULL) {
+    fprintf(stderr, "Could not allocate %d points.\n", num_points);
+    return EXIT_FAILURE;
+  }
+
+  const char *distributions[] = {"uniform", "clustered"};
+  const char *strategies[] = {"median", "midpoint", "sliding_midpoint"};
+  char metric[] = "squared_euclidean";
+
+  printf("distribution,strategy,num_points,k,leaf_size,build_seconds,"
+         "num_nodes,depth,us_per_query,nodes_per_query,leaves_per_query,"
+         "distances_per_query\n");
+  for (int d = 0; d < 2; d++) {
+    // Queries follow the distribution of the points.
+    srand(1);
+    if (d == 0) {
+      uniform_points(points, num_points, k);
+      uniform_points(queries, num_queries, k);
+    } else {
+      clustered_points(points, num_points, k);
+      clustered_points(queries, num_queries, k);
+    }
+
+    for (int s = 0; s < 3; s++) {
+      struct KdBuildOptions options = {0};
+      options.leaf_size = leaf_size;
+      options.split_strategy = (enum SplitStrategy) s;
+      double start = now();
+      struct KdTree *tree = build_kd_tree_with_options(points, num_points, k,
+                                                       &options);
+      double build_seconds = now() - start;
+      if (tree == NULL) {
+        fprintf(stderr, "Build with the %s strategy failed.\n",
+                strategies[s]);
+        return EXIT_FAILURE;
+      }
+
+      start = now();
+      kd_tree_query_n_nearest_neighbors_batch(tree, queries, num_queries,
+                                              NUM_NEIGHBORS, metric, 1,
+                                              indices, distances);
+      double query_seconds = now() - start;
+
+      // Counted in a second pass, so as not to weigh on the timing.
+      struct KdQueryStats stats;
+      struct KdQueryOptions query_options = {0};
+      query_options.stats = &stats;
+      kd_tree_query_n_nearest_neighbors_batch_with_options(
+          tree, queries, num_queries, NUM_NEIGHBORS, metric, &query_options,
+          1, indices, distances);
+
+      printf("%s,%s,%d,%d,%d,%.4f,%d,%d,%.2f,%.1f,%.1f,%.1f\n",
+             distributions[d], strategies[s], num_points, k, leaf_size,
+             build_seconds, tree->num_nodes, tree_depth(tree, tree->root),
+             query_seconds / num_queries * 1e6,
+             (double) stats.nodes_visited / num_queries,
+             (double) stats.leaves_scanned / num_queries,
+             (double) stats.distance_evaluations / num_queries);
+      free_kd_tree(tree);
+    }
+  }
+
+  free(points);
+  free(queries);
+  free(indices);
+  free(distances);
+  return EXIT_SUCCESS;
+}
+
+int tree_depth(struct KdTree *tree, struct KdNode *node) {
+  if (node->is_leaf) {
+    return 1;
+  }
+  int low = tree_depth(tree, tree->nodes + node->low);
+  int high = tree_depth(tree, tree->nodes + node->high);
+  return 1 + (low > high ? low : high);
+}
@@ -0,0 +1,135 @@
+/*
+  Saved tree benchmark. Builds a tree over uniform points, saves it with its
+  points and reports the time to build, save and load it, the time to the
+  first query after loading, and the time per n nearest neighbor query of the
+  built and the loaded tree. The points are then written to a file and built
+  again by a streaming build allowed an eighth of their size in memory.
+
+  usage: bench_store [num_points] [k] [num_queries] [path]
+*/
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../katy.h"
+#include "bench_common.h"
+
+#define NUM_NEIGHBORS 10
+#define LEAF_SIZE 16
+
+/* Seconds per query of a batch of queries run on one thread. */
+double time_queries(struct KdTree *tree, double *queries, int num_queries,
+                    int *indices, double *distances);
+
+
+int main(int argc, char **argv) {
+  int num_points = argc > 1 ? atoi(argv[1]) : 2000000;
+  int k = argc > 2 ? atoi(argv[2]) : 8;
+  int num_queries = argc > 3 ? atoi(argv[3]) : 10000;
+  char *path = argc > 4 ? argv[4] : "build/bench_store.kd";
+
+  double *points = malloc(sizeof(double) * num_points * k);
+  double *queries = malloc(sizeof(double) * num_queries * k);
+  int *indices = malloc(sizeof(int) * num_queries * NUM_NEIGHBORS);
+  double *distances = malloc(sizeof(double) * num_queries * NUM_NEIGHBORS);
+  if (points == NULL || queries == NULL || indices == NULL
+      || distances == NULL) {
+    fprintf(stderr, "Could not allocate %d points.\n", num_points);
+    return EXIT_FAILURE;
+  }
+  srand(1);
+  uniform_points(points, num_points, k);
+  uniform_points(queries, num_queries, k);
+
+  double start = now();
+  struct KdTree *tree = build_kd_tree(points, num_points, k, LEAF_SIZE, false);
+  double build_seconds = now() - start;
+  if (tree == NULL) {
+    fprintf(stderr, "Build failed.\n");
+    return EXIT_FAILURE;
+  }
+
+  start = now();
+  int saved = save_kd_tree(tree, path, true);
+  double save_seconds = now() - start;
+  if (!saved) {
+    fprintf(stderr, "Could not save the tree to %s.\n", path);
+    return EXIT_FAILURE;
+  }
+
+  start = now();
+  struct KdTree *loaded = load_kd_tree(path, NULL);
+  double load_seconds = now() - start;
+  if (loaded == NULL) {
+    fprintf(stderr, "Could not load the tree from %s.\n", path);
+    return EXIT_FAILURE;
+  }
+  kd_tree_query_n_nearest_neighbors_batch(loaded, queries, 1, NUM_NEIGHBORS,
+                                          "squared_euclidean", 1, indices,
+                                          distances);
+  double first_query_seconds = now() - start;
+
+  // The streamed tree goes to a second file next to the first.
+  char points_path[4096];
+  char streamed_path[4096];
+  snprintf(points_path, sizeof(points_path), "%s.points", path);
+  snprintf(streamed_path, sizeof(streamed_path), "%s.streamed", path);
+  FILE *file = fopen(points_path, "wb");
+  if (file == NULL
+      || fwrite(points, sizeof(double) * k, num_points, file)
+         != (size_t) num_points
+      || fclose(file) != 0) {
+    fprintf(stderr, "Could not write the points to %s.\n", points_path);
+    return EXIT_FAILURE;
+  }
+  struct KdStreamOptions stream_options = {0};
+  stream_options.build.leaf_size = LEAF_SIZE;
+  stream_options.memory_bytes = sizeof(double) * num_points * k / 8;
+  start = now();
+  int streamed = build_kd_tree_from_file(points_path, k, &stream_options,
+                                         streamed_path);
+  double stream_seconds = now() - start;
+  struct KdTree *streamed_tree = streamed ? load_kd_tree(streamed_path, NULL)
+                                          : NULL;
+  if (streamed_tree == NULL) {
+    fprintf(stderr, "Streaming build failed.\n");
+    return EXIT_FAILURE;
+  }
+
+  double built_query_seconds = time_queries(tree, queries, num_queries,
+                                            indices, distances);
+  double loaded_query_seconds = time_queries(loaded, queries, num_queries,
+                                             indices, distances);
+  double streamed_query_seconds = time_queries(streamed_tree, queries,
+                                               num_queries, indices,
+                                               distances);
+
+  printf("num_points,k,file_bytes,build_seconds,save_seconds,load_seconds,"
+         "first_query_seconds,built_us_per_query,loaded_us_per_query,"
+         "stream_seconds,streamed_us_per_query\n");
+  printf("%d,%d,%zu,%.4f,%.4f,%.6f,%.6f,%.2f,%.2f,%.4f,%.2f\n", num_points,
+         k, loaded->mapping_bytes, build_seconds, save_seconds, load_seconds,
+         first_query_seconds, built_query_seconds * 1e6,
+         loaded_query_seconds * 1e6, stream_seconds,
+         streamed_query_seconds * 1e6);
+
+  free_kd_tree(streamed_tree);
+  free_kd_tree(loaded);
+  free_kd_tree(tree);
+  remove(path);
+  remove(points_path);
+  remove(streamed_path);
+  free(points);
+  free(queries);
+  free(indices);
+  free(distances);
+  return EXIT_SUCCESS;
+}
+
+double time_queries(struct KdTree *tree, double *queries, int num_queries,
+                    int *indices, double *distances) {
+  double start = now();
+  kd_tree_query_n_nearest_neighbors_batch(tree, queries, num_queries,
+                                          NUM_NEIGHBORS, "squared_euclidean",
+                                          1, indices, distances);
+  return (now() - start) / num_queries;
+}
@@ -0,0 +1,360 @@
+/*
+  Regression benchmark suite. Sweeps the data distribution, k, the leaf size
+  and n over the main build and query paths, and times each against a brute
+  force scan of the same points:
+
+  - build: build_kd_tree_with_options()
+  - knn: single n nearest neighbor queries for median and 99th percentile
+    latency, and a serial batch query for throughput
+  - range, range_count: kd_tree_query_range_visit() and
+    kd_tree_query_range_count() over boxes holding about 0.1% of uniform
+    points
+
+  Brute force results are checked against the tree's, and the suite fails if
+  they disagree. Every measurement is one CSV row with the same columns, so
+  runs of two releases can be joined on the key columns and compared.
+
+  usage: bench_suite [num_points] [num_queries] [num_brute_queries]
+*/
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "../katy.h"
+#include "bench_common.h"
+
+#define NUM_DISTINCT_DIVISOR 100
+#define RANGE_FRACTION 0.001
+
+enum Distribution {
+  UNIFORM,
+  CLUSTERED,
+  DUPLICATES,
+  SORTED,
+  NUM_DISTRIBUTIONS
+};
+
+/*
+  Copies of num_points / NUM_DISTINCT_DIVISOR distinct uniform points, so that
+  every point has about as many exact duplicates.
+*/
+void duplicate_points(double *points, int num_points, int k);
+
+/*
+  Uniform points, except that the first coordinate increases with the index
+  of the point, as in time series or data loaded from a sorted table.
+*/
+void sorted_points(double *points, int num_points, int k);
+
+/* Points of `distribution`. */
+void generate_points(enum Distribution distribution, double *points,
+                     int num_points, int k);
+
+/* qsort() comparison of doubles in increasing order. */
+int compare_doubles(const void *a, const void *b);
+
+/*
+  Distances of the `n` points nearest to `test_point` by a linear scan,
+  written nearest first to `distances`.
+*/
+void brute_force_knn(double *points, int num_points, int k, double *test_point,
+                     int n, double *distances);
+
+/* Number of points within `radii` of `test_point` by a linear scan. */
+int brute_force_range_count(double *points, int num_points, int k,
+                            double *test_point, double *radii);
+
+/* Range query visitor counting the points found in an int. */
+int count_point(void *context, int index, double *point, double distance);
+
+/* Print one row of results. */
+void print_row(const char *workload, const char *distribution, int num_points,
+               int k, int leaf_size, int n, const char *method, int num_ops,
+               double seconds, double *latencies);
+
+
+int main(int argc, char **argv) {
+  int num_points = argc > 1 ? atoi(argv[1]) : 100000;
+  int num_queries = argc > 2 ? atoi(argv[2]) : 1000;
+  int num_brute_queries = argc > 3 ? atoi(argv[3]) : 50;
+  if (num_brute_queries > num_queries) {
+    num_brute_queries = num_queries;
+  }
+
+  const char *distributions[] = {"uniform", "clustered", "duplicates",
+                                 "sorted"};
+  int ks[] = {2, 3, 8, 16};
+  int leaf_sizes[] = {8, 32};
+  int ns[] = {1, 10, 50};
+  int num_ks = sizeof(ks) / sizeof(ks[0]);
+  int num_leaf_sizes = sizeof(leaf_sizes) / sizeof(leaf_sizes[0]);
+  int num_ns = sizeof(ns) / sizeof(ns[0]);
+  int max_k = ks[num_ks - 1];
+  int max_n = ns[num_ns - 1];
+
+  double *points = malloc(sizeof(double) * num_points * max_k);
+  double *queries = malloc(sizeof(double) * num_queries * max_k);
+  double *radii = malloc(sizeof(double) * max_k);
+  double *latencies = malloc(sizeof(double) * num_queries);
+  int *indices = malloc(sizeof(int) * num_queries * max_n);
+  double *distances = malloc(sizeof(double) * num_queries * max_n);
+  double *brute_distances = malloc(sizeof(double) * max_n);
+  int *range_counts = malloc(sizeof(int) * num_queries);
+  if (points == NULL || queries == NULL || radii == NULL || latencies == NULL
+      || indices == NULL || distances == NULL || brute_distances == NULL
+      || range_counts == NULL) {
+    fprintf(stderr, "Could not allocate %d points.\n", num_points);
+    return EXIT_FAILURE;
+  }
+  char metric[] = "squared_euclidean";
+
+  printf("workload,distribution,num_points,k,leaf_size,n,method,num_ops,"
+         "seconds,us_per_op,ops_per_second,p50_us,p99_us\n");
+  for (int d = 0; d < NUM_DISTRIBUTIONS; d++) {
+    for (int kk = 0; kk < num_ks; kk++) {
+      int k = ks[kk];
+      // Queries follow the distribution of the points.
+      srand(1);
+      generate_points((enum Distribution) d, points, num_points, k);
+      generate_points((enum Distribution) d, queries, num_queries, k);
+      // Boxes holding RANGE_FRACTION of uniform points.
+      for (int j = 0; j < k; j++) {
+        radii[j] = 0.5 * pow(RANGE_FRACTION, 1.0 / k);
+      }
+
+      for (int l = 0; l < num_leaf_sizes; l++) {
+        int leaf_size = leaf_sizes[l];
+        struct KdBuildOptions options = {0};
+        options.leaf_size = leaf_size;
+        double start = now();
+        struct KdTree *tree = build_kd_tree_with_options(points, num_points, k,
+                                                         &options);
+        double seconds = now() - start;
+        if (tree == NULL) {
+          fprintf(stderr, "Build of %s points failed.\n", distributions[d]);
+          return EXIT_FAILURE;
+        }
+        print_row("build", distributions[d], num_points, k, leaf_size, 0,
+                  "tree", 1, seconds, NULL);
+
+        for (int nn = 0; nn < num_ns; nn++) {
+          int n = ns[nn];
+          for (int q = 0; q < num_queries; q++) {
+            struct KdResult *results;
+            start = now();
+            kd_tree_query_n_nearest_neighbors(tree, queries + (q * k), n,
+                                              metric, &results);
+            latencies[q] = now() - start;
+            free(results);
+          }
+          print_row("knn", distributions[d], num_points, k, leaf_size, n,
+                    "tree", num_queries, 0, latencies);
+
+          start = now();
+          kd_tree_query_n_nearest_neighbors_batch(tree, queries, num_queries,
+                                                  n, metric, 1, indices,
+                                                  distances);
+          seconds = now() - start;
+          print_row("knn_batch", distributions[d], num_points, k, leaf_size,
+                    n, "tree", num_queries, seconds, NULL);
+
+          // Brute force does not depend on the leaf size.
+          for (int q = 0; q < num_brute_queries; q++) {
+            start = now();
+            brute_force_knn(points, num_points, k, queries + (q * k), n,
+                            brute_distances);
+            latencies[q] = now() - start;
+            for (int i = 0; i < n; i++) {
+              // Kernels may sum in a different order than the scan.
+              if (fabs(brute_distances[i] - distances[(q * n) + i])
+                  > 1e-9 * brute_distances[i]) {
+                fprintf(stderr, "Tree and brute force neighbors of %s "
+                        "points disagree.\n", distributions[d]);
+                return EXIT_FAILURE;
+              }
+            }
+          }
+          if (l == 0) {
+            print_row("knn", distributions[d], num_points, k, 0, n, "brute",
+                      num_brute_queries, 0, latencies);
+          }
+        }
+
+        int num_found = 0;
+        start = now();
+        for (int q = 0; q < num_queries; q++) {
+          int found = 0;
+          kd_tree_query_range_visit(tree, queries + (q * k), radii, NULL,
+                                    count_point, &found);
+          range_counts[q] = found;
+          num_found += found;
+        }
+        seconds = now() - start;
+        print_row("range", distributions[d], num_points, k, leaf_size, 0,
+                  "tree", num_queries, seconds, NULL);
+
+        start = now();
+        for (int q = 0; q < num_queries; q++) {
+          num_found -= kd_tree_query_range_count(tree, queries + (q * k),
+                                                 radii);
+        }
+        seconds = now() - start;
+        print_row("range_count", distributions[d], num_points, k, leaf_size,
+                  0, "tree", num_queries, seconds, NULL);
+
+        start = now();
+        bool agree = num_found == 0;
+        for (int q = 0; q < num_brute_queries; q++) {
+          agree = agree
+                  && brute_force_range_count(points, num_points, k,
+                                             queries + (q * k), radii)
+                     == range_counts[q];
+        }
+        seconds = now() - start;
+        if (!agree) {
+          fprintf(stderr, "Tree and brute force ranges of %s points "
+                  "disagree.\n", distributions[d]);
+          return EXIT_FAILURE;
+        }
+        if (l == 0) {
+          print_row("range", distributions[d], num_points, k, 0, 0, "brute",
+                    num_brute_queries, seconds, NULL);
+        }
+        free_kd_tree(tree);
+      }
+    }
+  }
+
+  free(points);
+  free(queries);
+  free(radii);
+  free(latencies);
+  free(indices);
+  free(distances);
+  free(brute_distances);
+  free(range_counts);
+  return EXIT_SUCCESS;
+}
+
+void duplicate_points(double *points, int num_points, int k) {
+  int num_distinct = num_points / NUM_DISTINCT_DIVISOR;
+  num_distinct = num_distinct > 0 ? num_distinct : 1;
+  // Always the same distinct points, so queries land on them.
+  unsigned int seed = (unsigned int) rand();
+  srand(54321);
+  double *distinct = malloc(sizeof(double) * num_distinct * k);
+  uniform_points(distinct, num_distinct, k);
+  srand(seed);
+
+  for (int i = 0; i < num_points; i++) {
+    double *point = distinct + ((rand() % num_distinct) * k);
+    for (int j = 0; j < k; j++) {
+      points[((size_t) i * k) + j] = point[j];
+    }
+  }
+  free(distinct);
+}
+
+void sorted_points(double *points, int num_points, int k) {
+  uniform_points(points, num_points, k);
+  for (int i = 0; i < num_points; i++) {
+    points[(size_t) i * k] = (double) i / num_points;
+  }
+}
+
+void generate_points(enum Distribution distribution, double *points,
+                     int num_points, int k) {
+  switch (distribution) {
+    case CLUSTERED:
+      clustered_points(points, num_points, k);
+      break;
+    case DUPLICATES:
+      duplicate_points(points, num_points, k);
+      break;
+    case SORTED:
+      sorted_points(points, num_points, k);
+      break;
+    default:
+      uniform_points(points, num_points, k);
+      break;
+  }
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+void brute_force_knn(double *points, int num_points, int k, double *test_point,
+                     int n, double *distances) {
+  int size = 0;
+  for (int i = 0; i < num_points; i++) {
+    double *point = points + ((size_t) i * k);
+    double distance = 0;
+    for (int j = 0; j < k; j++) {
+      double difference = point[j] - test_point[j];
+      distance += difference * difference;
+    }
+    if (size == n && distance >= distances[n - 1]) {
+      continue;
+    }
+    // Insertion into the sorted distances, dropping the furthest when full.
+    int slot = size < n ? size++ : n - 1;
+    while (slot > 0 && distances[slot - 1] > distance) {
+      distances[slot] = distances[slot - 1];
+      slot--;
+    }
+    distances[slot] = distance;
+  }
+  for (int i = size; i < n; i++) {
+    distances[i] = INFINITY;
+  }
+}
+
+int brute_force_range_count(double *points, int num_points, int k,
+                            double *test_point, double *radii) {
+  int count = 0;
+  for (int i = 0; i < num_points; i++) {
+    double *point = points + ((size_t) i * k);
+    bool inside = true;
+    for (int j = 0; j < k && inside; j++) {
+      inside = fabs(point[j] - test_point[j]) <= radii[j];
+    }
+    count += inside;
+  }
+  return count;
+}
+
+int count_point(void *context, int index, double *point, double distance) {
+  (*(int *) context)++;
+  return 1;
+}
+
+/*
+  Rows timed query by query carry percentiles of `latencies`, whose sum is
+  the time, and rows timed as a whole leave the percentile columns empty.
+*/
+void print_row(const char *workload, const char *distribution, int num_points,
+               int k, int leaf_size, int n, const char *method, int num_ops,
+               double seconds, double *latencies) {
+  char p50[32] = "";
+  char p99[32] = "";
+  if (num_ops == 0) {
+    return;
+  }
+  if (latencies != NULL) {
+    seconds = 0;
+    for (int i = 0; i < num_ops; i++) {
+      seconds += latencies[i];
+    }
+    qsort(latencies, num_ops, sizeof(double), compare_doubles);
+    snprintf(p50, sizeof(p50), "%.2f", latencies[num_ops / 2] * 1e6);
+    snprintf(p99, sizeof(p99), "%.2f",
+             latencies[(int) (num_ops * 0.99)] * 1e6);
+  }
+  printf("%s,%s,%d,%d,%d,%d,%s,%d,%.6f,%.3f,%.1f,%s,%s\n", workload,
+         distribution, num_points, k, leaf_size, n, method, num_ops, seconds,
+         seconds / num_ops * 1e6, num_ops / seconds, p50, p99);
+}
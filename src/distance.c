@@ -0,0 +1,856 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "distance.h"
+
+// Vector kernels need x86-64 and a compiler that can target instruction sets
+// per function, so the rest of the library keeps building for the baseline.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define KATY_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#ifdef KATY_X86_SIMD
+/* SSE2 kernels, two doubles or four floats per instruction. */
+double minkowski_1_sse2(double *a, double *b, int k);
+double squared_minkowski_2_sse2(double *a, double *b, int k);
+double chebyshev_sse2(double *a, double *b, int k);
+double float_minkowski_1_sse2(float *a, float *b, int k);
+double float_squared_minkowski_2_sse2(float *a, float *b, int k);
+double float_chebyshev_sse2(float *a, float *b, int k);
+
+/* AVX2 kernels, four doubles or eight floats per instruction. */
+double minkowski_1_avx2(double *a, double *b, int k);
+double squared_minkowski_2_avx2(double *a, double *b, int k);
+double chebyshev_avx2(double *a, double *b, int k);
+double float_minkowski_1_avx2(float *a, float *b, int k);
+double float_squared_minkowski_2_avx2(float *a, float *b, int k);
+double float_chebyshev_avx2(float *a, float *b, int k);
+
+/*
+  AVX-512 kernels, eight doubles or sixteen floats per instruction and masked
+  tails.
+*/
+double minkowski_1_avx512(double *a, double *b, int k);
+double squared_minkowski_2_avx512(double *a, double *b, int k);
+double chebyshev_avx512(double *a, double *b, int k);
+double float_minkowski_1_avx512(float *a, float *b, int k);
+double float_squared_minkowski_2_avx512(float *a, float *b, int k);
+double float_chebyshev_avx512(float *a, float *b, int k);
+
+/*
+  Horizontal sum of a vector of floats. SSE2 has no horizontal add, so lanes
+  are folded with shuffles.
+*/
+float sum_float_sse2(__m128 sum);
+
+/* Horizontal maximum of a vector of floats. */
+float max_float_sse2(__m128 max);
+#endif
+
+static const struct DistanceKernels scalar_kernels = {
+  "scalar", SIMD_SCALAR, minkowski_1, squared_minkowski_2, chebyshev,
+  float_minkowski_1, float_squared_minkowski_2, float_chebyshev
+};
+
+#ifdef KATY_X86_SIMD
+static const struct DistanceKernels sse2_kernels = {
+  "sse2", SIMD_SSE2, minkowski_1_sse2, squared_minkowski_2_sse2,
+  chebyshev_sse2, float_minkowski_1_sse2, float_squared_minkowski_2_sse2,
+  float_chebyshev_sse2
+};
+
+static const struct DistanceKernels avx2_kernels = {
+  "avx2", SIMD_AVX2, minkowski_1_avx2, squared_minkowski_2_avx2,
+  chebyshev_avx2, float_minkowski_1_avx2, float_squared_minkowski_2_avx2,
+  float_chebyshev_avx2
+};
+
+static const struct DistanceKernels avx512_kernels = {
+  "avx512", SIMD_AVX512, minkowski_1_avx512, squared_minkowski_2_avx512,
+  chebyshev_avx512, float_minkowski_1_avx512,
+  float_squared_minkowski_2_avx512, float_chebyshev_avx512
+};
+#endif
+
+/*
+  The widest supported level whose vectors hold no more than `k` coordinates,
+  given the coordinates per vector at each level.
+*/
+const struct DistanceKernels *best_kernels_for_widths(const int *widths,
+                                                      int k);
+
+
+const struct DistanceKernels *get_distance_kernels(enum SimdLevel level) {
+  if (level == SIMD_SCALAR) {
+    return &scalar_kernels;
+  }
+#ifdef KATY_X86_SIMD
+  // CPUID is queried by the compiler's runtime, which also checks that the
+  // OS saves the wider registers.
+  __builtin_cpu_init();
+  switch (level) {
+    case SIMD_SSE2:
+      return __builtin_cpu_supports("sse2") ? &sse2_kernels : NULL;
+    case SIMD_AVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+             ? &avx2_kernels : NULL;
+    case SIMD_AVX512:
+      return __builtin_cpu_supports("avx512f") ? &avx512_kernels : NULL;
+    default:
+      return NULL;
+  }
+#else
+  return NULL;
+#endif
+}
+
+const struct DistanceKernels *best_distance_kernels(int k) {
+  // Coordinates per vector at each level. Wider vectors only pay off once a
+  // point fills them.
+  static const int widths[SIMD_NUM_LEVELS] = {1, 2, 4, 8};
+  return best_kernels_for_widths(widths, k);
+}
+
+const struct DistanceKernels *best_float_distance_kernels(int k) {
+  static const int widths[SIMD_NUM_LEVELS] = {1, 4, 8, 16};
+  return best_kernels_for_widths(widths, k);
+}
+
+const struct DistanceKernels *best_kernels_for_widths(const int *widths,
+                                                      int k) {
+  for (int level = SIMD_NUM_LEVELS - 1; level > SIMD_SCALAR; level--) {
+    if (widths[level] > k) {
+      continue;
+    }
+    const struct DistanceKernels *kernels = get_distance_kernels(level);
+    if (kernels != NULL) {
+      return kernels;
+    }
+  }
+  return &scalar_kernels;
+}
+
+double minkowski_1(double *a, double *b, int k) {
+  double dist = 0;
+  for (int i = 0; i < k; i++) {
+    dist += fabs(a[i] - b[i]);
+  }
+  return dist;
+}
+
+double squared_minkowski_2(double *a, double *b, int k) {
+  double dist = 0;
+  for (int i = 0; i < k; i++) {
+    double diff = a[i] - b[i];
+    dist += diff * diff;
+  }
+  return dist;
+}
+
+double chebyshev(double *a, double *b, int k) {
+  double dist = 0;
+  for (int i = 0; i < k; i++) {
+    double diff = fabs(a[i] - b[i]);
+    dist = diff > dist ? diff : dist;
+  }
+  return dist;
+}
+
+double reduced_minkowski_p(double *a, double *b, int k, double p) {
+  double dist = 0;
+  for (int i = 0; i < k; i++) {
+    dist += pow(fabs(a[i] - b[i]), p);
+  }
+  return dist;
+}
+
+double float_minkowski_1(float *a, float *b, int k) {
+  float dist = 0;
+  for (int i = 0; i < k; i++) {
+    dist += fabsf(a[i] - b[i]);
+  }
+  return dist;
+}
+
+double float_squared_minkowski_2(float *a, float *b, int k) {
+  float dist = 0;
+  for (int i = 0; i < k; i++) {
+    float diff = a[i] - b[i];
+    dist += diff * diff;
+  }
+  return dist;
+}
+
+double float_chebyshev(float *a, float *b, int k) {
+  float dist = 0;
+  for (int i = 0; i < k; i++) {
+    float diff = fabsf(a[i] - b[i]);
+    dist = diff > dist ? diff : dist;
+  }
+  return dist;
+}
+
+double float_reduced_minkowski_p(float *a, float *b, int k, double p) {
+  float dist = 0;
+  for (int i = 0; i < k; i++) {
+    dist += powf(fabsf(a[i] - b[i]), (float) p);
+  }
+  return dist;
+}
+
+#ifdef KATY_X86_SIMD
+
+/*
+  The vector kernels keep two independent accumulators to hide add latency,
+  then finish odd coordinates with narrower steps.
+*/
+
+double minkowski_1_sse2(double *a, double *b, int k) {
+  const __m128d sign = _mm_set1_pd(-0.0);
+  __m128d sum0 = _mm_setzero_pd();
+  __m128d sum1 = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= k; i += 4) {
+    __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    __m128d d1 = _mm_sub_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2));
+    sum0 = _mm_add_pd(sum0, _mm_andnot_pd(sign, d0));
+    sum1 = _mm_add_pd(sum1, _mm_andnot_pd(sign, d1));
+  }
+  if (i + 2 <= k) {
+    __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    sum0 = _mm_add_pd(sum0, _mm_andnot_pd(sign, d0));
+    i += 2;
+  }
+  sum0 = _mm_add_pd(sum0, sum1);
+  double dist = _mm_cvtsd_f64(_mm_add_sd(sum0, _mm_unpackhi_pd(sum0, sum0)));
+  if (i < k) {
+    dist += fabs(a[i] - b[i]);
+  }
+  return dist;
+}
+
+double squared_minkowski_2_sse2(double *a, double *b, int k) {
+  __m128d sum0 = _mm_setzero_pd();
+  __m128d sum1 = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= k; i += 4) {
+    __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    __m128d d1 = _mm_sub_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2));
+    sum0 = _mm_add_pd(sum0, _mm_mul_pd(d0, d0));
+    sum1 = _mm_add_pd(sum1, _mm_mul_pd(d1, d1));
+  }
+  if (i + 2 <= k) {
+    __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    sum0 = _mm_add_pd(sum0, _mm_mul_pd(d0, d0));
+    i += 2;
+  }
+  sum0 = _mm_add_pd(sum0, sum1);
+  double dist = _mm_cvtsd_f64(_mm_add_sd(sum0, _mm_unpackhi_pd(sum0, sum0)));
+  if (i < k) {
+    double diff = a[i] - b[i];
+    dist += diff * diff;
+  }
+  return dist;
+}
+
+double chebyshev_sse2(double *a, double *b, int k) {
+  const __m128d sign = _mm_set1_pd(-0.0);
+  __m128d max0 = _mm_setzero_pd();
+  __m128d max1 = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= k; i += 4) {
+    __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    __m128d d1 = _mm_sub_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2));
+    max0 = _mm_max_pd(max0, _mm_andnot_pd(sign, d0));
+    max1 = _mm_max_pd(max1, _mm_andnot_pd(sign, d1));
+  }
+  if (i + 2 <= k) {
+    __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    max0 = _mm_max_pd(max0, _mm_andnot_pd(sign, d0));
+    i += 2;
+  }
+  max0 = _mm_max_pd(max0, max1);
+  double dist = _mm_cvtsd_f64(_mm_max_sd(max0, _mm_unpackhi_pd(max0, max0)));
+  if (i < k) {
+    double diff = fabs(a[i] - b[i]);
+    dist = diff > dist ? diff : dist;
+  }
+  return dist;
+}
+
+__attribute__((target("avx2,fma")))
+double minkowski_1_avx2(double *a, double *b, int k) {
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  __m256d sum0 = _mm256_setzero_pd();
+  __m256d sum1 = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 8 <= k; i += 8) {
+    __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+    __m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(a + i + 4),
+                               _mm256_loadu_pd(b + i + 4));
+    sum0 = _mm256_add_pd(sum0, _mm256_andnot_pd(sign, d0));
+    sum1 = _mm256_add_pd(sum1, _mm256_andnot_pd(sign, d1));
+  }
+  if (i + 4 <= k) {
+    __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+    sum0 = _mm256_add_pd(sum0, _mm256_andnot_pd(sign, d0));
+    i += 4;
+  }
+  sum0 = _mm256_add_pd(sum0, sum1);
+  __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum0),
+                            _mm256_extractf128_pd(sum0, 1));
+  if (i + 2 <= k) {
+    __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    half = _mm_add_pd(half, _mm_andnot_pd(_mm_set1_pd(-0.0), d0));
+    i += 2;
+  }
+  double dist = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+  if (i < k) {
+    dist += fabs(a[i] - b[i]);
+  }
+  return dist;
+}
+
+__attribute__((target("avx2,fma")))
+double squared_minkowski_2_avx2(double *a, double *b, int k) {
+  __m256d sum0 = _mm256_setzero_pd();
+  __m256d sum1 = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 8 <= k; i += 8) {
+    __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+    __m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(a + i + 4),
+                               _mm256_loadu_pd(b + i + 4));
+    sum0 = _mm256_fmadd_pd(d0, d0, sum0);
+    sum1 = _mm256_fmadd_pd(d1, d1, sum1);
+  }
+  if (i + 4 <= k) {
+    __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+    sum0 = _mm256_fmadd_pd(d0, d0, sum0);
+    i += 4;
+  }
+  sum0 = _mm256_add_pd(sum0, sum1);
+  __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum0),
+                            _mm256_extractf128_pd(sum0, 1));
+  if (i + 2 <= k) {
+    __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    half = _mm_fmadd_pd(d0, d0, half);
+    i += 2;
+  }
+  double dist = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+  if (i < k) {
+    double diff = a[i] - b[i];
+    dist += diff * diff;
+  }
+  return dist;
+}
+
+__attribute__((target("avx2,fma")))
+double chebyshev_avx2(double *a, double *b, int k) {
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  __m256d max0 = _mm256_setzero_pd();
+  __m256d max1 = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 8 <= k; i += 8) {
+    __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+    __m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(a + i + 4),
+                               _mm256_loadu_pd(b + i + 4));
+    max0 = _mm256_max_pd(max0, _mm256_andnot_pd(sign, d0));
+    max1 = _mm256_max_pd(max1, _mm256_andnot_pd(sign, d1));
+  }
+  if (i + 4 <= k) {
+    __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+    max0 = _mm256_max_pd(max0, _mm256_andnot_pd(sign, d0));
+    i += 4;
+  }
+  max0 = _mm256_max_pd(max0, max1);
+  __m128d half = _mm_max_pd(_mm256_castpd256_pd128(max0),
+                            _mm256_extractf128_pd(max0, 1));
+  if (i + 2 <= k) {
+    __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    half = _mm_max_pd(half, _mm_andnot_pd(_mm_set1_pd(-0.0), d0));
+    i += 2;
+  }
+  double dist = _mm_cvtsd_f64(_mm_max_sd(half, _mm_unpackhi_pd(half, half)));
+  if (i < k) {
+    double diff = fabs(a[i] - b[i]);
+    dist = diff > dist ? diff : dist;
+  }
+  return dist;
+}
+
+__attribute__((target("avx512f")))
+double minkowski_1_avx512(double *a, double *b, int k) {
+  __m512d sum0 = _mm512_setzero_pd();
+  __m512d sum1 = _mm512_setzero_pd();
+  int i = 0;
+  for (; i + 16 <= k; i += 16) {
+    __m512d d0 = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+    __m512d d1 = _mm512_sub_pd(_mm512_loadu_pd(a + i + 8),
+                               _mm512_loadu_pd(b + i + 8));
+    sum0 = _mm512_add_pd(sum0, _mm512_abs_pd(d0));
+    sum1 = _mm512_add_pd(sum1, _mm512_abs_pd(d1));
+  }
+  if (i + 8 <= k) {
+    __m512d d0 = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+    sum0 = _mm512_add_pd(sum0, _mm512_abs_pd(d0));
+    i += 8;
+  }
+  if (i < k) {
+    // Masked lanes load as zero and contribute nothing.
+    __mmask8 mask = (__mmask8) ((1u << (k - i)) - 1);
+    __m512d d1 = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, a + i),
+                               _mm512_maskz_loadu_pd(mask, b + i));
+    sum1 = _mm512_add_pd(sum1, _mm512_abs_pd(d1));
+  }
+  return _mm512_reduce_add_pd(_mm512_add_pd(sum0, sum1));
+}
+
+__attribute__((target("avx512f")))
+double squared_minkowski_2_avx512(double *a, double *b, int k) {
+  __m512d sum0 = _mm512_setzero_pd();
+  __m512d sum1 = _mm512_setzero_pd();
+  int i = 0;
+  for (; i + 16 <= k; i += 16) {
+    __m512d d0 = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+    __m512d d1 = _mm512_sub_pd(_mm512_loadu_pd(a + i + 8),
+                               _mm512_loadu_pd(b + i + 8));
+    sum0 = _mm512_fmadd_pd(d0, d0, sum0);
+    sum1 = _mm512_fmadd_pd(d1, d1, sum1);
+  }
+  if (i + 8 <= k) {
+    __m512d d0 = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+    sum0 = _mm512_fmadd_pd(d0, d0, sum0);
+    i += 8;
+  }
+  if (i < k) {
+    // Masked lanes load as zero and contribute nothing.
+    __mmask8 mask = (__mmask8) ((1u << (k - i)) - 1);
+    __m512d d1 = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, a + i),
+                               _mm512_maskz_loadu_pd(mask, b + i));
+    sum1 = _mm512_fmadd_pd(d1, d1, sum1);
+  }
+  return _mm512_reduce_add_pd(_mm512_add_pd(sum0, sum1));
+}
+
+__attribute__((target("avx512f")))
+double chebyshev_avx512(double *a, double *b, int k) {
+  __m512d max0 = _mm512_setzero_pd();
+  __m512d max1 = _mm512_setzero_pd();
+  int i = 0;
+  for (; i + 16 <= k; i += 16) {
+    __m512d d0 = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+    __m512d d1 = _mm512_sub_pd(_mm512_loadu_pd(a + i + 8),
+                               _mm512_loadu_pd(b + i + 8));
+    max0 = _mm512_max_pd(max0, _mm512_abs_pd(d0));
+    max1 = _mm512_max_pd(max1, _mm512_abs_pd(d1));
+  }
+  if (i + 8 <= k) {
+    __m512d d0 = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+    max0 = _mm512_max_pd(max0, _mm512_abs_pd(d0));
+    i += 8;
+  }
+  if (i < k) {
+    // Masked lanes load as zero, which never exceeds a distance.
+    __mmask8 mask = (__mmask8) ((1u << (k - i)) - 1);
+    __m512d d1 = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, a + i),
+                               _mm512_maskz_loadu_pd(mask, b + i));
+    max1 = _mm512_max_pd(max1, _mm512_abs_pd(d1));
+  }
+  return _mm512_reduce_max_pd(_mm512_max_pd(max0, max1));
+}
+
+float sum_float_sse2(__m128 sum) {
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum);
+}
+
+float max_float_sse2(__m128 max) {
+  max = _mm_max_ps(max, _mm_movehl_ps(max, max));
+  max = _mm_max_ss(max, _mm_shuffle_ps(max, max, 1));
+  return _mm_cvtss_f32(max);
+}
+
+double float_minkowski_1_sse2(float *a, float *b, int k) {
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  __m128 sum0 = _mm_setzero_ps();
+  __m128 sum1 = _mm_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= k; i += 8) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+    sum0 = _mm_add_ps(sum0, _mm_andnot_ps(sign, d0));
+    sum1 = _mm_add_ps(sum1, _mm_andnot_ps(sign, d1));
+  }
+  if (i + 4 <= k) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    sum0 = _mm_add_ps(sum0, _mm_andnot_ps(sign, d0));
+    i += 4;
+  }
+  float dist = sum_float_sse2(_mm_add_ps(sum0, sum1));
+  for (; i < k; i++) {
+    dist += fabsf(a[i] - b[i]);
+  }
+  return dist;
+}
+
+double float_squared_minkowski_2_sse2(float *a, float *b, int k) {
+  __m128 sum0 = _mm_setzero_ps();
+  __m128 sum1 = _mm_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= k; i += 8) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+    sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+  }
+  if (i + 4 <= k) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+    i += 4;
+  }
+  float dist = sum_float_sse2(_mm_add_ps(sum0, sum1));
+  for (; i < k; i++) {
+    float diff = a[i] - b[i];
+    dist += diff * diff;
+  }
+  return dist;
+}
+
+double float_chebyshev_sse2(float *a, float *b, int k) {
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  __m128 max0 = _mm_setzero_ps();
+  __m128 max1 = _mm_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= k; i += 8) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+    max0 = _mm_max_ps(max0, _mm_andnot_ps(sign, d0));
+    max1 = _mm_max_ps(max1, _mm_andnot_ps(sign, d1));
+  }
+  if (i + 4 <= k) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    max0 = _mm_max_ps(max0, _mm_andnot_ps(sign, d0));
+    i += 4;
+  }
+  float dist = max_float_sse2(_mm_max_ps(max0, max1));
+  for (; i < k; i++) {
+    float diff = fabsf(a[i] - b[i]);
+    dist = diff > dist ? diff : dist;
+  }
+  return dist;
+}
+
+__attribute__((target("avx2,fma")))
+double float_minkowski_1_avx2(float *a, float *b, int k) {
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  __m256 sum0 = _mm256_setzero_ps();
+  __m256 sum1 = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= k; i += 16) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8),
+                              _mm256_loadu_ps(b + i + 8));
+    sum0 = _mm256_add_ps(sum0, _mm256_andnot_ps(sign, d0));
+    sum1 = _mm256_add_ps(sum1, _mm256_andnot_ps(sign, d1));
+  }
+  if (i + 8 <= k) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    sum0 = _mm256_add_ps(sum0, _mm256_andnot_ps(sign, d0));
+    i += 8;
+  }
+  sum0 = _mm256_add_ps(sum0, sum1);
+  __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum0),
+                           _mm256_extractf128_ps(sum0, 1));
+  if (i + 4 <= k) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    half = _mm_add_ps(half, _mm_andnot_ps(_mm_set1_ps(-0.0f), d0));
+    i += 4;
+  }
+  float dist = sum_float_sse2(half);
+  for (; i < k; i++) {
+    dist += fabsf(a[i] - b[i]);
+  }
+  return dist;
+}
+
+__attribute__((target("avx2,fma")))
+double float_squared_minkowski_2_avx2(float *a, float *b, int k) {
+  __m256 sum0 = _mm256_setzero_ps();
+  __m256 sum1 = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= k; i += 16) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8),
+                              _mm256_loadu_ps(b + i + 8));
+    sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+    sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+  }
+  if (i + 8 <= k) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+    i += 8;
+  }
+  sum0 = _mm256_add_ps(sum0, sum1);
+  __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum0),
+                           _mm256_extractf128_ps(sum0, 1));
+  if (i + 4 <= k) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    half = _mm_fmadd_ps(d0, d0, half);
+    i += 4;
+  }
+  float dist = sum_float_sse2(half);
+  for (; i < k; i++) {
+    float diff = a[i] - b[i];
+    dist += diff * diff;
+  }
+  return dist;
+}
+
+__attribute__((target("avx2,fma")))
+double float_chebyshev_avx2(float *a, float *b, int k) {
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  __m256 max0 = _mm256_setzero_ps();
+  __m256 max1 = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= k; i += 16) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8),
+                              _mm256_loadu_ps(b + i + 8));
+    max0 = _mm256_max_ps(max0, _mm256_andnot_ps(sign, d0));
+    max1 = _mm256_max_ps(max1, _mm256_andnot_ps(sign, d1));
+  }
+  if (i + 8 <= k) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    max0 = _mm256_max_ps(max0, _mm256_andnot_ps(sign, d0));
+    i += 8;
+  }
+  max0 = _mm256_max_ps(max0, max1);
+  __m128 half = _mm_max_ps(_mm256_castps256_ps128(max0),
+                           _mm256_extractf128_ps(max0, 1));
+  if (i + 4 <= k) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    half = _mm_max_ps(half, _mm_andnot_ps(_mm_set1_ps(-0.0f), d0));
+    i += 4;
+  }
+  float dist = max_float_sse2(half);
+  for (; i < k; i++) {
+    float diff = fabsf(a[i] - b[i]);
+    dist = diff > dist ? diff : dist;
+  }
+  return dist;
+}
+
+__attribute__((target("avx512f")))
+double float_minkowski_1_avx512(float *a, float *b, int k) {
+  __m512 sum0 = _mm512_setzero_ps();
+  __m512 sum1 = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 32 <= k; i += 32) {
+    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+    __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16),
+                              _mm512_loadu_ps(b + i + 16));
+    sum0 = _mm512_add_ps(sum0, _mm512_abs_ps(d0));
+    sum1 = _mm512_add_ps(sum1, _mm512_abs_ps(d1));
+  }
+  if (i + 16 <= k) {
+    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+    sum0 = _mm512_add_ps(sum0, _mm512_abs_ps(d0));
+    i += 16;
+  }
+  if (i < k) {
+    // Masked lanes load as zero and contribute nothing.
+    __mmask16 mask = (__mmask16) ((1u << (k - i)) - 1);
+    __m512 d1 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i),
+                              _mm512_maskz_loadu_ps(mask, b + i));
+    sum1 = _mm512_add_ps(sum1, _mm512_abs_ps(d1));
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+}
+
+__attribute__((target("avx512f")))
+double float_squared_minkowski_2_avx512(float *a, float *b, int k) {
+  __m512 sum0 = _mm512_setzero_ps();
+  __m512 sum1 = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 32 <= k; i += 32) {
+    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+    __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16),
+                              _mm512_loadu_ps(b + i + 16));
+    sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+    sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+  }
+  if (i + 16 <= k) {
+    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+    sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+    i += 16;
+  }
+  if (i < k) {
+    // Masked lanes load as zero and contribute nothing.
+    __mmask16 mask = (__mmask16) ((1u << (k - i)) - 1);
+    __m512 d1 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i),
+                              _mm512_maskz_loadu_ps(mask, b + i));
+    sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+}
+
+__attribute__((target("avx512f")))
+double float_chebyshev_avx512(float *a, float *b, int k) {
+  __m512 max0 = _mm512_setzero_ps();
+  __m512 max1 = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 32 <= k; i += 32) {
+    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+    __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16),
+                              _mm512_loadu_ps(b + i + 16));
+    max0 = _mm512_max_ps(max0, _mm512_abs_ps(d0));
+    max1 = _mm512_max_ps(max1, _mm512_abs_ps(d1));
+  }
+  if (i + 16 <= k) {
+    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+    max0 = _mm512_max_ps(max0, _mm512_abs_ps(d0));
+    i += 16;
+  }
+  if (i < k) {
+    // Masked lanes load as zero, which never exceeds a distance.
+    __mmask16 mask = (__mmask16) ((1u << (k - i)) - 1);
+    __m512 d1 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i),
+                              _mm512_maskz_loadu_ps(mask, b + i));
+    max1 = _mm512_max_ps(max1, _mm512_abs_ps(d1));
+  }
+  return _mm512_reduce_max_ps(_mm512_max_ps(max0, max1));
+}
+
+#endif  // KATY_X86_SIMD
+
+int parse_kd_metric(char *distance_metric, struct KdMetric *metric) {
+  metric->p = 0;
+  if (strcmp(distance_metric, "squared_euclidean") == 0) {
+    metric->type = METRIC_SQUARED_EUCLIDEAN;
+  } else if (strcmp(distance_metric, "euclidean") == 0) {
+    metric->type = METRIC_EUCLIDEAN;
+  } else if (strcmp(distance_metric, "manhattan") == 0) {
+    metric->type = METRIC_MANHATTAN;
+  } else if (strcmp(distance_metric, "chebyshev") == 0) {
+    metric->type = METRIC_CHEBYSHEV;
+  } else if (strncmp(distance_metric, "minkowski_", 10) == 0) {
+    char *end;
+    metric->type = METRIC_MINKOWSKI;
+    metric->p = strtod(distance_metric + 10, &end);
+    if (*end != '\0' || end == distance_metric + 10 || !(metric->p >= 1)) {
+      return 0;
+    }
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+int resolve_metric(const struct DistanceKernels *kernels,
+                   struct KdMetric *kd_metric, struct Metric *metric) {
+  metric->type = kd_metric->type;
+  metric->p = 0;
+  if (kd_metric->type == METRIC_MINKOWSKI) {
+    double p = kd_metric->p;
+    if (!(p >= 1)) {
+      return 0;
+    }
+    // The orders with a kernel of their own.
+    if (p == 1) {
+      metric->type = METRIC_MANHATTAN;
+    } else if (p == 2) {
+      metric->type = METRIC_EUCLIDEAN;
+    } else if (isinf(p)) {
+      metric->type = METRIC_CHEBYSHEV;
+    } else {
+      metric->p = p;
+    }
+  } else if (kd_metric->type < METRIC_SQUARED_EUCLIDEAN
+             || kd_metric->type > METRIC_MINKOWSKI) {
+    return 0;
+  }
+
+  switch (metric->type) {
+    case METRIC_SQUARED_EUCLIDEAN:
+    case METRIC_EUCLIDEAN:
+      metric->distance = kernels->squared_euclidean;
+      metric->float_distance = kernels->float_squared_euclidean;
+      break;
+    case METRIC_MANHATTAN:
+      metric->distance = kernels->manhattan;
+      metric->float_distance = kernels->float_manhattan;
+      break;
+    case METRIC_CHEBYSHEV:
+      metric->distance = kernels->chebyshev;
+      metric->float_distance = kernels->float_chebyshev;
+      break;
+    default:
+      metric->distance = NULL;
+      metric->float_distance = NULL;
+  }
+  return 1;
+}
+
+double metric_distance(struct Metric *metric, double *a, double *b, int k) {
+  if (metric->distance != NULL) {
+    return metric->distance(a, b, k);
+  }
+  return reduced_minkowski_p(a, b, k, metric->p);
+}
+
+double metric_float_distance(struct Metric *metric, float *a, float *b,
+                             int k) {
+  if (metric->float_distance != NULL) {
+    return metric->float_distance(a, b, k);
+  }
+  return float_reduced_minkowski_p(a, b, k, metric->p);
+}
+
+double axis_distance(struct Metric *metric, double offset) {
+  switch (metric->type) {
+    case METRIC_SQUARED_EUCLIDEAN:
+    case METRIC_EUCLIDEAN:
+      return offset * offset;
+    case METRIC_MINKOWSKI:
+      return pow(fabs(offset), metric->p);
+    default:
+      return fabs(offset);
+  }
+}
+
+double add_axis_distance(struct Metric *metric, double distance,
+                         double offset) {
+  double added = axis_distance(metric, offset);
+  if (metric->type == METRIC_CHEBYSHEV) {
+    return added > distance ? added : distance;
+  }
+  return distance + added;
+}
+
+/*
+  Sums swap the old contribution for the new one. A maximum cannot forget the
+  old offset, but as the offset only grows the new maximum is the larger of
+  the old one and the new offset.
+*/
+double replace_axis_distance(struct Metric *metric, double distance,
+                             double old_offset, double new_offset) {
+  if (metric->type == METRIC_CHEBYSHEV) {
+    return add_axis_distance(metric, distance, new_offset);
+  }
+  return distance - axis_distance(metric, old_offset)
+         + axis_distance(metric, new_offset);
+}
+
+double true_distance(struct Metric *metric, double reduced_distance) {
+  switch (metric->type) {
+    case METRIC_EUCLIDEAN:
+      return sqrt(reduced_distance);
+    case METRIC_MINKOWSKI:
+      return pow(reduced_distance, 1 / metric->p);
+    default:
+      return reduced_distance;
+  }
+}
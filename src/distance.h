@@ -0,0 +1,127 @@
+/*
+  Distance kernels used in the innermost loops of tree queries. Each metric
+  has a scalar implementation and SSE2, AVX2 and AVX-512 implementations on
+  x86-64. The set used by a tree is picked once, when the tree is created.
+  Queries resolve a struct KdMetric into a struct Metric over these kernels.
+*/
+#ifndef _KATY_DISTANCE_H
+#define _KATY_DISTANCE_H
+
+#include "katy.h"
+
+/* Instruction set levels, from slowest to fastest. */
+enum SimdLevel {
+  SIMD_SCALAR,
+  SIMD_SSE2,
+  SIMD_AVX2,
+  SIMD_AVX512,
+  SIMD_NUM_LEVELS
+};
+
+/*
+  A set of distance functions implemented with one instruction set, for
+  double and for float coordinates. Float kernels accumulate in single
+  precision, twice as many coordinates per instruction.
+*/
+struct DistanceKernels {
+  const char *name;
+  enum SimdLevel level;
+  double (*manhattan)(double *a, double *b, int k);
+  double (*squared_euclidean)(double *a, double *b, int k);
+  double (*chebyshev)(double *a, double *b, int k);
+  double (*float_manhattan)(float *a, float *b, int k);
+  double (*float_squared_euclidean)(float *a, float *b, int k);
+  double (*float_chebyshev)(float *a, float *b, int k);
+};
+
+/*
+  Get the kernels for a specific instruction set level. Returns NULL if the
+  CPU or the compiler does not support it.
+*/
+const struct DistanceKernels *get_distance_kernels(enum SimdLevel level);
+
+/*
+  Get the kernels best suited to `k` dimensional points on this CPU: the
+  widest supported level whose vectors are no wider than a point.
+*/
+const struct DistanceKernels *best_distance_kernels(int k);
+
+/* best_distance_kernels() for points with float coordinates. */
+const struct DistanceKernels *best_float_distance_kernels(int k);
+
+/* Minkowski distance where p = 1, a.k.a. Manhattan distance. */
+double minkowski_1(double *a, double *b, int k);
+
+/*
+  Squared Minkowski distance where p = 2, a.k.a. Squared Euclidean distance.
+  Useful because it avoids a root operation.
+ */
+double squared_minkowski_2(double *a, double *b, int k);
+
+/* Chebyshev distance, the largest difference along any axis. */
+double chebyshev(double *a, double *b, int k);
+
+/*
+  Minkowski distance of order `p` raised to the power p, which ranks points
+  the same without a root operation. Only scalar, since pow() does not
+  vectorize.
+*/
+double reduced_minkowski_p(double *a, double *b, int k, double p);
+
+/* The scalar kernels over float coordinates. */
+double float_minkowski_1(float *a, float *b, int k);
+double float_squared_minkowski_2(float *a, float *b, int k);
+double float_chebyshev(float *a, float *b, int k);
+double float_reduced_minkowski_p(float *a, float *b, int k, double p);
+
+/*
+  A distance metric, resolved once per query over the kernels of a tree.
+  Queries rank points by a reduced distance that orders them the same way but
+  is cheaper to compute, the p-th power of Minkowski distances of order p,
+  and only convert the distances they report.
+*/
+struct Metric {
+  enum MetricType type;  // METRIC_MINKOWSKI only for orders without a kernel
+  double p;  // Order of Minkowski metrics
+  double (*distance)(double *a, double *b, int k);  // Reduced distance kernel,
+                                                    // NULL for METRIC_MINKOWSKI
+  double (*float_distance)(float *a, float *b, int k);
+};
+
+/*
+  Resolve `kd_metric` into `metric`, picking its kernel among `kernels`.
+  Minkowski orders 1, 2 and infinity resolve to the metrics of their own
+  kernels. Returns `0` if `kd_metric` is not a valid metric, `1` otherwise.
+*/
+int resolve_metric(const struct DistanceKernels *kernels,
+                   struct KdMetric *kd_metric, struct Metric *metric);
+
+/* Reduced distance between two points. */
+double metric_distance(struct Metric *metric, double *a, double *b, int k);
+double metric_float_distance(struct Metric *metric, float *a, float *b,
+                             int k);
+
+/*
+  Reduced distance of a point offset from another along a single axis, the
+  contribution of that axis to the reduced distance.
+*/
+double axis_distance(struct Metric *metric, double offset);
+
+/*
+  Add the contribution of an axis `offset` to a reduced `distance` summed over
+  other axes, or take the maximum for Chebyshev distances.
+*/
+double add_axis_distance(struct Metric *metric, double distance,
+                         double offset);
+
+/*
+  Update a reduced `distance` for the offset along one axis growing from
+  `old_offset` to `new_offset`.
+*/
+double replace_axis_distance(struct Metric *metric, double distance,
+                             double old_offset, double new_offset);
+
+/* Convert a reduced distance to the metric's distance. */
+double true_distance(struct Metric *metric, double reduced_distance);
+
+#endif  // _KATY_DISTANCE_H
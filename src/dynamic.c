@@ -0,0 +1,439 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "dynamic.h"
+#include "distance.h"
+#include "query.h"
+
+#define DEFAULT_BUFFER_CAPACITY 64
+
+/* Gathers query results from every part of a dynamic tree. */
+struct DynamicResults {
+  struct KdDynamicTree *tree;
+  int *ids;             // Ids of the level being searched
+  struct KdResult *results;
+  int size;
+  int capacity;
+  bool failed;
+};
+
+/*
+  Rebuild the points of levels [first, last), and of the buffer if
+  `with_buffer`, without their tombstones into a single tree at level
+  `target`, or at the smallest level big enough if `target` is -1. Returns
+  `0` on failure, in which case the tree is unchanged, `1` otherwise.
+*/
+int rebuild_levels(struct KdDynamicTree *tree, int first, int last,
+                   bool with_buffer, int target);
+
+/*
+  Grow the arrays of levels to hold at least `num_levels` levels. Returns `0`
+  on failure, `1` otherwise.
+*/
+int reserve_levels(struct KdDynamicTree *tree, int num_levels);
+
+/* Most points level `level` may hold. */
+long level_capacity(struct KdDynamicTree *tree, int level);
+
+/* Number of `results` from level `level` that are not deleted. */
+int count_live_results(struct KdDynamicTree *tree, int level,
+                       struct KdResult *results, int num_results);
+
+/* Append a result to `results`, growing it as needed. */
+void add_result(struct DynamicResults *results, int id, double *point,
+                double distance);
+
+/* Range query visitor adding the live points of a level to DynamicResults. */
+int add_range_hit(void *context, int index, double *point, double distance);
+
+
+struct KdDynamicTree *create_kd_dynamic_tree(int k, int leaf_size,
+                                             int buffer_capacity) {
+  struct KdDynamicTree *tree = calloc(1, sizeof(struct KdDynamicTree));
+  if (tree == NULL) {
+    return NULL;
+  }
+  tree->k = k;
+  tree->leaf_size = leaf_size;
+  tree->buffer_capacity = buffer_capacity > 0 ? buffer_capacity
+                                              : DEFAULT_BUFFER_CAPACITY;
+  tree->buffer = malloc(sizeof(double) * tree->buffer_capacity * k);
+  tree->buffer_ids = malloc(sizeof(int) * tree->buffer_capacity);
+  if (tree->buffer == NULL || tree->buffer_ids == NULL) {
+    free_kd_dynamic_tree(tree);
+    return NULL;
+  }
+  return tree;
+}
+
+void free_kd_dynamic_tree(struct KdDynamicTree *tree) {
+  for (int i = 0; i < tree->num_levels; i++) {
+    if (tree->levels[i] != NULL) {
+      free_kd_tree(tree->levels[i]);
+    }
+    free(tree->level_ids[i]);
+  }
+  free(tree->levels);
+  free(tree->level_ids);
+  free(tree->level_tombstones);
+  free(tree->locations);
+  free(tree->buffer);
+  free(tree->buffer_ids);
+  free(tree);
+}
+
+int kd_dynamic_tree_insert(struct KdDynamicTree *tree, double *point) {
+  if (tree->num_ids == tree->id_capacity) {
+    int capacity = tree->id_capacity == 0 ? 1024 : tree->id_capacity * 2;
+    int *locations = realloc(tree->locations, sizeof(int) * capacity);
+    if (locations == NULL) {
+      return -1;
+    }
+    tree->locations = locations;
+    tree->id_capacity = capacity;
+  }
+
+  // The buffer and the levels below the first empty one fit in it.
+  if (tree->buffer_size == tree->buffer_capacity) {
+    int target = 0;
+    while (target < tree->num_levels && tree->levels[target] != NULL) {
+      target++;
+    }
+    if (!rebuild_levels(tree, 0, target, true, target)) {
+      return -1;
+    }
+  }
+
+  int id = tree->num_ids++;
+  memcpy(tree->buffer + ((size_t) tree->buffer_size * tree->k), point,
+         sizeof(double) * tree->k);
+  tree->buffer_ids[tree->buffer_size++] = id;
+  tree->locations[id] = KD_IN_BUFFER;
+  tree->size++;
+  return id;
+}
+
+int kd_dynamic_tree_delete(struct KdDynamicTree *tree, int id) {
+  if (id < 0 || id >= tree->num_ids || tree->locations[id] == KD_DELETED) {
+    return 0;
+  }
+  int level = tree->locations[id];
+  tree->locations[id] = KD_DELETED;
+  tree->size--;
+
+  if (level == KD_IN_BUFFER) {
+    int k = tree->k;
+    int last = --tree->buffer_size;
+    for (int i = 0; i <= last; i++) {
+      if (tree->buffer_ids[i] == id) {
+        tree->buffer_ids[i] = tree->buffer_ids[last];
+        memcpy(tree->buffer + ((size_t) i * k),
+               tree->buffer + ((size_t) last * k), sizeof(double) * k);
+        break;
+      }
+    }
+    return 1;
+  }
+
+  // The point is gone once its tombstone is recorded. Should the rebuild
+  // fail, the level stays over half tombstones and the next delete retries.
+  tree->level_tombstones[level]++;
+  if (tree->level_tombstones[level] * 2 >= tree->levels[level]->size) {
+    rebuild_levels(tree, level, level + 1, false, level);
+  }
+  return 1;
+}
+
+int kd_dynamic_tree_compact(struct KdDynamicTree *tree) {
+  return rebuild_levels(tree, 0, tree->num_levels, false, -1);
+}
+
+/*
+  Levels know nothing of their tombstones, so a level is asked for `n` points
+  first and for twice as many each time deleted points leave it short.
+*/
+int kd_dynamic_tree_query_n_nearest_neighbors(struct KdDynamicTree *tree,
+                                              double *test_point, int n,
+                                              char *distance_metric,
+                                              struct KdResult **results) {
+  struct DynamicResults found = {tree, NULL, NULL, 0, 0, false};
+  // Parsed once for every level and the buffer.
+  struct KdMetric kd_metric;
+  if (n < 1 || !parse_kd_metric(distance_metric, &kd_metric)) {
+    *results = NULL;
+    return 0;
+  }
+  struct KdQueryOptions options = {0};
+  options.metric = &kd_metric;
+  for (int l = 0; l < tree->num_levels && !found.failed; l++) {
+    struct KdTree *level = tree->levels[l];
+    if (level == NULL) {
+      continue;
+    }
+    int num_wanted = n;
+    struct KdResult *level_results;
+    int num_found;
+    while (true) {
+      if (num_wanted > level->size) {
+        num_wanted = level->size;
+      }
+      num_found = kd_tree_query_n_nearest_neighbors_with_options(
+          level, test_point, num_wanted, NULL, &options, &level_results);
+      if (num_found < num_wanted) {
+        found.failed = true;
+        break;
+      }
+      if (num_found == level->size
+          || count_live_results(tree, l, level_results, num_found) >= n) {
+        break;
+      }
+      free(level_results);
+      num_wanted *= 2;
+    }
+    for (int i = 0; i < num_found; i++) {
+      int id = tree->level_ids[l][level_results[i].index];
+      if (tree->locations[id] == l) {
+        add_result(&found, id, level_results[i].point,
+                   level_results[i].distance);
+      }
+    }
+    free(level_results);
+  }
+
+  int k = tree->k;
+  struct Metric metric;
+  resolve_metric(best_distance_kernels(k), &kd_metric, &metric);
+  for (int i = 0; i < tree->buffer_size; i++) {
+    double *point = tree->buffer + ((size_t) i * k);
+    add_result(&found, tree->buffer_ids[i], point,
+               true_distance(&metric,
+                             metric_distance(&metric, point, test_point, k)));
+  }
+  if (found.failed) {
+    free(found.results);
+    *results = NULL;
+    return 0;
+  }
+
+  // Furthest first, as for static trees, keeping the nearest n.
+  qsort(found.results, found.size, sizeof(struct KdResult),
+        compare_results_descending);
+  int num_results = found.size < n ? found.size : n;
+  memmove(found.results, found.results + (found.size - num_results),
+          sizeof(struct KdResult) * num_results);
+  *results = found.results;
+  return num_results;
+}
+
+int kd_dynamic_tree_query_range(struct KdDynamicTree *tree,
+                                double *test_point, double *radii,
+                                char *distance_metric,
+                                struct KdResult **results) {
+  struct DynamicResults found = {tree, NULL, NULL, 0, 0, false};
+  struct KdMetric kd_metric;
+  struct KdMetric *parsed = NULL;
+  if (distance_metric != NULL) {
+    if (!parse_kd_metric(distance_metric, &kd_metric)) {
+      *results = NULL;
+      return 0;
+    }
+    parsed = &kd_metric;
+  }
+  for (int l = 0; l < tree->num_levels && !found.failed; l++) {
+    if (tree->levels[l] != NULL) {
+      found.ids = tree->level_ids[l];
+      if (kd_tree_query_range_visit_with_metric(
+              tree->levels[l], test_point, radii, parsed, add_range_hit,
+              &found) == -1) {
+        found.failed = true;
+      }
+    }
+  }
+
+  int k = tree->k;
+  struct Metric metric;
+  if (parsed != NULL) {
+    resolve_metric(best_distance_kernels(k), parsed, &metric);
+  }
+  for (int i = 0; i < tree->buffer_size; i++) {
+    double *point = tree->buffer + ((size_t) i * k);
+    bool inside = true;
+    for (int j = 0; j < k && inside; j++) {
+      inside = fabs(point[j] - test_point[j]) <= radii[j];
+    }
+    if (inside) {
+      double distance = NAN;
+      if (parsed != NULL) {
+        distance = true_distance(
+            &metric, metric_distance(&metric, point, test_point, k));
+      }
+      add_result(&found, tree->buffer_ids[i], point, distance);
+    }
+  }
+  if (found.failed) {
+    free(found.results);
+    *results = NULL;
+    return 0;
+  }
+
+  qsort(found.results, found.size, sizeof(struct KdResult),
+        compare_results_descending);
+  *results = found.results;
+  return found.size;
+}
+
+int rebuild_levels(struct KdDynamicTree *tree, int first, int last,
+                   bool with_buffer, int target) {
+  int k = tree->k;
+  int num_points = with_buffer ? tree->buffer_size : 0;
+  for (int l = first; l < last; l++) {
+    if (tree->levels[l] != NULL) {
+      num_points += tree->levels[l]->size - tree->level_tombstones[l];
+    }
+  }
+  if (target == -1) {
+    target = 0;
+    while (level_capacity(tree, target) < num_points) target++;
+  }
+  if (!reserve_levels(tree, target + 1)) {
+    return 0;
+  }
+
+  struct KdTree *level = NULL;
+  int *ids = NULL;
+  if (num_points > 0) {
+    double *points = malloc(sizeof(double) * num_points * k);
+    ids = malloc(sizeof(int) * num_points);
+    if (points == NULL || ids == NULL) {
+      free(points);
+      free(ids);
+      return 0;
+    }
+    int size = 0;
+    if (with_buffer) {
+      memcpy(points, tree->buffer, sizeof(double) * tree->buffer_size * k);
+      memcpy(ids, tree->buffer_ids, sizeof(int) * tree->buffer_size);
+      size = tree->buffer_size;
+    }
+    for (int l = first; l < last; l++) {
+      struct KdTree *merged = tree->levels[l];
+      for (int i = 0; merged != NULL && i < merged->size; i++) {
+        int id = tree->level_ids[l][merged->indices[i]];
+        if (tree->locations[id] == l) {
+          memcpy(points + ((size_t) size * k), kd_tree_point(merged, i),
+                 sizeof(double) * k);
+          ids[size++] = id;
+        }
+      }
+    }
+
+    // Leaf order keeps each leaf's points together for the scans.
+    struct KdBuildOptions options = {0};
+    options.leaf_size = tree->leaf_size;
+    options.reorder_data = true;
+    level = build_kd_tree_with_options(points, num_points, k, &options);
+    free(points);
+    if (level == NULL) {
+      free(ids);
+      return 0;
+    }
+  }
+
+  for (int l = first; l < last; l++) {
+    if (tree->levels[l] != NULL) {
+      free_kd_tree(tree->levels[l]);
+    }
+    free(tree->level_ids[l]);
+    tree->levels[l] = NULL;
+    tree->level_ids[l] = NULL;
+    tree->level_tombstones[l] = 0;
+  }
+  tree->levels[target] = level;
+  tree->level_ids[target] = ids;
+  tree->level_tombstones[target] = 0;
+  for (int i = 0; i < num_points; i++) {
+    tree->locations[ids[i]] = target;
+  }
+  if (with_buffer) {
+    tree->buffer_size = 0;
+  }
+  return 1;
+}
+
+int reserve_levels(struct KdDynamicTree *tree, int num_levels) {
+  if (num_levels <= tree->num_levels) {
+    return 1;
+  }
+  struct KdTree **levels = realloc(tree->levels,
+                                   sizeof(struct KdTree *) * num_levels);
+  if (levels == NULL) {
+    return 0;
+  }
+  tree->levels = levels;
+  int **level_ids = realloc(tree->level_ids, sizeof(int *) * num_levels);
+  if (level_ids == NULL) {
+    return 0;
+  }
+  tree->level_ids = level_ids;
+  int *level_tombstones = realloc(tree->level_tombstones,
+                                  sizeof(int) * num_levels);
+  if (level_tombstones == NULL) {
+    return 0;
+  }
+  tree->level_tombstones = level_tombstones;
+  for (int l = tree->num_levels; l < num_levels; l++) {
+    tree->levels[l] = NULL;
+    tree->level_ids[l] = NULL;
+    tree->level_tombstones[l] = 0;
+  }
+  tree->num_levels = num_levels;
+  return 1;
+}
+
+long level_capacity(struct KdDynamicTree *tree, int level) {
+  return (long) tree->buffer_capacity << level;
+}
+
+int count_live_results(struct KdDynamicTree *tree, int level,
+                       struct KdResult *results, int num_results) {
+  int num_live = 0;
+  for (int i = 0; i < num_results; i++) {
+    num_live += tree->locations[tree->level_ids[level][results[i].index]]
+                == level;
+  }
+  return num_live;
+}
+
+void add_result(struct DynamicResults *results, int id, double *point,
+                double distance) {
+  if (results->failed) {
+    return;
+  }
+  if (results->size == results->capacity) {
+    int capacity = results->capacity == 0 ? 64 : results->capacity * 2;
+    struct KdResult *grown = realloc(results->results,
+                                     sizeof(struct KdResult) * capacity);
+    if (grown == NULL) {
+      results->failed = true;
+      return;
+    }
+    results->results = grown;
+    results->capacity = capacity;
+  }
+  struct KdResult *result = results->results + results->size++;
+  result->point = point;
+  result->float_point = NULL;
+  result->index = id;
+  result->distance = distance;
+}
+
+int add_range_hit(void *context, int index, double *point, double distance) {
+  struct DynamicResults *results = context;
+  int id = results->ids[index];
+  if (results->tree->locations[id] != KD_DELETED) {
+    add_result(results, id, point, distance);
+  }
+  return !results->failed;
+}
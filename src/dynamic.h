@@ -0,0 +1,95 @@
+/*
+  An updatable index of k-dimensional points built from static kd-trees by
+  the logarithmic method of Bentley and Saxe. New points go to a small
+  unsorted buffer. When the buffer fills up, it is merged with the smallest
+  levels into a tree at the first empty level, where level i holds at most
+  buffer capacity * 2^i points, so each point takes part in O(log n)
+  rebuilds of O(log n) per point and inserts cost amortized O(log^2 n).
+
+  Deleted points are removed from the buffer right away and left in the
+  levels as tombstones that queries skip. A level is rebuilt without its
+  tombstones once they make up half of it, and every merge drops the
+  tombstones of the levels it merges. kd_dynamic_tree_compact() rebuilds all
+  levels into one.
+
+  Points are identified by the id returned when they are inserted. Queries
+  search every level and the buffer and merge the results.
+*/
+#ifndef _KATY_DYNAMIC_H
+#define _KATY_DYNAMIC_H
+
+#include "katy.h"
+
+struct KdDynamicTree {
+  int k;
+  int leaf_size;
+  double *buffer;           // Points inserted since the last merge
+  int *buffer_ids;
+  int buffer_size;
+  int buffer_capacity;
+  struct KdTree **levels;   // Tree of each level, NULL if empty
+  int **level_ids;          // Id of each point of a level, in the order of
+                            // the level's data
+  int *level_tombstones;    // Deleted points still stored in each level
+  int num_levels;
+  int *locations;           // Level of each id, KD_IN_BUFFER or KD_DELETED
+  int num_ids;              // Ids handed out so far
+  int id_capacity;
+  int size;                 // Points inserted and not deleted
+};
+
+// Locations of ids outside of the levels.
+#define KD_IN_BUFFER -1
+#define KD_DELETED -2
+
+/*
+  Create an empty dynamic tree of k-dimensional points whose levels have
+  leaves of up to `leaf_size` points, and whose buffer holds up to
+  `buffer_capacity` points, 64 if not positive. Returns NULL on failure.
+*/
+struct KdDynamicTree *create_kd_dynamic_tree(int k, int leaf_size,
+                                             int buffer_capacity);
+
+/* Free a dynamic tree and every point it holds. */
+void free_kd_dynamic_tree(struct KdDynamicTree *tree);
+
+/*
+  Insert a copy of `point`. Returns the id of the point, or -1 on failure, in
+  which case the tree is unchanged.
+*/
+int kd_dynamic_tree_insert(struct KdDynamicTree *tree, double *point);
+
+/*
+  Delete the point with id `id`. Returns `1` if it was deleted, `0` if no such
+  point is in the tree. A rebuild of its level that fails leaves the point
+  deleted and the level as it was, to be rebuilt by a later delete or
+  kd_dynamic_tree_compact().
+*/
+int kd_dynamic_tree_delete(struct KdDynamicTree *tree, int id);
+
+/*
+  Rebuild every level into a single tree without tombstones. Returns `0` on
+  failure, in which case the tree is unchanged, `1` otherwise.
+*/
+int kd_dynamic_tree_compact(struct KdDynamicTree *tree);
+
+/*
+  kd_tree_query_n_nearest_neighbors() over the points of a dynamic tree.
+  Results give the ids of the points as their index, and point into the tree,
+  valid until its next update.
+*/
+int kd_dynamic_tree_query_n_nearest_neighbors(struct KdDynamicTree *tree,
+                                              double *test_point, int n,
+                                              char *distance_metric,
+                                              struct KdResult **results);
+
+/*
+  kd_tree_query_range() over the points of a dynamic tree, with results as
+  for kd_dynamic_tree_query_n_nearest_neighbors().
+*/
+int kd_dynamic_tree_query_range(struct KdDynamicTree *tree,
+                                double *test_point, double *radii,
+                                char *distance_metric,
+                                struct KdResult **results);
+
+#endif  // _KATY_DYNAMIC_H
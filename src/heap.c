@@ -1,21 +1,44 @@
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 
 #include "heap.h"
 
 #define HEAP_RESIZE_FACTOR 1.25
 
-/* promote the heap item at index if its value is larger, then recurse. */
+/* promote the heap item at index while its value is larger than its parent. */
 void max_heap_percolate_up(struct MaxHeap *heap, int index);
 
-/* demote the heap item at index if its value is less, then recurse. */
+/* demote the heap item at index while its value is less than a child's. */
 void max_heap_percolate_down(struct MaxHeap *heap, int index);
 
+/*
+  Move `entry` up from the hole at `index` until its parent is no smaller, and
+  store it there.
+*/
+void bounded_heap_sift_up(struct BoundedHeap *heap, int index,
+                          struct HeapEntry entry);
+
+/*
+  Move `entry` down from the hole at `index` until no child is larger, and
+  store it there.
+*/
+void bounded_heap_sift_down(struct BoundedHeap *heap, int index,
+                            struct HeapEntry entry);
+
+/* Move `entry` down from the hole at `index` until no child is smaller. */
+void min_heap_sift_down(struct MinHeap *heap, int index,
+                        struct HeapEntry entry);
+
 
 struct MaxHeap *create_max_heap(int capacity) {
   struct MaxHeap *heap = malloc(sizeof(struct MaxHeap));
   if (heap == NULL) {
     return NULL;
   }
+  if (capacity < 1) {
+    capacity = 1;
+  }
 
   heap->items = malloc(sizeof(struct HeapItem *) * capacity);
   if (heap->items == NULL) {
@@ -39,6 +62,9 @@ void free_max_heap(struct MaxHeap *heap) {
 int max_heap_insert(struct MaxHeap *heap, void *item, double value) {
   if (heap->size == heap->capacity) {
     int new_cap = heap->capacity * HEAP_RESIZE_FACTOR;
+    if (new_cap <= heap->capacity) {
+      new_cap = heap->capacity + 1;
+    }
     struct HeapItem **reallocated = realloc(heap->items,
                                             (sizeof(struct HeapItem *)
                                             * new_cap));
@@ -49,6 +75,9 @@ int max_heap_insert(struct MaxHeap *heap, void *item, double value) {
     heap->capacity = new_cap;
   }
   heap->items[heap->size] = malloc(sizeof(struct HeapItem));
+  if (heap->items[heap->size] == NULL) {
+    return 0;
+  }
   heap->items[heap->size]->item = item;
   heap->items[heap->size]->value = value;
   heap->size++;
@@ -83,40 +112,199 @@ int max_heap_pop(struct MaxHeap *heap, struct HeapItem **return_item) {
 
 
 void max_heap_percolate_up(struct MaxHeap *heap, int index) {
-  if (index == 0) return;
-
-  int parent_index = (index - 1) / 2;
-  if (heap->items[index]->value > heap->items[parent_index]->value) {
-    struct HeapItem *tmp = heap->items[index];
+  struct HeapItem *item = heap->items[index];
+  while (index > 0) {
+    int parent_index = (index - 1) / 2;
+    if (item->value <= heap->items[parent_index]->value) {
+      break;
+    }
     heap->items[index] = heap->items[parent_index];
-    heap->items[parent_index] = tmp;
-    max_heap_percolate_up(heap, parent_index);
+    index = parent_index;
   }
+  heap->items[index] = item;
 }
 
 void max_heap_percolate_down(struct MaxHeap *heap, int index) {
-  int greatest = index;
+  struct HeapItem *item = heap->items[index];
+  while (true) {
+    int greatest = (2 * index) + 1;
+    if (greatest >= heap->size) {
+      break;
+    }
+    int right_child = greatest + 1;
+    if (right_child < heap->size
+        && heap->items[right_child]->value > heap->items[greatest]->value) {
+      greatest = right_child;
+    }
+    if (heap->items[greatest]->value <= item->value) {
+      break;
+    }
+    heap->items[index] = heap->items[greatest];
+    index = greatest;
+  }
+  heap->items[index] = item;
+}
 
-  int left_child = (2 * index) + 1;
-  int right_child = (2 * index) + 2;
+void init_bounded_heap(struct BoundedHeap *heap, struct HeapEntry *entries,
+                       int capacity) {
+  heap->entries = entries;
+  heap->size = 0;
+  heap->capacity = capacity;
+}
 
-  if (left_child < heap->size) {
-    if (heap->items[greatest]->value < heap->items[left_child]->value) {
-      greatest = left_child;
+int bounded_heap_push(struct BoundedHeap *heap, int index, double value) {
+  if (heap->size == heap->capacity) {
+    return 0;
+  }
+  struct HeapEntry entry = {index, value};
+  heap->size++;
+  bounded_heap_sift_up(heap, heap->size - 1, entry);
+  return 1;
+}
+
+void bounded_heap_replace_top(struct BoundedHeap *heap, int index,
+                              double value) {
+  struct HeapEntry entry = {index, value};
+  bounded_heap_sift_down(heap, 0, entry);
+}
+
+int bounded_heap_peak(struct BoundedHeap *heap, struct HeapEntry *entry) {
+  if (heap->size == 0) {
+    return 0;
+  }
+  *entry = heap->entries[0];
+  return 1;
+}
+
+int bounded_heap_pop(struct BoundedHeap *heap, struct HeapEntry *entry) {
+  if (heap->size == 0) {
+    return 0;
+  }
+  *entry = heap->entries[0];
+  heap->size--;
+  if (heap->size > 0) {
+    bounded_heap_sift_down(heap, 0, heap->entries[heap->size]);
+  }
+  return 1;
+}
+
+void bounded_heap_sift_up(struct BoundedHeap *heap, int index,
+                          struct HeapEntry entry) {
+  while (index > 0) {
+    int parent_index = (index - 1) / 2;
+    if (entry.value <= heap->entries[parent_index].value) {
+      break;
     }
+    heap->entries[index] = heap->entries[parent_index];
+    index = parent_index;
   }
+  heap->entries[index] = entry;
+}
 
-  if (right_child < heap->size) {
-    if (heap->items[greatest]->value < heap->items[right_child]->value) {
+void bounded_heap_sift_down(struct BoundedHeap *heap, int index,
+                            struct HeapEntry entry) {
+  while (true) {
+    int greatest = (2 * index) + 1;
+    if (greatest >= heap->size) {
+      break;
+    }
+    int right_child = greatest + 1;
+    if (right_child < heap->size
+        && heap->entries[right_child].value > heap->entries[greatest].value) {
       greatest = right_child;
     }
+    if (heap->entries[greatest].value <= entry.value) {
+      break;
+    }
+    heap->entries[index] = heap->entries[greatest];
+    index = greatest;
+  }
+  heap->entries[index] = entry;
+}
+
+void init_min_heap(struct MinHeap *heap, struct HeapEntry *entries,
+                   int capacity) {
+  heap->entries = entries;
+  heap->size = 0;
+  heap->capacity = capacity;
+  heap->initial = entries;
+}
+
+void destroy_min_heap(struct MinHeap *heap) {
+  if (heap->entries != heap->initial) {
+    free(heap->entries);
+  }
+  heap->entries = heap->initial;
+  heap->size = 0;
+  heap->capacity = 0;
+}
+
+void min_heap_clear(struct MinHeap *heap) {
+  heap->size = 0;
+}
+
+int min_heap_push(struct MinHeap *heap, int index, double value) {
+  if (heap->size == heap->capacity) {
+    int capacity = heap->capacity < 8 ? 16 : heap->capacity * 2;
+    struct HeapEntry *entries;
+    if (heap->entries == heap->initial) {
+      entries = malloc(sizeof(struct HeapEntry) * capacity);
+      if (entries != NULL && heap->size > 0) {
+        memcpy(entries, heap->entries, sizeof(struct HeapEntry) * heap->size);
+      }
+    } else {
+      entries = realloc(heap->entries, sizeof(struct HeapEntry) * capacity);
+    }
+    if (entries == NULL) {
+      return 0;
+    }
+    heap->entries = entries;
+    heap->capacity = capacity;
   }
 
-  if (greatest != index) {
-    struct HeapItem *tmp = heap->items[greatest];
-    heap->items[greatest] = heap->items[index];
-    heap->items[index] = tmp;
-    max_heap_percolate_down(heap, greatest);
+  struct HeapEntry entry = {index, value};
+  int hole = heap->size++;
+  while (hole > 0) {
+    int parent_index = (hole - 1) / 2;
+    if (entry.value >= heap->entries[parent_index].value) {
+      break;
+    }
+    heap->entries[hole] = heap->entries[parent_index];
+    hole = parent_index;
   }
+  heap->entries[hole] = entry;
+  return 1;
 }
 
+int min_heap_pop(struct MinHeap *heap, struct HeapEntry *entry) {
+  if (heap->size == 0) {
+    return 0;
+  }
+  *entry = heap->entries[0];
+  heap->size--;
+  if (heap->size > 0) {
+    min_heap_sift_down(heap, 0, heap->entries[heap->size]);
+  }
+  return 1;
+}
+
+void min_heap_sift_down(struct MinHeap *heap, int index,
+                        struct HeapEntry entry) {
+  while (true) {
+    int least = (2 * index) + 1;
+    if (least >= heap->size) {
+      break;
+    }
+    int right_child = least + 1;
+    if (right_child < heap->size
+        && heap->entries[right_child].value < heap->entries[least].value) {
+      least = right_child;
+    }
+    if (heap->entries[least].value >= entry.value) {
+      break;
+    }
+    heap->entries[index] = heap->entries[least];
+    index = least;
+  }
+  heap->entries[index] = entry;
+}
@@ -1,6 +1,13 @@
 /*
-  A max heap supporting operations needed for kd-tree queries. Notably, the
+  Heaps supporting operations needed for kd-tree queries. Notably, the
   ability to build a heap from existing items is lacking.
+
+  MaxHeap grows as needed and holds pointers to items. BoundedHeap has a fixed
+  capacity and holds entries by value in memory provided by the caller, so a
+  k nearest neighbor query can keep its candidates without allocating.
+  MinHeap holds entries by value in memory provided by the caller too, but
+  moves to a growing allocation once they run out, for best-first searches
+  whose frontier has no fixed bound.
 */
 #ifndef _KATY_HEAP_H
 #define _KATY_HEAP_H
@@ -38,9 +45,88 @@ int max_heap_insert(struct MaxHeap *heap, void *item, double value);
 int max_heap_peak(struct MaxHeap *heap, struct HeapItem **item);
 
 /*
-  Remove the item at the top of the heap and return it in `item`. Returns `0`
-  on failure (empty heap), `1` otherwise.
+  Remove the item at the top of the heap and return it in `item`. The caller
+  owns the item and frees it with free(). Returns `0` on failure (empty
+  heap), `1` otherwise.
 */
 int max_heap_pop(struct MaxHeap *heap, struct HeapItem **item);
 
+struct HeapEntry {
+  int index;
+  double value;  // determines heap ordering
+};
+
+struct BoundedHeap {
+  struct HeapEntry *entries;  // Caller-provided storage for `capacity` entries
+  int size;
+  int capacity;
+};
+
+/*
+  Initialize an empty bounded heap over `entries`, which must hold `capacity`
+  entries and outlive the heap, e.g. an array on the stack.
+*/
+void init_bounded_heap(struct BoundedHeap *heap, struct HeapEntry *entries,
+                       int capacity);
+
+/*
+  Insert an entry into the heap. Returns `0` on failure (full heap), `1`
+  otherwise.
+*/
+int bounded_heap_push(struct BoundedHeap *heap, int index, double value);
+
+/*
+  Replace the entry at the top of a non-empty heap, e.g. to swap the worst of
+  k candidates for a better one in a single sift.
+*/
+void bounded_heap_replace_top(struct BoundedHeap *heap, int index,
+                              double value);
+
+/*
+  Get the entry at the top of the heap without removing it. Returns `0` on
+  failure (empty heap), `1` otherwise.
+*/
+int bounded_heap_peak(struct BoundedHeap *heap, struct HeapEntry *entry);
+
+/*
+  Remove the entry at the top of the heap and return it in `entry`. Returns
+  `0` on failure (empty heap), `1` otherwise.
+*/
+int bounded_heap_pop(struct BoundedHeap *heap, struct HeapEntry *entry);
+
+struct MinHeap {
+  struct HeapEntry *entries;
+  int size;
+  int capacity;
+  struct HeapEntry *initial;  // Caller-provided storage, never freed
+};
+
+/*
+  Initialize an empty min heap over `entries`, which must hold `capacity`
+  entries and outlive the heap. Release it with destroy_min_heap().
+*/
+void init_min_heap(struct MinHeap *heap, struct HeapEntry *entries,
+                   int capacity);
+
+/* Free the memory a min heap allocated once it outgrew its initial storage. */
+void destroy_min_heap(struct MinHeap *heap);
+
+/*
+  Remove every entry from the heap, keeping its memory so that a reused heap
+  does not allocate once it has grown to its working size.
+*/
+void min_heap_clear(struct MinHeap *heap);
+
+/*
+  Insert an entry into the heap, growing it if full. Returns `0` on failure to
+  grow, `1` otherwise.
+*/
+int min_heap_push(struct MinHeap *heap, int index, double value);
+
+/*
+  Remove the entry with the smallest value and return it in `entry`. Returns
+  `0` on failure (empty heap), `1` otherwise.
+*/
+int min_heap_pop(struct MinHeap *heap, struct HeapEntry *entry);
+
 #endif  // _KATY_HEAP_H
@@ -1,479 +1,3760 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "katy.h"
 #include "heap.h"
+#include "pool.h"
+#include "distance.h"
+#include "query.h"
+
+// Number of queries a batch worker claims at a time.
+#define BATCH_CHUNK_SIZE 64
+
+// An all nearest neighbor join cuts the tree into about this many subtrees
+// per thread, so that workers finishing early have more to claim.
+#define ALL_KNN_SUBTREES_PER_THREAD 8
+
+// Largest number of neighbors whose candidates a query keeps on the stack.
+#define STACK_HEAP_CAPACITY 64
+#define STACK_OFFSETS_CAPACITY 64
+
+// Nodes a best-first query queues on the stack before allocating.
+#define STACK_QUEUE_CAPACITY 256
+
+// Nodes with at least this many points are split with block parallel passes.
+// The threshold does not depend on the thread count, which keeps builds
+// identical for any number of threads.
+#define BLOCK_SPLIT_MIN (1 << 17)
+
+// Points per block of a block parallel pass.
+#define BLOCK_SIZE (1 << 14)
+
+// Default number of points at which splitting stops.
+#define DEFAULT_LEAF_SIZE 16
+
+// Default number of points below which subtrees are built within one task.
+#define DEFAULT_PARALLEL_CUTOFF (1 << 15)
+
+// Saved trees start with these bytes and this version of the format.
+#define KD_FILE_MAGIC "KATYTREE"
+#define KD_FILE_VERSION 1
+
+// Written as one number to tell the byte order of the machine saving a tree.
+#define KD_FILE_BYTE_ORDER 0x01020304u
+
+// Every array of a saved tree starts at a multiple of this many bytes.
+#define KD_FILE_ALIGNMENT 64
+
+// Defaults and limits of streaming builds. Every cell keeps a spill file open
+// while points are distributed.
+#define STREAM_DEFAULT_MEMORY_BYTES ((size_t) 1 << 30)
+#define STREAM_DEFAULT_SAMPLE_SIZE (1 << 16)
+#define STREAM_MAX_CELLS 512
+
+// Points a streaming build reads from its input at a time.
+#define STREAM_CHUNK_SIZE 4096
+
+/* A range query in progress. */
+struct RangeQuery {
+  double *test_point;
+  float *float_test_point;  // The test point of float trees
+  double *radii;
+  struct Metric *metric;    // NULL to skip distances
+  int (*visit)(void *context, int position, double distance);
+  void *context;
+  int num_visited;
+};
+
+/* Passes range query hits on to the caller's visitor. */
+struct RangeVisitor {
+  struct KdTree *tree;
+  int (*visit)(void *context, int index, double *point, double distance);
+  void *context;
+};
+
+/* A range join between two trees in progress. */
+struct RangeJoin {
+  struct KdTree *tree_a;
+  struct KdTree *tree_b;
+  double *radii;
+  int (*visit)(void *context, int index_a, int index_b);
+  void *context;
+  long long num_visited;
+};
+
+/* Gathers range query hits into a growing array of results. */
+struct ResultCollector {
+  struct KdTree *tree;
+  struct KdResult *results;
+  int size;
+  int capacity;
+  bool failed;
+};
+
+/* Appends range query hits to a caller's buffer. */
+struct BufferAppender {
+  struct KdTree *tree;
+  struct KdRangeBuffer *buffer;
+  bool with_distances;
+  bool failed;
+};
+
+/*
+  Header of a saved tree. The arrays follow at the given offsets from the
+  start of the file, where offsets of arrays the tree lacks are 0.
+*/
+struct KdFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t node_bytes;      // sizeof(struct KdNode) when saved
+  int32_t k;
+  int32_t size;
+  int32_t num_nodes;
+  int32_t point_type;
+  int32_t quantization;
+  int32_t reordered;
+  int32_t has_points;
+  uint64_t nodes_offset;
+  uint64_t bounds_offset;
+  uint64_t indices_offset;
+  uint64_t codes_offset;
+  uint64_t steps_offset;
+  uint64_t points_offset;
+  uint64_t file_bytes;
+};
+
+/* One array of a saved tree. */
+struct KdFileSection {
+  void *data;
+  size_t bytes;
+  uint64_t *offset;         // Where the header records its offset
+};
+
+/*
+  State of a streaming build. The top levels of the tree are the nodes of a
+  tree over the sample, whose leaves are the cells, and keep their indices in
+  the final arena. Each cell's own subtree is rooted at the cell's leaf and
+  its other nodes follow the top levels.
+*/
+struct StreamBuild {
+  struct KdStreamOptions *options;
+  int k;
+  char *path;
+  int num_points;
+  double *sample;
+  struct KdTree *sample_tree;
+  int num_cells;
+  int *cell_of_node;        // Cell of each sample tree leaf, -1 if internal
+  FILE **spills;            // Spill file of each cell
+  int *cell_sizes;
+  int *cell_positions;      // First position of each cell in the tree
+  int *cell_node_bases;     // Arena index of each cell's second node
+  struct KdNode *top_nodes; // The sample tree's nodes, updated to the tree's
+  double *top_bounds;
+  FILE *file;
+  struct KdFileHeader header;
+};
+
+/* Reads points of k doubles from a file for build_kd_tree_from_file(). */
+struct FileReader {
+  FILE *file;
+  int k;
+};
+
+/* Shared state of a tree build. */
+struct BuildContext {
+  struct KdTree *tree;
+  int leaf_size;
+  int parallel_cutoff;
+  unsigned int seed;
+  struct TaskPool *pool;  // NULL for serial builds
+  int *buffer;            // One int per point for stable partitions, or NULL
+  double *worker_seconds; // Split axis then partition seconds of each
+                          // worker when profiling, or NULL
+  bool *worker_failed;    // Set by each worker that fails, one per worker,
+                          // so that workers never write the same flag
+};
+
+/* State of a midpoint or sliding-midpoint build. */
+struct MidpointBuild {
+  struct KdTree *tree;
+  int leaf_size;
+  unsigned int seed;
+  bool sliding;
+  int max_depth;      // Deeper nodes fall back to median splits
+  int capacity;       // Nodes the arena has room for
+  double *cell;       // Minimums then maximums of the current node's cell
+  struct KdBuildStats *stats;  // Receives split times when profiling, or NULL
+  bool failed;
+};
+
+/* A subtree handed to the task pool. */
+struct SubtreeTask {
+  struct BuildContext *build;
+  int node_index;
+  int num_nodes;
+  int start;
+  int end;
+};
+
+/* State shared by the blocks of one block parallel pass over a node. */
+struct BlockPass {
+  struct KdTree *tree;
+  int *indices;
+  int *buffer;
+  int split_axis;
+  double pivot;
+  int *offsets;      // Three counts, then offsets, per block
+  double *extents;   // 2 * k doubles per block
+};
+
+/* A nearest neighbor query in progress. */
+struct NearestQuery {
+  struct KdTree *tree;
+  double *test_point;
+  float *float_test_point;  // The test point of float trees
+  struct BoundedHeap *heap;
+  struct Metric *metric;
+  double *offsets;       // Per axis distance from the test point to the cell
+  double prune_factor;   // Scales the n-th distance when pruning subtrees,
+                         // 1 for exact queries
+  int leaves_left;       // Leaves the query may still scan
+  struct MinHeap *queue; // Frontier of best-first searches, NULL for
+                         // depth-first ones
+  struct KdQueryStats *stats;  // Receives the counts of the query, or NULL
+  bool failed;
+};
+
+/* Shared state of a batch nearest neighbor query. */
+struct BatchQuery {
+  struct KdTree *tree;
+  double *test_points;
+  int n;
+  struct Metric metric;
+  struct KdQueryOptions options;
+  int *indices;
+  double *distances;
+  struct WorkQueue queue;
+  struct KdQueryStats *worker_stats;  // Counts of each worker, or NULL
+};
+
+/* Scratch memory of queries, grown as needed and kept between them. */
+struct KdQueryContext {
+  struct HeapEntry *entries;  // Storage of the candidate heap
+  int entries_capacity;
+  double *offsets;            // Per axis offsets, k_capacity long
+  float *float_point;         // Float copy of the test point, k_capacity long
+  int k_capacity;
+  struct MinHeap queue;       // Frontier of best-first searches
+  struct KdResult *results;   // Results of the last query
+  int results_capacity;
+};
+
+/* State of an all nearest neighbor join, shared by its workers. */
+struct AllNearest {
+  struct KdTree *tree;
+  struct Metric metric;
+  struct BoundedHeap *heaps;  // Candidates of the point at each position
+  double *node_bounds;        // Largest reduced distance a point of each node
+                              // may still accept a neighbor at
+  int *subtrees;              // Subtrees whose points workers find neighbors
+                              // of, one at a time
+  struct WorkQueue queue;
+};
+
+/* Create an empty kd-tree of `point_type` points. Returns NULL on failure. */
+struct KdTree *create_typed_kd_tree(int k, enum PointType point_type);
+
+/*
+  Build a kd-tree over `input_points`, an array of doubles or floats as given
+  by `point_type`. Returns NULL on failure.
+*/
+struct KdTree *build_typed_kd_tree(enum PointType point_type,
+                                   void *input_points, int num_points, int k,
+                                   struct KdBuildOptions *options);
+
+/*
+  Fill in the depth and leaf size histogram of `stats` from a built tree.
+  Returns `0` on failure to allocate the histogram, `1` otherwise.
+*/
+int profile_tree(struct KdTree *tree, struct KdBuildStats *stats);
+
+/*
+  Visit the leaves under `node`, `depth` nodes down from the root, to update
+  the depth and the largest leaf of `stats`, and count their sizes into its
+  histogram if it has one.
+*/
+void profile_node(struct KdTree *tree, struct KdNode *node, int depth,
+                  struct KdBuildStats *stats);
+
+/* Seconds on a monotonic clock. */
+double monotonic_seconds(void);
+
+/* Leaf size of a build, the default if the option is not positive. */
+int build_leaf_size(struct KdBuildOptions *options);
+
+/*
+  Count the nodes a median split tree holds over `num_indices` points. Median
+  splits depend only on the number of points, so the arena can be sized and
+  laid out before any data is touched, and subtrees built independently.
+*/
+int count_kd_nodes(int num_indices, int leaf_size);
+
+/*
+  Count the nodes of median split trees over `num_indices` and
+  `num_indices + 1` points in O(log n), returned through `count` and
+  `count_next`.
+*/
+void count_kd_node_pair(int num_indices, int leaf_size, int *count,
+                        int *count_next);
+
+/*
+  Select the median of the longest axis from among the points in
+  tree->indices[start, end) and write the node representing the split to
+  `node_index` in the arena, whose subtree spans `num_nodes` nodes. The low
+  subtree is laid out directly after it and the high subtree after that.
+  Large enough low subtrees are handed to the build's task pool.
+*/
+void recursive_select_median(struct BuildContext *build, int worker_id,
+                             int node_index, int num_nodes, int start,
+                             int end);
+
+/* Task building the subtree described by a SubtreeTask. */
+void build_subtree_task(void *arg, int worker_id);
+
+/*
+  Build the tree with midpoint or sliding-midpoint splits. Their shape depends
+  on the data, so the arena grows as nodes are made, in pre-order. Returns `0`
+  on failure, `1` otherwise.
+*/
+int build_midpoint_tree(struct KdTree *tree, struct KdBuildOptions *options);
+
+/*
+  Split the points in tree->indices[start, end), whose cell is build->cell,
+  at the middle of the cell's longest side, and recurse. Returns the arena
+  index of the node, or -1 on failure.
+*/
+int recursive_split_midpoint(struct MidpointBuild *build, int start, int end,
+                             int depth);
+
+/* Append a node to the arena of a midpoint build. Returns -1 on failure. */
+int allocate_node(struct MidpointBuild *build);
+
+/*
+  Move the points whose value along `split_axis` is below `split_value`, or
+  not above it if `inclusive`, to the front. Returns how many there are.
+*/
+int partition_by_value(struct KdTree *tree, int *indices, int num_indices,
+                       int split_axis, double split_value, bool inclusive);
+
+/*
+  Determine the axis of greatest spread from among the points in the set of
+  indices. The extent of each axis is written to `bounds`, the minimums then
+  the maximums.
+*/
+int get_splitting_axis(struct KdTree *tree, int *indices, int num_indices,
+                       double *bounds);
+
+/*
+  get_splitting_axis() for large nodes, reducing the extents of blocks of
+  points in parallel. Returns -1 on failure.
+*/
+int get_splitting_axis_blocked(struct BuildContext *build, int worker_id,
+                               int *indices, int num_indices, double *bounds);
+
+/*
+  Update `minimums` and `maximums` with the extent of the indexed points. The
+  first point seeds them if `seed` is true.
+*/
+void accumulate_extents(struct KdTree *tree, int *indices, int num_indices,
+                        double *minimums, double *maximums, bool seed);
+
+/* The axis with the largest extent, or the first axis if all are flat. */
+int widest_axis(double *minimums, double *maximums, int k);
+
+/*
+  Partition the indices array in-place based on values from the tree's points
+  into smaller values on the split_axis below the partition_index and greater
+  values above. Pivots are drawn from `random_state`.
+*/
+void partition_indices(struct KdTree *tree, int *indices, int num_indices,
+                       int split_axis, int partition_index,
+                       uint64_t *random_state);
+
+/* Coordinate `axis` of the point in row `row` of the tree's data. */
+double get_coordinate(struct KdTree *tree, int row, int axis);
+
+/* Size of one coordinate of the tree's points. */
+size_t coordinate_size(struct KdTree *tree);
+
+/*
+  partition_indices() for large nodes. Each round is a stable three way
+  partition through `buffer` run over blocks in parallel, so the result does
+  not depend on the number of threads. Once the remaining range is small the
+  in-place partition finishes the job. Returns `0` on failure, `1` otherwise.
+*/
+int stable_partition_indices(struct BuildContext *build, int worker_id,
+                             int *indices, int *buffer, int num_indices,
+                             int split_axis, int partition_index,
+                             uint64_t *random_state);
+
+/* Blocks of get_splitting_axis_blocked(). */
+void extent_block(void *arg, int begin, int end, int worker_id);
+
+/* Blocks of stable_partition_indices() counting values around the pivot. */
+void count_block(void *arg, int begin, int end, int worker_id);
+
+/* Blocks of stable_partition_indices() scattering indices into the buffer. */
+void scatter_block(void *arg, int begin, int end, int worker_id);
+
+/* Blocks of stable_partition_indices() copying the buffer back. */
+void copy_back_block(void *arg, int begin, int end, int worker_id);
+
+/* Seed the pivot stream of the node spanning [start, end). */
+uint64_t seed_node(unsigned int seed, int start, int end);
+
+/* Draw from a splitmix64 stream. */
+uint64_t next_random(uint64_t *state);
+
+/*
+  Replace the tree's data with a copy laid out in the order of tree->indices,
+  so the points of every node are contiguous. Returns `0` on failure, `1`
+  otherwise.
+*/
+int reorder_tree_data(struct KdTree *tree);
+
+/*
+  Quantize the points of each leaf relative to its bounding box, filling
+  tree->codes and tree->steps. Returns `0` on failure, `1` otherwise.
+*/
+int quantize_leaves(struct KdTree *tree, enum Quantization quantization);
+
+/* The quantized coordinate along `axis` of the point at `position`. */
+int quantized_code(struct KdTree *tree, int position, int axis);
+
+/*
+  Fill `header` and `sections` with the layout of `tree` saved to a file,
+  with or without its points. Returns the number of sections.
+*/
+int layout_kd_file(struct KdTree *tree, bool save_points,
+                   struct KdFileHeader *header,
+                   struct KdFileSection *sections);
+
+/*
+  Check that `header` describes a tree this build can query and that every
+  array it lists lies inside a file of `file_bytes` bytes.
+*/
+bool valid_kd_file_header(struct KdFileHeader *header, size_t file_bytes);
+
+/* Is the array of `bytes` bytes at `offset` aligned and inside the file? */
+bool valid_kd_file_section(uint64_t offset, size_t bytes, size_t file_bytes);
+
+/* Round `offset` up to the next multiple of KD_FILE_ALIGNMENT. */
+uint64_t align_file_offset(uint64_t offset);
+
+/*
+  Read every point of the reader, keeping a uniform sample of them, and build
+  build->sample_tree with leaves holding few enough sample points that the
+  cells they stand for fit in memory. Returns `0` on failure, `1` otherwise.
+*/
+int sample_stream(struct StreamBuild *build, struct KdPointReader *reader);
+
+/*
+  Number the cells of the sample tree's leaves under `node_index` in order,
+  so every subtree's cells are consecutive.
+*/
+void number_cells(struct StreamBuild *build, int node_index, int *next_cell);
+
+/*
+  Read every point of the reader again and append it, after its index, to the
+  spill file of its cell. Returns `0` on failure, `1` otherwise.
+*/
+int spill_stream(struct StreamBuild *build, struct KdPointReader *reader);
+
+/*
+  Build the tree over the spilled points of `cell` and write its nodes,
+  bounding boxes, indices and points to their places in the tree's file.
+  Returns `0` on failure, `1` otherwise.
+*/
+int build_cell(struct StreamBuild *build, int cell);
+
+/*
+  Set the ranges and bounding boxes of the top level nodes from the cells
+  below `node_index`.
+*/
+void merge_top_nodes(struct StreamBuild *build, int node_index);
+
+/* Free everything a streaming build holds and remove its spill files. */
+void finish_stream_build(struct StreamBuild *build);
+
+/* Name of the spill file of `cell`, written to `name`. */
+void spill_file_name(struct StreamBuild *build, int cell, char *name,
+                     size_t name_bytes);
+
+/* Write `bytes` bytes at `offset` of a file. Returns `0` on failure. */
+int write_at(FILE *file, uint64_t offset, void *data, size_t bytes);
+
+/* KdPointReader callbacks of a FileReader. */
+int read_file_points(void *context, double *points, int max_points);
+int rewind_file_points(void *context);
+
+/* Utility function for swapping elements of the index array. */
+void swap(int *indices, int a, int b);
+
+/*
+  Worker of kd_tree_query_n_nearest_neighbors_batch(), answering chunks of
+  queries from the shared BatchQuery in `context`.
+*/
+void batch_query_worker(void *context, int worker_id);
+
+/*
+  Worker of kd_tree_all_knn(), finding the neighbors of the points of the
+  subtrees it claims from the shared AllNearest in `context`.
+*/
+void all_knn_worker(void *context, int worker_id);
+
+/*
+  Append to `subtrees` the nodes under `node` with at most `max_points`
+  points whose parents have more, or leaves. Returns the new count.
+*/
+int collect_subtrees(struct KdTree *tree, struct KdNode *node, int max_points,
+                     int *subtrees, int count);
+
+/*
+  Offer the points of reference node `reference` as neighbors to the points of
+  query node `query`, recursing into the children of both, and skipping
+  pairs of nodes too far apart to improve any neighbor of the query node.
+  Leaves node_bounds[query] up to date.
+*/
+void dual_tree_search(struct AllNearest *join, int query, int reference);
+
+/* Offer every point of leaf `reference` to every point of leaf `query`. */
+void dual_tree_leaves(struct AllNearest *join, struct KdNode *query,
+                      struct KdNode *reference);
+
+/*
+  Lower bound on the reduced distance between any point of the box
+  `bounds_a` and any point of the box `bounds_b`.
+*/
+double box_pair_distance(struct Metric *metric, double *bounds_a,
+                         double *bounds_b, int k);
+
+/* Reduced distance between the points at two positions of the tree. */
+double position_distance(struct KdTree *tree, struct Metric *metric, int a,
+                         int b);
+
+/*
+  Fill a query result for the point at `position` of the tree's index
+  permutation.
+*/
+void fill_result(struct KdTree *tree, int position, double distance,
+                 struct KdResult *result);
+
+/*
+  Run a nearest neighbor query over the whole tree, starting from the
+  distance between the test point and the root's bounding box. Best-first if
+  the query has a queue. Sets query->failed if the queue cannot grow.
+*/
+void nearest_neighbor_search(struct NearestQuery *query);
+
+/*
+  Visit nodes in increasing order of the distance from the test point to
+  their bounding box, scanning leaves until the nearest queued node is out of
+  reach, without recursion.
+*/
+void best_first_search(struct NearestQuery *query);
+
+/*
+  Set up the pruning factor and leaf budget of `query` for `options`, which
+  may be NULL.
+*/
+void apply_query_options(struct NearestQuery *query,
+                         struct KdQueryOptions *options);
+
+/*
+  Grow the scratch memory of `context` to hold the candidates and results of
+  `n` neighbors and the test points of `tree`. Returns `0` on failure.
+*/
+int reserve_query_context(struct KdQueryContext *context, struct KdTree *tree,
+                          int n);
+
+/*
+  Recursively descend down the kd-tree, pushing the positions of points onto
+  the query's heap while it is not full, or replacing its top if their
+  distance is less than the current maximum. `cell_distance` is a lower bound
+  on the distance from the test point to any point under `node`.
+*/
+void recursive_nearest_neighbor_descent(struct NearestQuery *query,
+                                        struct KdNode *node,
+                                        double cell_distance);
+
+/* Offer every point of leaf `node` to the query's heap. */
+void scan_leaf(struct NearestQuery *query, struct KdNode *node);
+
+/*
+  Add the point at `position` to the neighbors in `heap` if it is among the
+  closest seen so far. Returns `1` if it was added, `0` otherwise.
+*/
+int offer_neighbor(struct BoundedHeap *heap, int position, double distance);
+
+/*
+  Lower bound on the distance from the test point to the point at `position`
+  of leaf `node`, from its quantized coordinates.
+*/
+double quantized_distance(struct NearestQuery *query, struct KdNode *node,
+                          int position);
+
+/*
+  Lower bound on the distance from the test point to the points of `node`
+  from its bounding box. Stops summing once it exceeds `limit`.
+*/
+double node_box_distance(struct NearestQuery *query, struct KdNode *node,
+                         double limit);
+
+/*
+  Run a range query calling `visit` with the position of every point found.
+  Returns the number of points visited, or -1 on failure.
+*/
+int query_range_positions(struct KdTree *tree, double *test_point,
+                          double *radii, struct KdMetric *kd_metric,
+                          int (*visit)(void *context, int position,
+                                       double distance),
+                          void *context);
+
+/*
+  Recursively descend down the kd-tree, visiting the points that lie within
+  the query's `radii` around its `test_point`. Returns `0` if the visitor
+  stopped the query, `1` otherwise.
+*/
+int recursive_query_range_descent(struct KdTree *tree, struct KdNode *node,
+                                  struct RangeQuery *query);
+
+/*
+  Recursively count the points of the subtree at `node` within the `radii`
+  around `test_point`, using the nodes' bounding boxes to skip subtrees that
+  lie entirely inside or outside of the query box.
+*/
+int recursive_query_range_count(struct KdTree *tree, struct KdNode *node,
+                                double *test_point, double *radii);
+
+/*
+  Does the point at `position` of leaf `node` lie within `radii` around
+  `test_point`?
+*/
+bool point_in_range(struct KdTree *tree, struct KdNode *node, int position,
+                    double *test_point, double *radii);
+
+/*
+  Recursively visit the pairs of points of `node_a` and `node_b` that are in
+  range of each other. Returns `0` if the visitor stopped the join.
+*/
+int recursive_join_range(struct RangeJoin *join, struct KdNode *node_a,
+                         struct KdNode *node_b);
+
+/* Recursively count the pairs of points of `node_a` and `node_b` in range. */
+long long recursive_join_range_count(struct KdTree *tree_a,
+                                     struct KdNode *node_a,
+                                     struct KdTree *tree_b,
+                                     struct KdNode *node_b, double *radii);
 
-void recursive_free_kd_node(struct KdNode *node);
+/*
+  Compare the bounding boxes of two nodes of a range join. Returns `0` if no
+  pair of their points is in range, `1` if every pair is, and -1 otherwise.
+*/
+int node_pair_in_range(struct KdTree *tree_a, struct KdNode *node_a,
+                       struct KdTree *tree_b, struct KdNode *node_b,
+                       double *radii);
+
+/*
+  Whether the point at `position_a` of `tree_a` is in range of the bounding
+  box of `node_b`, so that it may pair up with one of its points.
+*/
+bool point_near_box(struct KdTree *tree_a, int position_a,
+                    struct KdTree *tree_b, struct KdNode *node_b,
+                    double *radii);
+
+/* Whether the points at two positions of two trees are in range. */
+bool pair_in_range(struct KdTree *tree_a, int position_a,
+                   struct KdTree *tree_b, int position_b, double *radii);
+
+/* Coordinate `axis` of the point at `position` of the tree. */
+double position_coordinate(struct KdTree *tree, int position, int axis);
+
+/*
+  Settle point_in_range() from the quantized coordinates alone. Returns 1 if
+  the point is inside, 0 if outside and -1 if the codes cannot tell.
+*/
+int quantized_in_range(struct KdTree *tree, struct KdNode *node, int position,
+                       double *test_point, double *radii);
 
 /*
-  Select the median of the longest axis from among the points in the set of
-  indices, then recursively call to determine the low and high subtree. Returns
-  a node representing the split, or NULL on failure.
+  Convert a test point to floats for the kernels of float trees, into
+  `stack_point` if it fits, else into memory the caller frees. Returns NULL
+  on failure.
 */
-struct KdNode *recursive_select_median(double *points, int *indices,
-                                       int num_indices, int k, int leaf_size);
+float *float_test_point(struct KdTree *tree, double *test_point,
+                        float *stack_point);
+
+/* Write `test_point` rounded to floats to `point`, which holds k floats. */
+void fill_float_test_point(struct KdTree *tree, double *test_point,
+                           float *point);
+
+/* Range query visitor passing hits on to a RangeVisitor. */
+int visit_hit(void *context, int position, double distance);
+
+/* Range query visitor growing the array of a ResultCollector. */
+int collect_result(void *context, int position, double distance);
+
+/* Range query visitor appending to the KdRangeBuffer of a BufferAppender. */
+int append_to_buffer(void *context, int position, double distance);
+
+struct KdTree *create_kd_tree(int k) {
+  return create_typed_kd_tree(k, POINT_DOUBLE);
+}
+
+struct KdTree *create_typed_kd_tree(int k, enum PointType point_type) {
+  struct KdTree *tree = malloc(sizeof(struct KdTree));
+  if (tree == NULL) {
+    return NULL;
+  }
+  tree->k = k;
+  tree->root = NULL;
+  tree->nodes = NULL;
+  tree->bounds = NULL;
+  tree->quantization = QUANTIZE_NONE;
+  tree->codes = NULL;
+  tree->steps = NULL;
+  tree->indices = NULL;
+  tree->num_nodes = 0;
+  tree->copied = false;
+  tree->reordered = false;
+  tree->data = NULL;
+  tree->float_data = NULL;
+  tree->point_type = point_type;
+  tree->size = 0;
+  tree->memory_bytes = sizeof(struct KdTree);
+  tree->mapping = NULL;
+  tree->mapping_bytes = 0;
+  tree->kernels = point_type == POINT_FLOAT ? best_float_distance_kernels(k)
+                                            : best_distance_kernels(k);
+  return tree;
+}
+
+struct KdTree *build_kd_tree(double *input_points, int num_points, int k,
+                             int leaf_size, bool copy_data) {
+  struct KdBuildOptions options = {0};
+  options.leaf_size = leaf_size;
+  options.copy_data = copy_data;
+  return build_kd_tree_with_options(input_points, num_points, k, &options);
+}
+
+struct KdTree *build_kd_tree_with_options(double *input_points, int num_points,
+                                          int k,
+                                          struct KdBuildOptions *options) {
+  return build_typed_kd_tree(POINT_DOUBLE, input_points, num_points, k,
+                             options);
+}
+
+struct KdTree *build_float_kd_tree_with_options(
+    float *input_points, int num_points, int k,
+    struct KdBuildOptions *options) {
+  return build_typed_kd_tree(POINT_FLOAT, input_points, num_points, k,
+                             options);
+}
+
+struct KdTree *build_typed_kd_tree(enum PointType point_type,
+                                   void *input_points, int num_points, int k,
+                                   struct KdBuildOptions *options) {
+  if (num_points <= 0
+      || (point_type == POINT_FLOAT
+          && options->quantization != QUANTIZE_NONE)) {
+    return NULL;
+  }
+  struct KdBuildStats *stats = options->stats;
+  double start_seconds = 0;
+  if (stats != NULL) {
+    // The histogram of an earlier build is dropped, not leaked.
+    free_kd_build_stats(stats);
+    memset(stats, 0, sizeof(*stats));
+    start_seconds = monotonic_seconds();
+  }
+  struct KdTree *tree = create_typed_kd_tree(k, point_type);
+  if (tree == NULL) {
+    return NULL;
+  }
+
+  // A reordered tree copies the points once the permutation is known, so an
+  // up front copy would be wasted.
+  size_t data_bytes = coordinate_size(tree) * num_points * k;
+  void *points = input_points;
+  tree->copied = false;
+  if (options->copy_data && !options->reorder_data) {
+    points = malloc(data_bytes);
+    if (points == NULL) {
+      free_kd_tree(tree);
+      return NULL;
+    }
+    memcpy(points, input_points, data_bytes);
+    tree->copied = true;
+    tree->memory_bytes += data_bytes;
+  }
+  if (point_type == POINT_FLOAT) {
+    tree->float_data = points;
+  } else {
+    tree->data = points;
+  }
+  tree->size = num_points;
+
+  tree->indices = malloc(sizeof(int) * num_points);
+  if (tree->indices == NULL) {
+    free_kd_tree(tree);
+    return NULL;
+  }
+  for (int i = 0; i < num_points; i++) tree->indices[i] = i;
+  tree->memory_bytes += sizeof(int) * num_points;
+
+  if (options->split_strategy != SPLIT_MEDIAN) {
+    if (!build_midpoint_tree(tree, options)
+        || (options->reorder_data && !reorder_tree_data(tree))
+        || (options->quantization != QUANTIZE_NONE
+            && !quantize_leaves(tree, options->quantization))
+        || (stats != NULL && !profile_tree(tree, stats))) {
+      free_kd_tree(tree);
+      return NULL;
+    }
+    if (stats != NULL) {
+      stats->seconds = monotonic_seconds() - start_seconds;
+    }
+    return tree;
+  }
+
+  tree->num_nodes = count_kd_nodes(num_points, build_leaf_size(options));
+  tree->nodes = malloc(sizeof(struct KdNode) * tree->num_nodes);
+  if (tree->nodes == NULL) {
+    free_kd_tree(tree);
+    return NULL;
+  }
+  tree->root = tree->nodes;
+  tree->memory_bytes += sizeof(struct KdNode) * tree->num_nodes;
+
+  tree->bounds = malloc(sizeof(double) * 2 * k * tree->num_nodes);
+  if (tree->bounds == NULL) {
+    free_kd_tree(tree);
+    return NULL;
+  }
+  tree->memory_bytes += sizeof(double) * 2 * k * tree->num_nodes;
+
+  struct BuildContext build;
+  build.tree = tree;
+  build.leaf_size = build_leaf_size(options);
+  build.parallel_cutoff = options->parallel_cutoff > 0
+                          ? options->parallel_cutoff
+                          : DEFAULT_PARALLEL_CUTOFF;
+  build.seed = options->seed;
+  build.pool = NULL;
+  if (options->num_threads > 1) {
+    build.pool = create_task_pool(options->num_threads);
+    if (build.pool == NULL) {
+      free_kd_tree(tree);
+      return NULL;
+    }
+  }
+  build.buffer = NULL;
+  if (num_points >= BLOCK_SPLIT_MIN) {
+    build.buffer = malloc(sizeof(int) * num_points);
+  }
+  build.worker_seconds = NULL;
+  int num_workers = options->num_threads > 1 ? options->num_threads : 1;
+  if (stats != NULL) {
+    build.worker_seconds = calloc(2 * num_workers, sizeof(double));
+  }
+  build.worker_failed = calloc(num_workers, sizeof(bool));
+
+  bool failed = (num_points >= BLOCK_SPLIT_MIN && build.buffer == NULL)
+                || (stats != NULL && build.worker_seconds == NULL)
+                || build.worker_failed == NULL;
+  if (!failed) {
+    recursive_select_median(&build, 0, 0, tree->num_nodes, 0, num_points);
+  }
+
+  if (build.pool != NULL) {
+    free_task_pool(build.pool);
+  }
+  // The pool has joined its threads, so the workers' flags can be read.
+  for (int i = 0; build.worker_failed != NULL && i < num_workers; i++) {
+    failed = failed || build.worker_failed[i];
+  }
+  free(build.worker_failed);
+  free(build.buffer);
+  for (int i = 0; build.worker_seconds != NULL && i < num_workers; i++) {
+    stats->split_axis_seconds += build.worker_seconds[2 * i];
+    stats->partition_seconds += build.worker_seconds[(2 * i) + 1];
+  }
+  free(build.worker_seconds);
+
+  if (failed
+      || (options->reorder_data && !reorder_tree_data(tree))
+      || (options->quantization != QUANTIZE_NONE
+          && !quantize_leaves(tree, options->quantization))
+      || (stats != NULL && !profile_tree(tree, stats))) {
+    free_kd_tree(tree);
+    return NULL;
+  }
+  if (stats != NULL) {
+    stats->seconds = monotonic_seconds() - start_seconds;
+  }
+
+  return tree;
+}
+
+int reorder_tree_data(struct KdTree *tree) {
+  size_t point_bytes = coordinate_size(tree) * tree->k;
+  char *data = tree->point_type == POINT_FLOAT ? (char *) tree->float_data
+                                               : (char *) tree->data;
+  char *reordered = malloc(point_bytes * tree->size);
+  if (reordered == NULL) {
+    return 0;
+  }
+  for (int i = 0; i < tree->size; i++) {
+    memcpy(reordered + (i * point_bytes),
+           data + ((size_t) tree->indices[i] * point_bytes), point_bytes);
+  }
+
+  if (tree->copied) {
+    free(data);
+  } else {
+    tree->memory_bytes += point_bytes * tree->size;
+  }
+  if (tree->point_type == POINT_FLOAT) {
+    tree->float_data = (float *) reordered;
+  } else {
+    tree->data = (double *) reordered;
+  }
+  tree->copied = true;
+  tree->reordered = true;
+  return 1;
+}
+
+/*
+  Codes number grid cells from the leaf's minimum, and the cell of code c
+  spans minimum + c * step to minimum + (c + 1) * step. Queries recompute the
+  cell with the same expressions, so after nudging each code until its cell
+  holds the coordinate exactly, bounds derived from the codes are never off
+  by a rounding error.
+*/
+int quantize_leaves(struct KdTree *tree, enum Quantization quantization) {
+  int k = tree->k;
+  int levels = quantization == QUANTIZE_INT8 ? UINT8_MAX : UINT16_MAX;
+  size_t code_size = quantization == QUANTIZE_INT8 ? sizeof(uint8_t)
+                                                   : sizeof(uint16_t);
+  tree->codes = malloc(code_size * tree->size * k);
+  // Zeroed, so that the unused rows of internal nodes save as zeros.
+  tree->steps = calloc((size_t) tree->num_nodes * k, sizeof(double));
+  if (tree->codes == NULL || tree->steps == NULL) {
+    return 0;
+  }
+  tree->quantization = quantization;
+  tree->memory_bytes += code_size * tree->size * k;
+  tree->memory_bytes += sizeof(double) * tree->num_nodes * k;
+
+  for (int n = 0; n < tree->num_nodes; n++) {
+    struct KdNode *node = tree->nodes + n;
+    if (!node->is_leaf || node->start == node->end) {
+      continue;
+    }
+    double *minimums = kd_node_bounds(tree, node);
+    double *maximums = minimums + k;
+    double *steps = tree->steps + ((size_t) n * k);
+    for (int j = 0; j < k; j++) {
+      steps[j] = (maximums[j] - minimums[j]) / levels;
+    }
+    for (int i = node->start; i < node->end; i++) {
+      double *point = kd_tree_point(tree, i);
+      for (int j = 0; j < k; j++) {
+        int code = 0;
+        if (steps[j] > 0) {
+          code = (int) ((point[j] - minimums[j]) / steps[j]);
+          code = code > levels ? levels : code;
+          while (code > 0 && minimums[j] + code * steps[j] > point[j]) {
+            code--;
+          }
+          while (code < levels
+                 && minimums[j] + (code + 1) * steps[j] < point[j]) {
+            code++;
+          }
+        }
+        size_t offset = ((size_t) i * k) + j;
+        if (quantization == QUANTIZE_INT8) {
+          ((uint8_t *) tree->codes)[offset] = (uint8_t) code;
+        } else {
+          ((uint16_t *) tree->codes)[offset] = (uint16_t) code;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+int quantized_code(struct KdTree *tree, int position, int axis) {
+  size_t offset = ((size_t) position * tree->k) + axis;
+  if (tree->quantization == QUANTIZE_INT8) {
+    return ((uint8_t *) tree->codes)[offset];
+  }
+  return ((uint16_t *) tree->codes)[offset];
+}
+
+double *kd_tree_point(struct KdTree *tree, int position) {
+  if (tree->data == NULL) {
+    return NULL;
+  }
+  if (tree->reordered) {
+    return tree->data + ((size_t) position * tree->k);
+  }
+  return tree->data + ((size_t) tree->indices[position] * tree->k);
+}
+
+float *kd_tree_float_point(struct KdTree *tree, int position) {
+  if (tree->float_data == NULL) {
+    return NULL;
+  }
+  if (tree->reordered) {
+    return tree->float_data + ((size_t) position * tree->k);
+  }
+  return tree->float_data + ((size_t) tree->indices[position] * tree->k);
+}
+
+double get_coordinate(struct KdTree *tree, int row, int axis) {
+  if (tree->point_type == POINT_FLOAT) {
+    return tree->float_data[((size_t) row * tree->k) + axis];
+  }
+  return tree->data[((size_t) row * tree->k) + axis];
+}
+
+size_t coordinate_size(struct KdTree *tree) {
+  return tree->point_type == POINT_FLOAT ? sizeof(float) : sizeof(double);
+}
+
+void free_kd_tree(struct KdTree *tree) {
+  if (tree->mapping != NULL) {
+    munmap(tree->mapping, tree->mapping_bytes);
+    free(tree);
+    return;
+  }
+  free(tree->nodes);
+  free(tree->bounds);
+  free(tree->codes);
+  free(tree->steps);
+  free(tree->indices);
+  if (tree->copied) {
+    free(tree->data);
+    free(tree->float_data);
+  }
+  free(tree);
+}
+
+int save_kd_tree(struct KdTree *tree, char *path, bool save_points) {
+  struct KdFileHeader header;
+  struct KdFileSection sections[6];
+  int num_sections = layout_kd_file(tree, save_points, &header, sections);
+
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    return 0;
+  }
+  bool failed = fwrite(&header, sizeof(header), 1, file) != 1;
+  uint64_t written = sizeof(header);
+  char padding[KD_FILE_ALIGNMENT] = {0};
+  for (int i = 0; i < num_sections && !failed; i++) {
+    uint64_t offset = *sections[i].offset;
+    failed = fwrite(padding, 1, offset - written, file) != offset - written
+             || fwrite(sections[i].data, 1, sections[i].bytes, file)
+                != sections[i].bytes;
+    written = offset + sections[i].bytes;
+  }
+  if (fclose(file) != 0 || failed) {
+    remove(path);
+    return 0;
+  }
+  return 1;
+}
+
+struct KdTree *load_kd_tree(char *path, void *points) {
+  int file = open(path, O_RDONLY);
+  if (file < 0) {
+    return NULL;
+  }
+  struct stat status;
+  if (fstat(file, &status) != 0
+      || (size_t) status.st_size < sizeof(struct KdFileHeader)) {
+    close(file);
+    return NULL;
+  }
+  size_t file_bytes = status.st_size;
+  // The mapping outlives the descriptor.
+  char *mapping = mmap(NULL, file_bytes, PROT_READ, MAP_SHARED, file, 0);
+  close(file);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+
+  struct KdFileHeader *header = (struct KdFileHeader *) mapping;
+  struct KdTree *tree = NULL;
+  if (valid_kd_file_header(header, file_bytes)
+      && (header->has_points || points != NULL)) {
+    tree = create_typed_kd_tree(header->k,
+                                (enum PointType) header->point_type);
+  }
+  if (tree == NULL) {
+    munmap(mapping, file_bytes);
+    return NULL;
+  }
+  tree->mapping = mapping;
+  tree->mapping_bytes = file_bytes;
+  tree->size = header->size;
+  tree->num_nodes = header->num_nodes;
+  tree->reordered = header->reordered;
+  tree->quantization = (enum Quantization) header->quantization;
+  tree->nodes = (struct KdNode *) (mapping + header->nodes_offset);
+  tree->root = tree->num_nodes > 0 ? tree->nodes : NULL;
+  tree->bounds = (double *) (mapping + header->bounds_offset);
+  tree->indices = (int *) (mapping + header->indices_offset);
+  if (tree->quantization != QUANTIZE_NONE) {
+    tree->codes = mapping + header->codes_offset;
+    tree->steps = (double *) (mapping + header->steps_offset);
+  }
+  if (header->has_points) {
+    points = mapping + header->points_offset;
+  }
+  if (tree->point_type == POINT_FLOAT) {
+    tree->float_data = points;
+  } else {
+    tree->data = points;
+  }
+  return tree;
+}
+
+int layout_kd_file(struct KdTree *tree, bool save_points,
+                   struct KdFileHeader *header,
+                   struct KdFileSection *sections) {
+  int k = tree->k;
+  // Zeroed so that padding bytes are written as zeros.
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, KD_FILE_MAGIC, sizeof(header->magic));
+  header->version = KD_FILE_VERSION;
+  header->byte_order = KD_FILE_BYTE_ORDER;
+  header->node_bytes = sizeof(struct KdNode);
+  header->k = k;
+  header->size = tree->size;
+  header->num_nodes = tree->num_nodes;
+  header->point_type = tree->point_type;
+  header->quantization = tree->quantization;
+  header->reordered = tree->reordered;
+  header->has_points = save_points || tree->reordered;
+
+  int num_sections = 0;
+  sections[num_sections++] = (struct KdFileSection) {
+      tree->nodes, sizeof(struct KdNode) * tree->num_nodes,
+      &header->nodes_offset};
+  sections[num_sections++] = (struct KdFileSection) {
+      tree->bounds, sizeof(double) * 2 * k * tree->num_nodes,
+      &header->bounds_offset};
+  sections[num_sections++] = (struct KdFileSection) {
+      tree->indices, sizeof(int) * tree->size, &header->indices_offset};
+  if (tree->quantization != QUANTIZE_NONE) {
+    size_t code_size = tree->quantization == QUANTIZE_INT8
+                       ? sizeof(uint8_t) : sizeof(uint16_t);
+    sections[num_sections++] = (struct KdFileSection) {
+        tree->codes, code_size * tree->size * k, &header->codes_offset};
+    sections[num_sections++] = (struct KdFileSection) {
+        tree->steps, sizeof(double) * k * tree->num_nodes,
+        &header->steps_offset};
+  }
+  if (header->has_points) {
+    void *data = tree->point_type == POINT_FLOAT ? (void *) tree->float_data
+                                                 : (void *) tree->data;
+    sections[num_sections++] = (struct KdFileSection) {
+        data, coordinate_size(tree) * tree->size * k,
+        &header->points_offset};
+  }
+
+  uint64_t offset = sizeof(*header);
+  for (int i = 0; i < num_sections; i++) {
+    offset = align_file_offset(offset);
+    *sections[i].offset = offset;
+    offset += sections[i].bytes;
+  }
+  header->file_bytes = offset;
+  return num_sections;
+}
+
+bool valid_kd_file_header(struct KdFileHeader *header, size_t file_bytes) {
+  if (memcmp(header->magic, KD_FILE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != KD_FILE_VERSION
+      || header->byte_order != KD_FILE_BYTE_ORDER
+      || header->node_bytes != sizeof(struct KdNode)
+      || header->file_bytes != file_bytes
+      || header->k < 1 || header->size < 0 || header->num_nodes < 0
+      || (header->point_type != POINT_DOUBLE
+          && header->point_type != POINT_FLOAT)
+      || header->quantization < QUANTIZE_NONE
+      || header->quantization > QUANTIZE_INT16) {
+    return false;
+  }
+  size_t k = header->k;
+  size_t num_nodes = header->num_nodes;
+  size_t size = header->size;
+  size_t coordinate_bytes = header->point_type == POINT_FLOAT
+                            ? sizeof(float) : sizeof(double);
+  size_t code_size = header->quantization == QUANTIZE_INT8
+                     ? sizeof(uint8_t) : sizeof(uint16_t);
+  return valid_kd_file_section(header->nodes_offset,
+                               sizeof(struct KdNode) * num_nodes, file_bytes)
+         && valid_kd_file_section(header->bounds_offset,
+                                  sizeof(double) * 2 * k * num_nodes,
+                                  file_bytes)
+         && valid_kd_file_section(header->indices_offset, sizeof(int) * size,
+                                  file_bytes)
+         && (header->quantization == QUANTIZE_NONE
+             || (valid_kd_file_section(header->codes_offset,
+                                       code_size * size * k, file_bytes)
+                 && valid_kd_file_section(header->steps_offset,
+                                          sizeof(double) * k * num_nodes,
+                                          file_bytes)))
+         && (!header->has_points
+             || valid_kd_file_section(header->points_offset,
+                                      coordinate_bytes * size * k,
+                                      file_bytes));
+}
+
+int kd_tree_validate(struct KdTree *tree) {
+  if ((tree->size == 0) != (tree->num_nodes == 0)) {
+    return 0;
+  }
+  for (int i = 0; i < tree->num_nodes; i++) {
+    struct KdNode *node = &tree->nodes[i];
+    if (node->start < 0 || node->start > node->end
+        || node->end > tree->size) {
+      return 0;
+    }
+    if (!node->is_leaf
+        && (node->low <= i || node->low >= tree->num_nodes
+            || node->high <= i || node->high >= tree->num_nodes
+            || node->split_axis < 0 || node->split_axis >= tree->k)) {
+      return 0;
+    }
+  }
+  for (int i = 0; i < tree->size; i++) {
+    if (tree->indices[i] < 0 || tree->indices[i] >= tree->size) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+bool valid_kd_file_section(uint64_t offset, size_t bytes, size_t file_bytes) {
+  return offset % KD_FILE_ALIGNMENT == 0
+         && offset >= sizeof(struct KdFileHeader) && offset <= file_bytes
+         && bytes <= file_bytes - offset;
+}
+
+uint64_t align_file_offset(uint64_t offset) {
+  return (offset + KD_FILE_ALIGNMENT - 1) / KD_FILE_ALIGNMENT
+         * KD_FILE_ALIGNMENT;
+}
+
+/*
+  Cells are built with median splits, whose node counts depend only on their
+  sizes, so the layout of the whole file is known once the points have been
+  spilled and each cell can be written to its place as soon as it is built.
+*/
+int build_kd_tree_streaming(struct KdPointReader *reader, int k,
+                            struct KdStreamOptions *options, char *path) {
+  if (k < 1 || options->build.split_strategy != SPLIT_MEDIAN
+      || options->build.quantization != QUANTIZE_NONE) {
+    return 0;
+  }
+  struct StreamBuild build = {0};
+  build.options = options;
+  build.k = k;
+  build.path = path;
+  if (!sample_stream(&build, reader)) {
+    finish_stream_build(&build);
+    return 0;
+  }
+
+  int num_top_nodes = build.sample_tree->num_nodes;
+  build.cell_of_node = malloc(sizeof(int) * num_top_nodes);
+  if (build.cell_of_node == NULL) {
+    finish_stream_build(&build);
+    return 0;
+  }
+  build.num_cells = 0;
+  number_cells(&build, 0, &build.num_cells);
+  build.spills = calloc(build.num_cells, sizeof(FILE *));
+  build.cell_sizes = calloc(build.num_cells, sizeof(int));
+  build.cell_positions = malloc(sizeof(int) * build.num_cells);
+  build.cell_node_bases = malloc(sizeof(int) * build.num_cells);
+  build.top_nodes = malloc(sizeof(struct KdNode) * num_top_nodes);
+  build.top_bounds = malloc(sizeof(double) * 2 * k * num_top_nodes);
+  if (build.spills == NULL || build.cell_sizes == NULL
+      || build.cell_positions == NULL || build.cell_node_bases == NULL
+      || build.top_nodes == NULL || build.top_bounds == NULL
+      || !spill_stream(&build, reader)) {
+    finish_stream_build(&build);
+    return 0;
+  }
+  memcpy(build.top_nodes, build.sample_tree->nodes,
+         sizeof(struct KdNode) * num_top_nodes);
+
+  // Lay out the cells one after the other, positions and nodes alike.
+  int leaf_size = build_leaf_size(&options->build);
+  int num_points = 0;
+  int num_nodes = num_top_nodes;
+  for (int c = 0; c < build.num_cells; c++) {
+    build.cell_positions[c] = num_points;
+    build.cell_node_bases[c] = num_nodes;
+    num_points += build.cell_sizes[c];
+    if (build.cell_sizes[c] > 0) {
+      num_nodes += count_kd_nodes(build.cell_sizes[c], leaf_size) - 1;
+    }
+  }
+  struct KdTree layout = {0};
+  layout.k = k;
+  layout.size = num_points;
+  layout.num_nodes = num_nodes;
+  layout.point_type = POINT_DOUBLE;
+  layout.quantization = QUANTIZE_NONE;
+  layout.reordered = true;
+  struct KdFileSection sections[6];
+  layout_kd_file(&layout, true, &build.header, sections);
+
+  build.file = fopen(path, "wb");
+  bool failed = build.file == NULL;
+  for (int c = 0; c < build.num_cells && !failed; c++) {
+    failed = !build_cell(&build, c);
+  }
+  if (!failed) {
+    merge_top_nodes(&build, 0);
+    struct KdFileHeader *header = &build.header;
+    failed = !write_at(build.file, 0, header, sizeof(*header))
+             || !write_at(build.file, header->nodes_offset, build.top_nodes,
+                          sizeof(struct KdNode) * num_top_nodes)
+             || !write_at(build.file, header->bounds_offset, build.top_bounds,
+                          sizeof(double) * 2 * k * num_top_nodes);
+  }
+  if (build.file != NULL) {
+    failed = fclose(build.file) != 0 || failed;
+    build.file = NULL;
+  }
+  finish_stream_build(&build);
+  if (failed) {
+    remove(path);
+    return 0;
+  }
+  return 1;
+}
+
+int build_kd_tree_from_file(char *points_path, int k,
+                            struct KdStreamOptions *options, char *path) {
+  struct FileReader file_reader;
+  file_reader.file = fopen(points_path, "rb");
+  file_reader.k = k;
+  if (file_reader.file == NULL) {
+    return 0;
+  }
+  struct KdPointReader reader;
+  reader.read = read_file_points;
+  reader.rewind = rewind_file_points;
+  reader.context = &file_reader;
+  int built = build_kd_tree_streaming(&reader, k, options, path);
+  fclose(file_reader.file);
+  return built;
+}
+
+/*
+  Reservoir sampling keeps each point seen so far in the sample with the same
+  probability, whatever the number of points turns out to be.
+*/
+int sample_stream(struct StreamBuild *build, struct KdPointReader *reader) {
+  struct KdStreamOptions *options = build->options;
+  int k = build->k;
+  int sample_size = options->sample_size > 0 ? options->sample_size
+                                             : STREAM_DEFAULT_SAMPLE_SIZE;
+  double *sample = malloc(sizeof(double) * sample_size * k);
+  double *chunk = malloc(sizeof(double) * STREAM_CHUNK_SIZE * k);
+  if (sample == NULL || chunk == NULL) {
+    free(sample);
+    free(chunk);
+    return 0;
+  }
+  uint64_t state = seed_node(options->build.seed, 0, sample_size);
+  int64_t num_points = 0;
+  int num_read;
+  while ((num_read = reader->read(reader->context, chunk,
+                                  STREAM_CHUNK_SIZE)) > 0) {
+    for (int i = 0; i < num_read; i++, num_points++) {
+      int64_t slot = num_points < sample_size
+                     ? num_points
+                     : (int64_t) (next_random(&state)
+                                  % (uint64_t) (num_points + 1));
+      if (slot < sample_size) {
+        memcpy(sample + (slot * k), chunk + ((size_t) i * k),
+               sizeof(double) * k);
+      }
+    }
+  }
+  free(chunk);
+  build->sample = sample;
+  if (num_read < 0 || num_points == 0 || num_points > INT_MAX) {
+    return 0;
+  }
+  build->num_points = num_points;
+  if (num_points < sample_size) {
+    sample_size = num_points;
+  }
+
+  // Each point of a cell costs its coordinates twice, once as read and once
+  // reordered, its index and position, and its share of the nodes.
+  size_t memory_bytes = options->memory_bytes > 0
+                        ? options->memory_bytes
+                        : STREAM_DEFAULT_MEMORY_BYTES;
+  size_t point_bytes = (sizeof(double) * 2 * k) + (sizeof(int) * 3)
+                       + sizeof(struct KdNode) + (sizeof(double) * 2 * k);
+  double cell_points = (double) (memory_bytes / point_bytes);
+  double sample_leaf_size = cell_points * sample_size / num_points;
+  // Median splits stop at fewer than 2 * sample_size / leaf_size leaves.
+  double min_leaf_size = 2.0 * sample_size / STREAM_MAX_CELLS;
+  struct KdBuildOptions sample_options = {0};
+  sample_options.leaf_size = (int) fmin(fmax(sample_leaf_size,
+                                             min_leaf_size),
+                                        sample_size);
+  sample_options.seed = options->build.seed;
+  build->sample_tree = build_kd_tree_with_options(sample, sample_size, k,
+                                                  &sample_options);
+  return build->sample_tree != NULL;
+}
+
+void number_cells(struct StreamBuild *build, int node_index, int *next_cell) {
+  struct KdNode *node = build->sample_tree->nodes + node_index;
+  build->cell_of_node[node_index] = -1;
+  if (node->is_leaf) {
+    build->cell_of_node[node_index] = (*next_cell)++;
+    return;
+  }
+  number_cells(build, node->low, next_cell);
+  number_cells(build, node->high, next_cell);
+}
+
+int spill_stream(struct StreamBuild *build, struct KdPointReader *reader) {
+  int k = build->k;
+  char name[4096];
+  for (int c = 0; c < build->num_cells; c++) {
+    spill_file_name(build, c, name, sizeof(name));
+    build->spills[c] = fopen(name, "w+b");
+    if (build->spills[c] == NULL) {
+      return 0;
+    }
+  }
+  double *chunk = malloc(sizeof(double) * STREAM_CHUNK_SIZE * k);
+  if (chunk == NULL || !reader->rewind(reader->context)) {
+    free(chunk);
+    return 0;
+  }
+
+  struct KdNode *nodes = build->sample_tree->nodes;
+  int index = 0;
+  int num_read;
+  bool failed = false;
+  while (!failed && (num_read = reader->read(reader->context, chunk,
+                                             STREAM_CHUNK_SIZE)) > 0) {
+    if (num_read > build->num_points - index) {
+      failed = true;
+    }
+    for (int i = 0; i < num_read && !failed; i++, index++) {
+      double *point = chunk + ((size_t) i * k);
+      struct KdNode *node = nodes;
+      while (!node->is_leaf) {
+        node = nodes + (point[node->split_axis] < node->split_value
+                        ? node->low : node->high);
+      }
+      int cell = build->cell_of_node[node - nodes];
+      FILE *spill = build->spills[cell];
+      failed = fwrite(&index, sizeof(int), 1, spill) != 1
+               || fwrite(point, sizeof(double), k, spill) != (size_t) k;
+      build->cell_sizes[cell]++;
+    }
+  }
+  free(chunk);
+  // The cells were sized for the points sampled.
+  return !failed && num_read == 0 && index == build->num_points;
+}
+
+int build_cell(struct StreamBuild *build, int cell) {
+  int k = build->k;
+  int num_points = build->cell_sizes[cell];
+  int slot = 0;
+  while (build->cell_of_node[slot] != cell) slot++;
+  struct KdNode *slot_node = build->top_nodes + slot;
+  double *slot_bounds = build->top_bounds + ((size_t) slot * 2 * k);
+  int position = build->cell_positions[cell];
+  if (num_points == 0) {
+    slot_node->start = position;
+    slot_node->end = position;
+    for (int j = 0; j < k; j++) {
+      slot_bounds[j] = INFINITY;
+      slot_bounds[k + j] = -INFINITY;
+    }
+    return 1;
+  }
+
+  FILE *spill = build->spills[cell];
+  int *indices = malloc(sizeof(int) * num_points);
+  double *points = malloc(sizeof(double) * num_points * k);
+  bool failed = indices == NULL || points == NULL
+                || fseek(spill, 0, SEEK_SET) != 0;
+  for (int i = 0; i < num_points && !failed; i++) {
+    failed = fread(indices + i, sizeof(int), 1, spill) != 1
+             || fread(points + ((size_t) i * k), sizeof(double), k, spill)
+                != (size_t) k;
+  }
+  // The points are read back, so the spill file's space can go.
+  fclose(spill);
+  build->spills[cell] = NULL;
+  char name[4096];
+  spill_file_name(build, cell, name, sizeof(name));
+  remove(name);
+
+  struct KdTree *tree = NULL;
+  int leaf_size = build_leaf_size(&build->options->build);
+  if (!failed) {
+    struct KdBuildOptions options = build->options->build;
+    options.copy_data = false;
+    options.reorder_data = true;
+    options.stats = NULL;
+    tree = build_kd_tree_with_options(points, num_points, k, &options);
+  }
+  free(points);
+  if (tree == NULL
+      || tree->num_nodes != count_kd_nodes(num_points, leaf_size)) {
+    if (tree != NULL) {
+      free_kd_tree(tree);
+    }
+    free(indices);
+    return 0;
+  }
+
+  // The cell's root takes the place of its leaf of the sample tree, and its
+  // other nodes are moved past the nodes before them.
+  int node_base = build->cell_node_bases[cell] - 1;
+  for (int n = 0; n < tree->num_nodes; n++) {
+    struct KdNode *node = tree->nodes + n;
+    node->start += position;
+    node->end += position;
+    if (!node->is_leaf) {
+      node->low += node_base;
+      node->high += node_base;
+    }
+  }
+  for (int i = 0; i < num_points; i++) {
+    tree->indices[i] = indices[tree->indices[i]];
+  }
+  free(indices);
+  *slot_node = *tree->root;
+  memcpy(slot_bounds, tree->bounds, sizeof(double) * 2 * k);
+
+  struct KdFileHeader *header = &build->header;
+  size_t node_bytes = sizeof(struct KdNode);
+  size_t box_bytes = sizeof(double) * 2 * k;
+  int written = write_at(build->file,
+                         header->nodes_offset
+                         + ((uint64_t) (node_base + 1) * node_bytes),
+                         tree->nodes + 1, node_bytes * (tree->num_nodes - 1))
+                && write_at(build->file,
+                            header->bounds_offset
+                            + ((uint64_t) (node_base + 1) * box_bytes),
+                            tree->bounds + (2 * k),
+                            box_bytes * (tree->num_nodes - 1))
+                && write_at(build->file,
+                            header->indices_offset
+                            + ((uint64_t) position * sizeof(int)),
+                            tree->indices, sizeof(int) * num_points)
+                && write_at(build->file,
+                            header->points_offset
+                            + ((uint64_t) position * sizeof(double) * k),
+                            tree->data, sizeof(double) * num_points * k);
+  free_kd_tree(tree);
+  return written;
+}
+
+void merge_top_nodes(struct StreamBuild *build, int node_index) {
+  // Cells already hold the root of their own tree.
+  if (build->cell_of_node[node_index] >= 0) {
+    return;
+  }
+  struct KdNode *node = build->top_nodes + node_index;
+  int k = build->k;
+  merge_top_nodes(build, node->low);
+  merge_top_nodes(build, node->high);
+  struct KdNode *low = build->top_nodes + node->low;
+  struct KdNode *high = build->top_nodes + node->high;
+  node->start = low->start;
+  node->end = high->end;
+  double *bounds = build->top_bounds + ((size_t) node_index * 2 * k);
+  double *low_bounds = build->top_bounds + ((size_t) node->low * 2 * k);
+  double *high_bounds = build->top_bounds + ((size_t) node->high * 2 * k);
+  for (int j = 0; j < k; j++) {
+    bounds[j] = fmin(low_bounds[j], high_bounds[j]);
+    bounds[k + j] = fmax(low_bounds[k + j], high_bounds[k + j]);
+  }
+}
+
+void finish_stream_build(struct StreamBuild *build) {
+  char name[4096];
+  for (int c = 0; build->spills != NULL && c < build->num_cells; c++) {
+    if (build->spills[c] != NULL) {
+      fclose(build->spills[c]);
+      spill_file_name(build, c, name, sizeof(name));
+      remove(name);
+    }
+  }
+  if (build->sample_tree != NULL) {
+    free_kd_tree(build->sample_tree);
+  }
+  free(build->sample);
+  free(build->cell_of_node);
+  free(build->spills);
+  free(build->cell_sizes);
+  free(build->cell_positions);
+  free(build->cell_node_bases);
+  free(build->top_nodes);
+  free(build->top_bounds);
+}
+
+void spill_file_name(struct StreamBuild *build, int cell, char *name,
+                     size_t name_bytes) {
+  snprintf(name, name_bytes, "%s.%d.spill", build->path, cell);
+}
+
+int write_at(FILE *file, uint64_t offset, void *data, size_t bytes) {
+  return fseeko(file, (off_t) offset, SEEK_SET) == 0
+         && fwrite(data, 1, bytes, file) == bytes;
+}
+
+int read_file_points(void *context, double *points, int max_points) {
+  struct FileReader *reader = context;
+  size_t num_read = fread(points, sizeof(double) * reader->k, max_points,
+                          reader->file);
+  return ferror(reader->file) ? -1 : (int) num_read;
+}
+
+int rewind_file_points(void *context) {
+  struct FileReader *reader = context;
+  return fseek(reader->file, 0, SEEK_SET) == 0;
+}
+
+void free_kd_build_stats(struct KdBuildStats *stats) {
+  free(stats->leaf_sizes);
+  stats->leaf_sizes = NULL;
+}
+
+int profile_tree(struct KdTree *tree, struct KdBuildStats *stats) {
+  stats->leaf_sizes = NULL;
+  stats->depth = 0;
+  stats->num_leaves = 0;
+  stats->max_leaf_size = 0;
+  profile_node(tree, tree->root, 1, stats);
+  stats->leaf_sizes = calloc(stats->max_leaf_size + 1, sizeof(int));
+  if (stats->leaf_sizes == NULL) {
+    return 0;
+  }
+  profile_node(tree, tree->root, 1, stats);
+  return 1;
+}
+
+void profile_node(struct KdTree *tree, struct KdNode *node, int depth,
+                  struct KdBuildStats *stats) {
+  if (!node->is_leaf) {
+    profile_node(tree, tree->nodes + node->low, depth + 1, stats);
+    profile_node(tree, tree->nodes + node->high, depth + 1, stats);
+    return;
+  }
+  int size = node->end - node->start;
+  if (stats->leaf_sizes != NULL) {
+    stats->leaf_sizes[size]++;
+    stats->num_leaves++;
+    return;
+  }
+  stats->depth = depth > stats->depth ? depth : stats->depth;
+  stats->max_leaf_size = size > stats->max_leaf_size ? size
+                                                     : stats->max_leaf_size;
+}
+
+double monotonic_seconds(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + (time.tv_nsec * 1e-9);
+}
+
+int build_leaf_size(struct KdBuildOptions *options) {
+  return options->leaf_size > 0 ? options->leaf_size : DEFAULT_LEAF_SIZE;
+}
+
+int count_kd_nodes(int num_indices, int leaf_size) {
+  int count, count_next;
+  count_kd_node_pair(num_indices, leaf_size, &count, &count_next);
+  return count;
+}
+
+/*
+  Median splits halve a node, so the subtrees of n and n + 1 points only ever
+  involve subtrees of two consecutive sizes at the next level down.
+*/
+void count_kd_node_pair(int num_indices, int leaf_size, int *count,
+                        int *count_next) {
+  if (num_indices <= leaf_size || num_indices < 2) {
+    *count = 1;
+    if (num_indices + 1 <= leaf_size || num_indices + 1 < 2) {
+      *count_next = 1;
+    } else {
+      // n + 1 splits into halves of at most n points, which are leaves.
+      *count_next = 3;
+    }
+    return;
+  }
+
+  int half = num_indices / 2;
+  int half_count, half_next_count;
+  count_kd_node_pair(half, leaf_size, &half_count, &half_next_count);
+  if (num_indices % 2 == 0) {
+    *count = 1 + 2 * half_count;
+    *count_next = 1 + half_count + half_next_count;
+  } else {
+    *count = 1 + half_count + half_next_count;
+    *count_next = 1 + 2 * half_next_count;
+  }
+}
+
+void recursive_select_median(struct BuildContext *build, int worker_id,
+                             int node_index, int num_nodes, int start,
+                             int end) {
+  struct KdTree *tree = build->tree;
+  struct KdNode *node = tree->nodes + node_index;
+  int num_indices = end - start;
+  int *indices = tree->indices + start;
+  int k = tree->k;
+  double *bounds = tree->bounds + ((size_t) node_index * 2 * k);
+  node->start = start;
+  node->end = end;
+
+  // bail if we have less than leaf number of points
+  if (num_indices <= build->leaf_size || num_indices < 2) {
+    node->is_leaf = true;
+    node->low = -1;
+    node->high = -1;
+    accumulate_extents(tree, indices, num_indices, bounds, bounds + k, true);
+    return;
+  }
+
+  int median_index = num_indices / 2;
+  uint64_t random_state = seed_node(build->seed, start, end);
+  double *seconds = build->worker_seconds;
+  double mark = seconds != NULL ? monotonic_seconds() : 0;
+  int splitting_axis;
+  if (num_indices >= BLOCK_SPLIT_MIN) {
+    splitting_axis = get_splitting_axis_blocked(build, worker_id, indices,
+                                                num_indices, bounds);
+    if (seconds != NULL) {
+      double split_mark = monotonic_seconds();
+      seconds[2 * worker_id] += split_mark - mark;
+      mark = split_mark;
+    }
+    if (splitting_axis == -1
+        || !stable_partition_indices(build, worker_id, indices,
+                                     build->buffer + start, num_indices,
+                                     splitting_axis, median_index,
+                                     &random_state)) {
+      build->worker_failed[worker_id] = true;
+      return;
+    }
+  } else {
+    splitting_axis = get_splitting_axis(tree, indices, num_indices, bounds);
+    if (seconds != NULL) {
+      double split_mark = monotonic_seconds();
+      seconds[2 * worker_id] += split_mark - mark;
+      mark = split_mark;
+    }
+    partition_indices(tree, indices, num_indices, splitting_axis,
+                      median_index, &random_state);
+  }
+  if (seconds != NULL) {
+    seconds[(2 * worker_id) + 1] += monotonic_seconds() - mark;
+  }
+
+  node->is_leaf = false;
+  node->split_axis = splitting_axis;
+  node->split_value = get_coordinate(tree, indices[median_index],
+                                     splitting_axis);
+  int low_nodes = count_kd_nodes(median_index, build->leaf_size);
+  int high_nodes = num_nodes - 1 - low_nodes;
+  node->low = node_index + 1;
+  node->high = node->low + low_nodes;
+
+  // Continue on, selecting medians among the two sets of points partitioned
+  // about the median. Big enough low halves become tasks that idle workers
+  // steal while this worker carries on with the high half.
+  if (build->pool != NULL && median_index >= build->parallel_cutoff) {
+    struct TaskGroup group = {0};
+    struct SubtreeTask low = {build, node->low, low_nodes, start,
+                              start + median_index};
+    task_pool_spawn(build->pool, worker_id, &group, build_subtree_task, &low);
+    recursive_select_median(build, worker_id, node->high, high_nodes,
+                            start + median_index, end);
+    task_pool_wait(build->pool, worker_id, &group);
+  } else {
+    recursive_select_median(build, worker_id, node->low, low_nodes, start,
+                            start + median_index);
+    recursive_select_median(build, worker_id, node->high, high_nodes,
+                            start + median_index, end);
+  }
+}
+
+void build_subtree_task(void *arg, int worker_id) {
+  struct SubtreeTask *task = arg;
+  recursive_select_median(task->build, worker_id, task->node_index,
+                          task->num_nodes, task->start, task->end);
+}
+
+int build_midpoint_tree(struct KdTree *tree, struct KdBuildOptions *options) {
+  int k = tree->k;
+  struct MidpointBuild build;
+  build.tree = tree;
+  build.leaf_size = build_leaf_size(options);
+  build.seed = options->seed;
+  build.sliding = options->split_strategy == SPLIT_SLIDING_MIDPOINT;
+  build.capacity = 0;
+  build.stats = options->stats;
+  build.failed = false;
+
+  // Unlucky data can make midpoint trees as deep as they have points. Past
+  // twice the depth of a median tree, nodes split at the median instead,
+  // which keeps the build O(n log n).
+  build.max_depth = 2;
+  for (int n = tree->size; n > 1; n /= 2) build.max_depth += 2;
+
+  // The root's cell is the bounding box of all the points.
+  build.cell = malloc(sizeof(double) * 2 * k);
+  if (build.cell == NULL) {
+    return 0;
+  }
+  accumulate_extents(tree, tree->indices, tree->size, build.cell,
+                     build.cell + k, true);
+  recursive_split_midpoint(&build, 0, tree->size, 0);
+  free(build.cell);
+  if (build.failed) {
+    return 0;
+  }
+
+  // Give back what the arena overallocated.
+  struct KdNode *nodes = realloc(tree->nodes,
+                                 sizeof(struct KdNode) * tree->num_nodes);
+  if (nodes != NULL) {
+    tree->nodes = nodes;
+  }
+  double *bounds = realloc(tree->bounds,
+                           sizeof(double) * 2 * k * tree->num_nodes);
+  if (bounds != NULL) {
+    tree->bounds = bounds;
+  }
+  tree->root = tree->nodes;
+  tree->memory_bytes += (sizeof(struct KdNode) + sizeof(double) * 2 * k)
+                        * tree->num_nodes;
+  return 1;
+}
+
+int recursive_split_midpoint(struct MidpointBuild *build, int start, int end,
+                             int depth) {
+  struct KdTree *tree = build->tree;
+  int k = tree->k;
+  int node_index = allocate_node(build);
+  if (node_index == -1) {
+    return -1;
+  }
+  // The arena moves as it grows, so nodes are only held by index.
+  struct KdNode *node = tree->nodes + node_index;
+  double *bounds = tree->bounds + ((size_t) node_index * 2 * k);
+  int *indices = tree->indices + start;
+  int num_indices = end - start;
+  node->start = start;
+  node->end = end;
+  node->is_leaf = true;
+  node->low = -1;
+  node->high = -1;
+
+  // Midpoint splits can leave a side without points, whose box is empty.
+  if (num_indices == 0) {
+    for (int j = 0; j < k; j++) {
+      bounds[j] = INFINITY;
+      bounds[k + j] = -INFINITY;
+    }
+    return node_index;
+  }
+  accumulate_extents(tree, indices, num_indices, bounds, bounds + k, true);
+  if (num_indices <= build->leaf_size || num_indices < 2) {
+    return node_index;
+  }
+
+  // Cut across the longest side of the cell, among the axes the points are
+  // spread along so that the cut eventually separates them.
+  double mark = build->stats != NULL ? monotonic_seconds() : 0;
+  int split_axis = -1;
+  double longest = 0;
+  for (int j = 0; j < k; j++) {
+    double side = build->cell[k + j] - build->cell[j];
+    if (bounds[k + j] > bounds[j] && (split_axis == -1 || side > longest)) {
+      split_axis = j;
+      longest = side;
+    }
+  }
+
+  double split_value;
+  int num_low;
+  if (split_axis == -1 || depth >= build->max_depth) {
+    // Median split, as recursive_select_median() makes them.
+    uint64_t random_state = seed_node(build->seed, start, end);
+    split_axis = widest_axis(bounds, bounds + k, k);
+    if (build->stats != NULL) {
+      double split_mark = monotonic_seconds();
+      build->stats->split_axis_seconds += split_mark - mark;
+      mark = split_mark;
+    }
+    num_low = num_indices / 2;
+    partition_indices(tree, indices, num_indices, split_axis, num_low,
+                      &random_state);
+    split_value = get_coordinate(tree, indices[num_low], split_axis);
+  } else {
+    split_value = (build->cell[split_axis] + build->cell[k + split_axis]) / 2;
+    bool inclusive = false;
+    if (build->sliding && bounds[k + split_axis] < split_value) {
+      // Every point is below the cut: slide it up to the highest.
+      split_value = bounds[k + split_axis];
+    } else if (build->sliding && bounds[split_axis] >= split_value) {
+      // Every point is above the cut: slide it down to the lowest, which
+      // stays on the low side.
+      split_value = bounds[split_axis];
+      inclusive = true;
+    }
+    if (build->stats != NULL) {
+      double split_mark = monotonic_seconds();
+      build->stats->split_axis_seconds += split_mark - mark;
+      mark = split_mark;
+    }
+    num_low = partition_by_value(tree, indices, num_indices, split_axis,
+                                 split_value, inclusive);
+  }
+  if (build->stats != NULL) {
+    build->stats->partition_seconds += monotonic_seconds() - mark;
+  }
+  node->is_leaf = false;
+  node->split_axis = split_axis;
+  node->split_value = split_value;
+
+  // Each side's cell is this cell cut at the split value.
+  double cell_max = build->cell[k + split_axis];
+  build->cell[k + split_axis] = split_value;
+  int low = recursive_split_midpoint(build, start, start + num_low,
+                                     depth + 1);
+  build->cell[k + split_axis] = cell_max;
+  double cell_min = build->cell[split_axis];
+  build->cell[split_axis] = split_value;
+  int high = recursive_split_midpoint(build, start + num_low, end,
+                                      depth + 1);
+  build->cell[split_axis] = cell_min;
+  if (low == -1 || high == -1) {
+    return -1;
+  }
+  tree->nodes[node_index].low = low;
+  tree->nodes[node_index].high = high;
+  return node_index;
+}
+
+int allocate_node(struct MidpointBuild *build) {
+  struct KdTree *tree = build->tree;
+  if (build->failed) {
+    return -1;
+  }
+  if (tree->num_nodes == build->capacity) {
+    int capacity = build->capacity == 0 ? 64 : build->capacity * 2;
+    struct KdNode *nodes = realloc(tree->nodes,
+                                   sizeof(struct KdNode) * capacity);
+    if (nodes != NULL) {
+      tree->nodes = nodes;
+    }
+    double *bounds = realloc(tree->bounds,
+                             sizeof(double) * 2 * tree->k * capacity);
+    if (bounds != NULL) {
+      tree->bounds = bounds;
+    }
+    if (nodes == NULL || bounds == NULL) {
+      build->failed = true;
+      return -1;
+    }
+    build->capacity = capacity;
+  }
+  return tree->num_nodes++;
+}
+
+int partition_by_value(struct KdTree *tree, int *indices, int num_indices,
+                       int split_axis, double split_value, bool inclusive) {
+  int low = 0;
+  int high = num_indices - 1;
+  while (low <= high) {
+    double value = get_coordinate(tree, indices[low], split_axis);
+    if (value < split_value || (inclusive && value == split_value)) {
+      low++;
+    } else {
+      swap(indices, low, high);
+      high--;
+    }
+  }
+  return low;
+}
+
+/*
+  Track the minimum and maximum of each dimension in one traversal of the
+  points, Then determine the largest spread among the dimensions by difference.
+*/
+int get_splitting_axis(struct KdTree *tree, int *indices, int num_indices,
+                       double *bounds) {
+  double *minimums = bounds;
+  double *maximums = bounds + tree->k;
+  accumulate_extents(tree, indices, num_indices, minimums, maximums, true);
+  return widest_axis(minimums, maximums, tree->k);
+}
+
+int get_splitting_axis_blocked(struct BuildContext *build, int worker_id,
+                               int *indices, int num_indices, double *bounds) {
+  int k = build->tree->k;
+  int num_blocks = (num_indices + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  struct BlockPass pass;
+  pass.tree = build->tree;
+  pass.indices = indices;
+  pass.extents = malloc(sizeof(double) * 2 * k * num_blocks);
+  if (pass.extents == NULL) {
+    return -1;
+  }
+  if (!task_pool_parallel_for(build->pool, worker_id, num_indices, BLOCK_SIZE,
+                              extent_block, &pass)) {
+    free(pass.extents);
+    return -1;
+  }
+
+  // min and max are exact, so the reduction order does not matter.
+  double *minimums = pass.extents;
+  double *maximums = pass.extents + k;
+  for (int b = 1; b < num_blocks; b++) {
+    double *block = pass.extents + (b * 2 * k);
+    for (int j = 0; j < k; j++) {
+      if (block[j] < minimums[j]) minimums[j] = block[j];
+      if (block[k + j] > maximums[j]) maximums[j] = block[k + j];
+    }
+  }
+  int split_axis = widest_axis(minimums, maximums, k);
+  memcpy(bounds, pass.extents, sizeof(double) * 2 * k);
+  free(pass.extents);
+  return split_axis;
+}
+
+void extent_block(void *arg, int begin, int end, int worker_id) {
+  struct BlockPass *pass = arg;
+  int k = pass->tree->k;
+  double *extents = pass->extents + ((begin / BLOCK_SIZE) * 2 * k);
+  accumulate_extents(pass->tree, pass->indices + begin, end - begin, extents,
+                     extents + k, true);
+}
+
+void accumulate_extents(struct KdTree *tree, int *indices, int num_indices,
+                        double *minimums, double *maximums, bool seed) {
+  int k = tree->k;
+  int first = 0;
+  // use the first point to pre-populate
+  if (seed) {
+    for (int i = 0; i < k; i++) {
+      minimums[i] = get_coordinate(tree, indices[0], i);
+      maximums[i] = minimums[i];
+    }
+    first = 1;
+  }
+
+  // One loop per type keeps the type check out of the innermost loop.
+  if (tree->point_type == POINT_FLOAT) {
+    for (int i = first; i < num_indices; i++) {
+      float *point = tree->float_data + ((size_t) indices[i] * k);
+      for (int j = 0; j < k; j++) {
+        double value = point[j];
+        if (value < minimums[j]) {
+          minimums[j] = value;
+        } else if (value > maximums[j]) {
+          maximums[j] = value;
+        }
+      }
+    }
+    return;
+  }
+  for (int i = first; i < num_indices; i++) {
+    double *point = tree->data + ((size_t) indices[i] * k);
+    for (int j = 0; j < k; j++) {
+      double value = point[j];
+      if (value < minimums[j]) {
+        minimums[j] = value;
+      } else if (value > maximums[j]) {
+        maximums[j] = value;
+      }
+    }
+  }
+}
+
+int widest_axis(double *minimums, double *maximums, int k) {
+  double max_spread = 0;
+  int split_axis = 0;
+  for (int i = 0; i < k; i++) {
+    double spread = maximums[i] - minimums[i];
+    if (spread > max_spread) {
+      max_spread = spread;
+      split_axis = i;
+    }
+  }
+  return split_axis;
+}
+
+/*
+  Quickselect with a random pivot and a three way partition, so sorted input
+  and runs of duplicate values stay linear.
+*/
+void partition_indices(struct KdTree *tree, int *indices, int num_indices,
+                       int split_axis, int partition_index,
+                       uint64_t *random_state) {
+  int left = 0;
+  int right = num_indices - 1;
+
+  while (left < right) {
+    int pivot_index = left + next_random(random_state) % (right - left + 1);
+    double pivot = get_coordinate(tree, indices[pivot_index], split_axis);
+
+    // [left, less) < pivot, [less, i) == pivot, (greater, right] > pivot
+    int less = left;
+    int greater = right;
+    int i = left;
+    while (i <= greater) {
+      double value = get_coordinate(tree, indices[i], split_axis);
+      if (value < pivot) {
+        swap(indices, less, i);
+        less++;
+        i++;
+      } else if (value > pivot) {
+        swap(indices, i, greater);
+        greater--;
+      } else {
+        i++;
+      }
+    }
+
+    if (partition_index < less) {
+      right = less - 1;
+    } else if (partition_index > greater) {
+      left = greater + 1;
+    } else {
+      break;
+    }
+  }
+}
+
+int stable_partition_indices(struct BuildContext *build, int worker_id,
+                             int *indices, int *buffer, int num_indices,
+                             int split_axis, int partition_index,
+                             uint64_t *random_state) {
+  struct KdTree *tree = build->tree;
+  int left = 0;
+  int right = num_indices;
+
+  struct BlockPass pass;
+  pass.tree = tree;
+  pass.split_axis = split_axis;
+  int max_blocks = (num_indices + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  pass.offsets = malloc(sizeof(int) * 3 * max_blocks);
+  if (pass.offsets == NULL) {
+    return 0;
+  }
+
+  while (right - left >= BLOCK_SPLIT_MIN) {
+    int count = right - left;
+    int pivot_index = left + next_random(random_state) % count;
+    pass.pivot = get_coordinate(tree, indices[pivot_index], split_axis);
+    pass.indices = indices + left;
+    pass.buffer = buffer + left;
+
+    if (!task_pool_parallel_for(build->pool, worker_id, count, BLOCK_SIZE,
+                                count_block, &pass)) {
+      free(pass.offsets);
+      return 0;
+    }
+
+    // Turn per block counts into offsets of each block's less, equal and
+    // greater runs in the buffer.
+    int num_blocks = (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int total_less = 0;
+    int total_equal = 0;
+    for (int b = 0; b < num_blocks; b++) {
+      total_less += pass.offsets[3 * b];
+      total_equal += pass.offsets[(3 * b) + 1];
+    }
+    int less = 0;
+    int equal = total_less;
+    int greater = total_less + total_equal;
+    for (int b = 0; b < num_blocks; b++) {
+      int *offsets = pass.offsets + (3 * b);
+      int block_less = offsets[0];
+      int block_equal = offsets[1];
+      int block_greater = offsets[2];
+      offsets[0] = less;
+      offsets[1] = equal;
+      offsets[2] = greater;
+      less += block_less;
+      equal += block_equal;
+      greater += block_greater;
+    }
+
+    if (!task_pool_parallel_for(build->pool, worker_id, count, BLOCK_SIZE,
+                                scatter_block, &pass)
+        || !task_pool_parallel_for(build->pool, worker_id, count, BLOCK_SIZE,
+                                   copy_back_block, &pass)) {
+      free(pass.offsets);
+      return 0;
+    }
+
+    int target = partition_index - left;
+    if (target < total_less) {
+      right = left + total_less;
+    } else if (target < total_less + total_equal) {
+      free(pass.offsets);
+      return 1;
+    } else {
+      left += total_less + total_equal;
+    }
+  }
+
+  free(pass.offsets);
+  partition_indices(tree, indices + left, right - left, split_axis,
+                    partition_index - left, random_state);
+  return 1;
+}
+
+void count_block(void *arg, int begin, int end, int worker_id) {
+  struct BlockPass *pass = arg;
+  int *counts = pass->offsets + (3 * (begin / BLOCK_SIZE));
+  counts[0] = 0;
+  counts[1] = 0;
+  counts[2] = 0;
+  for (int i = begin; i < end; i++) {
+    double value = get_coordinate(pass->tree, pass->indices[i],
+                                  pass->split_axis);
+    if (value < pass->pivot) {
+      counts[0]++;
+    } else if (value == pass->pivot) {
+      counts[1]++;
+    } else {
+      counts[2]++;
+    }
+  }
+}
+
+void scatter_block(void *arg, int begin, int end, int worker_id) {
+  struct BlockPass *pass = arg;
+  int *offsets = pass->offsets + (3 * (begin / BLOCK_SIZE));
+  int less = offsets[0];
+  int equal = offsets[1];
+  int greater = offsets[2];
+  for (int i = begin; i < end; i++) {
+    int index = pass->indices[i];
+    double value = get_coordinate(pass->tree, index, pass->split_axis);
+    if (value < pass->pivot) {
+      pass->buffer[less++] = index;
+    } else if (value == pass->pivot) {
+      pass->buffer[equal++] = index;
+    } else {
+      pass->buffer[greater++] = index;
+    }
+  }
+}
+
+void copy_back_block(void *arg, int begin, int end, int worker_id) {
+  struct BlockPass *pass = arg;
+  memcpy(pass->indices + begin, pass->buffer + begin,
+         sizeof(int) * (end - begin));
+}
+
+uint64_t seed_node(unsigned int seed, int start, int end) {
+  uint64_t state = seed;
+  state = (state * 0x9E3779B97F4A7C15ULL) + (uint64_t) start;
+  state = (state * 0x9E3779B97F4A7C15ULL) + (uint64_t) end;
+  return state;
+}
+
+uint64_t next_random(uint64_t *state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+void swap(int *indices, int a, int b) {
+  int tmp = indices[a];
+  indices[a] = indices[b];
+  indices[b] = tmp;
+}
+
+
+double kd_distance(double *a, double *b, int k, char *distance_metric) {
+  struct Metric metric;
+  if (!resolve_query_metric(best_distance_kernels(k), distance_metric, NULL,
+                            &metric)) {
+    return NAN;
+  }
+  return true_distance(&metric, metric_distance(&metric, a, b, k));
+}
+
+int resolve_query_metric(const struct DistanceKernels *kernels,
+                         char *distance_metric,
+                         struct KdQueryOptions *options,
+                         struct Metric *metric) {
+  struct KdMetric parsed;
+  struct KdMetric *kd_metric = options != NULL ? options->metric : NULL;
+  if (kd_metric == NULL) {
+    if (distance_metric == NULL || !parse_kd_metric(distance_metric, &parsed)) {
+      return 0;
+    }
+    kd_metric = &parsed;
+  }
+  return resolve_metric(kernels, kd_metric, metric);
+}
+
+int kd_tree_query_n_nearest_neighbors(struct KdTree *tree, double *input,
+                                      int n, char *distance_metric,
+                                      struct KdResult **results) {
+  return kd_tree_query_n_nearest_neighbors_with_options(
+      tree, input, n, distance_metric, NULL, results);
+}
+
+int kd_tree_query_n_nearest_neighbors_with_options(
+    struct KdTree *tree, double *input, int n, char *distance_metric,
+    struct KdQueryOptions *options, struct KdResult **results) {
+  struct Metric metric;
+  if (tree->size == 0 || n <= 0
+      || !resolve_query_metric(tree->kernels, distance_metric, options,
+                               &metric)) {
+    return 0;
+  }
+
+  // Small candidate sets live on the stack.
+  struct HeapEntry stack_entries[STACK_HEAP_CAPACITY];
+  struct HeapEntry *entries = stack_entries;
+  if (n > STACK_HEAP_CAPACITY) {
+    entries = malloc(sizeof(struct HeapEntry) * n);
+    if (entries == NULL) {
+      return 0;
+    }
+  }
+  double stack_offsets[STACK_OFFSETS_CAPACITY];
+  double *offsets = stack_offsets;
+  if (tree->k > STACK_OFFSETS_CAPACITY) {
+    offsets = malloc(sizeof(double) * tree->k);
+  }
+  float stack_point[STACK_OFFSETS_CAPACITY];
+  float *float_point = float_test_point(tree, input, stack_point);
+  if (offsets == NULL
+      || (tree->point_type == POINT_FLOAT && float_point == NULL)) {
+    if (entries != stack_entries) {
+      free(entries);
+    }
+    if (offsets != stack_offsets) {
+      free(offsets);
+    }
+    if (float_point != NULL && float_point != stack_point) {
+      free(float_point);
+    }
+    return 0;
+  }
+  struct BoundedHeap results_heap;
+  init_bounded_heap(&results_heap, entries, n);
+  struct HeapEntry queue_entries[STACK_QUEUE_CAPACITY];
+  struct MinHeap queue;
+  init_min_heap(&queue, queue_entries, STACK_QUEUE_CAPACITY);
+
+  struct NearestQuery query;
+  query.tree = tree;
+  query.test_point = input;
+  query.float_test_point = float_point;
+  query.heap = &results_heap;
+  query.metric = &metric;
+  query.offsets = offsets;
+  query.queue = NULL;
+  if (options != NULL && options->search_order == SEARCH_BEST_FIRST) {
+    query.queue = &queue;
+  }
+  query.stats = NULL;
+  if (options != NULL && options->stats != NULL) {
+    query.stats = options->stats;
+    memset(query.stats, 0, sizeof(*query.stats));
+  }
+  apply_query_options(&query, options);
+  nearest_neighbor_search(&query);
+  destroy_min_heap(&queue);
+
+  struct HeapEntry entry;
+  int num_results = query.failed ? 0 : results_heap.size;
+  *results = malloc(sizeof(struct KdResult) * num_results);
+  if (*results == NULL) {
+    num_results = 0;
+  }
+  for (int i = 0; i < num_results; i++) {
+    bounded_heap_pop(&results_heap, &entry);
+    fill_result(tree, entry.index, true_distance(&metric, entry.value),
+                *results + i);
+  }
+
+  if (entries != stack_entries) {
+    free(entries);
+  }
+  if (offsets != stack_offsets) {
+    free(offsets);
+  }
+  if (float_point != stack_point) {
+    free(float_point);
+  }
+
+  return num_results;
+}
+
+struct KdQueryContext *create_kd_query_context(void) {
+  struct KdQueryContext *context = calloc(1, sizeof(struct KdQueryContext));
+  if (context != NULL) {
+    init_min_heap(&context->queue, NULL, 0);
+  }
+  return context;
+}
+
+void free_kd_query_context(struct KdQueryContext *context) {
+  free(context->entries);
+  free(context->offsets);
+  free(context->float_point);
+  destroy_min_heap(&context->queue);
+  free(context->results);
+  free(context);
+}
+
+int reserve_query_context(struct KdQueryContext *context, struct KdTree *tree,
+                          int n) {
+  if (n > context->entries_capacity) {
+    struct HeapEntry *entries = realloc(context->entries,
+                                        sizeof(struct HeapEntry) * n);
+    if (entries == NULL) {
+      return 0;
+    }
+    context->entries = entries;
+    context->entries_capacity = n;
+  }
+  if (n > context->results_capacity) {
+    struct KdResult *results = realloc(context->results,
+                                       sizeof(struct KdResult) * n);
+    if (results == NULL) {
+      return 0;
+    }
+    context->results = results;
+    context->results_capacity = n;
+  }
+  if (tree->k > context->k_capacity) {
+    double *offsets = realloc(context->offsets, sizeof(double) * tree->k);
+    if (offsets == NULL) {
+      return 0;
+    }
+    context->offsets = offsets;
+    float *float_point = realloc(context->float_point,
+                                 sizeof(float) * tree->k);
+    if (float_point == NULL) {
+      return 0;
+    }
+    context->float_point = float_point;
+    context->k_capacity = tree->k;
+  }
+  return 1;
+}
+
+/*
+  The same search as kd_tree_query_n_nearest_neighbors_with_options(), with
+  every buffer taken from the context instead of the stack or the allocator.
+  The best-first queue keeps the memory it grew to, as the heaps do.
+*/
+int kd_tree_query_n_nearest_neighbors_in_context(
+    struct KdTree *tree, double *input, int n, char *distance_metric,
+    struct KdQueryOptions *options, struct KdQueryContext *context,
+    struct KdResult **results) {
+  struct Metric metric;
+  if (tree->size == 0 || n <= 0
+      || !resolve_query_metric(tree->kernels, distance_metric, options,
+                               &metric)
+      || !reserve_query_context(context, tree, n)) {
+    *results = context->results;
+    return 0;
+  }
+  *results = context->results;
+
+  struct BoundedHeap results_heap;
+  init_bounded_heap(&results_heap, context->entries, n);
+  struct NearestQuery query;
+  query.tree = tree;
+  query.test_point = input;
+  query.float_test_point = NULL;
+  if (tree->point_type == POINT_FLOAT) {
+    fill_float_test_point(tree, input, context->float_point);
+    query.float_test_point = context->float_point;
+  }
+  query.heap = &results_heap;
+  query.metric = &metric;
+  query.offsets = context->offsets;
+  query.queue = NULL;
+  if (options != NULL && options->search_order == SEARCH_BEST_FIRST) {
+    query.queue = &context->queue;
+  }
+  query.stats = NULL;
+  if (options != NULL && options->stats != NULL) {
+    query.stats = options->stats;
+    memset(query.stats, 0, sizeof(*query.stats));
+  }
+  apply_query_options(&query, options);
+  nearest_neighbor_search(&query);
+
+  struct HeapEntry entry;
+  int num_results = query.failed ? 0 : results_heap.size;
+  for (int i = 0; i < num_results; i++) {
+    bounded_heap_pop(&results_heap, &entry);
+    fill_result(tree, entry.index, true_distance(&metric, entry.value),
+                context->results + i);
+  }
+  return num_results;
+}
+
+int kd_tree_query_n_nearest_neighbors_batch(struct KdTree *tree,
+                                            double *test_points,
+                                            int num_queries, int n,
+                                            char *distance_metric,
+                                            int num_threads, int *indices,
+                                            double *distances) {
+  return kd_tree_query_n_nearest_neighbors_batch_with_options(
+      tree, test_points, num_queries, n, distance_metric, NULL, num_threads,
+      indices, distances);
+}
+
+int kd_tree_query_n_nearest_neighbors_batch_with_options(
+    struct KdTree *tree, double *test_points, int num_queries, int n,
+    char *distance_metric, struct KdQueryOptions *options, int num_threads,
+    int *indices, double *distances) {
+  if (n <= 0 || num_queries <= 0) {
+    return 1;
+  }
+
+  struct BatchQuery batch;
+  if (!resolve_query_metric(tree->kernels, distance_metric, options,
+                            &batch.metric)) {
+    return 0;
+  }
+  batch.tree = tree;
+  batch.test_points = test_points;
+  batch.n = n;
+  struct KdQueryOptions exact = {0};
+  batch.options = options == NULL ? exact : *options;
+  batch.indices = indices;
+  batch.distances = distances;
+  // Workers count separately and the counts are added up at the end.
+  struct KdQueryStats *stats = batch.options.stats;
+  int num_workers = num_threads > 1 ? num_threads : 1;
+  batch.worker_stats = NULL;
+  if (stats != NULL) {
+    batch.worker_stats = calloc(num_workers, sizeof(struct KdQueryStats));
+    if (batch.worker_stats == NULL) {
+      return 0;
+    }
+  }
+  if (!init_work_queue(&batch.queue, num_queries, BATCH_CHUNK_SIZE)) {
+    free(batch.worker_stats);
+    return 0;
+  }
+
+  // Workers report failures through the queue, whose lock orders them.
+  bool failed = !run_workers(num_threads, batch_query_worker, &batch)
+                || batch.queue.failed;
+  destroy_work_queue(&batch.queue);
+  if (stats != NULL) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < num_workers; i++) {
+      struct KdQueryStats *counts = batch.worker_stats + i;
+      stats->nodes_visited += counts->nodes_visited;
+      stats->leaves_scanned += counts->leaves_scanned;
+      stats->distance_evaluations += counts->distance_evaluations;
+      stats->subtrees_pruned += counts->subtrees_pruned;
+      stats->heap_operations += counts->heap_operations;
+    }
+    free(batch.worker_stats);
+  }
+  return !failed;
+}
+
+void batch_query_worker(void *context, int worker_id) {
+  struct BatchQuery *batch = context;
+  struct KdTree *tree = batch->tree;
+  int n = batch->n;
+
+  // One context per worker, reused between queries, so queries do not
+  // allocate.
+  struct KdQueryContext *scratch = create_kd_query_context();
+  if (scratch == NULL || !reserve_query_context(scratch, tree, n)) {
+    if (scratch != NULL) {
+      free_kd_query_context(scratch);
+    }
+    work_queue_fail(&batch->queue);
+    return;
+  }
+  struct BoundedHeap heap;
+  struct NearestQuery query;
+  query.tree = tree;
+  query.heap = &heap;
+  query.queue = NULL;
+  if (batch->options.search_order == SEARCH_BEST_FIRST) {
+    query.queue = &scratch->queue;
+  }
+  query.metric = &batch->metric;
+  query.float_test_point = NULL;
+  if (tree->point_type == POINT_FLOAT) {
+    query.float_test_point = scratch->float_point;
+  }
+  query.offsets = scratch->offsets;
+  query.stats = NULL;
+  if (batch->worker_stats != NULL) {
+    query.stats = batch->worker_stats + worker_id;
+  }
+
+  int start, end;
+  while (work_queue_next(&batch->queue, &start, &end)) {
+    for (int q = start; q < end; q++) {
+      double *test_point = batch->test_points + ((size_t) q * tree->k);
+      int *row_indices = batch->indices + ((size_t) q * n);
+      double *row_distances = batch->distances + ((size_t) q * n);
+
+      init_bounded_heap(&heap, scratch->entries, n);
+      if (tree->size > 0) {
+        query.test_point = test_point;
+        if (query.float_test_point != NULL) {
+          fill_float_test_point(tree, test_point, query.float_test_point);
+        }
+        apply_query_options(&query, &batch->options);
+        nearest_neighbor_search(&query);
+        if (query.failed) {
+          work_queue_fail(&batch->queue);
+        }
+      }
+
+      fill_batch_row(&heap, tree->indices, &batch->metric, n, row_indices,
+                     row_distances);
+    }
+  }
+
+  free_kd_query_context(scratch);
+}
+
+/*
+  Every point keeps its own heap of candidates for the whole join, and every
+  node the largest distance its points still accept. Workers own disjoint
+  subtrees of query points, so they never write to the same heap or bound,
+  and each of them walks the whole tree as reference.
+*/
+int kd_tree_all_knn(struct KdTree *tree, int n, char *distance_metric,
+                    int num_threads, int *indices, double *distances) {
+  if (n <= 0 || tree->size == 0) {
+    return 1;
+  }
+  struct AllNearest join;
+  if (!resolve_query_metric(tree->kernels, distance_metric, NULL,
+                            &join.metric)) {
+    return 0;
+  }
+  join.tree = tree;
+  struct HeapEntry *entries = malloc(sizeof(struct HeapEntry) * tree->size
+                                     * n);
+  join.heaps = malloc(sizeof(struct BoundedHeap) * tree->size);
+  join.node_bounds = malloc(sizeof(double) * tree->num_nodes);
+  join.subtrees = malloc(sizeof(int) * tree->num_nodes);
+  bool failed = entries == NULL || join.heaps == NULL
+                || join.node_bounds == NULL || join.subtrees == NULL;
+  int num_subtrees = 0;
+  if (!failed) {
+    for (int i = 0; i < tree->size; i++) {
+      init_bounded_heap(join.heaps + i, entries + ((size_t) i * n), n);
+    }
+    for (int i = 0; i < tree->num_nodes; i++) {
+      join.node_bounds[i] = INFINITY;
+    }
+    int workers = num_threads > 1 ? num_threads : 1;
+    int max_points = tree->size / (workers * ALL_KNN_SUBTREES_PER_THREAD);
+    num_subtrees = collect_subtrees(tree, tree->root, max_points,
+                                    join.subtrees, 0);
+    failed = !init_work_queue(&join.queue, num_subtrees, 1);
+  }
+  if (!failed) {
+    failed = !run_workers(num_threads, all_knn_worker, &join);
+    destroy_work_queue(&join.queue);
+  }
+
+  for (int position = 0; position < tree->size && !failed; position++) {
+    struct BoundedHeap *heap = join.heaps + position;
+    int *row_indices = indices + ((size_t) tree->indices[position] * n);
+    double *row_distances = distances
+                            + ((size_t) tree->indices[position] * n);
+    for (int i = heap->size; i < n; i++) {
+      row_indices[i] = -1;
+      row_distances[i] = INFINITY;
+    }
+    struct HeapEntry entry;
+    for (int i = heap->size - 1; i >= 0; i--) {
+      bounded_heap_pop(heap, &entry);
+      row_indices[i] = tree->indices[entry.index];
+      row_distances[i] = true_distance(&join.metric, entry.value);
+    }
+  }
+  free(entries);
+  free(join.heaps);
+  free(join.node_bounds);
+  free(join.subtrees);
+  return !failed;
+}
+
+void all_knn_worker(void *context, int worker_id) {
+  struct AllNearest *join = context;
+  int start, end;
+  while (work_queue_next(&join->queue, &start, &end)) {
+    for (int i = start; i < end; i++) {
+      dual_tree_search(join, join->subtrees[i], 0);
+    }
+  }
+}
+
+int collect_subtrees(struct KdTree *tree, struct KdNode *node, int max_points,
+                     int *subtrees, int count) {
+  if (node->is_leaf || node->end - node->start <= max_points) {
+    subtrees[count] = node - tree->nodes;
+    return count + 1;
+  }
+  count = collect_subtrees(tree, tree->nodes + node->low, max_points,
+                           subtrees, count);
+  return collect_subtrees(tree, tree->nodes + node->high, max_points,
+                          subtrees, count);
+}
+
+/*
+  A query node's bound is the largest of its children's once they have been
+  searched, so it tightens as soon as every point below has n close enough
+  candidates. The nearer reference child goes first, which tightens the
+  bound before the further one is tested against it.
+*/
+void dual_tree_search(struct AllNearest *join, int query, int reference) {
+  struct KdTree *tree = join->tree;
+  int k = tree->k;
+  struct KdNode *query_node = tree->nodes + query;
+  struct KdNode *reference_node = tree->nodes + reference;
+  double distance = box_pair_distance(&join->metric,
+                                      kd_node_bounds(tree, query_node),
+                                      kd_node_bounds(tree, reference_node),
+                                      k);
+  if (distance > join->node_bounds[query]) {
+    return;
+  }
+
+  if (query_node->is_leaf && reference_node->is_leaf) {
+    dual_tree_leaves(join, query_node, reference_node);
+    double bound = 0;
+    for (int i = query_node->start; i < query_node->end; i++) {
+      struct BoundedHeap *heap = join->heaps + i;
+      double accepted = heap->size < heap->capacity
+                        ? INFINITY : heap->entries[0].value;
+      bound = accepted > bound ? accepted : bound;
+    }
+    join->node_bounds[query] = bound;
+    return;
+  }
+
+  if (query_node->is_leaf) {
+    int near = reference_node->low;
+    int far = reference_node->high;
+    double *query_bounds = kd_node_bounds(tree, query_node);
+    if (box_pair_distance(&join->metric, query_bounds,
+                          kd_node_bounds(tree, tree->nodes + far), k)
+        < box_pair_distance(&join->metric, query_bounds,
+                            kd_node_bounds(tree, tree->nodes + near), k)) {
+      near = reference_node->high;
+      far = reference_node->low;
+    }
+    dual_tree_search(join, query, near);
+    dual_tree_search(join, query, far);
+    return;
+  }
+
+  int children[] = {query_node->low, query_node->high};
+  for (int c = 0; c < 2; c++) {
+    if (reference_node->is_leaf) {
+      dual_tree_search(join, children[c], reference);
+      continue;
+    }
+    int near = reference_node->low;
+    int far = reference_node->high;
+    double *child_bounds = kd_node_bounds(tree, tree->nodes + children[c]);
+    if (box_pair_distance(&join->metric, child_bounds,
+                          kd_node_bounds(tree, tree->nodes + far), k)
+        < box_pair_distance(&join->metric, child_bounds,
+                            kd_node_bounds(tree, tree->nodes + near), k)) {
+      near = reference_node->high;
+      far = reference_node->low;
+    }
+    dual_tree_search(join, children[c], near);
+    dual_tree_search(join, children[c], far);
+  }
+  double low_bound = join->node_bounds[query_node->low];
+  double high_bound = join->node_bounds[query_node->high];
+  join->node_bounds[query] = low_bound > high_bound ? low_bound : high_bound;
+}
+
+void dual_tree_leaves(struct AllNearest *join, struct KdNode *query,
+                      struct KdNode *reference) {
+  struct KdTree *tree = join->tree;
+  for (int i = query->start; i < query->end; i++) {
+    struct BoundedHeap *heap = join->heaps + i;
+    for (int j = reference->start; j < reference->end; j++) {
+      if (j != i) {
+        offer_neighbor(heap, j, position_distance(tree, &join->metric, i, j));
+      }
+    }
+  }
+}
+
+double box_pair_distance(struct Metric *metric, double *bounds_a,
+                         double *bounds_b, int k) {
+  double distance = 0;
+  for (int j = 0; j < k; j++) {
+    double gap = bounds_a[j] - bounds_b[k + j];
+    double other_gap = bounds_b[j] - bounds_a[k + j];
+    gap = other_gap > gap ? other_gap : gap;
+    if (gap > 0) {
+      distance = add_axis_distance(metric, distance, gap);
+    }
+  }
+  return distance;
+}
+
+double position_distance(struct KdTree *tree, struct Metric *metric, int a,
+                         int b) {
+  if (tree->point_type == POINT_FLOAT) {
+    return metric_float_distance(metric, kd_tree_float_point(tree, a),
+                                 kd_tree_float_point(tree, b), tree->k);
+  }
+  return metric_distance(metric, kd_tree_point(tree, a),
+                         kd_tree_point(tree, b), tree->k);
+}
+
+void fill_result(struct KdTree *tree, int position, double distance,
+                 struct KdResult *result) {
+  result->point = kd_tree_point(tree, position);
+  result->float_point = kd_tree_float_point(tree, position);
+  result->index = tree->indices[position];
+  result->distance = distance;
+}
+
+/*
+  Shrinking the pruning radius by 1 + epsilon scales reduced distances by
+  the reduced distance of an offset of 1 + epsilon, e.g. its square for
+  euclidean distances.
+*/
+void apply_query_options(struct NearestQuery *query,
+                         struct KdQueryOptions *options) {
+  query->prune_factor = 1;
+  query->leaves_left = INT_MAX;
+  if (options == NULL) {
+    return;
+  }
+  if (options->epsilon > 0) {
+    query->prune_factor = 1 / axis_distance(query->metric,
+                                            1 + options->epsilon);
+  }
+  if (options->max_leaves > 0) {
+    query->leaves_left = options->max_leaves;
+  }
+}
+
+void nearest_neighbor_search(struct NearestQuery *query) {
+  query->failed = false;
+  if (query->queue != NULL) {
+    best_first_search(query);
+    return;
+  }
+  int k = query->tree->k;
+  double *minimums = kd_node_bounds(query->tree, query->tree->root);
+  double *maximums = minimums + k;
+  double cell_distance = 0;
+  for (int j = 0; j < k; j++) {
+    double value = query->test_point[j];
+    double offset = 0;
+    if (value < minimums[j]) {
+      offset = minimums[j] - value;
+    } else if (value > maximums[j]) {
+      offset = value - maximums[j];
+    }
+    query->offsets[j] = offset;
+    cell_distance = add_axis_distance(query->metric, cell_distance, offset);
+  }
+  recursive_nearest_neighbor_descent(query, query->tree->root, cell_distance);
+}
+
+/*
+  Descends down the tree recursively, selecting regions that contain the
+  test point first. The far side of a split is only checked if its cell could
+  hold a closer point. Its distance follows incrementally from the current
+  cell's by swapping in the offset to the splitting plane along the split axis
+  (Arya and Mount), and subtrees that pass are checked again against their
+  bounding box, which is usually much tighter than the cell.
+*/
+void recursive_nearest_neighbor_descent(struct NearestQuery *query,
+                                        struct KdNode *node,
+                                        double cell_distance) {
+  struct KdTree *tree = query->tree;
+  struct BoundedHeap *result_heap = query->heap;
+  double *test_point = query->test_point;
+  if (query->leaves_left == 0) {
+    return;
+  }
+  if (query->stats != NULL) {
+    query->stats->nodes_visited++;
+  }
+
+  if (node->is_leaf) {
+    // The nearest cell rarely has its points out of reach, but other leaves
+    // often do.
+    if (result_heap->size == result_heap->capacity) {
+      double max_distance = result_heap->entries[0].value
+                            * query->prune_factor;
+      if (node_box_distance(query, node, max_distance) > max_distance) {
+        if (query->stats != NULL) {
+          query->stats->subtrees_pruned++;
+        }
+        return;
+      }
+    }
+    query->leaves_left--;
+    scan_leaf(query, node);
+    return;
+  }
+
+  // descend on the same side as the test point
+  int axis = node->split_axis;
+  double split_offset = test_point[axis] - node->split_value;
+  struct KdNode *near = tree->nodes + node->high;
+  struct KdNode *far = tree->nodes + node->low;
+  if (split_offset < 0) {
+    near = tree->nodes + node->low;
+    far = tree->nodes + node->high;
+  }
+  recursive_nearest_neighbor_descent(query, near, cell_distance);
 
-/*
-  Determine the axis of greatest spread from among the points in the set of
-  indices.
-*/
-int get_splitting_axis(double *points, int *indices, int num_indices, int k);
+  // Decide if the other side of the splitting plane is a possibility. It
+  // always is while fewer than `n` points have been found.
+  double old_offset = query->offsets[axis];
+  double far_distance = replace_axis_distance(query->metric, cell_distance,
+                                              old_offset, split_offset);
+  if (result_heap->size == result_heap->capacity) {
+    double max_distance = result_heap->entries[0].value * query->prune_factor;
+    if (far_distance > max_distance
+        || (!far->is_leaf
+            && node_box_distance(query, far, max_distance) > max_distance)) {
+      if (query->stats != NULL) {
+        query->stats->subtrees_pruned++;
+      }
+      return;
+    }
+  }
+  query->offsets[axis] = fabs(split_offset);
+  recursive_nearest_neighbor_descent(query, far, far_distance);
+  query->offsets[axis] = old_offset;
+}
 
 /*
-  Partition the indices array in-place based on values from the points array
-  into smaller values on the split_axis below the partition_index and greater
-  values above.
+  From each node popped the search walks down to a leaf through the closer
+  child, queueing the farther one, so only nodes off the walk go through the
+  queue. A child's bounding box is inside its parent's, so the first node
+  popped out of reach ends the search.
 */
-void partition_indices(double *points, int *indices, int num_indices, int k,
-                       int split_axis, int partition_index);
+void best_first_search(struct NearestQuery *query) {
+  struct KdTree *tree = query->tree;
+  struct BoundedHeap *result_heap = query->heap;
+  struct MinHeap *queue = query->queue;
+  struct KdQueryStats *stats = query->stats;
+  min_heap_clear(queue);
+  if (!min_heap_push(queue, 0, node_box_distance(query, tree->root,
+                                                 INFINITY))) {
+    query->failed = true;
+    return;
+  }
+  if (stats != NULL) {
+    stats->heap_operations++;
+  }
 
-/* Utility function for swapping elements of the index array. */
-void swap(int *indices, int a, int b);
+  struct HeapEntry entry;
+  while (query->leaves_left > 0 && min_heap_pop(queue, &entry)) {
+    double max_distance = INFINITY;
+    if (result_heap->size == result_heap->capacity) {
+      max_distance = result_heap->entries[0].value * query->prune_factor;
+    }
+    struct KdNode *node = tree->nodes + entry.index;
+    double distance = entry.value;
+    if (stats != NULL) {
+      stats->heap_operations++;
+    }
+    if (distance > max_distance) {
+      // Every node left in the queue is further still.
+      if (stats != NULL) {
+        stats->subtrees_pruned += 1 + queue->size;
+      }
+      break;
+    }
+    while (!node->is_leaf) {
+      if (stats != NULL) {
+        stats->nodes_visited++;
+      }
+      int low = node->low;
+      int high = node->high;
+      double low_distance = node_box_distance(query, tree->nodes + low,
+                                              max_distance);
+      double high_distance = node_box_distance(query, tree->nodes + high,
+                                               max_distance);
+      if (high_distance < low_distance) {
+        int swap = low;
+        low = high;
+        high = swap;
+        double swap_distance = low_distance;
+        low_distance = high_distance;
+        high_distance = swap_distance;
+      }
+      if (high_distance <= max_distance
+          && !min_heap_push(queue, high, high_distance)) {
+        query->failed = true;
+        return;
+      }
+      node = tree->nodes + low;
+      distance = low_distance;
+      if (stats != NULL) {
+        stats->heap_operations += high_distance <= max_distance;
+        stats->subtrees_pruned += (high_distance > max_distance)
+                                  + (distance > max_distance);
+      }
+      if (distance > max_distance) {
+        break;
+      }
+    }
+    if (node->is_leaf && distance <= max_distance) {
+      if (stats != NULL) {
+        stats->nodes_visited++;
+      }
+      query->leaves_left--;
+      scan_leaf(query, node);
+    }
+  }
+}
 
 /*
-  Ridiculous function pointer syntax. get_comparison_function parses
-  distance_metric and returns a pointer to a function with a signature like so:
-
-  double fxn(double *a, double *b, int k) -- a.k.a a distance function
+  Counting additions and skips in locals leaves the loops as they are when
+  the query keeps no stats.
 */
-double (*get_distance_function(char *distance_metric))(double *a, double *b,
-                                                       int k);
+void scan_leaf(struct NearestQuery *query, struct KdNode *node) {
+  struct KdTree *tree = query->tree;
+  struct BoundedHeap *result_heap = query->heap;
+  int num_added = 0;
+  int num_skipped = 0;
+  if (tree->point_type == POINT_FLOAT) {
+    for (int i = node->start; i < node->end; i++) {
+      float *point = kd_tree_float_point(tree, i);
+      num_added += offer_neighbor(
+          result_heap, i,
+          metric_float_distance(query->metric, point,
+                                query->float_test_point, tree->k));
+    }
+  } else {
+    for (int i = node->start; i < node->end; i++) {
+      // Only points whose codes leave them in reach are re-ranked by their
+      // exact distance.
+      if (tree->codes != NULL
+          && result_heap->size == result_heap->capacity
+          && quantized_distance(query, node, i)
+             > result_heap->entries[0].value) {
+        num_skipped++;
+        continue;
+      }
+      double *point = kd_tree_point(tree, i);
+      num_added += offer_neighbor(
+          result_heap, i,
+          metric_distance(query->metric, point, query->test_point, tree->k));
+    }
+  }
+  if (query->stats != NULL) {
+    query->stats->leaves_scanned++;
+    query->stats->distance_evaluations += node->end - node->start
+                                          - num_skipped;
+    query->stats->heap_operations += num_added;
+  }
+}
 
-/*
-  Recursively descend down the kd-tree, pushing points onto the result_heap
-  if less than `n` are currently recorded or their distance is less than the
-  current maximum.
-*/
-void recursive_nearest_neighbor_descent(struct KdTree *tree,
-                                        struct KdNode *node, double *input,
-                                        int n, struct MaxHeap *result_heap,
-                                        double (*distance_function)(double *a,
-                                                                    double *b,
-                                                                    int k));
+int offer_neighbor(struct BoundedHeap *heap, int position, double distance) {
+  if (heap->size < heap->capacity) {
+    bounded_heap_push(heap, position, distance);
+    return 1;
+  }
+  if (distance < heap->entries[0].value) {
+    bounded_heap_replace_top(heap, position, distance);
+    return 1;
+  }
+  return 0;
+}
 
 /*
-  Recursively descend down the kd-tree, pushing points onto the result_heap if
-  they lie within the `radii` around the `test_point`.
+  Branch free, since whether a point is below or above its cell along each
+  axis is anyone's guess, which costs more than the early exit saves.
 */
-void recursive_query_range_descent(struct KdTree *tree, struct KdNode *node,
-                                   double *test_point, double *radii,
-                                   struct MaxHeap *result_heap,
-                                   double (distance_function)(double *a,
-                                                              double *b,
-                                                              int k));
+double quantized_distance(struct NearestQuery *query, struct KdNode *node,
+                          int position) {
+  struct KdTree *tree = query->tree;
+  int k = tree->k;
+  double *minimums = kd_node_bounds(tree, node);
+  double *steps = tree->steps + ((size_t) (node - tree->nodes) * k);
+  double *test_point = query->test_point;
+  uint8_t *bytes = (uint8_t *) tree->codes + ((size_t) position * k);
+  uint16_t *words = (uint16_t *) tree->codes + ((size_t) position * k);
+  bool int8 = tree->quantization == QUANTIZE_INT8;
+  double distance = 0;
+  for (int j = 0; j < k; j++) {
+    int code = int8 ? bytes[j] : words[j];
+    double low = minimums[j] + code * steps[j];
+    double high = minimums[j] + (code + 1) * steps[j];
+    double below = low - test_point[j];
+    double above = test_point[j] - high;
+    double offset = below > above ? below : above;
+    offset = offset > 0 ? offset : 0;
+    distance = add_axis_distance(query->metric, distance, offset);
+  }
+  return distance;
+}
 
-/* Minkowski distance where p = 1, a.k.a. Manhattan distance. */
-double minkowski_1(double *a, double *b, int k);
+double node_box_distance(struct NearestQuery *query, struct KdNode *node,
+                         double limit) {
+  int k = query->tree->k;
+  double *minimums = kd_node_bounds(query->tree, node);
+  double *maximums = minimums + k;
+  double distance = 0;
+  for (int j = 0; j < k && distance <= limit; j++) {
+    double value = query->test_point[j];
+    if (value < minimums[j]) {
+      distance = add_axis_distance(query->metric, distance,
+                                   minimums[j] - value);
+    } else if (value > maximums[j]) {
+      distance = add_axis_distance(query->metric, distance,
+                                   value - maximums[j]);
+    }
+  }
+  return distance;
+}
 
-/*
-  Squared Minkowski distance where p = 2, a.k.a. Squared Euclidean distance.
-  Useful because it avoids a root operation.
- */
-double squared_minkowski_2(double *a, double *b, int k);
+int kd_tree_query_range(struct KdTree *tree, double *test_point, double *radii,
+                        char *distance_metric, struct KdResult **results) {
+  struct KdMetric metric;
+  if (distance_metric != NULL && !parse_kd_metric(distance_metric, &metric)) {
+    *results = NULL;
+    return 0;
+  }
+  struct ResultCollector collector = {tree, NULL, 0, 0, false};
+  int num_results = query_range_positions(
+      tree, test_point, radii, distance_metric == NULL ? NULL : &metric,
+      collect_result, &collector);
+  if (collector.failed || num_results == -1) {
+    free(collector.results);
+    *results = NULL;
+    return 0;
+  }
 
+  // Furthest first, as n nearest neighbor results are. Empty results have
+  // no array to sort.
+  if (num_results > 1) {
+    qsort(collector.results, num_results, sizeof(struct KdResult),
+          compare_results_descending);
+  }
+  *results = collector.results;
+  return num_results;
+}
 
-struct KdTree *create_kd_tree(int k) {
-  struct KdTree *tree = malloc(sizeof(struct KdTree));
-  if (tree == NULL) {
-    return NULL;
+int kd_tree_query_range_visit(struct KdTree *tree, double *test_point,
+                              double *radii, char *distance_metric,
+                              int (*visit)(void *context, int index,
+                                           double *point, double distance),
+                              void *context) {
+  struct KdMetric metric;
+  if (distance_metric != NULL && !parse_kd_metric(distance_metric, &metric)) {
+    return -1;
   }
-  tree->k = k;
-  tree->root = NULL;
-  tree->copied = false;
-  tree->data = NULL;
-  tree->size = 0;
-  return tree;
+  return kd_tree_query_range_visit_with_metric(
+      tree, test_point, radii, distance_metric == NULL ? NULL : &metric,
+      visit, context);
 }
 
-struct KdTree *build_kd_tree(double *input_points, int num_points, int k,
-                             int leaf_size, bool copy_data) {
-  struct KdTree *tree = create_kd_tree(k);
-  if (tree == NULL || num_points == 0) {
-    return NULL;
+int kd_tree_query_range_visit_with_metric(
+    struct KdTree *tree, double *test_point, double *radii,
+    struct KdMetric *metric,
+    int (*visit)(void *context, int index, double *point, double distance),
+    void *context) {
+  struct RangeVisitor visitor = {tree, visit, context};
+  return query_range_positions(tree, test_point, radii, metric, visit_hit,
+                               &visitor);
+}
+
+int query_range_positions(struct KdTree *tree, double *test_point,
+                          double *radii, struct KdMetric *kd_metric,
+                          int (*visit)(void *context, int position,
+                                       double distance),
+                          void *context) {
+  if (tree->size == 0) {
+    return 0;
   }
 
-  if (copy_data) {
-    double *points = malloc(sizeof(double) * num_points * k);
-    if (points == NULL) {
-      return NULL;
+  struct RangeQuery query;
+  query.test_point = test_point;
+  query.float_test_point = NULL;
+  query.radii = radii;
+  query.metric = NULL;
+  query.visit = visit;
+  query.context = context;
+  query.num_visited = 0;
+
+  struct Metric metric;
+  float stack_point[STACK_OFFSETS_CAPACITY];
+  if (kd_metric != NULL) {
+    if (!resolve_metric(tree->kernels, kd_metric, &metric)) {
+      return -1;
+    }
+    query.metric = &metric;
+    query.float_test_point = float_test_point(tree, test_point, stack_point);
+    if (tree->point_type == POINT_FLOAT && query.float_test_point == NULL) {
+      return -1;
     }
-    memcpy(points, points, sizeof(double) * num_points * k);
-    tree->copied = true;
-    tree->data = points;
-  } else {
-    tree->copied = false;
-    tree->data = input_points;
   }
-  tree->size = num_points;
-
-  int *indices = malloc(sizeof(int) * num_points);
-  if (indices == NULL) {
-    return NULL;
+  recursive_query_range_descent(tree, tree->root, &query);
+  if (query.float_test_point != stack_point) {
+    free(query.float_test_point);
   }
-  for (int i = 0; i < num_points; i++) indices[i] = i;
+  return query.num_visited;
+}
 
-  if (num_points <= leaf_size) {
-    struct KdNode *node = malloc(sizeof(struct KdNode));
-    if (node == NULL) {
-      return NULL;
-    }
-    node->is_leaf = true;
-    node->indices = indices;
-    node->num_indices = num_points;
-    node->low = NULL;
-    node->high = NULL;
+void init_kd_range_buffer(struct KdRangeBuffer *buffer) {
+  buffer->indices = NULL;
+  buffer->distances = NULL;
+  buffer->size = 0;
+  buffer->capacity = 0;
+}
 
-    tree->root = node;
-    return tree;
+void free_kd_range_buffer(struct KdRangeBuffer *buffer) {
+  free(buffer->indices);
+  free(buffer->distances);
+  init_kd_range_buffer(buffer);
+}
+
+int kd_tree_query_range_into(struct KdTree *tree, double *test_point,
+                             double *radii, char *distance_metric,
+                             struct KdRangeBuffer *buffer) {
+  struct KdMetric metric;
+  if (distance_metric != NULL && !parse_kd_metric(distance_metric, &metric)) {
+    return -1;
   }
+  return kd_tree_query_range_into_with_metric(
+      tree, test_point, radii, distance_metric == NULL ? NULL : &metric,
+      buffer);
+}
 
-  tree->root = recursive_select_median(tree->data, indices, num_points, k,
-                                       leaf_size);
-  return tree;
+int kd_tree_query_range_into_with_metric(struct KdTree *tree,
+                                         double *test_point, double *radii,
+                                         struct KdMetric *metric,
+                                         struct KdRangeBuffer *buffer) {
+  struct BufferAppender appender = {tree, buffer, metric != NULL, false};
+  int num_found = query_range_positions(tree, test_point, radii, metric,
+                                        append_to_buffer, &appender);
+  return appender.failed || num_found == -1 ? -1 : num_found;
 }
 
-void free_kd_tree(struct KdTree *tree) {
-  if (tree->root != NULL) {
-    recursive_free_kd_node(tree->root);
+int kd_tree_query_range_count(struct KdTree *tree, double *test_point,
+                              double *radii) {
+  if (tree->size == 0) {
+    return 0;
   }
+  return recursive_query_range_count(tree, tree->root, test_point, radii);
+}
 
-  if (tree->copied) {
-    free(tree->data);
+long long kd_tree_join_range(struct KdTree *tree_a, struct KdTree *tree_b,
+                             double *radii,
+                             int (*visit)(void *context, int index_a,
+                                          int index_b),
+                             void *context) {
+  if (tree_a->k != tree_b->k) {
+    return -1;
   }
-  free(tree);
+  if (tree_a->size == 0 || tree_b->size == 0) {
+    return 0;
+  }
+  struct RangeJoin join = {tree_a, tree_b, radii, visit, context, 0};
+  recursive_join_range(&join, tree_a->root, tree_b->root);
+  return join.num_visited;
 }
 
-void recursive_free_kd_node(struct KdNode *node) {
-  // node guaranteed not null
-  if (node->low != NULL) {
-    recursive_free_kd_node(node->low);
+long long kd_tree_join_range_count(struct KdTree *tree_a,
+                                   struct KdTree *tree_b, double *radii) {
+  if (tree_a->k != tree_b->k) {
+    return -1;
   }
-  if (node->high != NULL) {
-    recursive_free_kd_node(node->high);
+  if (tree_a->size == 0 || tree_b->size == 0) {
+    return 0;
   }
-  free(node->indices);
-  free(node);
+  return recursive_join_range_count(tree_a, tree_a->root, tree_b,
+                                    tree_b->root, radii);
 }
 
-struct KdNode *recursive_select_median(double *points, int *indices,
-                                       int num_indices, int k, int leaf_size) {
-  int *indices_copy = malloc(sizeof(int) * num_indices);
-  for (int i = 0; i < num_indices; i++) {
-    indices_copy[i] = indices[i];
+/*
+  The larger of the two nodes is split, so that both sides shrink at the same
+  pace and boxes stay comparable in size.
+*/
+int recursive_join_range(struct RangeJoin *join, struct KdNode *node_a,
+                         struct KdNode *node_b) {
+  struct KdTree *tree_a = join->tree_a;
+  struct KdTree *tree_b = join->tree_b;
+  int overlap = node_pair_in_range(tree_a, node_a, tree_b, node_b,
+                                   join->radii);
+  if (overlap == 0) {
+    return 1;
   }
 
-  // bail if we have less than leaf number of points
-  if (num_indices <= leaf_size) {
-    struct KdNode *node = malloc(sizeof(struct KdNode));
-    if (node == NULL) {
-      return NULL;
+  if (overlap == 1 || (node_a->is_leaf && node_b->is_leaf)) {
+    for (int i = node_a->start; i < node_a->end; i++) {
+      if (overlap == -1
+          && !point_near_box(tree_a, i, tree_b, node_b, join->radii)) {
+        continue;
+      }
+      for (int j = node_b->start; j < node_b->end; j++) {
+        if (overlap == -1
+            && !pair_in_range(tree_a, i, tree_b, j, join->radii)) {
+          continue;
+        }
+        join->num_visited++;
+        if (!join->visit(join->context, tree_a->indices[i],
+                         tree_b->indices[j])) {
+          return 0;
+        }
+      }
     }
-    node->is_leaf = true;
-    node->indices = indices_copy;
-    node->num_indices = num_indices;
-    node->low = NULL;
-    node->high = NULL;
-    return node;
+    return 1;
   }
 
-  int splitting_axis = get_splitting_axis(points, indices, num_indices, k);
-  if (splitting_axis == -1) {
-    return NULL;
+  if (node_b->is_leaf
+      || (!node_a->is_leaf
+          && node_a->end - node_a->start >= node_b->end - node_b->start)) {
+    return recursive_join_range(join, tree_a->nodes + node_a->low, node_b)
+           && recursive_join_range(join, tree_a->nodes + node_a->high,
+                                   node_b);
   }
+  return recursive_join_range(join, node_a, tree_b->nodes + node_b->low)
+         && recursive_join_range(join, node_a, tree_b->nodes + node_b->high);
+}
 
-  int median_index = num_indices / 2;
-  partition_indices(points, indices, num_indices, k, splitting_axis,
-                    median_index);
-
-  struct KdNode *node = malloc(sizeof(struct KdNode));
-  if (node == NULL) {
-    return NULL;
+long long recursive_join_range_count(struct KdTree *tree_a,
+                                     struct KdNode *node_a,
+                                     struct KdTree *tree_b,
+                                     struct KdNode *node_b, double *radii) {
+  int overlap = node_pair_in_range(tree_a, node_a, tree_b, node_b, radii);
+  if (overlap != -1) {
+    return overlap * (long long) (node_a->end - node_a->start)
+           * (node_b->end - node_b->start);
   }
-  node->is_leaf = false;
-  node->indices = indices_copy;
-  node->num_indices = num_indices;
-  node->split_axis = splitting_axis;
-  node->split_value = points[(indices[median_index] * k) + splitting_axis];
 
-  // Continue on, selecting medians among the two sets of points partitioned
-  // about the median
-  node->low = recursive_select_median(points, indices, median_index, k,
-                                      leaf_size);
-  node->high = recursive_select_median(points, indices + median_index,
-                                       num_indices - median_index, k,
-                                       leaf_size);
+  if (node_a->is_leaf && node_b->is_leaf) {
+    long long count = 0;
+    for (int i = node_a->start; i < node_a->end; i++) {
+      if (!point_near_box(tree_a, i, tree_b, node_b, radii)) {
+        continue;
+      }
+      for (int j = node_b->start; j < node_b->end; j++) {
+        count += pair_in_range(tree_a, i, tree_b, j, radii);
+      }
+    }
+    return count;
+  }
 
-  return node;
+  if (node_b->is_leaf
+      || (!node_a->is_leaf
+          && node_a->end - node_a->start >= node_b->end - node_b->start)) {
+    return recursive_join_range_count(tree_a, tree_a->nodes + node_a->low,
+                                      tree_b, node_b, radii)
+           + recursive_join_range_count(tree_a, tree_a->nodes + node_a->high,
+                                        tree_b, node_b, radii);
+  }
+  return recursive_join_range_count(tree_a, node_a, tree_b,
+                                    tree_b->nodes + node_b->low, radii)
+         + recursive_join_range_count(tree_a, node_a, tree_b,
+                                      tree_b->nodes + node_b->high, radii);
 }
 
-
 /*
-  Track the minimum and maximum of each dimension in one traversal of the
-  points, Then determine the largest spread among the dimensions by difference.
+  Differences between points grow monotonically with the gap between them,
+  so the furthest and nearest corners of the boxes decide the test exactly
+  as pair_in_range() would for the points there. Empty leaves have inverted
+  infinite boxes and never pair up.
 */
-int get_splitting_axis(double *points, int *indices, int num_indices, int k) {
-  int *minimums = malloc(sizeof(int) * k);
-  int *maximums = malloc(sizeof(int) * k);
-
-  if ((minimums == NULL) | (maximums == NULL)) {
-    return -1;
-  }
-
-  // use the first point to pre-populate
-  for (int i = 0; i < k; i++) {
-    minimums[i] = points[(indices[0] * k) + i];
-    maximums[i] = points[(indices[0] * k) + i];
-  }
-
-  for (int i = 1; i < num_indices; i++) {
-    for (int j = 0; j < k; j++) {
-      double value = points[(indices[i] * k) + j];
-      if (value < minimums[j]) {
-        minimums[j] = value;
-      } else if (value > maximums[j]) {
-        maximums[j] = value;
-      }
+int node_pair_in_range(struct KdTree *tree_a, struct KdNode *node_a,
+                       struct KdTree *tree_b, struct KdNode *node_b,
+                       double *radii) {
+  int k = tree_a->k;
+  double *bounds_a = kd_node_bounds(tree_a, node_a);
+  double *bounds_b = kd_node_bounds(tree_b, node_b);
+  int inside = 1;
+  for (int j = 0; j < k; j++) {
+    if (bounds_a[j] - bounds_b[k + j] > radii[j]
+        || bounds_b[j] - bounds_a[k + j] > radii[j]) {
+      return 0;
+    }
+    if (bounds_a[k + j] - bounds_b[j] > radii[j]
+        || bounds_b[k + j] - bounds_a[j] > radii[j]) {
+      inside = -1;
     }
   }
+  return inside;
+}
 
-  double max_spread = 0;
-  int split_axis = -1;
-  for (int i = 0; i < k; i++) {
-    double spread = maximums[i] - minimums[i];
-    if (spread > max_spread) {
-      max_spread = spread;
-      split_axis = i;
+bool point_near_box(struct KdTree *tree_a, int position_a,
+                    struct KdTree *tree_b, struct KdNode *node_b,
+                    double *radii) {
+  int k = tree_a->k;
+  double *bounds = kd_node_bounds(tree_b, node_b);
+  for (int j = 0; j < k; j++) {
+    double coordinate = position_coordinate(tree_a, position_a, j);
+    if (coordinate - bounds[k + j] > radii[j]
+        || bounds[j] - coordinate > radii[j]) {
+      return false;
     }
   }
-
-  free(minimums);
-  free(maximums);
-  return split_axis;
+  return true;
 }
 
-void partition_indices(double *points, int *indices, int num_indices, int k,
-                       int split_axis, int partition_index) {
-  int left = 0;
-  int right = num_indices - 1;
-
-  int middle;
-  while (true) {
-    middle = left;
-    for (int i = left; i < right; i++) {
-      double val1 = points[indices[i] * k + split_axis];
-      double val2 = points[indices[right] * k + split_axis];
-      if (val1 < val2) {
-        swap(indices, i, middle);
-        middle++;
+bool pair_in_range(struct KdTree *tree_a, int position_a,
+                   struct KdTree *tree_b, int position_b, double *radii) {
+  if (tree_a->point_type == POINT_DOUBLE
+      && tree_b->point_type == POINT_DOUBLE) {
+    double *point_a = kd_tree_point(tree_a, position_a);
+    double *point_b = kd_tree_point(tree_b, position_b);
+    for (int j = 0; j < tree_a->k; j++) {
+      if (fabs(point_a[j] - point_b[j]) > radii[j]) {
+        return false;
       }
     }
-    swap(indices, middle, right);
-    if (middle == partition_index) {
-      break;
-    } else if (middle < partition_index) {
-      left = middle + 1;
-    } else {
-      right = middle - 1;
+    return true;
+  }
+  for (int j = 0; j < tree_a->k; j++) {
+    if (fabs(position_coordinate(tree_a, position_a, j)
+             - position_coordinate(tree_b, position_b, j)) > radii[j]) {
+      return false;
     }
   }
+  return true;
 }
 
-void swap(int *indices, int a, int b) {
-  int tmp = indices[a];
-  indices[a] = indices[b];
-  indices[b] = tmp;
+double position_coordinate(struct KdTree *tree, int position, int axis) {
+  int row = tree->reordered ? position : tree->indices[position];
+  return get_coordinate(tree, row, axis);
 }
 
-
-double (*get_distance_function(char *distance_metric))(double *a, double *b,
-                                                       int k) {
-  if (strncmp(distance_metric, "squared_euclidean", 17) == 0) {
-    return squared_minkowski_2;
-  } else if (strncmp(distance_metric, "manhattan", 9) == 0) {
-    return minkowski_1;
-  } else {
-    fprintf(stderr, "Unknown distance metric encountered.\n");
-    exit(EXIT_FAILURE);
-  }
+double *kd_node_bounds(struct KdTree *tree, struct KdNode *node) {
+  return tree->bounds + ((size_t) (node - tree->nodes) * 2 * tree->k);
 }
 
-int kd_tree_query_n_nearest_neighbors(struct KdTree *tree, double *input,
-                                      int n, char *distance_metric,
-                                      struct KdResult **results) {
-  if (tree->size == 0) {
-    return 0;
+/*
+  Differences to the test point are monotonic on either side of it, so
+  comparing the box corners the way points are compared keeps the counts
+  identical to kd_tree_query_range().
+*/
+int recursive_query_range_count(struct KdTree *tree, struct KdNode *node,
+                                double *test_point, double *radii) {
+  int k = tree->k;
+  double *minimums = kd_node_bounds(tree, node);
+  double *maximums = minimums + k;
+  bool contained = true;
+  for (int j = 0; j < k; j++) {
+    bool min_outside = fabs(minimums[j] - test_point[j]) > radii[j];
+    bool max_outside = fabs(maximums[j] - test_point[j]) > radii[j];
+    if ((max_outside && maximums[j] < test_point[j])
+        || (min_outside && minimums[j] > test_point[j])) {
+      return 0;
+    }
+    contained = contained && !min_outside && !max_outside;
   }
-
-  struct MaxHeap *results_heap = create_max_heap(n);
-
-
-  recursive_nearest_neighbor_descent(tree, tree->root, input, n, results_heap,
-                                     get_distance_function(distance_metric));
-
-  struct HeapItem *item;
-  int num_results = results_heap->size;
-  *results = malloc(sizeof(struct KdResult) * num_results);
-  for (int i = 0; i < num_results; i++) {
-    max_heap_pop(results_heap, &item);
-    (*results)[i].point = item->item;
-    (*results)[i].distance = item->value;
+  if (contained) {
+    return node->end - node->start;
   }
 
-  free_max_heap(results_heap);
+  if (node->is_leaf) {
+    int count = 0;
+    for (int i = node->start; i < node->end; i++) {
+      count += point_in_range(tree, node, i, test_point, radii);
+    }
+    return count;
+  }
 
-  return num_results;
+  return recursive_query_range_count(tree, tree->nodes + node->low,
+                                     test_point, radii)
+         + recursive_query_range_count(tree, tree->nodes + node->high,
+                                       test_point, radii);
 }
 
-/*
-  Descends down the tree recursively, selecting regions that contain the
-  test point. We determine if the other side of the splitting plane could
-  contain a point loser, and check it if so.
-*/
-void recursive_nearest_neighbor_descent(struct KdTree *tree,
-                                        struct KdNode *node,
-                                        double *test_point, int n,
-                                        struct MaxHeap *result_heap,
-                                        double (*distance_function)(double *a,
-                                                                    double *b,
-                                                                    int k)) {
-  if (node == NULL) {
-    return;
+bool point_in_range(struct KdTree *tree, struct KdNode *node, int position,
+                    double *test_point, double *radii) {
+  if (tree->codes != NULL) {
+    int inside = quantized_in_range(tree, node, position, test_point, radii);
+    if (inside != -1) {
+      return inside;
+    }
   }
-
-  if (node->is_leaf) {
-    for (int i = 0; i < node->num_indices; i++) {
-      double *point = tree->data + (node->indices[i] * tree->k);
-      double distance = distance_function(point, test_point, tree->k);
-      if (result_heap->size < n) {
-        max_heap_insert(result_heap, point, distance);
-      } else {
-        struct HeapItem *top_item;
-        max_heap_peak(result_heap, &top_item);
-        if (top_item->value > distance) {
-          struct HeapItem *throwaway;
-          max_heap_pop(result_heap, &throwaway);
-          max_heap_insert(result_heap, point, distance);
-        }
+  if (tree->point_type == POINT_FLOAT) {
+    float *point = kd_tree_float_point(tree, position);
+    for (int j = 0; j < tree->k; j++) {
+      if (fabs(point[j] - test_point[j]) > radii[j]) {
+        return false;
       }
     }
-    return;
+    return true;
   }
-
-  // descend on the same side as the test point
-  bool took_low = false;
-  if (test_point[node->split_axis] < node->split_value) {
-    recursive_nearest_neighbor_descent(tree, node->low, test_point, n,
-                                       result_heap, distance_function);
-    took_low = true;
-  } else {
-    recursive_nearest_neighbor_descent(tree, node->high, test_point, n,
-                                       result_heap, distance_function);
+  double *point = kd_tree_point(tree, position);
+  for (int j = 0; j < tree->k; j++) {
+    if (fabs(point[j] - test_point[j]) > radii[j]) {
+      return false;
+    }
   }
+  return true;
+}
 
-  // Decide if the other side of the splitting plane is a possibility
-  struct HeapItem *current_furthest;
-  max_heap_peak(result_heap, &current_furthest);
-  double max_distance = current_furthest->value;
-  if (took_low) {
-    if ((test_point[node->split_axis] + max_distance) >= node->split_value) {
-      recursive_nearest_neighbor_descent(tree, node->high, test_point, n,
-                                         result_heap, distance_function);
+/*
+  The cell of a code holds its coordinate, and differences to the test point
+  grow monotonically away from it, so comparing the cell's ends like
+  recursive_query_range_count() compares box corners agrees with the exact
+  test.
+*/
+int quantized_in_range(struct KdTree *tree, struct KdNode *node, int position,
+                       double *test_point, double *radii) {
+  int k = tree->k;
+  double *minimums = kd_node_bounds(tree, node);
+  double *steps = tree->steps + ((size_t) (node - tree->nodes) * k);
+  int inside = 1;
+  for (int j = 0; j < k; j++) {
+    int code = quantized_code(tree, position, j);
+    double low = minimums[j] + code * steps[j];
+    double high = minimums[j] + (code + 1) * steps[j];
+    bool low_outside = fabs(low - test_point[j]) > radii[j];
+    bool high_outside = fabs(high - test_point[j]) > radii[j];
+    if ((high_outside && high < test_point[j])
+        || (low_outside && low > test_point[j])) {
+      return 0;
     }
-  } else {
-    if ((test_point[node->split_axis] - max_distance) <= node->split_value) {
-      recursive_nearest_neighbor_descent(tree, node->low, test_point, n,
-                                         result_heap, distance_function);
+    if (low_outside || high_outside) {
+      inside = -1;
     }
   }
+  return inside;
 }
 
-int kd_tree_query_range(struct KdTree *tree, double *test_point, double *radii,
-                        char *distance_metric, struct KdResult **results) {
-  if (tree->size == 0) {
-    return 0;
+float *float_test_point(struct KdTree *tree, double *test_point,
+                        float *stack_point) {
+  if (tree->point_type != POINT_FLOAT) {
+    return NULL;
+  }
+  float *point = stack_point;
+  if (tree->k > STACK_OFFSETS_CAPACITY) {
+    point = malloc(sizeof(float) * tree->k);
+    if (point == NULL) {
+      return NULL;
+    }
   }
+  fill_float_test_point(tree, test_point, point);
+  return point;
+}
 
-  int initial_heap_capacity = 100;
-  struct MaxHeap *results_heap = create_max_heap(initial_heap_capacity);
-  recursive_query_range_descent(tree, tree->root, test_point, radii,
-                                results_heap,
-                                get_distance_function(distance_metric));
+void fill_float_test_point(struct KdTree *tree, double *test_point,
+                           float *point) {
+  for (int j = 0; j < tree->k; j++) {
+    point[j] = (float) test_point[j];
+  }
+}
 
-  struct HeapItem *item;
-  int num_results = results_heap->size;
-  *results = malloc(sizeof(struct KdResult) * num_results);
-  for (int i = 0; i < num_results; i++) {
-    max_heap_pop(results_heap, &item);
-    (*results)[i].point = item->item;
-    (*results)[i].distance = item->value;
+int visit_hit(void *context, int position, double distance) {
+  struct RangeVisitor *visitor = context;
+  return visitor->visit(visitor->context, visitor->tree->indices[position],
+                        kd_tree_point(visitor->tree, position), distance);
+}
+
+int collect_result(void *context, int position, double distance) {
+  struct ResultCollector *collector = context;
+  if (collector->size == collector->capacity) {
+    int capacity = collector->capacity == 0 ? 64 : collector->capacity * 2;
+    struct KdResult *results = realloc(collector->results,
+                                       sizeof(struct KdResult) * capacity);
+    if (results == NULL) {
+      collector->failed = true;
+      return 0;
+    }
+    collector->results = results;
+    collector->capacity = capacity;
   }
+  fill_result(collector->tree, position, distance,
+              collector->results + collector->size);
+  collector->size++;
+  return 1;
+}
 
-  free_max_heap(results_heap);
+int compare_results_descending(const void *a, const void *b) {
+  double distance_a = ((const struct KdResult *) a)->distance;
+  double distance_b = ((const struct KdResult *) b)->distance;
+  return (distance_a < distance_b) - (distance_a > distance_b);
+}
 
-  return num_results;
+/*
+  Missing neighbors are padded first, then the heap pops the furthest first
+  into the back of the row so that rows are ordered nearest first.
+*/
+void fill_batch_row(struct BoundedHeap *heap, int *indices,
+                    struct Metric *metric, int n, int *row_indices,
+                    double *row_distances) {
+  for (int i = heap->size; i < n; i++) {
+    row_indices[i] = -1;
+    row_distances[i] = INFINITY;
+  }
+  struct HeapEntry entry;
+  for (int i = heap->size - 1; i >= 0; i--) {
+    bounded_heap_pop(heap, &entry);
+    row_indices[i] = indices[entry.index];
+    row_distances[i] = true_distance(metric, entry.value);
+  }
+}
+
+int append_to_buffer(void *context, int position, double distance) {
+  struct BufferAppender *appender = context;
+  struct KdRangeBuffer *buffer = appender->buffer;
+  if (buffer->size == buffer->capacity) {
+    int capacity = buffer->capacity == 0 ? 64 : buffer->capacity * 2;
+    int *indices = realloc(buffer->indices, sizeof(int) * capacity);
+    if (indices == NULL) {
+      appender->failed = true;
+      return 0;
+    }
+    buffer->indices = indices;
+    if (appender->with_distances) {
+      double *distances = realloc(buffer->distances,
+                                  sizeof(double) * capacity);
+      if (distances == NULL) {
+        appender->failed = true;
+        return 0;
+      }
+      buffer->distances = distances;
+    }
+    buffer->capacity = capacity;
+  } else if (appender->with_distances && buffer->distances == NULL) {
+    // Grown by queries that skipped distances.
+    buffer->distances = malloc(sizeof(double) * buffer->capacity);
+    if (buffer->distances == NULL) {
+      appender->failed = true;
+      return 0;
+    }
+  }
+  buffer->indices[buffer->size] = appender->tree->indices[position];
+  if (appender->with_distances) {
+    buffer->distances[buffer->size] = distance;
+  }
+  buffer->size++;
+  return 1;
 }
 
 /*
   Recursively descend down the tree, only entering regions that intersect the
   query range area.
 */
-void recursive_query_range_descent(struct KdTree *tree, struct KdNode *node,
-                                   double *test_point, double *radii,
-                                   struct MaxHeap *result_heap,
-                                   double (*distance_function)(double *a,
-                                                               double *b,
-                                                               int k)) {
-  if (node == NULL) {
-    return;
-  }
+int recursive_query_range_descent(struct KdTree *tree, struct KdNode *node,
+                                  struct RangeQuery *query) {
+  double *test_point = query->test_point;
+  double *radii = query->radii;
 
   if (node->is_leaf) {
-    for (int i = 0; i < node->num_indices; i++) {
+    for (int i = node->start; i < node->end; i++) {
       // check the distance between test point and kd-tree point in each
       // dimension to determine if it satisfies the range query.
-      double *point = tree->data + (node->indices[i] * tree->k);
-      bool inside = true;
-      for (int j = 0; j < tree->k; j++) {
-        if (fabs(point[j] - test_point[j]) > radii[j]) {
-          inside = false;
+      if (point_in_range(tree, node, i, test_point, radii)) {
+        double distance = NAN;
+        if (query->metric == NULL) {
+          // No metric, no distance.
+        } else if (tree->point_type == POINT_FLOAT) {
+          distance = true_distance(
+              query->metric,
+              metric_float_distance(query->metric,
+                                    kd_tree_float_point(tree, i),
+                                    query->float_test_point, tree->k));
+        } else {
+          distance = true_distance(
+              query->metric,
+              metric_distance(query->metric, kd_tree_point(tree, i),
+                              test_point, tree->k));
+        }
+        query->num_visited++;
+        if (!query->visit(query->context, i, distance)) {
+          return 0;
         }
-      }
-      if (inside) {
-        double distance = distance_function(point, test_point, tree->k);
-        max_heap_insert(result_heap, point, distance);
       }
     }
-    return;
+    return 1;
   }
 
   if ((test_point[node->split_axis] + radii[node->split_axis])
       >= node->split_value) {
-    recursive_query_range_descent(tree, node->high, test_point, radii,
-                                  result_heap, distance_function);
+    if (!recursive_query_range_descent(tree, tree->nodes + node->high,
+                                       query)) {
+      return 0;
+    }
   }
   if ((test_point[node->split_axis] - radii[node->split_axis])
       <= node->split_value) {
-    recursive_query_range_descent(tree, node->low, test_point, radii,
-                                  result_heap, distance_function);
-  }
-}
-
-double minkowski_1(double *a, double *b, int k) {
-  double dist = 0;
-  for (int i = 0; i < k; i++) {
-    dist += fabs(a[i] - b[i]);
-  }
-  return dist;
-}
-
-double squared_minkowski_2(double *a, double *b, int k) {
-  double dist = 0;
-  for (int i = 0; i < k; i++) {
-    dist += pow(a[i] - b[i], 2);
+    if (!recursive_query_range_descent(tree, tree->nodes + node->low,
+                                       query)) {
+      return 0;
+    }
   }
-  return dist;
+  return 1;
 }
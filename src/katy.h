@@ -1,44 +1,244 @@
 /*
-  A kd-tree supporting k-dimensional points composed of doubles and
+  A kd-tree supporting k-dimensional points composed of doubles or floats and
   n-nearest-neighbor and range queries. The tree contains a pointer to the
-  underlying data (optionally copied) and stores indices into that data in
-  leaves in the tree.
+  underlying data (optionally copied) and a single permutation of indices into
+  that data. Every node owns a contiguous `[start, end)` range of the
+  permutation, and all nodes live in one contiguous arena, so the whole tree
+  costs O(n) memory.
 
   The tree is built using by splitting at the median along the longest axis at
   each level of the tree. The median is selected using a quicksort-esque pivot,
   drawn from the sklearn implementation.
 
-  Katy does not support insertion or deletion, which can degenerate a kd-tree.
-  To alter the points contained, rebuild the tree.
+  Katy trees do not support insertion or deletion, which can degenerate a
+  kd-tree. To alter the points contained, rebuild the tree, or see dynamic.h
+  for an index of static trees that takes updates. For data of many dimensions,
+  where bounding boxes stop pruning, see the ball tree of ball.h.
 */
 #ifndef _KATY_H_
 #define _KATY_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+
+struct DistanceKernels;
+struct KdQueryContext;
+
+/* Types the coordinates of a tree's points can be stored as. */
+enum PointType {
+  POINT_DOUBLE,
+  POINT_FLOAT
+};
+
+/*
+  Compressed copies of the points scanned by queries before the full-precision
+  points. Each coordinate becomes an 8 or 16 bit code locating it on a grid
+  spanning its leaf's bounding box, which bounds its distance to a test point.
+*/
+enum Quantization {
+  QUANTIZE_NONE,
+  QUANTIZE_INT8,
+  QUANTIZE_INT16
+};
 
 struct KdNode {
-  struct KdNode *low;   // The subtree containins points lesser than split
-                        // value along the split axis.
-  struct KdNode *high;  // The subtree containing points greater than split
-                        // value along the split axis.
-  int *indices;         // Indices of all data below this point in the tree.
+  int low;              // Arena index of the subtree containing points lesser
+                        // than split value along the split axis, -1 if leaf.
+  int high;             // Arena index of the subtree containing points greater
+                        // than split value along the split axis, -1 if leaf.
+  int start;            // First position of this subtree in tree->indices.
+  int end;              // One past the last position in tree->indices.
   double split_value;   // The demarcating value along the split axis
   int split_axis;       // The axis along which this node represents a split
-  int num_indices;      // The number of indices contained if a leaf.
   bool is_leaf;         // Leaf nodes do not represent splits
 };
 
 struct KdTree {
-  struct KdNode *root;
-  double *data;
+  struct KdNode *root;  // The first node in the arena, NULL if empty.
+  struct KdNode *nodes; // Arena holding every node of the tree.
+  int *indices;         // Permutation of indices into data, grouped by node.
+                        // For reordered trees, the caller's index of the
+                        // point stored at each position of data.
+  double *data;         // Points of double trees, NULL for float trees.
+  float *float_data;    // Points of float trees, NULL for double trees.
+  enum PointType point_type;
+  double *bounds;       // Bounding box of each node's points, 2 * k doubles
+                        // per node: the minimums then the maximums.
+  enum Quantization quantization;
+  void *codes;          // Quantized coordinates of the point at each position,
+                        // uint8_t or uint16_t. NULL if not quantized.
+  double *steps;        // Grid spacing along each axis of each leaf, k
+                        // doubles per node. NULL if not quantized.
   int size;
   int k;
+  int num_nodes;
   bool copied;          // Was the input data copied?
+  bool reordered;       // Is data stored in leaf order?
+  size_t memory_bytes;  // Bytes allocated by the build, including copied data.
+  void *mapping;        // File the arrays of loaded trees point into, NULL
+                        // for built trees.
+  size_t mapping_bytes;
+  const struct DistanceKernels *kernels;  // Distance kernels for this CPU
+                                          // and k, picked at creation.
+};
+
+/*
+  How nodes choose their splitting plane. Median splits cut the points of a
+  node in half along the axis of greatest spread, so the tree is balanced but
+  cells can get skinny. Midpoint splits cut a node's cell in half across its
+  longest side, which bounds the aspect ratio of cells but may leave one side
+  empty. Sliding-midpoint splits move such a plane to the nearest point so
+  both sides get points.
+*/
+enum SplitStrategy {
+  SPLIT_MEDIAN,
+  SPLIT_MIDPOINT,
+  SPLIT_SLIDING_MIDPOINT
+};
+
+/*
+  Profile of a build, filled in when the build options point to one. Times
+  of parallel builds add up the time of every thread. Zero-initialize it
+  before its first build; later builds free the histogram of the previous one.
+*/
+struct KdBuildStats {
+  double seconds;             // Wall time of the whole build
+  double split_axis_seconds;  // Time spent choosing splitting axes
+  double partition_seconds;   // Time spent partitioning indices
+  int depth;                  // Nodes on the longest path from root to leaf
+  int num_leaves;
+  int *leaf_sizes;            // Number of leaves holding each number of
+                              // points, from 0 to max_leaf_size
+  int max_leaf_size;
+};
+
+/* Free the leaf size histogram of build stats. */
+void free_kd_build_stats(struct KdBuildStats *stats);
+
+/*
+  Options for build_kd_tree_with_options(). A zero-initialized struct gives
+  the default build.
+*/
+struct KdBuildOptions {
+  int leaf_size;        // Threshold number of points at which splitting stops.
+                        // Defaults to 16 if not positive.
+  bool copy_data;       // Copy the input points instead of referencing them.
+  bool reorder_data;    // Copy the points into leaf order so each leaf is one
+                        // contiguous block. The caller's buffer is untouched.
+  int num_threads;      // Threads building the tree, serial if less than 2.
+  int parallel_cutoff;  // Subtrees with fewer points are built by a single
+                        // task. Defaults to 32768 if not positive.
+  unsigned int seed;    // Seeds pivot selection. For a given seed the tree is
+                        // identical for any number of threads.
+  enum SplitStrategy split_strategy;  // Median by default. Midpoint
+                                      // strategies build serially.
+  enum Quantization quantization;     // Leaf scans test quantized points
+                                      // first and only compute the distance
+                                      // of those that could be close enough.
+                                      // Double trees only.
+  struct KdBuildStats *stats;         // Profile of the build, or NULL. Not
+                                      // filled in by streaming builds.
+};
+
+/*
+  Orders in which n nearest neighbor queries visit the tree. Depth-first
+  searches recurse to the test point's leaf and backtrack through the far
+  sides of its ancestors. Best-first searches keep every node they have
+  reached in a priority queue and always scan the nearest leaf next, so they
+  stop as soon as no queued node can hold a closer point, and a leaf budget
+  goes to the most promising leaves.
+*/
+enum SearchOrder {
+  SEARCH_DEPTH_FIRST,
+  SEARCH_BEST_FIRST
+};
+
+/* Kinds of distance metric. */
+enum MetricType {
+  METRIC_SQUARED_EUCLIDEAN,
+  METRIC_EUCLIDEAN,
+  METRIC_MANHATTAN,
+  METRIC_CHEBYSHEV,
+  METRIC_MINKOWSKI
+};
+
+/*
+  A distance metric, parsed once from its name by parse_kd_metric() or set
+  directly, and passed to any number of queries.
+*/
+struct KdMetric {
+  enum MetricType type;
+  double p;             // Order of METRIC_MINKOWSKI, at least 1
+};
+
+/*
+  A source of points for streaming builds, which read their input twice.
+  `read` copies up to `max_points` points of k doubles each into `points` and
+  returns how many it copied, 0 once the input is exhausted or -1 on failure.
+  `rewind` restarts the input from its first point and returns `0` on
+  failure, `1` otherwise.
+*/
+struct KdPointReader {
+  int (*read)(void *context, double *points, int max_points);
+  int (*rewind)(void *context);
+  void *context;
+};
+
+/*
+  Options for build_kd_tree_streaming(). A zero-initialized struct gives the
+  default build.
+*/
+struct KdStreamOptions {
+  struct KdBuildOptions build;  // Leaf size, threads and seed of the build.
+                                // Median splits only, and neither
+                                // quantization nor float points.
+  size_t memory_bytes;  // Rough bound on the memory the build may use, which
+                        // sizes the partitions built in memory. Defaults to
+                        // 1 GiB if zero.
+  int sample_size;      // Points sampled to choose the top-level splits.
+                        // Defaults to 65536 if not positive.
+};
+
+/*
+  Counts of the work done by n nearest neighbor queries, filled in when the
+  query options point to one.
+*/
+struct KdQueryStats {
+  long nodes_visited;         // Internal nodes and leaves reached
+  long leaves_scanned;
+  long distance_evaluations;  // Exact distances to points computed
+  long subtrees_pruned;       // Subtrees skipped as out of reach
+  long heap_operations;       // Pushes and replacements of candidate
+                              // neighbors, and pushes and pops of the
+                              // best-first queue
+};
+
+/*
+  Options for the n nearest neighbor queries taking options. A
+  zero-initialized struct gives exact queries.
+*/
+struct KdQueryOptions {
+  double epsilon;       // Skip subtrees that cannot hold a point closer than
+                        // 1 / (1 + epsilon) times the current n-th distance,
+                        // so the i-th neighbor found is at most 1 + epsilon
+                        // times further than the true i-th neighbor.
+  int max_leaves;       // Stop after scanning this many leaves and report the
+                        // best points seen. Unlimited if not positive.
+  enum SearchOrder search_order;  // Depth-first by default.
+  struct KdQueryStats *stats;     // Counts of a single query, or the totals
+                                  // of a batch, or NULL to count nothing.
+  struct KdMetric *metric;        // Metric used in place of the query's
+                                  // metric name, which may then be NULL.
 };
 
-/* A query result, containing a k dimensional point and a distance. */
+/*
+  A query result, containing a k dimensional point, its index in the caller's
+  input and a distance.
+*/
 struct KdResult {
-  double *point;
+  double *point;        // The point of double trees, NULL for float trees.
+  float *float_point;   // The point of float trees, NULL for double trees.
+  int index;
   double distance;
 };
 
@@ -47,27 +247,196 @@ struct KdTree *create_kd_tree(int k);
 
 /*
   Build a kd-tree from an array of points. `leaf_size` dictates the threshold
-  number of points at which splitting stops and leaf node ism ade. Input data
-  is copied if `copy_data` is true. Returns NULL on failure.
+  number of points at which splitting stops and leaf node ism ade, 16 if not
+  positive. Input data is copied if `copy_data` is true. Returns NULL on
+  failure or if `num_points` is not positive.
 */
 struct KdTree *build_kd_tree(double *points, int num_points, int k,
                              int leaf_size, bool copy_data);
 
+/*
+  Build a kd-tree from an array of points as configured by `options`. Returns
+  NULL on failure or if `num_points` is not positive.
+*/
+struct KdTree *build_kd_tree_with_options(double *points, int num_points,
+                                          int k,
+                                          struct KdBuildOptions *options);
+
+/*
+  build_kd_tree_with_options() for points with float coordinates. The tree
+  stores and scans floats, and computes distances in single precision. Queries
+  take the same double test points and radii as for double trees.
+*/
+struct KdTree *build_float_kd_tree_with_options(float *points, int num_points,
+                                                int k,
+                                                struct KdBuildOptions *options);
+
 /* Free a kd tree and its underlying data if copied. */
 void free_kd_tree(struct KdTree *tree);
 
 /*
-  Find the `n` nearest neighbors to the `test_point` according to a specific
-  distance metric. Results are returned through the `results` return parameter,
-  which is an array of KdResult. The actual number of neighbors found is
-  returned by the function.
+  Write a built tree to the file at `path`: its nodes, bounding boxes, index
+  permutation and quantized codes, and its points if `save_points` is true.
+  The points of reordered trees are always saved, since they are no longer in
+  the caller's order. Every array is written as laid out in memory, so the
+  file only loads on machines of the same byte order and struct layout.
+  Returns `0` on failure, `1` otherwise.
+*/
+int save_kd_tree(struct KdTree *tree, char *path, bool save_points);
 
-  Acceptable distance metrics are `manhattan` and `squared_euclidean`.
+/*
+  Build a tree over the points of `reader` without holding them all in
+  memory, writing it to the file at `path` in the format of save_kd_tree(),
+  points included, for load_kd_tree() to query. The top levels of the tree
+  split a random sample of the points. Each point is then spilled to a
+  temporary file next to `path` for the cell of the top levels it falls in,
+  and the cells are built in memory one at a time, the tree of each written
+  to its place in the file. The cells are sized to fit in
+  options->memory_bytes as estimated from the sample, in at most 512 cells,
+  and the tree holds at most INT_MAX points. Returns `0` on failure, `1`
+  otherwise.
+*/
+int build_kd_tree_streaming(struct KdPointReader *reader, int k,
+                            struct KdStreamOptions *options, char *path);
+
+/*
+  build_kd_tree_streaming() over the file at `points_path`, which holds
+  points of k doubles each, one after the other, in native byte order.
+*/
+int build_kd_tree_from_file(char *points_path, int k,
+                            struct KdStreamOptions *options, char *path);
+
+/*
+  Map a file written by save_kd_tree() and return a tree querying straight out
+  of the mapping, read-only and shared, so processes loading the same file
+  share one copy of it in the page cache. Nothing is read up front beyond the
+  file's header, which is checked to describe arrays that fit in the file, but
+  not what the arrays hold; see kd_tree_validate() for files that may be
+  corrupt. If the file holds no points, `points` must be the doubles or floats
+  the tree was built from, which the tree references without copying.
+  Returns NULL if the file cannot be mapped or was not written by a
+  compatible build. free_kd_tree() unmaps the file.
+*/
+struct KdTree *load_kd_tree(char *path, void *points);
+
+/*
+  Check that the nodes and indices of `tree` are safe to query: children are
+  in the arena and follow their parent, so that no traversal loops, split
+  axes are below k, node ranges lie inside the indices, and every index names
+  one of the tree's points. Reads every node and index, so a loaded tree
+  pages in its whole arena and permutation. Returns `0` if the tree is
+  corrupt, `1` otherwise.
+*/
+int kd_tree_validate(struct KdTree *tree);
+
+/*
+  Get the point stored at `position` of tree->indices, whose index in the
+  caller's input is tree->indices[position]. Reads from reordered trees are
+  sequential as `position` increases.
+*/
+double *kd_tree_point(struct KdTree *tree, int position);
+
+/* kd_tree_point() for float trees. */
+float *kd_tree_float_point(struct KdTree *tree, int position);
+
+/*
+  Parse the name of a distance metric into `metric`. Acceptable names are
+  `squared_euclidean`, `euclidean`, `manhattan`, `chebyshev` and
+  `minkowski_<p>` for an order p of at least 1, e.g. `minkowski_3`. Returns
+  `0` if the name is unknown, `1` otherwise.
+*/
+int parse_kd_metric(char *distance_metric, struct KdMetric *metric);
+
+/*
+  Distance between two k-dimensional points according to a distance metric,
+  as reported by queries. Returns NAN for unknown metrics.
+*/
+double kd_distance(double *a, double *b, int k, char *distance_metric);
+
+/*
+  Find the `n` nearest neighbors to the `test_point` according to a specific
+  distance metric, named as parse_kd_metric() accepts. Results are returned
+  through the `results` return parameter, which is an array of KdResult. The
+  actual number of neighbors found is returned by the function, 0 for unknown
+  metrics.
 */
 int kd_tree_query_n_nearest_neighbors(struct KdTree *tree, double *test_point,
                                       int n, char *distance_metric,
                                       struct KdResult **results);
 
+/*
+  kd_tree_query_n_nearest_neighbors() trading accuracy for speed as
+  configured by `options`, see struct KdQueryOptions. NULL options give exact
+  queries.
+*/
+int kd_tree_query_n_nearest_neighbors_with_options(
+    struct KdTree *tree, double *test_point, int n, char *distance_metric,
+    struct KdQueryOptions *options, struct KdResult **results);
+
+/*
+  Scratch memory of n nearest neighbor queries: the candidate heap, the
+  per-axis offsets and float test point, the best-first queue and the results.
+  A caller creates one per thread and passes it to every query, which grows it
+  to the largest n and k seen and otherwise leaves it be, so that queries stop
+  allocating once it has warmed up. Returns NULL on failure.
+*/
+struct KdQueryContext *create_kd_query_context(void);
+
+/* Free a query context and the scratch memory it holds. */
+void free_kd_query_context(struct KdQueryContext *context);
+
+/*
+  kd_tree_query_n_nearest_neighbors_with_options() drawing all of its memory
+  from `context`. `*results` points into the context, and stays valid until
+  its next query or until it is freed. A context must not be used by two
+  queries at once.
+*/
+int kd_tree_query_n_nearest_neighbors_in_context(
+    struct KdTree *tree, double *test_point, int n, char *distance_metric,
+    struct KdQueryOptions *options, struct KdQueryContext *context,
+    struct KdResult **results);
+
+/*
+  Find the `n` nearest neighbors of each of the `num_queries` points stored
+  contiguously in `test_points`, spreading the queries over `num_threads`
+  threads. The neighbors of query `i` are written to row `i` of the caller
+  provided `[num_queries x n]` arrays `indices` (indices into the caller's
+  input) and `distances`, nearest first. Rows with fewer than `n` neighbors
+  are padded with index -1 and an infinite distance.
+
+  The tree is only read, so concurrent calls may share a tree. Returns `0` on
+  failure or for unknown metrics, `1` otherwise.
+*/
+int kd_tree_query_n_nearest_neighbors_batch(struct KdTree *tree,
+                                            double *test_points,
+                                            int num_queries, int n,
+                                            char *distance_metric,
+                                            int num_threads, int *indices,
+                                            double *distances);
+
+/*
+  kd_tree_query_n_nearest_neighbors_batch() as configured by `options`, see
+  struct KdQueryOptions. NULL options give exact queries.
+*/
+int kd_tree_query_n_nearest_neighbors_batch_with_options(
+    struct KdTree *tree, double *test_points, int num_queries, int n,
+    char *distance_metric, struct KdQueryOptions *options, int num_threads,
+    int *indices, double *distances);
+
+/*
+  Find the `n` nearest neighbors of every point of the tree other than the
+  point itself, the edges of its nearest neighbor graph, by walking the tree
+  against itself. Node pairs are skipped when their bounding boxes are
+  further apart than any point of the first node still accepts, and the
+  subtrees of the first node are spread over `num_threads` threads. Writes
+  the neighbors of the point of index `i` in the caller's input to row `i` of
+  the `[size x n]` arrays `indices` and `distances`, as for
+  kd_tree_query_n_nearest_neighbors_batch(). Returns `0` on failure, `1`
+  otherwise.
+*/
+int kd_tree_all_knn(struct KdTree *tree, int n, char *distance_metric,
+                    int num_threads, int *indices, double *distances);
+
 /*
   Find all points that lie within a specific range of the `test_point`. The
   range is specified by a k-dimensional point of radii assumed to be symmetric
@@ -75,10 +444,107 @@ int kd_tree_query_n_nearest_neighbors(struct KdTree *tree, double *test_point,
   (5.0, 5.0), then the query range encompases (x +/- 5, y +/- 5).
 
   Results are returned through the `results` return parameter, which is an
-  array of KdResult. The actual numver of points found is returned by the
-  function.
+  array of KdResult ordered by decreasing distance. The actual numver of
+  points found is returned by the function, 0 for unknown metrics.
 */
 int kd_tree_query_range(struct KdTree *tree, double *test_point, double *radii,
                         char *distance_metric, struct KdResult **results);
 
+/*
+  Range query calling `visit` for each point found, in no particular order,
+  with the point's index in the caller's input, the point (NULL for float
+  trees) and its distance. Returning `0` from `visit` stops the query. If
+  `distance_metric` is NULL no distances are computed and NAN is passed
+  instead. Nothing is allocated, short of float trees of more than 64
+  dimensions, so the cost is linear in the number of points found. Returns the
+  number of points visited, or -1 for unknown metrics or on failure to
+  allocate.
+*/
+int kd_tree_query_range_visit(struct KdTree *tree, double *test_point,
+                              double *radii, char *distance_metric,
+                              int (*visit)(void *context, int index,
+                                           double *point, double distance),
+                              void *context);
+
+/*
+  kd_tree_query_range_visit() with a parsed `metric`, or NULL to compute no
+  distances, so that repeated queries do not parse a metric name each time.
+*/
+int kd_tree_query_range_visit_with_metric(
+    struct KdTree *tree, double *test_point, double *radii,
+    struct KdMetric *metric,
+    int (*visit)(void *context, int index, double *point, double distance),
+    void *context);
+
+/*
+  A growable buffer of range query hits, owned by the caller and meant to be
+  reused across queries so that it stops allocating once grown.
+*/
+struct KdRangeBuffer {
+  int *indices;         // Indices of the hits in the caller's input
+  double *distances;    // Distances of the hits, if a metric was given
+  int size;
+  int capacity;
+};
+
+/* Initialize an empty range buffer. */
+void init_kd_range_buffer(struct KdRangeBuffer *buffer);
+
+/* Free the memory held by a range buffer and empty it. */
+void free_kd_range_buffer(struct KdRangeBuffer *buffer);
+
+/*
+  Range query appending the indices of the points found, and their distances
+  unless `distance_metric` is NULL, to `buffer` after its current contents.
+  Set buffer->size to 0 to reuse it. Returns the number of points appended, or
+  -1 for unknown metrics or on failure to grow the buffer.
+*/
+int kd_tree_query_range_into(struct KdTree *tree, double *test_point,
+                             double *radii, char *distance_metric,
+                             struct KdRangeBuffer *buffer);
+
+/* kd_tree_query_range_into() with a parsed `metric`, or NULL. */
+int kd_tree_query_range_into_with_metric(struct KdTree *tree,
+                                         double *test_point, double *radii,
+                                         struct KdMetric *metric,
+                                         struct KdRangeBuffer *buffer);
+
+/*
+  Count the points that lie within the box of `radii` around `test_point`, as
+  kd_tree_query_range() would find them. Subtrees whose bounding box lies
+  entirely inside the query box are counted from their size without being
+  visited, so the cost follows the boundary of the box rather than the number
+  of points inside it.
+*/
+int kd_tree_query_range_count(struct KdTree *tree, double *test_point,
+                              double *radii);
+
+/*
+  Find every pair of a point of `tree_a` and a point of `tree_b` that differ
+  by at most `radii[j]` along every axis j, the pairs kd_tree_query_range()
+  finds with the points of `tree_a` as test points. The trees are walked
+  together, and pairs of nodes whose bounding boxes are too far apart are
+  skipped whole. Calls `visit` for each pair, in no particular order, with the
+  indices of its points in the callers' inputs. Returning `0` from `visit`
+  stops the join. Returns the number of pairs visited, or -1 if the trees
+  differ in dimension.
+*/
+long long kd_tree_join_range(struct KdTree *tree_a, struct KdTree *tree_b,
+                             double *radii,
+                             int (*visit)(void *context, int index_a,
+                                          int index_b),
+                             void *context);
+
+/*
+  Count the pairs kd_tree_join_range() would visit. Pairs of nodes whose
+  bounding boxes are close enough along every axis for all their points to
+  pair up are counted from their sizes without being visited. Returns -1 if
+  the trees differ in dimension.
+*/
+long long kd_tree_join_range_count(struct KdTree *tree_a,
+                                   struct KdTree *tree_b, double *radii);
+
+/* The bounding box of a node's points: k minimums followed by k maximums. */
+double *kd_node_bounds(struct KdTree *tree, struct KdNode *node);
+
 #endif  // _KATY_H_
@@ -0,0 +1,363 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+#define DEQUE_INITIAL_CAPACITY 16
+
+/* Arguments handed to each spawned worker thread. */
+struct WorkerArgs {
+  void (*work)(void *context, int worker_id);
+  void *context;
+  int worker_id;
+};
+
+/* pthread entry point unpacking a WorkerArgs. */
+void *worker_main(void *args);
+
+struct Task {
+  void (*run)(void *arg, int worker_id);
+  void *arg;
+  struct TaskGroup *group;
+};
+
+/*
+  Tasks of one worker. The owner pushes and pops at the tail, thieves take
+  from the head, so stolen tasks are the oldest and typically the largest.
+*/
+struct TaskDeque {
+  struct Task *tasks;
+  int head;
+  int tail;
+  int capacity;
+};
+
+/*
+  Coarse tasks (whole subtrees, blocks of thousands of points) keep lock
+  traffic low, so a single lock guards every deque and group counter.
+*/
+struct TaskPool {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t *threads;
+  struct WorkerArgs *args;
+  struct TaskDeque *deques;
+  int num_threads;
+  int num_started;
+  bool shutdown;
+};
+
+/* One block of a task_pool_parallel_for() call. */
+struct ForBlock {
+  void (*body)(void *arg, int begin, int end, int worker_id);
+  void *arg;
+  int begin;
+  int end;
+};
+
+/* Loop run by the pool's spawned threads until shutdown. */
+void task_pool_worker(void *context, int worker_id);
+
+/*
+  Take a task for `worker_id`, its own newest first, else the oldest of
+  another worker. Must hold the pool lock. Returns `0` if none is queued.
+*/
+int take_task(struct TaskPool *pool, int worker_id, struct Task *task);
+
+/* Run a taken task and account for it. Must hold the pool lock. */
+void run_task(struct TaskPool *pool, int worker_id, struct Task *task);
+
+/* Task running one ForBlock. */
+void run_for_block(void *arg, int worker_id);
+
+
+int run_workers(int num_threads, void (*work)(void *context, int worker_id),
+                void *context) {
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+  struct WorkerArgs *args = malloc(sizeof(struct WorkerArgs) * num_threads);
+  if (threads == NULL || args == NULL) {
+    free(threads);
+    free(args);
+    return 0;
+  }
+
+  // Worker 0 runs on the calling thread, so spawn the rest.
+  int started = 1;
+  for (int i = 1; i < num_threads; i++) {
+    args[i].work = work;
+    args[i].context = context;
+    args[i].worker_id = i;
+    if (pthread_create(&threads[i], NULL, worker_main, &args[i]) != 0) {
+      break;
+    }
+    started++;
+  }
+
+  // Workers pull from shared queues, so those that did start can still
+  // finish the job if the system refuses to give us more threads.
+  work(context, 0);
+
+  for (int i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+  free(args);
+  return 1;
+}
+
+void *worker_main(void *args) {
+  struct WorkerArgs *worker = args;
+  worker->work(worker->context, worker->worker_id);
+  return NULL;
+}
+
+int init_work_queue(struct WorkQueue *queue, int num_items, int chunk_size) {
+  pthread_mutex_t *lock = malloc(sizeof(pthread_mutex_t));
+  if (lock == NULL) {
+    return 0;
+  }
+  if (pthread_mutex_init(lock, NULL) != 0) {
+    free(lock);
+    return 0;
+  }
+  queue->lock = lock;
+  queue->next = 0;
+  queue->end = num_items;
+  queue->chunk_size = chunk_size < 1 ? 1 : chunk_size;
+  queue->failed = 0;
+  return 1;
+}
+
+void destroy_work_queue(struct WorkQueue *queue) {
+  pthread_mutex_destroy(queue->lock);
+  free(queue->lock);
+}
+
+int work_queue_next(struct WorkQueue *queue, int *start, int *end) {
+  pthread_mutex_lock(queue->lock);
+  if (queue->failed) {
+    queue->next = queue->end;
+  }
+  int claimed = queue->next;
+  if (claimed < queue->end) {
+    queue->next += queue->chunk_size;
+    if (queue->next > queue->end) {
+      queue->next = queue->end;
+    }
+  }
+  int claimed_end = queue->next;
+  pthread_mutex_unlock(queue->lock);
+
+  *start = claimed;
+  *end = claimed_end;
+  return claimed < claimed_end;
+}
+
+void work_queue_fail(struct WorkQueue *queue) {
+  pthread_mutex_lock(queue->lock);
+  queue->failed = 1;
+  pthread_mutex_unlock(queue->lock);
+}
+
+struct TaskPool *create_task_pool(int num_threads) {
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  struct TaskPool *pool = malloc(sizeof(struct TaskPool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  pool->threads = malloc(sizeof(pthread_t) * num_threads);
+  pool->args = malloc(sizeof(struct WorkerArgs) * num_threads);
+  pool->deques = calloc(num_threads, sizeof(struct TaskDeque));
+  if (pool->threads == NULL || pool->args == NULL || pool->deques == NULL) {
+    free(pool->threads);
+    free(pool->args);
+    free(pool->deques);
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pool->num_threads = num_threads;
+  pool->num_started = 1;
+  pool->shutdown = false;
+
+  for (int i = 1; i < num_threads; i++) {
+    pool->args[i].work = task_pool_worker;
+    pool->args[i].context = pool;
+    pool->args[i].worker_id = i;
+    if (pthread_create(&pool->threads[i], NULL, worker_main,
+                       &pool->args[i]) != 0) {
+      break;
+    }
+    pool->num_started++;
+  }
+  return pool;
+}
+
+void free_task_pool(struct TaskPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 1; i < pool->num_started; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  for (int i = 0; i < pool->num_threads; i++) {
+    free(pool->deques[i].tasks);
+  }
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool->args);
+  free(pool->deques);
+  free(pool);
+}
+
+int task_pool_size(struct TaskPool *pool) {
+  return pool->num_threads;
+}
+
+void task_pool_spawn(struct TaskPool *pool, int worker_id,
+                     struct TaskGroup *group,
+                     void (*task)(void *arg, int worker_id), void *arg) {
+  pthread_mutex_lock(&pool->lock);
+  struct TaskDeque *deque = pool->deques + worker_id;
+  if (deque->head == deque->tail) {
+    deque->head = 0;
+    deque->tail = 0;
+  }
+  if (deque->tail == deque->capacity) {
+    int new_capacity = deque->capacity == 0 ? DEQUE_INITIAL_CAPACITY
+                                            : deque->capacity * 2;
+    struct Task *reallocated = realloc(deque->tasks,
+                                       sizeof(struct Task) * new_capacity);
+    if (reallocated == NULL) {
+      pthread_mutex_unlock(&pool->lock);
+      task(arg, worker_id);
+      return;
+    }
+    deque->tasks = reallocated;
+    deque->capacity = new_capacity;
+  }
+  struct Task *queued = deque->tasks + deque->tail;
+  queued->run = task;
+  queued->arg = arg;
+  queued->group = group;
+  deque->tail++;
+  group->pending++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void task_pool_wait(struct TaskPool *pool, int worker_id,
+                    struct TaskGroup *group) {
+  pthread_mutex_lock(&pool->lock);
+  while (group->pending > 0) {
+    struct Task task;
+    if (take_task(pool, worker_id, &task)) {
+      run_task(pool, worker_id, &task);
+    } else {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int task_pool_parallel_for(struct TaskPool *pool, int worker_id,
+                           int num_items, int block_size,
+                           void (*body)(void *arg, int begin, int end,
+                                        int worker_id),
+                           void *arg) {
+  if (pool == NULL || num_items <= block_size) {
+    for (int begin = 0; begin < num_items; begin += block_size) {
+      int end = begin + block_size < num_items ? begin + block_size
+                                               : num_items;
+      body(arg, begin, end, worker_id);
+    }
+    return 1;
+  }
+
+  int num_blocks = (num_items + block_size - 1) / block_size;
+  struct ForBlock *blocks = malloc(sizeof(struct ForBlock) * num_blocks);
+  if (blocks == NULL) {
+    return 0;
+  }
+
+  struct TaskGroup group = {0};
+  for (int i = 0; i < num_blocks; i++) {
+    blocks[i].body = body;
+    blocks[i].arg = arg;
+    blocks[i].begin = i * block_size;
+    blocks[i].end = i == num_blocks - 1 ? num_items : (i + 1) * block_size;
+  }
+  // Queue all but the first block, which the caller runs itself.
+  for (int i = num_blocks - 1; i > 0; i--) {
+    task_pool_spawn(pool, worker_id, &group, run_for_block, blocks + i);
+  }
+  run_for_block(blocks, worker_id);
+  task_pool_wait(pool, worker_id, &group);
+
+  free(blocks);
+  return 1;
+}
+
+void task_pool_worker(void *context, int worker_id) {
+  struct TaskPool *pool = context;
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->shutdown) {
+    struct Task task;
+    if (take_task(pool, worker_id, &task)) {
+      run_task(pool, worker_id, &task);
+    } else {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int take_task(struct TaskPool *pool, int worker_id, struct Task *task) {
+  struct TaskDeque *own = pool->deques + worker_id;
+  if (own->tail > own->head) {
+    own->tail--;
+    *task = own->tasks[own->tail];
+    return 1;
+  }
+  for (int i = 1; i < pool->num_threads; i++) {
+    struct TaskDeque *victim = pool->deques
+                               + ((worker_id + i) % pool->num_threads);
+    if (victim->tail > victim->head) {
+      *task = victim->tasks[victim->head];
+      victim->head++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void run_task(struct TaskPool *pool, int worker_id, struct Task *task) {
+  pthread_mutex_unlock(&pool->lock);
+  task->run(task->arg, worker_id);
+  pthread_mutex_lock(&pool->lock);
+
+  task->group->pending--;
+  if (task->group->pending == 0) {
+    pthread_cond_broadcast(&pool->wake);
+  }
+}
+
+void run_for_block(void *arg, int worker_id) {
+  struct ForBlock *block = arg;
+  block->body(block->arg, block->begin, block->end, worker_id);
+}
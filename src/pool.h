@@ -0,0 +1,102 @@
+/*
+  Threading helpers: a one-shot set of workers used to parallelize queries
+  over a shared, read-only tree, and a fork-join task pool whose workers
+  balance load by stealing from each other, used to parallelize builds.
+*/
+#ifndef _KATY_POOL_H
+#define _KATY_POOL_H
+
+/*
+  Run `work(context, worker_id)` on `num_threads` workers, one of which is the
+  calling thread, and wait for all of them to return. Worker ids run from 0 to
+  num_threads - 1. Returns `0` on failure to start the workers, `1` otherwise.
+*/
+int run_workers(int num_threads, void (*work)(void *context, int worker_id),
+                void *context);
+
+/*
+  A shared cursor handing out chunks of a range of work items to workers.
+*/
+struct WorkQueue {
+  void *lock;
+  int next;
+  int end;
+  int chunk_size;
+  int failed;     // Set under the lock by work_queue_fail()
+};
+
+/*
+  Initialize a queue over the items [0, num_items), handed out `chunk_size`
+  at a time. Returns `0` on failure, `1` otherwise.
+*/
+int init_work_queue(struct WorkQueue *queue, int num_items, int chunk_size);
+
+/* Release the resources held by a work queue. */
+void destroy_work_queue(struct WorkQueue *queue);
+
+/*
+  Claim the next chunk of items as [*start, *end). Returns `0` once the queue
+  is exhausted or has failed, `1` otherwise.
+*/
+int work_queue_next(struct WorkQueue *queue, int *start, int *end);
+
+/*
+  Record that a worker failed, so that the queue stops handing out chunks.
+  Workers may call this concurrently; read queue->failed once they have all
+  returned.
+*/
+void work_queue_fail(struct WorkQueue *queue);
+
+/*
+  A fixed set of worker threads, each owning a deque of tasks. Workers run
+  their own newest task first and steal the oldest task of another worker
+  when they run dry. The thread that creates the pool acts as worker 0.
+*/
+struct TaskPool;
+
+/* Counts the tasks spawned into it that have not yet finished. */
+struct TaskGroup {
+  int pending;
+};
+
+/*
+  Create a pool of `num_threads` workers, starting `num_threads - 1` threads.
+  Returns NULL on failure.
+*/
+struct TaskPool *create_task_pool(int num_threads);
+
+/* Stop and join the pool's threads and free the pool. */
+void free_task_pool(struct TaskPool *pool);
+
+/* The number of workers in the pool, including the creating thread. */
+int task_pool_size(struct TaskPool *pool);
+
+/*
+  Queue `task(arg, worker_id)` on the deque of `worker_id`, the worker calling
+  this function, as a member of `group`. `arg` must stay valid until the group
+  has been waited on. If the task cannot be queued it is run immediately.
+*/
+void task_pool_spawn(struct TaskPool *pool, int worker_id,
+                     struct TaskGroup *group,
+                     void (*task)(void *arg, int worker_id), void *arg);
+
+/*
+  Run queued tasks on the calling worker until every task of `group` has
+  finished.
+*/
+void task_pool_wait(struct TaskPool *pool, int worker_id,
+                    struct TaskGroup *group);
+
+/*
+  Call `body(arg, begin, end, worker_id)` on consecutive blocks of
+  `block_size` items covering [0, num_items), spread across the pool, and wait
+  for them all. Runs every block on the caller when `pool` is NULL. Returns
+  `0` on failure, `1` otherwise.
+*/
+int task_pool_parallel_for(struct TaskPool *pool, int worker_id,
+                           int num_items, int block_size,
+                           void (*body)(void *arg, int begin, int end,
+                                        int worker_id),
+                           void *arg);
+
+#endif  // _KATY_POOL_H
@@ -0,0 +1,435 @@
+/*
+  CPython extension exposing katy's kd-tree to NumPy users as `katy.KdTree`.
+
+  A tree is built over the caller's array without copying it: C-contiguous
+  float64 arrays back a double tree and float32 arrays a float tree, through
+  the copy_data = false path of the C library, and the tree holds a reference
+  to the array for as long as it lives. Arrays of other types or layouts are
+  converted once, and the tree then owns the converted array. The points must
+  not be modified while the tree exists.
+
+  Batch nearest neighbor and range queries release the GIL while they run,
+  so other Python threads keep going, and return NumPy arrays.
+*/
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../katy.h"
+
+#define DEFAULT_LEAF_SIZE 16
+
+struct KdTreeObject {
+  PyObject_HEAD
+  struct KdTree *tree;
+  PyArrayObject *points;  // The array the tree's points live in
+};
+
+/*
+  parse_kd_metric() setting a ValueError for unknown metrics. Returns `0` if
+  `name` is unknown.
+*/
+int parse_metric(char *name, struct KdMetric *metric);
+
+/*
+  Convert `object` to a C-contiguous float64 array of test points of the
+  tree's dimensionality, one per row, or a single point. Returns NULL with an
+  exception set on failure.
+*/
+PyArrayObject *test_points_array(struct KdTreeObject *self, PyObject *object);
+
+/*
+  Convert `object`, a number or one radius per axis, to an array of k radii.
+  Returns NULL with an exception set on failure.
+*/
+PyArrayObject *radii_array(struct KdTreeObject *self, PyObject *object);
+
+PyObject *KdTree_new(PyTypeObject *type, PyObject *args, PyObject *kwargs);
+void KdTree_dealloc(struct KdTreeObject *self);
+PyObject *KdTree_query(struct KdTreeObject *self, PyObject *args,
+                       PyObject *kwargs);
+PyObject *KdTree_query_range(struct KdTreeObject *self, PyObject *args,
+                             PyObject *kwargs);
+PyObject *KdTree_get_size(struct KdTreeObject *self, void *closure);
+PyObject *KdTree_get_k(struct KdTreeObject *self, void *closure);
+PyObject *KdTree_get_data(struct KdTreeObject *self, void *closure);
+
+
+int parse_metric(char *name, struct KdMetric *metric) {
+  if (!parse_kd_metric(name, metric)) {
+    PyErr_Format(PyExc_ValueError, "unknown distance metric '%s'", name);
+    return 0;
+  }
+  return 1;
+}
+
+PyArrayObject *test_points_array(struct KdTreeObject *self, PyObject *object) {
+  PyArrayObject *array = (PyArrayObject *) PyArray_FROM_OTF(
+      object, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY);
+  if (array == NULL) {
+    return NULL;
+  }
+  int ndim = PyArray_NDIM(array);
+  if ((ndim != 1 && ndim != 2)
+      || PyArray_DIM(array, ndim - 1) != self->tree->k
+      || PyArray_SIZE(array) / self->tree->k > INT_MAX) {
+    PyErr_Format(PyExc_ValueError,
+                 "test points must have shape (k,) or (m, k) with k = %d",
+                 self->tree->k);
+    Py_DECREF(array);
+    return NULL;
+  }
+  return array;
+}
+
+PyArrayObject *radii_array(struct KdTreeObject *self, PyObject *object) {
+  PyArrayObject *array = (PyArrayObject *) PyArray_FROM_OTF(
+      object, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY);
+  if (array == NULL) {
+    return NULL;
+  }
+  int k = self->tree->k;
+  if (PyArray_SIZE(array) == k && PyArray_NDIM(array) <= 1) {
+    return array;
+  }
+  if (PyArray_NDIM(array) != 0) {
+    PyErr_Format(PyExc_ValueError,
+                 "radii must be a number or have shape (%d,)", k);
+    Py_DECREF(array);
+    return NULL;
+  }
+  // One radius for every axis.
+  npy_intp dims[1] = {k};
+  PyArrayObject *radii = (PyArrayObject *) PyArray_SimpleNew(1, dims,
+                                                             NPY_DOUBLE);
+  if (radii != NULL) {
+    double radius = *(double *) PyArray_DATA(array);
+    double *data = PyArray_DATA(radii);
+    for (int j = 0; j < k; j++) {
+      data[j] = radius;
+    }
+  }
+  Py_DECREF(array);
+  return radii;
+}
+
+PyObject *KdTree_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+  static char *keywords[] = {"points", "leaf_size", "num_threads", NULL};
+  PyObject *object;
+  int leaf_size = DEFAULT_LEAF_SIZE;
+  int num_threads = 1;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ii", keywords, &object,
+                                   &leaf_size, &num_threads)) {
+    return NULL;
+  }
+  if (leaf_size < 1) {
+    PyErr_SetString(PyExc_ValueError, "leaf_size must be positive");
+    return NULL;
+  }
+
+  // float32 arrays are kept as they are, anything else becomes float64.
+  int type_num = NPY_DOUBLE;
+  if (PyArray_Check(object)
+      && PyArray_TYPE((PyArrayObject *) object) == NPY_FLOAT) {
+    type_num = NPY_FLOAT;
+  }
+  PyArrayObject *points = (PyArrayObject *) PyArray_FROM_OTF(
+      object, type_num, NPY_ARRAY_IN_ARRAY);
+  if (points == NULL) {
+    return NULL;
+  }
+  if (PyArray_NDIM(points) != 2 || PyArray_DIM(points, 1) < 1
+      || PyArray_DIM(points, 0) > INT_MAX
+      || PyArray_DIM(points, 1) > INT_MAX) {
+    PyErr_SetString(PyExc_ValueError, "points must have shape (n, k)");
+    Py_DECREF(points);
+    return NULL;
+  }
+  int num_points = (int) PyArray_DIM(points, 0);
+  int k = (int) PyArray_DIM(points, 1);
+
+  struct KdBuildOptions options = {0};
+  options.leaf_size = leaf_size;
+  options.num_threads = num_threads;
+  struct KdTree *tree;
+  Py_BEGIN_ALLOW_THREADS
+  if (num_points == 0) {
+    tree = create_kd_tree(k);
+  } else if (type_num == NPY_FLOAT) {
+    tree = build_float_kd_tree_with_options(PyArray_DATA(points), num_points,
+                                            k, &options);
+  } else {
+    tree = build_kd_tree_with_options(PyArray_DATA(points), num_points, k,
+                                      &options);
+  }
+  Py_END_ALLOW_THREADS
+  if (tree == NULL) {
+    Py_DECREF(points);
+    return PyErr_NoMemory();
+  }
+
+  struct KdTreeObject *self = (struct KdTreeObject *) type->tp_alloc(type, 0);
+  if (self == NULL) {
+    free_kd_tree(tree);
+    Py_DECREF(points);
+    return NULL;
+  }
+  self->tree = tree;
+  self->points = points;
+  return (PyObject *) self;
+}
+
+void KdTree_dealloc(struct KdTreeObject *self) {
+  if (self->tree != NULL) {
+    free_kd_tree(self->tree);
+  }
+  Py_XDECREF(self->points);
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+PyObject *KdTree_query(struct KdTreeObject *self, PyObject *args,
+                       PyObject *kwargs) {
+  static char *keywords[] = {"test_points", "n", "metric", "num_threads",
+                             NULL};
+  PyObject *object;
+  int n;
+  char *metric = "euclidean";
+  int num_threads = 1;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi|si", keywords, &object,
+                                   &n, &metric, &num_threads)) {
+    return NULL;
+  }
+  if (n < 1) {
+    PyErr_SetString(PyExc_ValueError, "n must be positive");
+    return NULL;
+  }
+  struct KdQueryOptions options = {0};
+  struct KdMetric kd_metric;
+  if (!parse_metric(metric, &kd_metric)) {
+    return NULL;
+  }
+  options.metric = &kd_metric;
+  PyArrayObject *test_points = test_points_array(self, object);
+  if (test_points == NULL) {
+    return NULL;
+  }
+
+  // Rows of n neighbors, or a single row for a single test point.
+  int num_queries = (int) (PyArray_SIZE(test_points) / self->tree->k);
+  int single = PyArray_NDIM(test_points) == 1;
+  npy_intp dims[2] = {num_queries, n};
+  if (single) {
+    dims[0] = n;
+  }
+  PyArrayObject *indices = (PyArrayObject *) PyArray_SimpleNew(
+      single ? 1 : 2, dims, NPY_INT);
+  PyArrayObject *distances = (PyArrayObject *) PyArray_SimpleNew(
+      single ? 1 : 2, dims, NPY_DOUBLE);
+  if (indices == NULL || distances == NULL) {
+    Py_DECREF(test_points);
+    Py_XDECREF(indices);
+    Py_XDECREF(distances);
+    return NULL;
+  }
+
+  int succeeded;
+  Py_BEGIN_ALLOW_THREADS
+  succeeded = kd_tree_query_n_nearest_neighbors_batch_with_options(
+      self->tree, PyArray_DATA(test_points), num_queries, n, NULL, &options,
+      num_threads, PyArray_DATA(indices), PyArray_DATA(distances));
+  Py_END_ALLOW_THREADS
+  Py_DECREF(test_points);
+  if (!succeeded) {
+    Py_DECREF(indices);
+    Py_DECREF(distances);
+    return PyErr_NoMemory();
+  }
+  return Py_BuildValue("NN", indices, distances);
+}
+
+/*
+  Hits of all test points go to one buffer, and the offsets of each point's
+  hits into it to a CSR style array, so any number of queries comes back as
+  three arrays.
+*/
+PyObject *KdTree_query_range(struct KdTreeObject *self, PyObject *args,
+                             PyObject *kwargs) {
+  static char *keywords[] = {"test_points", "radii", "metric", NULL};
+  PyObject *object;
+  PyObject *radii_object;
+  char *metric = NULL;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|z", keywords, &object,
+                                   &radii_object, &metric)) {
+    return NULL;
+  }
+  // Parsed once for all test points.
+  struct KdMetric kd_metric;
+  struct KdMetric *parsed = NULL;
+  if (metric != NULL) {
+    if (!parse_metric(metric, &kd_metric)) {
+      return NULL;
+    }
+    parsed = &kd_metric;
+  }
+  PyArrayObject *test_points = test_points_array(self, object);
+  if (test_points == NULL) {
+    return NULL;
+  }
+  PyArrayObject *radii = radii_array(self, radii_object);
+  if (radii == NULL) {
+    Py_DECREF(test_points);
+    return NULL;
+  }
+  int k = self->tree->k;
+  int num_queries = (int) (PyArray_SIZE(test_points) / k);
+  int single = PyArray_NDIM(test_points) == 1;
+  npy_intp offsets_dims[1] = {(npy_intp) num_queries + 1};
+  PyArrayObject *offsets = (PyArrayObject *) PyArray_SimpleNew(
+      1, offsets_dims, NPY_INTP);
+  if (offsets == NULL) {
+    Py_DECREF(test_points);
+    Py_DECREF(radii);
+    return NULL;
+  }
+
+  struct KdRangeBuffer buffer;
+  init_kd_range_buffer(&buffer);
+  npy_intp *offset = PyArray_DATA(offsets);
+  int failed = 0;
+  Py_BEGIN_ALLOW_THREADS
+  offset[0] = 0;
+  for (int q = 0; q < num_queries && !failed; q++) {
+    double *test_point = (double *) PyArray_DATA(test_points)
+                         + ((size_t) q * k);
+    failed = kd_tree_query_range_into_with_metric(
+        self->tree, test_point, PyArray_DATA(radii), parsed, &buffer) == -1;
+    offset[q + 1] = buffer.size;
+  }
+  Py_END_ALLOW_THREADS
+  Py_DECREF(test_points);
+  Py_DECREF(radii);
+  if (failed) {
+    free_kd_range_buffer(&buffer);
+    Py_DECREF(offsets);
+    return PyErr_NoMemory();
+  }
+
+  npy_intp dims[1] = {buffer.size};
+  PyArrayObject *indices = (PyArrayObject *) PyArray_SimpleNew(1, dims,
+                                                               NPY_INT);
+  PyObject *distances = Py_None;
+  Py_INCREF(Py_None);
+  if (metric != NULL) {
+    Py_DECREF(Py_None);
+    distances = PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+  }
+  if (indices == NULL || distances == NULL) {
+    free_kd_range_buffer(&buffer);
+    Py_DECREF(offsets);
+    Py_XDECREF(indices);
+    Py_XDECREF(distances);
+    return NULL;
+  }
+  if (buffer.size > 0) {
+    memcpy(PyArray_DATA(indices), buffer.indices, sizeof(int) * buffer.size);
+    if (metric != NULL) {
+      memcpy(PyArray_DATA((PyArrayObject *) distances), buffer.distances,
+             sizeof(double) * buffer.size);
+    }
+  }
+  free_kd_range_buffer(&buffer);
+
+  if (single) {
+    Py_DECREF(offsets);
+    return Py_BuildValue("NN", indices, distances);
+  }
+  return Py_BuildValue("NNN", offsets, indices, distances);
+}
+
+PyObject *KdTree_get_size(struct KdTreeObject *self, void *closure) {
+  return PyLong_FromLong(self->tree->size);
+}
+
+PyObject *KdTree_get_k(struct KdTreeObject *self, void *closure) {
+  return PyLong_FromLong(self->tree->k);
+}
+
+PyObject *KdTree_get_data(struct KdTreeObject *self, void *closure) {
+  Py_INCREF(self->points);
+  return (PyObject *) self->points;
+}
+
+static PyMethodDef KdTree_methods[] = {
+  {"query", (PyCFunction) (void (*)(void)) KdTree_query,
+   METH_VARARGS | METH_KEYWORDS,
+   "query(test_points, n, metric='euclidean', num_threads=1)\n\n"
+   "Find the n nearest neighbors of each test point, spread over\n"
+   "num_threads threads with the GIL released. Returns (indices, distances)\n"
+   "arrays of shape (m, n), or (n,) for a single test point, nearest first.\n"
+   "Missing neighbors have index -1 and an infinite distance."},
+  {"query_range", (PyCFunction) (void (*)(void)) KdTree_query_range,
+   METH_VARARGS | METH_KEYWORDS,
+   "query_range(test_points, radii, metric=None)\n\n"
+   "Find the points within a box of radii, a number or one per axis, around\n"
+   "each test point, with the GIL released. Returns (offsets, indices,\n"
+   "distances), where the hits of test point i are\n"
+   "indices[offsets[i]:offsets[i + 1]], in no particular order, or\n"
+   "(indices, distances) for a single test point. distances is None unless\n"
+   "a metric is given."},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef KdTree_getset[] = {
+  {"size", (getter) KdTree_get_size, NULL, "Number of points.", NULL},
+  {"k", (getter) KdTree_get_k, NULL, "Dimensionality of the points.", NULL},
+  {"data", (getter) KdTree_get_data, NULL,
+   "The array holding the tree's points.", NULL},
+  {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject KdTreeType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "katy.KdTree",
+  .tp_doc = "KdTree(points, leaf_size=16, num_threads=1)\n\n"
+            "kd-tree over an (n, k) array of points, which it references\n"
+            "without copying when it is a C-contiguous float64 or float32\n"
+            "array. The array must not be modified while the tree exists.",
+  .tp_basicsize = sizeof(struct KdTreeObject),
+  .tp_itemsize = 0,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_new = KdTree_new,
+  .tp_dealloc = (destructor) KdTree_dealloc,
+  .tp_methods = KdTree_methods,
+  .tp_getset = KdTree_getset,
+};
+
+static struct PyModuleDef katy_module = {
+  PyModuleDef_HEAD_INIT,
+  .m_name = "katy",
+  .m_doc = "kd-trees over NumPy arrays.",
+  .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_katy(void) {
+  import_array();
+  if (PyType_Ready(&KdTreeType) < 0) {
+    return NULL;
+  }
+  PyObject *module = PyModule_Create(&katy_module);
+  if (module == NULL) {
+    return NULL;
+  }
+  Py_INCREF(&KdTreeType);
+  if (PyModule_AddObject(module, "KdTree", (PyObject *) &KdTreeType) < 0) {
+    Py_DECREF(&KdTreeType);
+    Py_DECREF(module);
+    return NULL;
+  }
+  return module;
+}
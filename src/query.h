@@ -0,0 +1,38 @@
+/*
+  Helpers shared by the query code of the kd-tree, the ball tree and the
+  dynamic tree, so that every index reports results the same way. Internal to
+  the library; callers only see the results these produce.
+*/
+#ifndef _KATY_QUERY_H
+#define _KATY_QUERY_H
+
+struct BoundedHeap;
+struct DistanceKernels;
+struct KdQueryOptions;
+struct Metric;
+
+/*
+  Resolve the metric of a query over `kernels` into `metric`: the metric of
+  `options` if they carry one, the metric named `distance_metric` otherwise.
+  Returns `0` if neither is a valid metric, `1` otherwise.
+*/
+int resolve_query_metric(const struct DistanceKernels *kernels,
+                         char *distance_metric,
+                         struct KdQueryOptions *options,
+                         struct Metric *metric);
+
+/* qsort() comparison ordering KdResults by decreasing distance. */
+int compare_results_descending(const void *a, const void *b);
+
+/*
+  Empty the `heap` of neighbors found for one query of a batch into its row of
+  `n` caller indices and distances, nearest first, padding missing neighbors
+  with index -1 and an infinite distance. Heap entries hold positions, which
+  `indices` maps to indices into the caller's input, and reduced distances
+  under `metric`.
+*/
+void fill_batch_row(struct BoundedHeap *heap, int *indices,
+                    struct Metric *metric, int n, int *row_indices,
+                    double *row_distances);
+
+#endif  // _KATY_QUERY_H
@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+extern "C" {
+  #include <stdlib.h>
+  #include "../ball.h"
+}
+
+/* `num_points` k-dimensional points around a few centers, row by row. */
+std::vector<double> clustered_points(int num_points, int k);
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+
+TEST(TestBallTree, NearestNeighborsMatchKdTree) {
+  char metrics[][32] = {"euclidean", "squared_euclidean", "manhattan",
+                        "chebyshev", "minkowski_3", "minkowski_1.5"};
+  int dimensions[] = {2, 16, 64};
+  int num_points = 2000;
+  int n = 10;
+  srand(11);
+  for (int d = 0; d < 3; d++) {
+    int k = dimensions[d];
+    std::vector<double> points = clustered_points(num_points, k);
+    struct BallTree *ball = build_ball_tree(points.data(), num_points, k, 16,
+                                            false);
+    struct KdTree *kd = build_kd_tree(points.data(), num_points, k, 16,
+                                      false);
+    ASSERT_NE(ball, nullptr);
+    ASSERT_NE(kd, nullptr);
+    for (int m = 0; m < 6; m++) {
+      for (int q = 0; q < 20; q++) {
+        double *test_point = points.data() + ((size_t) (q * 97) * k);
+        std::vector<double> jittered(test_point, test_point + k);
+        for (int j = 0; j < k; j++) {
+          jittered[j] += (double) rand() / RAND_MAX - 0.5;
+        }
+        struct KdResult *ball_results, *kd_results;
+        int num_ball = ball_tree_query_n_nearest_neighbors(
+            ball, jittered.data(), n, metrics[m], &ball_results);
+        int num_kd = kd_tree_query_n_nearest_neighbors(
+            kd, jittered.data(), n, metrics[m], &kd_results);
+        ASSERT_EQ(num_ball, n);
+        ASSERT_EQ(num_kd, n);
+        for (int i = 0; i < n; i++) {
+          EXPECT_NEAR(ball_results[i].distance, kd_results[i].distance,
+                      1e-9 * (1 + kd_results[i].distance));
+          EXPECT_EQ(ball_results[i].point,
+                    points.data() + ((size_t) ball_results[i].index * k));
+        }
+        free(ball_results);
+        free(kd_results);
+      }
+    }
+    free_ball_tree(ball);
+    free_kd_tree(kd);
+  }
+}
+
+TEST(TestBallTree, BatchMatchesSingleQueries) {
+  int k = 32;
+  int num_points = 1500;
+  int num_queries = 300;
+  int n = 5;
+  std::vector<double> points = clustered_points(num_points, k);
+  std::vector<double> test_points = clustered_points(num_queries, k);
+  struct BallTree *tree = build_ball_tree(points.data(), num_points, k, 8,
+                                          true);
+  ASSERT_NE(tree, nullptr);
+  EXPECT_NE(tree->data, points.data());
+
+  std::vector<int> indices(num_queries * n);
+  std::vector<double> distances(num_queries * n);
+  ASSERT_TRUE(ball_tree_query_n_nearest_neighbors_batch(
+      tree, test_points.data(), num_queries, n, (char *) "euclidean", 3,
+      indices.data(), distances.data()));
+  for (int q = 0; q < num_queries; q++) {
+    struct KdResult *results;
+    int num_results = ball_tree_query_n_nearest_neighbors(
+        tree, test_points.data() + ((size_t) q * k), n, (char *) "euclidean",
+        &results);
+    ASSERT_EQ(num_results, n);
+    for (int i = 0; i < n; i++) {
+      EXPECT_EQ(indices[q * n + i], results[n - 1 - i].index);
+      EXPECT_DOUBLE_EQ(distances[q * n + i], results[n - 1 - i].distance);
+    }
+    free(results);
+  }
+  free_ball_tree(tree);
+}
+
+TEST(TestBallTree, PadsWhenFewerPointsThanNeighbors) {
+  double points[] = {0, 0, 1, 1, 2, 2};
+  struct BallTree *tree = build_ball_tree(points, 3, 2, 1, false);
+  ASSERT_NE(tree, nullptr);
+  EXPECT_EQ(tree->num_nodes, 5);
+
+  double test_point[] = {1.9, 2.1};
+  int indices[5];
+  double distances[5];
+  ASSERT_TRUE(ball_tree_query_n_nearest_neighbors_batch(
+      tree, test_point, 1, 5, (char *) "manhattan", 1, indices, distances));
+  int expected[] = {2, 1, 0, -1, -1};
+  for (int i = 0; i < 5; i++) {
+    EXPECT_EQ(indices[i], expected[i]);
+  }
+  EXPECT_NEAR(distances[0], 0.2, 1e-12);
+  EXPECT_EQ(distances[4], INFINITY);
+
+  struct KdResult *results;
+  EXPECT_EQ(ball_tree_query_n_nearest_neighbors(tree, test_point, 5,
+                                                (char *) "manhattan",
+                                                &results), 3);
+  EXPECT_EQ(results[0].index, 0);
+  free(results);
+  free_ball_tree(tree);
+  EXPECT_EQ(build_ball_tree(points, 0, 2, 1, false), nullptr);
+}
+
+TEST(TestBallTree, RangeMatchesKdTree) {
+  int k = 8;
+  int num_points = 3000;
+  std::vector<double> points = clustered_points(num_points, k);
+  // Duplicates along the split axes must not upset the median selection.
+  for (int i = 0; i < num_points; i += 3) {
+    points[(size_t) i * k] = 1;
+  }
+  struct BallTree *ball = build_ball_tree(points.data(), num_points, k, 16,
+                                          false);
+  struct KdTree *kd = build_kd_tree(points.data(), num_points, k, 16, false);
+  ASSERT_NE(ball, nullptr);
+  std::vector<double> radii(k, 2.5);
+  for (int q = 0; q < 10; q++) {
+    double *test_point = points.data() + ((size_t) (q * 31) * k);
+    struct KdResult *ball_results, *kd_results;
+    int num_ball = ball_tree_query_range(ball, test_point, radii.data(),
+                                         (char *) "euclidean", &ball_results);
+    int num_kd = kd_tree_query_range(kd, test_point, radii.data(),
+                                     (char *) "euclidean", &kd_results);
+    ASSERT_EQ(num_ball, num_kd);
+    EXPECT_GT(num_ball, 0);
+    std::vector<int> ball_indices, kd_indices;
+    for (int i = 0; i < num_ball; i++) {
+      ball_indices.push_back(ball_results[i].index);
+      kd_indices.push_back(kd_results[i].index);
+      EXPECT_DOUBLE_EQ(ball_results[i].distance, kd_results[i].distance);
+    }
+    std::sort(ball_indices.begin(), ball_indices.end());
+    std::sort(kd_indices.begin(), kd_indices.end());
+    EXPECT_EQ(ball_indices, kd_indices);
+    free(ball_results);
+    free(kd_results);
+  }
+  free_ball_tree(ball);
+  free_kd_tree(kd);
+}
+
+std::vector<double> clustered_points(int num_points, int k) {
+  std::vector<double> points((size_t) num_points * k);
+  for (int i = 0; i < num_points; i++) {
+    int cluster = rand() % 8;
+    for (int j = 0; j < k; j++) {
+      double center = ((cluster * 7 + j * 3) % 10) * 2.0;
+      points[(size_t) i * k + j] = center + (double) rand() / RAND_MAX;
+    }
+  }
+  return points;
+}
@@ -0,0 +1,126 @@
+#include "gtest/gtest.h"
+
+extern "C" {
+  #include <stdlib.h>
+  #include <stdio.h>
+  #include "../distance.h"
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+
+TEST(TestDistance, ScalarKernels) {
+  double a[] = {1.0, -2.0, 3.0};
+  double b[] = {4.0, 2.0, 3.0};
+  EXPECT_EQ(minkowski_1(a, b, 3), 7);
+  EXPECT_EQ(squared_minkowski_2(a, b, 3), 25);
+  EXPECT_EQ(chebyshev(a, b, 3), 4);
+  EXPECT_EQ(reduced_minkowski_p(a, b, 3, 3), 91);
+
+  float fa[] = {1.0f, -2.0f, 3.0f};
+  float fb[] = {4.0f, 2.0f, 3.0f};
+  EXPECT_EQ(float_minkowski_1(fa, fb, 3), 7);
+  EXPECT_EQ(float_squared_minkowski_2(fa, fb, 3), 25);
+  EXPECT_EQ(float_chebyshev(fa, fb, 3), 4);
+  EXPECT_EQ(float_reduced_minkowski_p(fa, fb, 3, 3), 91);
+}
+
+TEST(TestDistance, ParseAndResolveMetrics) {
+  struct KdMetric kd_metric;
+  struct Metric metric;
+  const struct DistanceKernels *kernels = get_distance_kernels(SIMD_SCALAR);
+  ASSERT_TRUE(parse_kd_metric((char *) "manhattan", &kd_metric));
+  EXPECT_EQ(kd_metric.type, METRIC_MANHATTAN);
+  ASSERT_TRUE(parse_kd_metric((char *) "minkowski_3", &kd_metric));
+  EXPECT_EQ(kd_metric.type, METRIC_MINKOWSKI);
+  EXPECT_EQ(kd_metric.p, 3);
+  ASSERT_TRUE(resolve_metric(kernels, &kd_metric, &metric));
+  EXPECT_EQ(metric.type, METRIC_MINKOWSKI);
+  EXPECT_EQ(metric.distance, nullptr);
+
+  // Orders with a kernel of their own resolve to it.
+  ASSERT_TRUE(parse_kd_metric((char *) "minkowski_inf", &kd_metric));
+  ASSERT_TRUE(resolve_metric(kernels, &kd_metric, &metric));
+  EXPECT_EQ(metric.type, METRIC_CHEBYSHEV);
+  EXPECT_EQ(metric.distance, kernels->chebyshev);
+
+  const char *unknown[] = {"cosine", "minkowski_", "minkowski_0.5",
+                           "minkowski_3x", "minkowski_nan"};
+  for (const char *name : unknown) {
+    EXPECT_FALSE(parse_kd_metric((char *) name, &kd_metric)) << name;
+  }
+  kd_metric = {METRIC_MINKOWSKI, 0.5};
+  EXPECT_FALSE(resolve_metric(kernels, &kd_metric, &metric));
+}
+
+TEST(TestDistance, BestKernelsAreSupported) {
+  EXPECT_NE(get_distance_kernels(SIMD_SCALAR), nullptr);
+  for (int k = 1; k <= 128; k++) {
+    const struct DistanceKernels *best = best_distance_kernels(k);
+    ASSERT_NE(best, nullptr);
+    EXPECT_EQ(get_distance_kernels(best->level), best);
+  }
+  EXPECT_EQ(best_distance_kernels(1)->level, SIMD_SCALAR);
+  EXPECT_EQ(best_float_distance_kernels(3)->level, SIMD_SCALAR);
+}
+
+TEST(TestDistance, VectorKernelsMatchScalar) {
+  double a[130];
+  double b[130];
+  for (int i = 0; i < 130; i++) {
+    a[i] = (rand() % 2000 - 1000) / 7.0;
+    b[i] = (rand() % 2000 - 1000) / 7.0;
+  }
+
+  for (int level = SIMD_SSE2; level < SIMD_NUM_LEVELS; level++) {
+    const struct DistanceKernels *kernels =
+        get_distance_kernels((enum SimdLevel) level);
+    if (kernels == NULL) {
+      continue;  // not supported by this CPU
+    }
+    for (int k = 1; k <= 130; k++) {
+      double manhattan = minkowski_1(a, b, k);
+      double euclidean = squared_minkowski_2(a, b, k);
+      EXPECT_NEAR(kernels->manhattan(a, b, k), manhattan, 1e-9 * manhattan)
+          << kernels->name << " k=" << k;
+      EXPECT_NEAR(kernels->squared_euclidean(a, b, k), euclidean,
+                  1e-9 * euclidean) << kernels->name << " k=" << k;
+      EXPECT_EQ(kernels->chebyshev(a, b, k), chebyshev(a, b, k))
+          << kernels->name << " k=" << k;
+    }
+  }
+}
+
+TEST(TestDistance, FloatKernelsMatchDouble) {
+  float a[130];
+  float b[130];
+  double da[130];
+  double db[130];
+  for (int i = 0; i < 130; i++) {
+    a[i] = (rand() % 2000 - 1000) / 7.0f;
+    b[i] = (rand() % 2000 - 1000) / 7.0f;
+    da[i] = a[i];
+    db[i] = b[i];
+  }
+
+  for (int level = SIMD_SCALAR; level < SIMD_NUM_LEVELS; level++) {
+    const struct DistanceKernels *kernels =
+        get_distance_kernels((enum SimdLevel) level);
+    if (kernels == NULL) {
+      continue;  // not supported by this CPU
+    }
+    for (int k = 1; k <= 130; k++) {
+      double manhattan = minkowski_1(da, db, k);
+      double euclidean = squared_minkowski_2(da, db, k);
+      EXPECT_NEAR(kernels->float_manhattan(a, b, k), manhattan,
+                  1e-5 * manhattan) << kernels->name << " k=" << k;
+      EXPECT_NEAR(kernels->float_squared_euclidean(a, b, k), euclidean,
+                  1e-5 * euclidean) << kernels->name << " k=" << k;
+      double largest = chebyshev(da, db, k);
+      EXPECT_NEAR(kernels->float_chebyshev(a, b, k), largest, 1e-5 * largest)
+          << kernels->name << " k=" << k;
+    }
+  }
+}
@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <utility>
+
+#include "gtest/gtest.h"
+
+extern "C" {
+  #include <stdlib.h>
+  #include <stdio.h>
+  #include "../dynamic.h"
+}
+
+/* Live points of a dynamic tree kept alongside it, by id. */
+struct Reference {
+  std::vector<std::vector<double> > points;
+  std::vector<bool> live;
+};
+
+/* Sorted distances of the `n` nearest live reference points. */
+std::vector<double> nearest_distances(Reference &reference,
+                                      double *test_point, int n, int k,
+                                      char *metric);
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+
+TEST(TestDynamicTree, InsertsBuildLevelsOfGrowingSize) {
+  int k = 2;
+  int buffer_capacity = 16;
+  struct KdDynamicTree *tree = create_kd_dynamic_tree(k, 4, buffer_capacity);
+  ASSERT_NE(tree, nullptr);
+  for (int i = 0; i < 1000; i++) {
+    double point[] = {(double) i, (double) -i};
+    ASSERT_EQ(kd_dynamic_tree_insert(tree, point), i);
+  }
+  EXPECT_EQ(tree->size, 1000);
+
+  // 1000 = 62 * 16 + 8: levels 1 to 5 hold 62 buffers' worth.
+  EXPECT_EQ(tree->buffer_size, 8);
+  int stored = tree->buffer_size;
+  for (int l = 0; l < tree->num_levels; l++) {
+    if (tree->levels[l] != NULL) {
+      EXPECT_LE(tree->levels[l]->size, buffer_capacity << l);
+      stored += tree->levels[l]->size;
+    }
+  }
+  EXPECT_EQ(stored, 1000);
+  EXPECT_EQ(tree->levels[0], nullptr);
+  for (int l = 1; l < 6; l++) {
+    ASSERT_NE(tree->levels[l], nullptr);
+    EXPECT_EQ(tree->levels[l]->size, buffer_capacity << l);
+  }
+  free_kd_dynamic_tree(tree);
+}
+
+TEST(TestDynamicTree, QueriesMatchBruteForce) {
+  int k = 3;
+  int n = 7;
+  struct KdDynamicTree *tree = create_kd_dynamic_tree(k, 8, 32);
+  Reference reference;
+  char metrics[][32] = {"squared_euclidean", "manhattan"};
+  srand(7);
+
+  for (int round = 0; round < 30; round++) {
+    for (int i = 0; i < 200; i++) {
+      std::vector<double> point(k);
+      for (int j = 0; j < k; j++) {
+        point[j] = (double) rand() / RAND_MAX;
+      }
+      ASSERT_EQ(kd_dynamic_tree_insert(tree, point.data()),
+                (int) reference.points.size());
+      reference.points.push_back(point);
+      reference.live.push_back(true);
+    }
+    // Delete more than is inserted in later rounds, so levels compact.
+    int num_deletes = round < 20 ? 100 : 300;
+    for (int i = 0; i < num_deletes; i++) {
+      int id = rand() % reference.points.size();
+      EXPECT_EQ(kd_dynamic_tree_delete(tree, id), (int) reference.live[id]);
+      reference.live[id] = false;
+    }
+    int num_live = std::count(reference.live.begin(), reference.live.end(),
+                              true);
+    ASSERT_EQ(tree->size, num_live);
+    for (int l = 0; l < tree->num_levels; l++) {
+      if (tree->levels[l] != NULL) {
+        EXPECT_LT(tree->level_tombstones[l] * 2, tree->levels[l]->size);
+      }
+    }
+
+    double test_point[] = {0.5, 0.25, 0.75};
+    for (int m = 0; m < 2; m++) {
+      struct KdResult *results;
+      int num_results = kd_dynamic_tree_query_n_nearest_neighbors(
+          tree, test_point, n, metrics[m], &results);
+      std::vector<double> expected = nearest_distances(reference, test_point,
+                                                       n, k, metrics[m]);
+      ASSERT_EQ(num_results, (int) expected.size());
+      for (int i = 0; i < num_results; i++) {
+        ASSERT_TRUE(reference.live[results[i].index]);
+        EXPECT_DOUBLE_EQ(results[num_results - 1 - i].distance, expected[i]);
+      }
+      free(results);
+    }
+
+    double radii[] = {0.2, 0.3, 0.1};
+    struct KdResult *results;
+    int num_results = kd_dynamic_tree_query_range(tree, test_point, radii,
+                                                  metrics[0], &results);
+    std::vector<int> found, expected;
+    for (int i = 0; i < num_results; i++) {
+      found.push_back(results[i].index);
+    }
+    for (size_t id = 0; id < reference.points.size(); id++) {
+      bool inside = reference.live[id];
+      for (int j = 0; j < k; j++) {
+        inside = inside && std::fabs(reference.points[id][j] - test_point[j])
+                           <= radii[j];
+      }
+      if (inside) {
+        expected.push_back(id);
+      }
+    }
+    std::sort(found.begin(), found.end());
+    EXPECT_EQ(found, expected);
+    free(results);
+
+    if (round == 25) {
+      ASSERT_TRUE(kd_dynamic_tree_compact(tree));
+      int num_levels = 0;
+      for (int l = 0; l < tree->num_levels; l++) {
+        num_levels += tree->levels[l] != NULL;
+        EXPECT_EQ(tree->level_tombstones[l], 0);
+      }
+      EXPECT_LE(num_levels, 1);
+    }
+  }
+
+  // Unknown and deleted ids are refused.
+  EXPECT_FALSE(kd_dynamic_tree_delete(tree, -1));
+  EXPECT_FALSE(kd_dynamic_tree_delete(tree, reference.points.size()));
+  free_kd_dynamic_tree(tree);
+}
+
+std::vector<double> nearest_distances(Reference &reference,
+                                      double *test_point, int n, int k,
+                                      char *metric) {
+  std::vector<double> distances;
+  for (size_t id = 0; id < reference.points.size(); id++) {
+    if (reference.live[id]) {
+      distances.push_back(kd_distance(reference.points[id].data(),
+                                      test_point, k, metric));
+    }
+  }
+  std::sort(distances.begin(), distances.end());
+  distances.resize(std::min((int) distances.size(), n));
+  return distances;
+}
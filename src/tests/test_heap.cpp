@@ -65,6 +65,7 @@ TEST(TestHeap, Pop) {
   EXPECT_EQ(heap->size, 1);
   EXPECT_EQ(popped->value, 100);
 
+  free(popped);
   free_max_heap(heap);
 }
 
@@ -80,3 +81,67 @@ TEST(TestHeap, InsertMany) {
   max_heap_peak(heap, &peak_item);
   EXPECT_EQ(peak_item->value, n);
 }
+
+TEST(TestBoundedHeap, PushUntilFull) {
+  struct HeapEntry entries[3];
+  struct BoundedHeap heap;
+  init_bounded_heap(&heap, entries, 3);
+  EXPECT_EQ(bounded_heap_push(&heap, 0, 5.0), 1);
+  EXPECT_EQ(bounded_heap_push(&heap, 1, 9.0), 1);
+  EXPECT_EQ(bounded_heap_push(&heap, 2, 1.0), 1);
+  EXPECT_EQ(bounded_heap_push(&heap, 3, 2.0), 0);
+  EXPECT_EQ(heap.size, 3);
+
+  struct HeapEntry top;
+  EXPECT_EQ(bounded_heap_peak(&heap, &top), 1);
+  EXPECT_EQ(top.index, 1);
+  EXPECT_EQ(top.value, 9.0);
+}
+
+TEST(TestBoundedHeap, ReplaceTopKeepsSmallest) {
+  int capacity = 10;
+  struct HeapEntry entries[10];
+  struct BoundedHeap heap;
+  init_bounded_heap(&heap, entries, capacity);
+
+  // keep the 10 smallest of 1000 shuffled values
+  for (int i = 0; i < 1000; i++) {
+    int value = (i * 337) % 1000;
+    if (heap.size < capacity) {
+      bounded_heap_push(&heap, i, value);
+    } else if (value < heap.entries[0].value) {
+      bounded_heap_replace_top(&heap, i, value);
+    }
+  }
+
+  struct HeapEntry popped;
+  for (int expected = capacity - 1; expected >= 0; expected--) {
+    EXPECT_EQ(bounded_heap_pop(&heap, &popped), 1);
+    EXPECT_EQ(popped.value, expected);
+  }
+  EXPECT_EQ(bounded_heap_pop(&heap, &popped), 0);
+}
+
+TEST(TestMinHeap, PopsInIncreasingOrderPastInitialStorage) {
+  struct HeapEntry entries[4];
+  struct MinHeap heap;
+  init_min_heap(&heap, entries, 4);
+
+  for (int round = 0; round < 2; round++) {
+    min_heap_clear(&heap);
+    for (int i = 0; i < 1000; i++) {
+      EXPECT_EQ(min_heap_push(&heap, i, (i * 337) % 1000), 1);
+    }
+    EXPECT_NE(heap.entries, entries);
+
+    struct HeapEntry popped;
+    for (int expected = 0; expected < 1000; expected++) {
+      EXPECT_EQ(min_heap_pop(&heap, &popped), 1);
+      EXPECT_EQ(popped.value, expected);
+      EXPECT_EQ((popped.index * 337) % 1000, expected);
+    }
+    EXPECT_EQ(min_heap_pop(&heap, &popped), 0);
+  }
+  destroy_min_heap(&heap);
+  EXPECT_EQ(heap.entries, entries);
+}
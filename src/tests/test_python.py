@@ -0,0 +1,128 @@
+"""Tests of the katy CPython extension against brute force NumPy answers."""
+import sys
+import threading
+import unittest
+
+import numpy as np
+
+import katy
+
+
+def brute_force_knn(points, test_points, n):
+    distances = np.sqrt(((test_points[:, None, :] - points[None, :, :]) ** 2)
+                        .sum(axis=2))
+    order = np.argsort(distances, axis=1, kind="stable")[:, :n]
+    return np.take_along_axis(distances, order, axis=1)
+
+
+class TestKdTree(unittest.TestCase):
+    def setUp(self):
+        rng = np.random.default_rng(5)
+        self.points = rng.random((2000, 3))
+        self.test_points = rng.random((200, 3))
+
+    def test_references_points_without_copying(self):
+        for dtype in (np.float64, np.float32):
+            points = self.points.astype(dtype)
+            references = sys.getrefcount(points)
+            tree = katy.KdTree(points, leaf_size=8)
+            self.assertIs(tree.data, points)
+            self.assertEqual(sys.getrefcount(points), references + 1)
+            self.assertEqual((tree.size, tree.k), (2000, 3))
+            del tree
+            self.assertEqual(sys.getrefcount(points), references)
+
+    def test_converts_other_layouts(self):
+        points = np.asfortranarray(self.points)
+        tree = katy.KdTree(points)
+        self.assertIsNot(tree.data, points)
+        self.assertTrue(tree.data.flags.c_contiguous)
+        _, distances = tree.query(self.test_points, 4)
+        np.testing.assert_allclose(
+            distances, brute_force_knn(self.points, self.test_points, 4))
+
+    def test_query_matches_brute_force(self):
+        tree = katy.KdTree(self.points, leaf_size=8)
+        expected = brute_force_knn(self.points, self.test_points, 5)
+        for num_threads in (1, 3):
+            indices, distances = tree.query(self.test_points, 5,
+                                            num_threads=num_threads)
+            self.assertEqual(indices.shape, (200, 5))
+            self.assertEqual(distances.dtype, np.float64)
+            np.testing.assert_allclose(distances, expected)
+            found = np.linalg.norm(
+                self.points[indices] - self.test_points[:, None, :], axis=2)
+            np.testing.assert_allclose(found, expected)
+
+        indices, distances = tree.query(self.test_points[0], 5,
+                                        metric="squared_euclidean")
+        self.assertEqual(indices.shape, (5,))
+        np.testing.assert_allclose(distances, expected[0] ** 2)
+
+    def test_query_pads_missing_neighbors(self):
+        tree = katy.KdTree(self.points[:3])
+        indices, distances = tree.query(self.test_points[:2], 5)
+        np.testing.assert_array_equal(indices[:, 3:], -1)
+        self.assertTrue(np.isinf(distances[:, 3:]).all())
+
+        empty = katy.KdTree(np.empty((0, 3)))
+        indices, _ = empty.query(self.test_points[:2], 2)
+        np.testing.assert_array_equal(indices, -1)
+
+    def test_query_range_matches_brute_force(self):
+        tree = katy.KdTree(self.points, leaf_size=8)
+        radii = np.array([0.1, 0.05, 0.2])
+        offsets, indices, distances = tree.query_range(
+            self.test_points, radii, metric="manhattan")
+        self.assertEqual(offsets.shape, (201,))
+        self.assertEqual(offsets[-1], len(indices))
+        for q, test_point in enumerate(self.test_points):
+            hits = indices[offsets[q]:offsets[q + 1]]
+            inside = (np.abs(self.points - test_point) <= radii).all(axis=1)
+            np.testing.assert_array_equal(np.sort(hits),
+                                          np.flatnonzero(inside))
+            np.testing.assert_allclose(
+                distances[offsets[q]:offsets[q + 1]],
+                np.abs(self.points[hits] - test_point).sum(axis=1))
+
+        indices, distances = tree.query_range(self.test_points[0], 0.1)
+        inside = (np.abs(self.points - self.test_points[0]) <= 0.1).all(axis=1)
+        np.testing.assert_array_equal(np.sort(indices), np.flatnonzero(inside))
+        self.assertIsNone(distances)
+
+    def test_rejects_invalid_arguments(self):
+        tree = katy.KdTree(self.points)
+        with self.assertRaises(ValueError):
+            tree.query(self.test_points, 3, metric="cosine")
+        with self.assertRaises(ValueError):
+            tree.query(self.test_points, 3, metric="minkowski_0.5")
+        with self.assertRaises(ValueError):
+            tree.query(self.test_points[:, :2], 3)
+        with self.assertRaises(ValueError):
+            tree.query(self.test_points, 0)
+        with self.assertRaises(ValueError):
+            tree.query_range(self.test_points, [0.1, 0.1])
+        with self.assertRaises(ValueError):
+            katy.KdTree(self.points[0])
+
+    def test_concurrent_queries_share_the_tree(self):
+        # Queries run without the GIL, so Python threads query the tree at
+        # the same time, and must agree with a single thread.
+        tree = katy.KdTree(self.points)
+        expected, _ = tree.query(self.test_points, 3)
+        results = [None] * 4
+
+        def run(i):
+            results[i], _ = tree.query(self.test_points, 3)
+
+        threads = [threading.Thread(target=run, args=(i,)) for i in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        for indices in results:
+            np.testing.assert_array_equal(indices, expected)
+
+
+if __name__ == "__main__":
+    unittest.main()
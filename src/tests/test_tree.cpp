@@ -1,3 +1,9 @@
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <utility>
+
 #include "gtest/gtest.h"
 
 extern "C" {
@@ -10,6 +16,7 @@ extern "C" {
 void random_nonzero_array(double *arr, int n, int range);
 void check_tree_invariant(struct KdTree *tree);
 void recursive_check_node_invariant(struct KdTree *tree, struct KdNode *node);
+double tree_coordinate(struct KdTree *tree, int position, int axis);
 
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
@@ -43,9 +50,26 @@ TEST(TestBuildTree, BuildLessThanLeafPoints) {
   random_nonzero_array(points, 10, 40);
   struct KdTree *tree = build_kd_tree(points, 5, 2, 20, false);
   EXPECT_TRUE(tree->root->is_leaf);
-  EXPECT_EQ(tree->root->low, nullptr);
-  EXPECT_EQ(tree->root->high, nullptr);
+  EXPECT_EQ(tree->root->low, -1);
+  EXPECT_EQ(tree->root->high, -1);
+  EXPECT_EQ(tree->num_nodes, 1);
+  check_tree_invariant(tree);
+}
+
+TEST(TestBuildTree, DefaultLeafSize) {
+  int size = 100;
+  int k = 2;
+  double points[200];
+  random_nonzero_array(points, size * k, 40);
+  struct KdBuildOptions options = {0};
+  struct KdTree *tree = build_kd_tree_with_options(points, size, k, &options);
+  struct KdTree *sized = build_kd_tree(points, size, k, 16, false);
+  EXPECT_EQ(tree->num_nodes, sized->num_nodes);
   check_tree_invariant(tree);
+  free_kd_tree(tree);
+  free_kd_tree(sized);
+  EXPECT_EQ(build_kd_tree(points, -1, k, 16, false), nullptr);
+  EXPECT_EQ(build_kd_tree_with_options(points, -1, k, &options), nullptr);
 }
 
 TEST(TestBuildTree, FewPoints) {
@@ -69,6 +93,315 @@ TEST(TestBuildTree, ManyPoints) {
   check_tree_invariant(tree);
 }
 
+TEST(TestBuildTree, IndicesArePermutation) {
+  int size = 5000;
+  double points[10000];
+  random_nonzero_array(points, 10000, 10000);
+  struct KdTree *tree = build_kd_tree(points, size, 2, 8, false);
+
+  std::vector<bool> seen(size, false);
+  for (int i = 0; i < size; i++) {
+    ASSERT_GE(tree->indices[i], 0);
+    ASSERT_LT(tree->indices[i], size);
+    EXPECT_FALSE(seen[tree->indices[i]]);
+    seen[tree->indices[i]] = true;
+  }
+  EXPECT_EQ(tree->root->start, 0);
+  EXPECT_EQ(tree->root->end, size);
+  free_kd_tree(tree);
+}
+
+TEST(TestBuildTree, MemoryIsLinear) {
+  int k = 2;
+  int leaf_size = 8;
+  for (int size = 1000; size <= 4000; size *= 2) {
+    double *points = (double *) malloc(sizeof(double) * size * k);
+    random_nonzero_array(points, size * k, 10000);
+    struct KdTree *tree = build_kd_tree(points, size, k, leaf_size, true);
+
+    size_t expected = sizeof(struct KdTree)
+                      + sizeof(struct KdNode) * tree->num_nodes
+                      + sizeof(double) * 2 * k * tree->num_nodes
+                      + sizeof(int) * size + sizeof(double) * size * k;
+    EXPECT_EQ(tree->memory_bytes, expected);
+    EXPECT_LE(tree->num_nodes, size / 2);  // leaves hold at least 4 points
+    free_kd_tree(tree);
+    free(points);
+  }
+}
+
+TEST(TestBuildTree, ReorderData) {
+  int size = 2000;
+  int k = 3;
+  double points[6000];
+  random_nonzero_array(points, size * k, 1000);
+  for (int copy = 0; copy < 2; copy++) {
+    struct KdBuildOptions options = {};
+    options.leaf_size = 16;
+    options.copy_data = copy;
+    options.reorder_data = true;
+    struct KdTree *tree = build_kd_tree_with_options(points, size, k, &options);
+    EXPECT_TRUE(tree->reordered);
+    EXPECT_TRUE(tree->copied);
+    EXPECT_NE(tree->data, points);
+    for (int i = 0; i < size; i++) {
+      for (int j = 0; j < k; j++) {
+        EXPECT_EQ(tree->data[i * k + j], points[tree->indices[i] * k + j]);
+      }
+    }
+    check_tree_invariant(tree);
+    free_kd_tree(tree);
+  }
+}
+
+TEST(TestBuildTree, DuplicateAndSortedPoints) {
+  int size = 20000;
+  int k = 2;
+  std::vector<double> duplicates(size * k, 7.0);
+  struct KdTree *tree = build_kd_tree(duplicates.data(), size, k, 4, false);
+  check_tree_invariant(tree);
+  free_kd_tree(tree);
+
+  std::vector<double> sorted(size * k);
+  for (int i = 0; i < size * k; i++) sorted[i] = i / k;
+  tree = build_kd_tree(sorted.data(), size, k, 4, false);
+  check_tree_invariant(tree);
+  free_kd_tree(tree);
+}
+
+TEST(TestBuildTree, ParallelBuildMatchesSerial) {
+  // Large enough that the top levels use block parallel splits.
+  int size = 300000;
+  int k = 3;
+  std::vector<double> points(size * k);
+  random_nonzero_array(points.data(), size * k, 100000);
+
+  struct KdBuildOptions options = {};
+  options.leaf_size = 16;
+  options.parallel_cutoff = 1000;
+  options.seed = 42;
+  struct KdTree *serial = build_kd_tree_with_options(points.data(), size, k,
+                                                     &options);
+  check_tree_invariant(serial);
+
+  for (int num_threads = 2; num_threads <= 4; num_threads++) {
+    options.num_threads = num_threads;
+    struct KdTree *parallel = build_kd_tree_with_options(points.data(), size,
+                                                         k, &options);
+    ASSERT_EQ(parallel->num_nodes, serial->num_nodes);
+    for (int i = 0; i < size; i++) {
+      ASSERT_EQ(parallel->indices[i], serial->indices[i]);
+    }
+    for (int i = 0; i < serial->num_nodes; i++) {
+      struct KdNode *expected = serial->nodes + i;
+      struct KdNode *actual = parallel->nodes + i;
+      ASSERT_EQ(actual->is_leaf, expected->is_leaf);
+      ASSERT_EQ(actual->start, expected->start);
+      ASSERT_EQ(actual->end, expected->end);
+      ASSERT_EQ(actual->low, expected->low);
+      ASSERT_EQ(actual->high, expected->high);
+      if (!expected->is_leaf) {
+        ASSERT_EQ(actual->split_axis, expected->split_axis);
+        ASSERT_EQ(actual->split_value, expected->split_value);
+      }
+    }
+    free_kd_tree(parallel);
+  }
+  free_kd_tree(serial);
+}
+
+TEST(TestBuildTree, SplitStrategies) {
+  // Tight clusters far apart, a run of duplicates and a sorted line.
+  int size = 6000;
+  int k = 3;
+  std::vector<double> points(size * k);
+  for (int i = 0; i < 4000; i++) {
+    double center = (i % 4) * 1000.0;
+    for (int j = 0; j < k; j++) {
+      points[i * k + j] = center + (rand() % 1000) / 1000.0;
+    }
+  }
+  for (int i = 4000; i < 5000; i++) {
+    for (int j = 0; j < k; j++) points[i * k + j] = 500.0;
+  }
+  for (int i = 5000; i < size; i++) {
+    for (int j = 0; j < k; j++) points[i * k + j] = i * (j + 1);
+  }
+  std::vector<double> queries(50 * k);
+  random_nonzero_array(queries.data(), 50 * k, 6000);
+  int n = 8;
+  char distance[] = "squared_euclidean";
+
+  struct KdBuildOptions options = {};
+  options.leaf_size = 8;
+  struct KdTree *median = build_kd_tree_with_options(points.data(), size, k,
+                                                     &options);
+  std::vector<int> expected_indices(50 * n);
+  std::vector<double> expected_distances(50 * n);
+  ASSERT_TRUE(kd_tree_query_n_nearest_neighbors_batch(
+      median, queries.data(), 50, n, distance, 1, expected_indices.data(),
+      expected_distances.data()));
+
+  enum SplitStrategy strategies[] = {SPLIT_MIDPOINT, SPLIT_SLIDING_MIDPOINT};
+  for (int s = 0; s < 2; s++) {
+    options.split_strategy = strategies[s];
+    struct KdTree *tree = build_kd_tree_with_options(points.data(), size, k,
+                                                     &options);
+    ASSERT_TRUE(tree != NULL);
+    check_tree_invariant(tree);
+    for (int i = 0; i < tree->num_nodes; i++) {
+      struct KdNode *node = tree->nodes + i;
+      if (node->is_leaf && options.split_strategy == SPLIT_SLIDING_MIDPOINT) {
+        EXPECT_GT(node->end, node->start);  // sliding never leaves one empty
+      }
+    }
+
+    std::vector<int> indices(50 * n);
+    std::vector<double> distances(50 * n);
+    ASSERT_TRUE(kd_tree_query_n_nearest_neighbors_batch(
+        tree, queries.data(), 50, n, distance, 1, indices.data(),
+        distances.data()));
+    EXPECT_EQ(distances, expected_distances);
+
+    double radii[] = {600.0, 600.0, 600.0};
+    EXPECT_EQ(kd_tree_query_range_count(tree, queries.data(), radii),
+              kd_tree_query_range_count(median, queries.data(), radii));
+    free_kd_tree(tree);
+  }
+  free_kd_tree(median);
+}
+
+TEST(TestBuildTree, BuildStats) {
+  int size = 20000;
+  int k = 3;
+  std::vector<double> points(size * k);
+  for (int i = 0; i < size * k; i++) {
+    points[i] = (double) rand() / RAND_MAX;
+  }
+  // Reused across builds, each of which frees the previous histogram.
+  struct KdBuildStats stats = {0};
+  struct KdBuildOptions options = {0};
+  options.leaf_size = 10;
+  options.stats = &stats;
+  enum SplitStrategy strategies[] = {SPLIT_MEDIAN, SPLIT_MEDIAN,
+                                     SPLIT_SLIDING_MIDPOINT};
+  for (int s = 0; s < 3; s++) {
+    options.split_strategy = strategies[s];
+    options.num_threads = s == 1 ? 3 : 1;
+    struct KdTree *tree = build_kd_tree_with_options(points.data(), size, k,
+                                                     &options);
+    ASSERT_NE(tree, nullptr);
+    int num_leaves = 0;
+    for (int i = 0; i < tree->num_nodes; i++) {
+      num_leaves += tree->nodes[i].is_leaf;
+    }
+    EXPECT_EQ(stats.num_leaves, num_leaves);
+    EXPECT_GT(stats.depth, 10);
+    EXPECT_LT(stats.depth, 40);
+    EXPECT_LE(stats.max_leaf_size, 10);
+    int leaves = 0;
+    int points_in_leaves = 0;
+    for (int i = 0; i <= stats.max_leaf_size; i++) {
+      leaves += stats.leaf_sizes[i];
+      points_in_leaves += i * stats.leaf_sizes[i];
+    }
+    EXPECT_EQ(leaves, num_leaves);
+    EXPECT_EQ(points_in_leaves, size);
+    EXPECT_GT(stats.split_axis_seconds, 0);
+    EXPECT_GT(stats.partition_seconds, 0);
+    EXPECT_GT(stats.seconds, 0);
+    free_kd_tree(tree);
+  }
+  free_kd_build_stats(&stats);
+}
+
+TEST(TestQuery, QueryStats) {
+  int size = 20000;
+  int k = 3;
+  int n = 5;
+  int num_queries = 50;
+  std::vector<double> points(size * k);
+  for (int i = 0; i < size * k; i++) {
+    points[i] = (double) rand() / RAND_MAX;
+  }
+  struct KdTree *tree = build_kd_tree(points.data(), size, k, 8, false);
+  std::vector<int> indices(num_queries * n);
+  std::vector<double> distances(num_queries * n);
+  char distance[] = "squared_euclidean";
+
+  for (int order = 0; order < 2; order++) {
+    struct KdQueryStats stats;
+    struct KdQueryOptions options = {0};
+    options.search_order = (enum SearchOrder) order;
+    options.stats = &stats;
+    struct KdQueryStats totals = {0};
+    for (int q = 0; q < num_queries; q++) {
+      struct KdResult *results;
+      ASSERT_EQ(kd_tree_query_n_nearest_neighbors_with_options(
+                    tree, points.data() + 7 + (q * k), n, distance, &options,
+                    &results),
+                n);
+      free(results);
+      EXPECT_GT(stats.leaves_scanned, 0);
+      EXPECT_GE(stats.nodes_visited, stats.leaves_scanned);
+      EXPECT_LE(stats.distance_evaluations, 8 * stats.leaves_scanned);
+      EXPECT_GE(stats.distance_evaluations, n);
+      EXPECT_GE(stats.heap_operations, n);
+      EXPECT_GT(stats.subtrees_pruned, 0);
+      totals.nodes_visited += stats.nodes_visited;
+      totals.leaves_scanned += stats.leaves_scanned;
+      totals.distance_evaluations += stats.distance_evaluations;
+      totals.subtrees_pruned += stats.subtrees_pruned;
+      totals.heap_operations += stats.heap_operations;
+    }
+
+    // Batches report the totals of their queries whatever the threads.
+    for (int num_threads = 1; num_threads <= 3; num_threads += 2) {
+      ASSERT_TRUE(kd_tree_query_n_nearest_neighbors_batch_with_options(
+          tree, points.data() + 7, num_queries, n, distance, &options,
+          num_threads, indices.data(), distances.data()));
+      EXPECT_EQ(stats.nodes_visited, totals.nodes_visited);
+      EXPECT_EQ(stats.leaves_scanned, totals.leaves_scanned);
+      EXPECT_EQ(stats.distance_evaluations, totals.distance_evaluations);
+      EXPECT_EQ(stats.subtrees_pruned, totals.subtrees_pruned);
+      EXPECT_EQ(stats.heap_operations, totals.heap_operations);
+    }
+  }
+  free_kd_tree(tree);
+}
+
+TEST(TestQuery, ReorderedResultsReportCallerIndices) {
+  int size = 2000;
+  int k = 3;
+  double points[6000];
+  random_nonzero_array(points, size * k, 1000);
+  struct KdTree *plain = build_kd_tree(points, size, k, 16, false);
+  struct KdBuildOptions options = {};
+  options.leaf_size = 16;
+  options.reorder_data = true;
+  struct KdTree *reordered = build_kd_tree_with_options(points, size, k,
+                                                        &options);
+
+  double test_point[] = {500.0, 500.0, 500.0};
+  char distance[] = "squared_euclidean";
+  struct KdResult *expected, *actual;
+  int n = 10;
+  EXPECT_EQ(kd_tree_query_n_nearest_neighbors(plain, test_point, n, distance,
+                                              &expected), n);
+  EXPECT_EQ(kd_tree_query_n_nearest_neighbors(reordered, test_point, n,
+                                              distance, &actual), n);
+  for (int i = 0; i < n; i++) {
+    EXPECT_EQ(actual[i].distance, expected[i].distance);
+    for (int j = 0; j < k; j++) {
+      EXPECT_EQ(points[actual[i].index * k + j], actual[i].point[j]);
+    }
+  }
+  free(expected);
+  free(actual);
+  free_kd_tree(plain);
+  free_kd_tree(reordered);
+}
+
 TEST(TestQuery, NearestNeighbor) {
   // a 10x10 cube
   double points[] = {0.0, 0.0, 10.0, 10.0, 10.0, 0.0, 0.0, 10.0};
@@ -86,9 +419,717 @@ TEST(TestQuery, NearestNeighbor) {
   EXPECT_EQ(num_results, n);
   EXPECT_EQ(results[0].point[0], 10);
   EXPECT_EQ(results[0].point[1], 10);
+  EXPECT_EQ(results[0].index, 1);
   EXPECT_EQ(results[0].distance, 2);
 }
 
+TEST(TestQuery, NearestNeighborsMatchBruteForce) {
+  int size = 2000;
+  int k = 4;
+  std::vector<double> points(size * k);
+  random_nonzero_array(points.data(), size * k, 1000);
+  struct KdTree *tree = build_kd_tree(points.data(), size, k, 8, false);
+  char distance[] = "squared_euclidean";
+
+  for (int n = 1; n <= 100; n += 33) {
+    double test_point[] = {250.0, 500.0, 750.0, 100.0};
+    std::vector<double> expected(size);
+    for (int i = 0; i < size; i++) {
+      expected[i] = 0;
+      for (int j = 0; j < k; j++) {
+        double diff = points[i * k + j] - test_point[j];
+        expected[i] += diff * diff;
+      }
+    }
+    std::sort(expected.begin(), expected.end());
+
+    struct KdResult *results;
+    ASSERT_EQ(kd_tree_query_n_nearest_neighbors(tree, test_point, n, distance,
+                                                &results), n);
+    // furthest first
+    for (int i = 0; i < n; i++) {
+      EXPECT_EQ(results[i].distance, expected[n - 1 - i]);
+    }
+    free(results);
+  }
+  free_kd_tree(tree);
+}
+
+TEST(TestQuery, MetricsMatchBruteForce) {
+  int size = 3000;
+  int k = 5;
+  int n = 8;
+  std::vector<double> points(size * k);
+  for (int i = 0; i < size * k; i++) {
+    points[i] = (double) rand() / RAND_MAX;
+  }
+  struct KdTree *tree = build_kd_tree(points.data(), size, k, 8, false);
+  char metrics[][32] = {"euclidean", "chebyshev", "minkowski_3",
+                        "minkowski_1.5", "minkowski_inf"};
+  double orders[] = {2, INFINITY, 3, 1.5, INFINITY};
+
+  for (int m = 0; m < 5; m++) {
+    for (int t = 0; t < 20; t++) {
+      double *test_point = points.data() + (t * 101 * k);
+      std::vector<double> expected(size);
+      for (int i = 0; i < size; i++) {
+        double distance = 0;
+        for (int j = 0; j < k; j++) {
+          double diff = fabs(points[i * k + j] - test_point[j]);
+          if (std::isinf(orders[m])) {
+            distance = std::max(distance, diff);
+          } else {
+            distance += pow(diff, orders[m]);
+          }
+        }
+        expected[i] = std::isinf(orders[m]) ? distance
+                                       : pow(distance, 1 / orders[m]);
+      }
+      std::sort(expected.begin(), expected.end());
+
+      struct KdResult *results;
+      ASSERT_EQ(kd_tree_query_n_nearest_neighbors(tree, test_point, n,
+                                                  metrics[m], &results), n);
+      // Metrics parsed up front give the same results without a name.
+      struct KdMetric metric;
+      ASSERT_TRUE(parse_kd_metric(metrics[m], &metric));
+      struct KdQueryOptions options = {0};
+      options.metric = &metric;
+      struct KdResult *parsed_results;
+      ASSERT_EQ(kd_tree_query_n_nearest_neighbors_with_options(
+                    tree, test_point, n, NULL, &options, &parsed_results),
+                n);
+      // furthest first
+      for (int i = 0; i < n; i++) {
+        EXPECT_NEAR(results[i].distance, expected[n - 1 - i], 1e-12)
+            << metrics[m];
+        EXPECT_EQ(parsed_results[i].index, results[i].index);
+        EXPECT_EQ(parsed_results[i].distance, results[i].distance);
+      }
+      free(results);
+      free(parsed_results);
+    }
+  }
+
+  // Unknown metrics fail the query rather than the program.
+  char unknown[] = "cosine";
+  struct KdResult *results;
+  EXPECT_EQ(kd_tree_query_n_nearest_neighbors(tree, points.data(), n, unknown,
+                                              &results), 0);
+  EXPECT_EQ(kd_tree_query_range(tree, points.data(), points.data(), unknown,
+                                &results), 0);
+  struct KdRangeBuffer buffer;
+  init_kd_range_buffer(&buffer);
+  EXPECT_EQ(kd_tree_query_range_into(tree, points.data(), points.data(),
+                                     unknown, &buffer), -1);
+  std::vector<int> indices(n);
+  std::vector<double> distances(n);
+  EXPECT_FALSE(kd_tree_query_n_nearest_neighbors_batch(
+      tree, points.data(), 1, n, unknown, 1, indices.data(),
+      distances.data()));
+  EXPECT_TRUE(std::isnan(kd_distance(points.data(), points.data(), k,
+                                     unknown)));
+  free_kd_tree(tree);
+}
+
+TEST(TestQuery, ApproximateNearestNeighbors) {
+  int size = 20000;
+  int k = 6;
+  int n = 10;
+  std::vector<double> points(size * k);
+  for (int i = 0; i < size * k; i++) {
+    points[i] = (double) rand() / RAND_MAX;
+  }
+  struct KdTree *tree = build_kd_tree(points.data(), size, k, 8, false);
+  char metrics[][32] = {"euclidean", "manhattan", "minkowski_3"};
+  double epsilons[] = {0.1, 0.5, 2.0};
+
+  for (int m = 0; m < 3; m++) {
+    for (int e = 0; e < 3; e++) {
+      struct KdQueryOptions options = {0};
+      options.epsilon = epsilons[e];
+      for (int t = 0; t < 20; t++) {
+        double *test_point = points.data() + (t * 499 * k);
+        struct KdResult *exact;
+        struct KdResult *approximate;
+        ASSERT_EQ(kd_tree_query_n_nearest_neighbors(tree, test_point, n,
+                                                    metrics[m], &exact), n);
+        ASSERT_EQ(kd_tree_query_n_nearest_neighbors_with_options(
+                      tree, test_point, n, metrics[m], &options,
+                      &approximate), n);
+        for (int i = 0; i < n; i++) {
+          EXPECT_GE(approximate[i].distance, exact[i].distance);
+          EXPECT_LE(approximate[i].distance,
+                    (1 + epsilons[e]) * exact[i].distance + 1e-12);
+        }
+        free(exact);
+        free(approximate);
+      }
+    }
+  }
+
+  // A single leaf holds the nearest points of its own cell only, and enough
+  // leaves make the query exact again.
+  struct KdQueryOptions options = {0};
+  int num_queries = 50;
+  std::vector<int> indices(num_queries * n);
+  std::vector<double> distances(num_queries * n);
+  for (int max_leaves = 1; max_leaves <= size; max_leaves *= 50) {
+    options.max_leaves = max_leaves;
+    ASSERT_TRUE(kd_tree_query_n_nearest_neighbors_batch_with_options(
+        tree, points.data(), num_queries, n, metrics[0], &options, 2,
+        indices.data(), distances.data()));
+    for (int q = 0; q < num_queries; q++) {
+      struct KdResult *results;
+      int num_results = kd_tree_query_n_nearest_neighbors_with_options(
+          tree, points.data() + (q * k), n, metrics[0], &options, &results);
+      if (max_leaves == 1) {
+        EXPECT_LE(num_results, 8);
+      } else {
+        EXPECT_EQ(num_results, n);
+      }
+      for (int i = 0; i < num_results; i++) {
+        EXPECT_EQ(distances[(q * n) + num_results - 1 - i],
+                  results[i].distance);
+      }
+      free(results);
+    }
+  }
+  struct KdResult *exact;
+  struct KdResult *results;
+  ASSERT_EQ(kd_tree_query_n_nearest_neighbors(tree, points.data(), n,
+                                              metrics[0], &exact), n);
+  ASSERT_EQ(kd_tree_query_n_nearest_neighbors_with_options(
+                tree, points.data(), n, metrics[0], &options, &results), n);
+  for (int i = 0; i < n; i++) {
+    EXPECT_EQ(results[i].distance, exact[i].distance);
+  }
+  free(exact);
+  free(results);
+  free_kd_tree(tree);
+}
+
+TEST(TestQuery, BestFirstMatchesDepthFirst) {
+  int size = 20000;
+  int k = 5;
+  int n = 12;
+  int num_queries = 40;
+  std::vector<double> points(size * k);
+  for (int i = 0; i < size * k; i++) {
+    points[i] = (double) rand() / RAND_MAX;
+  }
+  struct KdTree *tree = build_kd_tree(points.data(), size, k, 8, false);
+  char metrics[][32] = {"squared_euclidean", "manhattan", "chebyshev",
+                        "minkowski_3"};
+  struct KdQueryOptions options = {0};
+  options.search_order = SEARCH_BEST_FIRST;
+  std::vector<int> indices(num_queries * n);
+  std::vector<double> distances(num_queries * n);
+
+  for (int m = 0; m < 4; m++) {
+    ASSERT_TRUE(kd_tree_query_n_nearest_neighbors_batch_with_options(
+        tree, points.data() + 7, num_queries, n, metrics[m], &options, 2,
+        indices.data(), distances.data()));
+    for (int q = 0; q < num_queries; q++) {
+      // Off the data points, so the queue holds more than a few nodes.
+      double *test_point = points.data() + 7 + (q * k);
+      struct KdResult *depth_first;
+      struct KdResult *best_first;
+      ASSERT_EQ(kd_tree_query_n_nearest_neighbors(tree, test_point, n,
+                                                  metrics[m], &depth_first),
+                n);
+      ASSERT_EQ(kd_tree_query_n_nearest_neighbors_with_options(
+                    tree, test_point, n, metrics[m], &options, &best_first),
+                n);
+      for (int i = 0; i < n; i++) {
+        EXPECT_EQ(best_first[i].distance, depth_first[i].distance)
+            << metrics[m];
+        EXPECT_EQ(distances[(q * n) + n - 1 - i], best_first[i].distance);
+      }
+      free(depth_first);
+      free(best_first);
+    }
+  }
+
+  // With a budget of one leaf only the test point's own leaf is scanned.
+  options.max_leaves = 1;
+  struct KdResult *results;
+  int num_results = kd_tree_query_n_nearest_neighbors_with_options(
+      tree, points.data(), n, metrics[0], &options, &results);
+  EXPECT_LE(num_results, 8);
+  ASSERT_GT(num_results, 0);
+  EXPECT_EQ(results[num_results - 1].distance, 0);
+  free(results);
+  free_kd_tree(tree);
+}
+
+TEST(TestStore, LoadedTreeMatchesBuiltTree) {
+  int size = 5000;
+  int k = 4;
+  int n = 8;
+  int num_queries = 30;
+  std::vector<double> points(size * k);
+  std::vector<float> float_points(size * k);
+  for (int i = 0; i < size * k; i++) {
+    points[i] = (double) rand() / RAND_MAX;
+    float_points[i] = (float) points[i];
+  }
+  std::string path = ::testing::TempDir() + "katy_test_tree.kd";
+
+  for (int c = 0; c < 4; c++) {
+    struct KdBuildOptions options = {0};
+    options.leaf_size = 8;
+    bool save_points = c == 1;
+    options.reorder_data = c == 2;
+    options.quantization = c == 3 ? QUANTIZE_INT8 : QUANTIZE_NONE;
+    struct KdTree *tree;
+    if (c == 2) {
+      tree = build_float_kd_tree_with_options(float_points.data(), size, k,
+                                              &options);
+    } else {
+      options.split_strategy = c == 1 ? SPLIT_SLIDING_MIDPOINT
+                                      : SPLIT_MEDIAN;
+      tree = build_kd_tree_with_options(points.data(), size, k, &options);
+    }
+    ASSERT_NE(tree, nullptr);
+    ASSERT_TRUE(save_kd_tree(tree, (char *) path.c_str(), save_points));
+    void *caller_points = c == 2 ? (void *) float_points.data()
+                                 : (void *) points.data();
+    struct KdTree *loaded = load_kd_tree((char *) path.c_str(),
+                                         save_points ? NULL : caller_points);
+    ASSERT_NE(loaded, nullptr) << c;
+    EXPECT_TRUE(kd_tree_validate(loaded));
+    EXPECT_EQ(loaded->size, tree->size);
+    EXPECT_EQ(loaded->num_nodes, tree->num_nodes);
+    EXPECT_EQ(loaded->point_type, tree->point_type);
+    EXPECT_EQ(loaded->quantization, tree->quantization);
+    EXPECT_EQ(loaded->reordered, tree->reordered);
+    // Saved points are read from the mapping, others from the caller.
+    char *data = c == 2 ? (char *) loaded->float_data : (char *) loaded->data;
+    char *mapping = (char *) loaded->mapping;
+    EXPECT_EQ(data >= mapping && data < mapping + loaded->mapping_bytes,
+              save_points || tree->reordered);
+    // Internal nodes have no quantization steps, and save zeros for them.
+    for (int i = 0; c == 3 && i < loaded->num_nodes; i++) {
+      for (int j = 0; j < k && !loaded->nodes[i].is_leaf; j++) {
+        EXPECT_EQ(loaded->steps[(i * k) + j], 0);
+      }
+    }
+
+    std::vector<int> indices(num_queries * n);
+    std::vector<double> distances(num_queries * n);
+    std::vector<int> loaded_indices(num_queries * n);
+    std::vector<double> loaded_distances(num_queries * n);
+    char metric[] = "euclidean";
+    ASSERT_TRUE(kd_tree_query_n_nearest_neighbors_batch(
+        tree, points.data() + 3, num_queries, n, metric, 1, indices.data(),
+        distances.data()));
+    ASSERT_TRUE(kd_tree_query_n_nearest_neighbors_batch(
+        loaded, points.data() + 3, num_queries, n, metric, 2,
+        loaded_indices.data(), loaded_distances.data()));
+    EXPECT_EQ(loaded_indices, indices);
+    EXPECT_EQ(loaded_distances, distances);
+
+    double radii[] = {0.1, 0.1, 0.1, 0.1};
+    EXPECT_EQ(kd_tree_query_range_count(loaded, points.data(), radii),
+              kd_tree_query_range_count(tree, points.data(), radii));
+    free_kd_tree(loaded);
+    free_kd_tree(tree);
+  }
+  remove(path.c_str());
+}
+
+TEST(TestStore, LoadRejectsInvalidFiles) {
+  int size = 100;
+  int k = 2;
+  std::vector<double> points(size * k);
+  for (int i = 0; i < size * k; i++) {
+    points[i] = (double) rand() / RAND_MAX;
+  }
+  std::string path = ::testing::TempDir() + "katy_test_invalid.kd";
+  char *file_path = (char *) path.c_str();
+  remove(file_path);
+  EXPECT_EQ(load_kd_tree(file_path, points.data()), nullptr);
+
+  struct KdTree *tree = build_kd_tree(points.data(), size, k, 4, false);
+  ASSERT_TRUE(save_kd_tree(tree, file_path, false));
+  // Trees saved without their points need them back.
+  EXPECT_EQ(load_kd_tree(file_path, NULL), nullptr);
+
+  FILE *file = fopen(file_path, "rb");
+  std::vector<char> bytes;
+  int byte;
+  while ((byte = fgetc(file)) != EOF) {
+    bytes.push_back((char) byte);
+  }
+  fclose(file);
+
+  // Truncated, then with a different version.
+  file = fopen(file_path, "wb");
+  fwrite(bytes.data(), 1, bytes.size() - 1, file);
+  fclose(file);
+  EXPECT_EQ(load_kd_tree(file_path, points.data()), nullptr);
+  bytes[8]++;
+  file = fopen(file_path, "wb");
+  fwrite(bytes.data(), 1, bytes.size(), file);
+  fclose(file);
+  EXPECT_EQ(load_kd_tree(file_path, points.data()), nullptr);
+  bytes[8]--;
+
+  // Loads read no more than the header, so a valid header over a root that
+  // is its own child, then over an index past the points, loads but fails
+  // validation. The header keeps the nodes and indices offsets at bytes 48
+  // and 64.
+  uint64_t nodes_offset;
+  uint64_t indices_offset;
+  memcpy(&nodes_offset, &bytes[48], sizeof(nodes_offset));
+  memcpy(&indices_offset, &bytes[64], sizeof(indices_offset));
+  struct KdNode root;
+  memcpy(&root, &bytes[nodes_offset], sizeof(root));
+  ASSERT_FALSE(root.is_leaf);
+  struct KdNode looping = root;
+  looping.high = 0;
+  int outside = size;
+  for (int c = 0; c < 3; c++) {
+    std::vector<char> corrupt = bytes;
+    if (c == 1) {
+      memcpy(&corrupt[nodes_offset], &looping, sizeof(looping));
+    } else if (c == 2) {
+      memcpy(&corrupt[indices_offset], &outside, sizeof(outside));
+    }
+    file = fopen(file_path, "wb");
+    fwrite(corrupt.data(), 1, corrupt.size(), file);
+    fclose(file);
+    struct KdTree *loaded = load_kd_tree(file_path, points.data());
+    ASSERT_NE(loaded, nullptr) << c;
+    EXPECT_EQ(kd_tree_validate(loaded), c == 0) << c;
+    free_kd_tree(loaded);
+  }
+
+  free_kd_tree(tree);
+  remove(file_path);
+}
+
+/* Reads points from memory, one more point each pass if `grow` is set. */
+struct MemoryReader {
+  double *points;
+  int num_points;
+  int k;
+  int next;
+  bool grow;
+};
+
+int read_memory_points(void *context, double *points, int max_points) {
+  struct MemoryReader *reader = (struct MemoryReader *) context;
+  int num_read = std::min(max_points, reader->num_points - reader->next);
+  std::copy(reader->points + (reader->next * reader->k),
+            reader->points + ((reader->next + num_read) * reader->k),
+            points);
+  reader->next += num_read;
+  return num_read;
+}
+
+int rewind_memory_points(void *context) {
+  struct MemoryReader *reader = (struct MemoryReader *) context;
+  reader->next = 0;
+  reader->num_points += reader->grow;
+  return 1;
+}
+
+TEST(TestStore, StreamingBuildMatchesInMemoryBuild) {
+  int size = 20000;
+  int k = 3;
+  int n = 10;
+  int num_queries = 50;
+  std::vector<double> points(size * k);
+  for (int i = 0; i < size * k; i++) {
+    points[i] = (double) rand() / RAND_MAX;
+  }
+  std::string points_path = ::testing::TempDir() + "katy_test_points.bin";
+  std::string path = ::testing::TempDir() + "katy_test_streamed.kd";
+  FILE *file = fopen(points_path.c_str(), "wb");
+  ASSERT_EQ(fwrite(points.data(), sizeof(double), points.size(), file),
+            points.size());
+  fclose(file);
+
+  // Small enough a budget for a few dozen cells.
+  struct KdStreamOptions options = {};
+  options.build.leaf_size = 8;
+  options.memory_bytes = 100000;
+  options.sample_size = 4000;
+  ASSERT_TRUE(build_kd_tree_from_file((char *) points_path.c_str(), k,
+                                      &options, (char *) path.c_str()));
+  struct KdTree *streamed = load_kd_tree((char *) path.c_str(), NULL);
+  ASSERT_NE(streamed, nullptr);
+  EXPECT_TRUE(kd_tree_validate(streamed));
+  EXPECT_EQ(streamed->size, size);
+  EXPECT_GT(streamed->num_nodes, 2 * size / 8 - 1);
+  check_tree_invariant(streamed);
+  std::vector<int> seen(size, 0);
+  for (int i = 0; i < size; i++) {
+    int index = streamed->indices[i];
+    ASSERT_TRUE(index >= 0 && index < size);
+    seen[index]++;
+    for (int j = 0; j < k; j++) {
+      EXPECT_EQ(kd_tree_point(streamed, i)[j], points[(index * k) + j]);
+    }
+  }
+  EXPECT_EQ(std::count(seen.begin(), seen.end(), 1), size);
+
+  struct KdTree *tree = build_kd_tree(points.data(), size, k, 8, false);
+  std::vector<int> indices(num_queries * n);
+  std::vector<double> distances(num_queries * n);
+  std::vector<int> streamed_indices(num_queries * n);
+  std::vector<double> streamed_distances(num_queries * n);
+  char metric[] = "squared_euclidean";
+  ASSERT_TRUE(kd_tree_query_n_nearest_neighbors_batch(
+      tree, points.data() + 1, num_queries, n, metric, 1, indices.data(),
+      distances.data()));
+  ASSERT_TRUE(kd_tree_query_n_nearest_neighbors_batch(
+      streamed, points.data() + 1, num_queries, n, metric, 1,
+      streamed_indices.data(), streamed_distances.data()));
+  EXPECT_EQ(streamed_indices, indices);
+  EXPECT_EQ(streamed_distances, distances);
+  free_kd_tree(streamed);
+  free_kd_tree(tree);
+
+  // An input that changes between passes is refused.
+  struct MemoryReader memory_reader = {points.data(), size - 1, k, 0, true};
+  struct KdPointReader reader = {read_memory_points, rewind_memory_points,
+                                 &memory_reader};
+  EXPECT_FALSE(build_kd_tree_streaming(&reader, k, &options,
+                                       (char *) path.c_str()));
+  memory_reader = {points.data(), size, k, 0, false};
+  EXPECT_TRUE(build_kd_tree_streaming(&reader, k, &options,
+                                      (char *) path.c_str()));
+  remove(points_path.c_str());
+  remove(path.c_str());
+}
+
+TEST(TestQuery, NearestNeighborsInUnitCube) {
+  // Squared distances below one must not be mistaken for axis offsets.
+  int size = 10000;
+  int k = 3;
+  int n = 10;
+  int num_queries = 20;
+  std::vector<double> points(size * k);
+  std::vector<double> queries(num_queries * k);
+  for (size_t i = 0; i < points.size(); i++) {
+    points[i] = rand() / (double) RAND_MAX;
+  }
+  for (size_t i = 0; i < queries.size(); i++) {
+    queries[i] = rand() / (double) RAND_MAX;
+  }
+  struct KdTree *tree = build_kd_tree(points.data(), size, k, 8, false);
+  char squared_euclidean[] = "squared_euclidean";
+  char manhattan[] = "manhattan";
+  char *metrics[] = {squared_euclidean, manhattan};
+
+  for (int m = 0; m < 2; m++) {
+    std::vector<int> indices(num_queries * n);
+    std::vector<double> distances(num_queries * n);
+    ASSERT_TRUE(kd_tree_query_n_nearest_neighbors_batch(
+        tree, queries.data(), num_queries, n, metrics[m], 1, indices.data(),
+        distances.data()));
+    for (int q = 0; q < num_queries; q++) {
+      std::vector<double> expected(size);
+      for (int i = 0; i < size; i++) {
+        expected[i] = 0;
+        for (int j = 0; j < k; j++) {
+          double diff = points[i * k + j] - queries[q * k + j];
+          expected[i] += m == 0 ? diff * diff : std::fabs(diff);
+        }
+      }
+      std::sort(expected.begin(), expected.end());
+      for (int i = 0; i < n; i++) {
+        EXPECT_NEAR(distances[q * n + i], expected[i], 1e-12);
+      }
+    }
+  }
+  free_kd_tree(tree);
+}
+
+TEST(TestQuery, BatchMatchesSingleQueries) {
+  int size = 3000;
+  int k = 3;
+  int n = 5;
+  int num_queries = 500;
+  std::vector<double> points(size * k);
+  std::vector<double> queries(num_queries * k);
+  random_nonzero_array(points.data(), size * k, 1000);
+  random_nonzero_array(queries.data(), num_queries * k, 1000);
+  struct KdTree *tree = build_kd_tree(points.data(), size, k, 8, false);
+  char distance[] = "squared_euclidean";
+
+  for (int num_threads = 1; num_threads <= 4; num_threads *= 2) {
+    std::vector<int> indices(num_queries * n);
+    std::vector<double> distances(num_queries * n);
+    EXPECT_EQ(kd_tree_query_n_nearest_neighbors_batch(
+        tree, queries.data(), num_queries, n, distance, num_threads,
+        indices.data(), distances.data()), 1);
+
+    for (int q = 0; q < num_queries; q++) {
+      struct KdResult *results;
+      int num_results = kd_tree_query_n_nearest_neighbors(
+          tree, queries.data() + q * k, n, distance, &results);
+      ASSERT_EQ(num_results, n);
+      // single queries come out furthest first, batch rows nearest first
+      for (int i = 0; i < n; i++) {
+        EXPECT_EQ(distances[q * n + i], results[n - 1 - i].distance);
+      }
+      free(results);
+    }
+  }
+  free_kd_tree(tree);
+}
+
+TEST(TestQuery, ContextQueriesMatchQueries) {
+  // More axes than the stack buffers hold, so scratch test points of float
+  // trees come from the context and the batch workers' contexts.
+  int size = 2000;
+  int k = 72;
+  int num_queries = 50;
+  std::vector<double> points(size * k);
+  std::vector<double> queries(num_queries * k);
+  random_nonzero_array(points.data(), size * k, 1000);
+  random_nonzero_array(queries.data(), num_queries * k, 1000);
+  std::vector<float> float_points(points.begin(), points.end());
+  struct KdBuildOptions build_options = {0};
+  build_options.leaf_size = 8;
+  struct KdTree *trees[] = {
+      build_kd_tree(points.data(), size, k, 8, false),
+      build_float_kd_tree_with_options(float_points.data(), size, k,
+                                       &build_options)};
+  struct KdQueryContext *context = create_kd_query_context();
+  ASSERT_NE(context, nullptr);
+  char distance[] = "euclidean";
+  int neighbor_counts[] = {3, 100, 10};
+
+  for (int t = 0; t < 2; t++) {
+    ASSERT_NE(trees[t], nullptr);
+    for (int order = 0; order < 2; order++) {
+      struct KdQueryOptions options = {0};
+      options.search_order = order == 0 ? SEARCH_DEPTH_FIRST
+                                        : SEARCH_BEST_FIRST;
+      for (int c = 0; c < 3; c++) {
+        int n = neighbor_counts[c];
+        std::vector<int> indices(num_queries * n);
+        std::vector<double> distances(num_queries * n);
+        ASSERT_EQ(kd_tree_query_n_nearest_neighbors_batch_with_options(
+            trees[t], queries.data(), num_queries, n, distance, &options, 2,
+            indices.data(), distances.data()), 1);
+        for (int q = 0; q < num_queries; q++) {
+          double *test_point = queries.data() + q * k;
+          struct KdResult *expected;
+          struct KdResult *results;
+          int num_expected = kd_tree_query_n_nearest_neighbors_with_options(
+              trees[t], test_point, n, distance, &options, &expected);
+          int num_results = kd_tree_query_n_nearest_neighbors_in_context(
+              trees[t], test_point, n, distance, &options, context, &results);
+          ASSERT_EQ(num_results, num_expected);
+          ASSERT_EQ(num_results, n);
+          for (int i = 0; i < n; i++) {
+            EXPECT_EQ(results[i].index, expected[i].index);
+            EXPECT_EQ(results[i].distance, expected[i].distance);
+            EXPECT_EQ(distances[q * n + i], expected[n - 1 - i].distance);
+          }
+          free(expected);
+        }
+      }
+    }
+    free_kd_tree(trees[t]);
+  }
+
+  // Once grown, the context hands out the same memory for smaller queries.
+  double points_2d[] = {1.0, 1.0, 2.0, 2.0, 3.0, 3.0};
+  struct KdTree *tree = build_kd_tree(points_2d, 3, 2, 1, false);
+  double test_point[] = {2.1, 2.1};
+  struct KdResult *first;
+  struct KdResult *second;
+  EXPECT_EQ(kd_tree_query_n_nearest_neighbors_in_context(
+      tree, test_point, 5, distance, NULL, context, &first), 3);
+  EXPECT_EQ(first[2].index, 1);
+  EXPECT_EQ(kd_tree_query_n_nearest_neighbors_in_context(
+      tree, test_point, 1, distance, NULL, context, &second), 1);
+  EXPECT_EQ(second, first);
+  EXPECT_EQ(second[0].index, 1);
+  free_kd_tree(tree);
+  free_kd_query_context(context);
+}
+
+TEST(TestQuery, BatchPadsMissingNeighbors) {
+  double points[] = {0.0, 0.0, 10.0, 10.0};
+  struct KdTree *tree = build_kd_tree(points, 2, 2, 1, false);
+  double queries[] = {1.0, 1.0};
+  int indices[3];
+  double distances[3];
+  char distance[] = "squared_euclidean";
+  EXPECT_EQ(kd_tree_query_n_nearest_neighbors_batch(tree, queries, 1, 3,
+                                                    distance, 2, indices,
+                                                    distances), 1);
+  EXPECT_EQ(indices[0], 0);
+  EXPECT_EQ(distances[0], 2);
+  EXPECT_EQ(indices[1], 1);
+  EXPECT_EQ(indices[2], -1);
+  EXPECT_TRUE(std::isinf(distances[2]));
+  free_kd_tree(tree);
+}
+
+TEST(TestQuery, AllNearestNeighborsMatchBatch) {
+  int size = 3000;
+  int k = 3;
+  int n = 6;
+  std::vector<double> points(size * k);
+  for (int i = 0; i < size * k; i++) {
+    points[i] = (double) rand() / RAND_MAX;
+  }
+  struct KdBuildOptions options = {0};
+  options.leaf_size = 8;
+  options.reorder_data = true;
+  struct KdTree *tree = build_kd_tree_with_options(points.data(), size, k,
+                                                   &options);
+  char metrics[][32] = {"squared_euclidean", "manhattan", "chebyshev",
+                        "minkowski_3"};
+  std::vector<int> indices(size * n);
+  std::vector<double> distances(size * n);
+  std::vector<int> batch_indices(size * (n + 1));
+  std::vector<double> batch_distances(size * (n + 1));
+
+  for (int m = 0; m < 4; m++) {
+    ASSERT_TRUE(kd_tree_query_n_nearest_neighbors_batch(
+        tree, points.data(), size, n + 1, metrics[m], 2,
+        batch_indices.data(), batch_distances.data()));
+    for (int num_threads = 1; num_threads <= 4; num_threads += 3) {
+      ASSERT_TRUE(kd_tree_all_knn(tree, n, metrics[m], num_threads,
+                                  indices.data(), distances.data()));
+      for (int q = 0; q < size; q++) {
+        // Each point is its own nearest neighbor in the batch query.
+        ASSERT_EQ(batch_indices[q * (n + 1)], q);
+        for (int i = 0; i < n; i++) {
+          EXPECT_EQ(indices[(q * n) + i], batch_indices[(q * (n + 1)) + i + 1])
+              << metrics[m];
+          EXPECT_EQ(distances[(q * n) + i],
+                    batch_distances[(q * (n + 1)) + i + 1]);
+        }
+      }
+    }
+  }
+  free_kd_tree(tree);
+
+  // Rows of trees with n points or less end in padding.
+  double few_points[] = {0.0, 0.0, 3.0, 4.0};
+  tree = build_kd_tree(few_points, 2, 2, 1, false);
+  ASSERT_TRUE(kd_tree_all_knn(tree, 2, metrics[0], 1, indices.data(),
+                              distances.data()));
+  EXPECT_EQ(indices[0], 1);
+  EXPECT_EQ(distances[0], 25);
+  EXPECT_EQ(indices[1], -1);
+  EXPECT_TRUE(std::isinf(distances[1]));
+  EXPECT_EQ(indices[2], 0);
+  EXPECT_EQ(indices[3], -1);
+  free_kd_tree(tree);
+}
+
 TEST(TestQuery, RangeSearch) {
   // a 10x10 cube
   double points[] = {0.0, 0.0, 10.0, 10.0, 10.0, 0.0, 0.0, 10.0};
@@ -106,6 +1147,321 @@ TEST(TestQuery, RangeSearch) {
   EXPECT_EQ(num_results, 2);  // (0, 10), (10, 10);
 }
 
+TEST(TestQuery, RangeCountMatchesRangeSearch) {
+  int num_points = 20000;
+  int k = 3;
+  std::vector<double> points(num_points * k);
+  random_nonzero_array(points.data(), num_points * k, 100);
+  struct KdTree *tree = build_kd_tree(points.data(), num_points, k, 8, false);
+  check_tree_invariant(tree);
+
+  double test_point[] = {50.0, 40.0, 60.0};
+  double radii[][3] = {{0.0, 0.0, 0.0}, {1.0, 2.0, 3.0}, {20.0, 10.0, 30.0},
+                       {45.0, 45.0, 45.0}, {100.0, 100.0, 100.0}};
+  char distance[] = "manhattan";
+  for (int i = 0; i < 5; i++) {
+    struct KdResult *results;
+    int num_results = kd_tree_query_range(tree, test_point, radii[i],
+                                          distance, &results);
+    EXPECT_EQ(kd_tree_query_range_count(tree, test_point, radii[i]),
+              num_results);
+    free(results);
+  }
+  EXPECT_EQ(kd_tree_query_range_count(tree, test_point, radii[4]),
+            num_points);
+  free_kd_tree(tree);
+}
+
+TEST(TestQuery, FloatTreeMatchesDoubleTree) {
+  // Small integers are exact in single precision, and so are their distances.
+  int num_points = 5000;
+  int k = 4;
+  int n = 10;
+  std::vector<double> points(num_points * k);
+  random_nonzero_array(points.data(), num_points * k, 1000);
+  std::vector<float> float_points(points.begin(), points.end());
+
+  struct KdBuildOptions options = {0};
+  options.leaf_size = 8;
+  options.reorder_data = true;
+  struct KdTree *tree = build_kd_tree(points.data(), num_points, k, 8, false);
+  struct KdTree *float_tree = build_float_kd_tree_with_options(
+      float_points.data(), num_points, k, &options);
+  ASSERT_NE(float_tree, nullptr);
+  EXPECT_EQ(float_tree->point_type, POINT_FLOAT);
+  EXPECT_EQ(float_tree->data, nullptr);
+  EXPECT_NE(float_tree->float_data, float_points.data());
+  check_tree_invariant(float_tree);
+
+  double test_point[] = {250.0, 500.0, 750.0, 100.0};
+  double radii[] = {100.0, 200.0, 100.0, 300.0};
+  char metrics[][32] = {"squared_euclidean", "manhattan"};
+  for (int m = 0; m < 2; m++) {
+    struct KdResult *expected;
+    struct KdResult *results;
+    ASSERT_EQ(kd_tree_query_n_nearest_neighbors(tree, test_point, n,
+                                                metrics[m], &expected), n);
+    ASSERT_EQ(kd_tree_query_n_nearest_neighbors(float_tree, test_point, n,
+                                                metrics[m], &results), n);
+    for (int i = 0; i < n; i++) {
+      EXPECT_EQ(results[i].distance, expected[i].distance);
+      EXPECT_EQ(results[i].point, nullptr);
+      for (int j = 0; j < k; j++) {
+        EXPECT_EQ(results[i].float_point[j],
+                  points[results[i].index * k + j]);
+      }
+    }
+    free(expected);
+    free(results);
+
+    int num_expected = kd_tree_query_range(tree, test_point, radii,
+                                           metrics[m], &expected);
+    int num_results = kd_tree_query_range(float_tree, test_point, radii,
+                                           metrics[m], &results);
+    ASSERT_EQ(num_results, num_expected);
+    for (int i = 0; i < num_results; i++) {
+      EXPECT_EQ(results[i].distance, expected[i].distance);
+    }
+    free(expected);
+    free(results);
+  }
+  EXPECT_EQ(kd_tree_query_range_count(float_tree, test_point, radii),
+            kd_tree_query_range_count(tree, test_point, radii));
+
+  std::vector<int> indices(num_points * n);
+  std::vector<double> distances(num_points * n);
+  std::vector<int> float_indices(num_points * n);
+  std::vector<double> float_distances(num_points * n);
+  int num_queries = 200;
+  kd_tree_query_n_nearest_neighbors_batch(tree, points.data(), num_queries, n,
+                                          metrics[0], 2, indices.data(),
+                                          distances.data());
+  kd_tree_query_n_nearest_neighbors_batch(float_tree, points.data(),
+                                          num_queries, n, metrics[0], 2,
+                                          float_indices.data(),
+                                          float_distances.data());
+  for (int i = 0; i < num_queries * n; i++) {
+    EXPECT_EQ(float_distances[i], distances[i]);
+  }
+  free_kd_tree(tree);
+  free_kd_tree(float_tree);
+}
+
+TEST(TestQuery, QuantizedTreeMatchesExactTree) {
+  int num_points = 20000;
+  int k = 3;
+  int n = 10;
+  std::vector<double> points(num_points * k);
+  for (int i = 0; i < num_points * k; i++) {
+    points[i] = (double) rand() / RAND_MAX;
+  }
+  struct KdTree *tree = build_kd_tree(points.data(), num_points, k, 16, false);
+  double radii[] = {0.1, 0.05, 0.2};
+  char metrics[][32] = {"squared_euclidean", "manhattan", "chebyshev"};
+
+  enum Quantization quantizations[] = {QUANTIZE_INT8, QUANTIZE_INT16};
+  for (int q = 0; q < 2; q++) {
+    struct KdBuildOptions options = {0};
+    options.leaf_size = 16;
+    options.quantization = quantizations[q];
+    struct KdTree *quantized = build_kd_tree_with_options(
+        points.data(), num_points, k, &options);
+    ASSERT_NE(quantized, nullptr);
+    EXPECT_EQ(quantized->quantization, quantizations[q]);
+    EXPECT_GT(quantized->memory_bytes, tree->memory_bytes);
+
+    for (int t = 0; t < 50; t++) {
+      double *test_point = points.data() + (t * 97 * k);
+      for (int m = 0; m < 3; m++) {
+        struct KdResult *expected;
+        struct KdResult *results;
+        ASSERT_EQ(kd_tree_query_n_nearest_neighbors(tree, test_point, n,
+                                                    metrics[m], &expected),
+                  n);
+        ASSERT_EQ(kd_tree_query_n_nearest_neighbors(quantized, test_point, n,
+                                                    metrics[m], &results),
+                  n);
+        for (int i = 0; i < n; i++) {
+          EXPECT_EQ(results[i].distance, expected[i].distance);
+        }
+        free(expected);
+        free(results);
+      }
+
+      struct KdResult *expected;
+      struct KdResult *results;
+      int num_expected = kd_tree_query_range(tree, test_point, radii,
+                                             metrics[0], &expected);
+      ASSERT_EQ(kd_tree_query_range(quantized, test_point, radii, metrics[0],
+                                    &results),
+                num_expected);
+      for (int i = 0; i < num_expected; i++) {
+        EXPECT_EQ(results[i].distance, expected[i].distance);
+      }
+      free(expected);
+      free(results);
+      EXPECT_EQ(kd_tree_query_range_count(quantized, test_point, radii),
+                num_expected);
+    }
+    free_kd_tree(quantized);
+  }
+
+  // Quantization is only offered for double points.
+  std::vector<float> float_points(points.begin(), points.end());
+  struct KdBuildOptions options = {0};
+  options.leaf_size = 16;
+  options.quantization = QUANTIZE_INT8;
+  EXPECT_EQ(build_float_kd_tree_with_options(float_points.data(), num_points,
+                                             k, &options),
+            nullptr);
+  free_kd_tree(tree);
+}
+
+int count_visit(void *context, int index, double *point, double distance) {
+  int *count = (int *) context;
+  (*count)++;
+  return *count < 3;
+}
+
+TEST(TestQuery, RangeVisitorsMatchRangeSearch) {
+  int num_points = 5000;
+  int k = 3;
+  std::vector<double> points(num_points * k);
+  random_nonzero_array(points.data(), num_points * k, 100);
+  struct KdTree *tree = build_kd_tree(points.data(), num_points, k, 8, false);
+
+  double test_point[] = {50.0, 50.0, 50.0};
+  double radii[] = {20.0, 10.0, 30.0};
+  char distance[] = "squared_euclidean";
+  struct KdResult *results;
+  int num_results = kd_tree_query_range(tree, test_point, radii, distance,
+                                        &results);
+  ASSERT_GT(num_results, 3);
+  for (int i = 1; i < num_results; i++) {
+    EXPECT_GE(results[i - 1].distance, results[i].distance);
+  }
+
+  // The second round passes the metric parsed.
+  struct KdMetric metric;
+  ASSERT_TRUE(parse_kd_metric(distance, &metric));
+  struct KdRangeBuffer buffer;
+  init_kd_range_buffer(&buffer);
+  for (int round = 0; round < 2; round++) {
+    buffer.size = 0;
+    int num_found = round == 0
+        ? kd_tree_query_range_into(tree, test_point, radii, distance, &buffer)
+        : kd_tree_query_range_into_with_metric(tree, test_point, radii,
+                                               &metric, &buffer);
+    ASSERT_EQ(num_found, num_results);
+    ASSERT_EQ(buffer.size, num_results);
+    std::vector<std::pair<double, int> > expected, found;
+    for (int i = 0; i < num_results; i++) {
+      expected.push_back(std::make_pair(results[i].distance,
+                                        results[i].index));
+      found.push_back(std::make_pair(buffer.distances[i], buffer.indices[i]));
+    }
+    std::sort(expected.begin(), expected.end());
+    std::sort(found.begin(), found.end());
+    EXPECT_EQ(found, expected);
+  }
+
+  // skipping distances only gathers indices
+  buffer.size = 0;
+  EXPECT_EQ(kd_tree_query_range_into(tree, test_point, radii, NULL, &buffer),
+            num_results);
+
+  // the visitor stops the query early
+  int count = 0;
+  EXPECT_EQ(kd_tree_query_range_visit(tree, test_point, radii, NULL,
+                                      count_visit, &count), 3);
+  EXPECT_EQ(count, 3);
+  count = 0;
+  EXPECT_EQ(kd_tree_query_range_visit_with_metric(tree, test_point, radii,
+                                                  &metric, count_visit,
+                                                  &count), 3);
+
+  free_kd_range_buffer(&buffer);
+  free(results);
+  free_kd_tree(tree);
+}
+
+int collect_pair(void *context, int index_a, int index_b) {
+  std::vector<std::pair<int, int> > *pairs =
+      (std::vector<std::pair<int, int> > *) context;
+  pairs->push_back(std::make_pair(index_a, index_b));
+  return 1;
+}
+
+int count_pair(void *context, int index_a, int index_b) {
+  int *count = (int *) context;
+  (*count)++;
+  return *count < 3;
+}
+
+TEST(TestQuery, RangeJoinMatchesRangeSearch) {
+  int size_a = 700;
+  int size_b = 1500;
+  int k = 3;
+  std::vector<double> points_a(size_a * k);
+  std::vector<double> points_b(size_b * k);
+  random_nonzero_array(points_a.data(), size_a * k, 100);
+  random_nonzero_array(points_b.data(), size_b * k, 100);
+  std::vector<float> float_points_b(points_b.begin(), points_b.end());
+  struct KdTree *tree_a = build_kd_tree(points_a.data(), size_a, k, 8, false);
+  struct KdBuildOptions options = {0};
+  options.leaf_size = 4;
+  struct KdTree *trees_b[] = {
+      build_kd_tree(points_b.data(), size_b, k, 8, false),
+      build_float_kd_tree_with_options(float_points_b.data(), size_b, k,
+                                       &options)};
+  double radii[] = {8.0, 5.0, 20.0};
+
+  for (int t = 0; t < 2; t++) {
+    struct KdTree *tree_b = trees_b[t];
+    std::vector<std::pair<int, int> > expected, found;
+    long long expected_count = 0;
+    for (int i = 0; i < size_a; i++) {
+      struct KdResult *results;
+      int num_results = kd_tree_query_range(tree_b, points_a.data() + (i * k),
+                                            radii, NULL, &results);
+      for (int r = 0; r < num_results; r++) {
+        expected.push_back(std::make_pair(i, results[r].index));
+      }
+      expected_count += num_results;
+      free(results);
+    }
+    ASSERT_GT(expected_count, size_a);
+
+    EXPECT_EQ(kd_tree_join_range_count(tree_a, tree_b, radii),
+              expected_count);
+    EXPECT_EQ(kd_tree_join_range(tree_a, tree_b, radii, collect_pair,
+                                 &found),
+              expected_count);
+    std::sort(expected.begin(), expected.end());
+    std::sort(found.begin(), found.end());
+    EXPECT_EQ(found, expected);
+  }
+
+  // wide radii accept whole node pairs at once
+  double wide_radii[] = {200.0, 200.0, 200.0};
+  EXPECT_EQ(kd_tree_join_range_count(tree_a, trees_b[0], wide_radii),
+            (long long) size_a * size_b);
+
+  // the visitor stops the join early
+  int count = 0;
+  EXPECT_EQ(kd_tree_join_range(tree_a, trees_b[0], wide_radii, count_pair,
+                               &count), 3);
+  EXPECT_EQ(count, 3);
+
+  struct KdTree *flat_tree = build_kd_tree(points_a.data(), size_a, 2, 8,
+                                           false);
+  EXPECT_EQ(kd_tree_join_range_count(tree_a, flat_tree, radii), -1);
+  free_kd_tree(flat_tree);
+  free_kd_tree(tree_a);
+  free_kd_tree(trees_b[0]);
+  free_kd_tree(trees_b[1]);
+}
+
 void random_nonzero_array(double *arr, int n, int range) {
   for (int i = 0; i < n; i++) {
     double val = rand();  // srand(1) default
@@ -119,21 +1475,55 @@ void check_tree_invariant(struct KdTree *tree) {
     return;
   }
   recursive_check_node_invariant(tree, tree->root);
+
+  // every node of the arena is reachable from the root
+  int reachable = 0;
+  std::vector<int> stack(1, 0);
+  while (!stack.empty()) {
+    struct KdNode *node = tree->nodes + stack.back();
+    stack.pop_back();
+    reachable++;
+    if (!node->is_leaf) {
+      stack.push_back(node->low);
+      stack.push_back(node->high);
+    }
+  }
+  EXPECT_EQ(reachable, tree->num_nodes);
 }
 
 void recursive_check_node_invariant(struct KdTree *tree, struct KdNode *node) {
+  double *bounds = kd_node_bounds(tree, node);
+  for (int i = node->start; i < node->end; i++) {
+    for (int j = 0; j < tree->k; j++) {
+      EXPECT_LE(bounds[j], tree_coordinate(tree, i, j));
+      EXPECT_GE(bounds[tree->k + j], tree_coordinate(tree, i, j));
+    }
+  }
+
   if (!node->is_leaf) {
+    struct KdNode *low = tree->nodes + node->low;
+    struct KdNode *high = tree->nodes + node->high;
+    EXPECT_EQ(low->start, node->start);
+    EXPECT_EQ(low->end, high->start);
+    EXPECT_EQ(high->end, node->end);
 
-    for (int i = 0; i < node->low->num_indices; i++) {
-      int data_index = (node->low->indices[i] * tree->k) + node->split_axis;
-      EXPECT_LE(tree->data[data_index], node->split_value);
+    for (int i = low->start; i < low->end; i++) {
+      EXPECT_LE(tree_coordinate(tree, i, node->split_axis),
+                node->split_value);
     }
 
-    for (int i = 0; i < node->high->num_indices; i++) {
-      int data_index = (node->high->indices[i] * tree->k) + node->split_axis;
-      EXPECT_GE(tree->data[data_index], node->split_value);
+    for (int i = high->start; i < high->end; i++) {
+      EXPECT_GE(tree_coordinate(tree, i, node->split_axis),
+                node->split_value);
     }
-    recursive_check_node_invariant(tree, node->low);
-    recursive_check_node_invariant(tree, node->high);
+    recursive_check_node_invariant(tree, low);
+    recursive_check_node_invariant(tree, high);
+  }
+}
+
+double tree_coordinate(struct KdTree *tree, int position, int axis) {
+  if (tree->point_type == POINT_FLOAT) {
+    return kd_tree_float_point(tree, position)[axis];
   }
+  return kd_tree_point(tree, position)[axis];
 }